@@ -0,0 +1,70 @@
+#!/usr/bin/env python3
+#
+# Stand-in for VMI-Honeymon, to measure how fast mod_vmi redirects attackers
+# without a Xen host. Answers echo_test, request_clone and release_clone on
+# http://127.0.0.1:4567/RPC2 like the real server, taking --delay seconds to
+# "create" each clone.
+#
+# Honeybrid prints the pick and clone latencies when mod_vmi closes.
+
+import argparse
+import itertools
+import threading
+import time
+from socketserver import ThreadingMixIn
+from xmlrpc.server import SimpleXMLRPCServer, SimpleXMLRPCRequestHandler
+
+
+class Server(ThreadingMixIn, SimpleXMLRPCServer):
+    daemon_threads = True
+
+
+class Handler(SimpleXMLRPCRequestHandler):
+    rpc_paths = ('/RPC2',)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--port', type=int, default=4567)
+    parser.add_argument('--delay', type=float, default=2.0,
+                        help='seconds spent creating a clone')
+    parser.add_argument('--network', default='10.0.1',
+                        help='first three octets of the clone addresses')
+    parser.add_argument('--vlan', type=int, default=2)
+    args = parser.parse_args()
+
+    ids = itertools.count(1)
+    lock = threading.Lock()
+    live = {}
+
+    def echo_test(value):
+        return 'echo %d' % value
+
+    def request_clone():
+        time.sleep(args.delay)
+        with lock:
+            n = next(ids)
+            name = 'standin-%d' % n
+            live[name] = time.time()
+        return '%s,%s.%d,02:00:00:00:%02x:%02x,%d,%d' % (
+            name, args.network, n % 254 + 1, (n >> 8) & 0xff, n & 0xff,
+            args.vlan, n)
+
+    def release_clone(name, log_id):
+        with lock:
+            born = live.pop(name, None)
+        if born is not None:
+            print('%s released after %.1fs' % (name, time.time() - born))
+        return 0
+
+    server = Server(('127.0.0.1', args.port), requestHandler=Handler,
+                    logRequests=False, allow_none=True)
+    server.register_function(echo_test)
+    server.register_function(request_clone)
+    server.register_function(release_clone)
+    print('VMI stand-in listening on http://127.0.0.1:%d/RPC2' % args.port)
+    server.serve_forever()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,258 @@
+/*
+ * This file is part of the honeybrid project.
+ *
+ * 2007-2009 University of Maryland (http://www.umd.edu)
+ * Robin Berthier <robinb@umd.edu>, Thomas Coquelin <coquelin@umd.edu>
+ * and Julien Vehent <julien@linuxwall.info>
+ *
+ * 2012-2014 University of Connecticut (http://www.uconn.edu)
+ * Tamas K Lengyel <tamas.k.lengyel@gmail.com>
+ *
+ * Honeybrid is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "balancer.h"
+#include "log.h"
+
+/*!	\file balancer.c
+ \brief
+
+ Load of the backends of a target. Every backend with room left sits in two
+ sequences: one sorted by live connections per unit of weight, the other by
+ the virtual time of its next weighted turn. Picking a backend is a look at
+ the head of one of them (or a position in the first for a random pick),
+ and a connection coming or going moves its backend in O(log n).
+
+ A backend that reached its capacity leaves both sequences until one of its
+ connections ends, so whatever is picked has room. The live connection count
+ of a backend is the length of its conns queue, which is kept under connlock:
+ balancer_update is called with connlock held, after the queue changed.
+
+ The weighted policy is stride scheduling: each pick advances the pass of
+ the picked backend by BALANCER_STRIDE/weight, and the backend with the
+ smallest pass comes next.
+
+ */
+
+#define BALANCER_STRIDE	(1 << 20)
+
+struct balancer {
+	GMutex lock;
+	GSequence *by_load; /* backends with room left, least loaded first */
+	GSequence *by_pass; /* the same backends, next weighted turn first */
+	uint64_t pass; /* pass of the last weighted pick */
+};
+
+static inline gboolean saturated(const struct handler *handler) {
+	return handler->capacity && handler->slot.active >= handler->capacity;
+}
+
+static gint load_cmp(gconstpointer a, gconstpointer b,
+		__attribute__ ((unused)) gpointer data) {
+	const struct handler *h1 = a, *h2 = b;
+
+	/* active1/weight1 against active2/weight2 without dividing */
+	uint64_t l1 = (uint64_t) h1->slot.active * h2->weight;
+	uint64_t l2 = (uint64_t) h2->slot.active * h1->weight;
+
+	if (l1 != l2)
+		return l1 < l2 ? -1 : 1;
+
+	return h1->ID < h2->ID ? -1 : (h1->ID > h2->ID);
+}
+
+static gint pass_cmp(gconstpointer a, gconstpointer b,
+		__attribute__ ((unused)) gpointer data) {
+	const struct handler *h1 = a, *h2 = b;
+
+	if (h1->slot.pass != h2->slot.pass)
+		return h1->slot.pass < h2->slot.pass ? -1 : 1;
+
+	return h1->ID < h2->ID ? -1 : (h1->ID > h2->ID);
+}
+
+/*! list
+ \brief put a backend in the sequences unless it's saturated
+ *
+ * A backend coming back doesn't get the turns it missed while it was out.
+ */
+static void list(struct balancer *balancer, struct handler *handler) {
+
+	if (saturated(handler))
+		return;
+
+	if (handler->slot.pass < balancer->pass)
+		handler->slot.pass = balancer->pass;
+
+	handler->slot.by_load = g_sequence_insert_sorted(balancer->by_load,
+			handler, load_cmp, NULL);
+	handler->slot.by_pass = g_sequence_insert_sorted(balancer->by_pass,
+			handler, pass_cmp, NULL);
+}
+
+/*! unlist
+ \brief undo list
+ */
+static void unlist(struct handler *handler) {
+
+	if (handler->slot.by_load) {
+		g_sequence_remove(handler->slot.by_load);
+		g_sequence_remove(handler->slot.by_pass);
+		handler->slot.by_load = NULL;
+		handler->slot.by_pass = NULL;
+	}
+}
+
+struct balancer *balancer_new(void) {
+	struct balancer *balancer = g_malloc0(sizeof(struct balancer));
+	g_mutex_init(&balancer->lock);
+	balancer->by_load = g_sequence_new(NULL);
+	balancer->by_pass = g_sequence_new(NULL);
+	return balancer;
+}
+
+void balancer_free(struct balancer *balancer) {
+	if (balancer) {
+		g_sequence_free(balancer->by_load);
+		g_sequence_free(balancer->by_pass);
+		g_mutex_clear(&balancer->lock);
+		g_free(balancer);
+	}
+}
+
+/*! balancer_add
+ \brief start balancing connections to a backend, a weight of 0 counts as 1
+ */
+void balancer_add(struct balancer *balancer, struct handler *handler) {
+
+	if (!handler->weight)
+		handler->weight = 1;
+
+	g_mutex_lock(&balancer->lock);
+	if (!handler->slot.listed) {
+		handler->slot.listed = TRUE;
+		handler->slot.active = 0;
+		handler->slot.pass = balancer->pass;
+		list(balancer, handler);
+	}
+	g_mutex_unlock(&balancer->lock);
+}
+
+/*! balancer_remove
+ \brief stop balancing connections to a backend, before it gets freed
+ */
+void balancer_remove(struct balancer *balancer, struct handler *handler) {
+
+	g_mutex_lock(&balancer->lock);
+	unlist(handler);
+	handler->slot.listed = FALSE;
+	g_mutex_unlock(&balancer->lock);
+}
+
+/*! balancer_update
+ \brief move a backend after its number of live connections changed
+ *
+ * connlock must be held by the caller.
+ */
+void balancer_update(struct balancer *balancer, struct handler *handler) {
+
+	if (!balancer)
+		return;
+
+	g_mutex_lock(&balancer->lock);
+	if (handler->slot.listed && handler->slot.active != handler->conns.length) {
+		unlist(handler);
+		handler->slot.active = handler->conns.length;
+		list(balancer, handler);
+	}
+	g_mutex_unlock(&balancer->lock);
+}
+
+/*! balancer_pick
+ \brief choose a backend with room left
+ \return the ID of the backend, 0 when all of them are saturated
+ */
+int64_t balancer_pick(struct balancer *balancer, balance_policy_t policy,
+		GRand *rand) {
+
+	int64_t ID = 0;
+	struct handler *handler = NULL;
+
+	if (!balancer)
+		return 0;
+
+	g_mutex_lock(&balancer->lock);
+
+	gint n = g_sequence_get_length(balancer->by_load);
+	if (!n)
+		goto done;
+
+	switch (policy) {
+	case BALANCE_WEIGHTED:
+		handler = g_sequence_get(g_sequence_get_begin_iter(balancer->by_pass));
+		balancer->pass = handler->slot.pass;
+		handler->slot.pass += BALANCER_STRIDE / handler->weight;
+		g_sequence_sort_changed(handler->slot.by_pass, pass_cmp, NULL);
+		break;
+	case BALANCE_RANDOM:
+		handler = g_sequence_get(
+				g_sequence_get_iter_at_pos(balancer->by_load,
+						g_rand_int_range(rand, 0, n)));
+		break;
+	case BALANCE_LEAST_CONN:
+	default:
+		handler = g_sequence_get(g_sequence_get_begin_iter(balancer->by_load));
+		break;
+	}
+
+	ID = handler->ID;
+
+	done:
+	g_mutex_unlock(&balancer->lock);
+	return ID;
+}
+
+/*! balancer_has_room
+ \brief check whether a backend can take one more connection
+ */
+gboolean balancer_has_room(struct balancer *balancer, struct handler *handler) {
+
+	gboolean room;
+
+	if (!balancer)
+		return TRUE;
+
+	g_mutex_lock(&balancer->lock);
+	room = !saturated(handler);
+	g_mutex_unlock(&balancer->lock);
+
+	return room;
+}
+
+/*! balancer_available
+ \brief count the backends with room left
+ */
+uint32_t balancer_available(struct balancer *balancer) {
+
+	uint32_t n;
+
+	if (!balancer)
+		return 0;
+
+	g_mutex_lock(&balancer->lock);
+	n = g_sequence_get_length(balancer->by_load);
+	g_mutex_unlock(&balancer->lock);
+
+	return n;
+}
@@ -0,0 +1,48 @@
+/*
+ * This file is part of the honeybrid project.
+ *
+ * 2007-2009 University of Maryland (http://www.umd.edu)
+ * Robin Berthier <robinb@umd.edu>, Thomas Coquelin <coquelin@umd.edu>
+ * and Julien Vehent <julien@linuxwall.info>
+ *
+ * 2012-2014 University of Connecticut (http://www.uconn.edu)
+ * Tamas K Lengyel <tamas.k.lengyel@gmail.com>
+ *
+ * Honeybrid is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BALANCER_H_
+#define __BALANCER_H_
+
+#include "types.h"
+#include "structs.h"
+
+struct balancer *balancer_new(void);
+
+void balancer_free(struct balancer *balancer);
+
+void balancer_add(struct balancer *balancer, struct handler *handler);
+
+void balancer_remove(struct balancer *balancer, struct handler *handler);
+
+void balancer_update(struct balancer *balancer, struct handler *handler);
+
+int64_t balancer_pick(struct balancer *balancer, balance_policy_t policy,
+		GRand *rand);
+
+gboolean balancer_has_room(struct balancer *balancer, struct handler *handler);
+
+uint32_t balancer_available(struct balancer *balancer);
+
+#endif /* __BALANCER_H_ */
@@ -1,6 +1,7 @@
 %{
 #include <glib/gstdio.h>
 #include <fcntl.h>
+#include <stdarg.h>
 #include "globals.h"
 #include "structs.h"
 #include "convenience.h"
@@ -8,10 +9,23 @@
 #include "modules.h"
 #include "log.h"
 #include "management.h"
+#include "prefix.h"
+
+#include "reload.h"
 
 extern int  yylineno;
 extern char *yytext;
+void yyrestart(FILE *fp);
 static void yyerror(const char *msg);
+static void parse_fatal(const char *format, ...);
+static struct rule *compile_rule(const char *equation);
+static void define_target(struct target *target);
+
+/* Set while the configuration is parsed again at runtime, see reload.c */
+static struct config_reload *reloading;
+
+#define config_table() (reloading ? reloading->config : config)
+#define module_table() (reloading ? reloading->modules : module)
 
 int yylex(void);
 
@@ -30,7 +44,8 @@ int yywrap() {
 %token BACKPICK INTERNET CONFIGURATION 
 %token TARGET LINK HW VLAN DEFAULT SRC
 %token ROUTE VIA NETMASK INTERNAL
-%token WITH EXCLUSIVE INTRALAN
+%token WITH EXCLUSIVE INTRALAN ADDRESS
+%token WEIGHT CAPACITY
 
 /* Content Variables */
 %token <number> NUMBER
@@ -43,9 +58,12 @@ int yywrap() {
 %type <target>  	rule
 %type <gstring>  	equation 
 %type <addr>    	honeynet
+%type <addr>    	prefix
 %type <addr> 		mac
 %type <addr> 		netmask
 %type <number>		vlan
+%type <number>		weight
+%type <number>		capacity
 
 %union {
 	int    number;
@@ -73,26 +91,26 @@ parameters: { /* nothing to do */ }
 	;
 
 parameter: WORD EQ WORD {
-		g_hash_table_insert(config, $1, $3);
+		g_hash_table_insert(config_table(), $1, $3);
 		g_printerr("\t'%s' => '%s'\n", $1, $3);
 		g_free($2);
 	}
 	|  WORD EQ EXPR {
-		g_hash_table_insert(config, $1, $3);
+		g_hash_table_insert(config_table(), $1, $3);
         g_printerr("\t'%s' => '%s'\n", $1, $3);
         g_free($2);
 	}
 	|  WORD EQ NUMBER {
 		int *d =g_malloc(sizeof(int));
 		*d = $3;
-		g_hash_table_insert(config, $1, d);
+		g_hash_table_insert(config_table(), $1, d);
 		g_printerr("\t'%s' => %i\n", $1, *d);
 		g_free($2);
     }
 	|  WORD EQ QUOTE honeynet QUOTE {
 		char *s = g_malloc0(snprintf(NULL, 0, "%s", addr_ntoa($4)) + 1);
 		sprintf(s, "%s", addr_ntoa($4));
-        g_hash_table_insert(config, $1, s);
+        g_hash_table_insert(config_table(), $1, s);
         g_printerr("\tDefining IP: '%s' => '%s'\n", $1, s);
 		free($4);
 		g_free($2);
@@ -103,25 +121,32 @@ parameter: WORD EQ WORD {
 
 link: LINK QUOTE WORD QUOTE OPEN link_settings END { 
         struct interface *iface=(struct interface *)$6;
-        if(iface) {
+        if(iface && reloading) {
+            /* the links are opened at startup, only their targets change */
+            if(!g_hash_table_lookup(links, $3)) {
+                parse_fatal("Link '%s' is new, adding a link needs a restart", $3);
+            }
+            free_interface(iface);
+            g_free($3);
+        } else if(iface) {
             iface->tag=$3;
             
             g_printerr("\t'tag' => '%s'\n", $3);
             
             g_hash_table_insert(links, iface->tag, iface);
         } else {
-            errx(1, "Link configuration is incomplete!\n");
+            parse_fatal("Link configuration is incomplete!\n");
         }
     }
     ;
 
 link_settings: {
         if (NULL == ($$ = g_malloc0(sizeof(struct interface))))
-            errx(1, "%s: Fatal error while creating link table.\n", __func__);
+            parse_fatal("%s: Fatal error while creating link table.\n", __func__);
     }
     | link_settings WORD EQ QUOTE WORD QUOTE SEMICOLON {
         if(strcmp($2, "interface")) {
-            errx(1, "Unrecognized option: %s. Did you mean: 'interface'?\n", $2); 
+            parse_fatal("Unrecognized option: %s. Did you mean: 'interface'?\n", $2); 
         }
         struct interface *iface=(struct interface *)$$;
         iface->name = $5;
@@ -131,7 +156,7 @@ link_settings: {
     }
 	|  link_settings WORD EQ NUMBER SEMICOLON {
 		if(strcmp($2, "promisc")) {
-            errx(1, "Unrecognized option: %s. Did you mean: 'promisc'?\n", $2); 
+            parse_fatal("Unrecognized option: %s. Did you mean: 'promisc'?\n", $2); 
         }
         struct interface *iface=(struct interface *)$$;
         iface->promisc = $4;
@@ -150,49 +175,17 @@ link_settings: {
     ;
 
 module: MODULE QUOTE WORD QUOTE OPEN module_settings END {
-		g_hash_table_insert(module, $3, $6);
+		g_hash_table_insert(module_table(), $3, $6);
 		g_printerr("\tmodule '%s' defined with %d parameters\n", $3, g_hash_table_size((GHashTable *)$6));
 		if (NULL == g_hash_table_lookup((GHashTable *)$6, "function")) {
-			errx(1, "%s: Fatal error: missing parameter 'function' in module '%s'\n", __func__, $3);
-		}
-		
-		gchar *backup_file = NULL;
-		if (NULL != (backup_file = (gchar *)g_hash_table_lookup((GHashTable *)$6, "backup"))) {
-			int backup_fd;
-			GError *error = NULL;
-			GKeyFile *backup = NULL;
-			backup = g_key_file_new();
-			g_key_file_set_list_separator(backup, '\t');
-			/*! We store a pointer to GKeyFile object in the module hash table */
-			g_hash_table_insert((GHashTable *)$6, g_strdup("backup"), backup);
-			g_printerr("\t%s: New GKeyFile %p created\n", __func__, backup);
-			/*! We then check if the file exists. Otherwise we create it */
-			if (FALSE == g_file_test(backup_file, G_FILE_TEST_IS_REGULAR)) {
-				if (-1 == (backup_fd = g_open(backup_file, O_WRONLY | O_CREAT | O_TRUNC, NULL))) {
-					errx(1, "%s: Fatal error, can't create backup file for module", __func__);
-				} else {
-					//g_hash_table_insert((GHashTable *)$6, "backup_fd", &backup_fd);
-					close(backup_fd);
-				}
-			} else {
-				/*! If the file exists, we try to load it into memory */
-				/*! \todo free all these structures, and close file descriptor when exiting */
-				if (FALSE == g_key_file_load_from_file(
-					g_hash_table_lookup((GHashTable *)$6, "backup"),
-					backup_file,
-					G_KEY_FILE_KEEP_COMMENTS,
-					&error)) {
-					g_printerr("\t%s: can't load backup file for module: %s\n", __func__, error->message);
-				}
-			}
-			//g_free(backup_file);
+			parse_fatal("%s: Fatal error: missing parameter 'function' in module '%s'\n", __func__, $3);
 		}
 	}
 	;
 
 module_settings: { 
 		if (NULL == ($$ = (struct GHashTable *)g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free)))		
-	    	errx(1, "%s: Fatal error while creating module hash table.\n", __func__);
+	    	parse_fatal("%s: Fatal error while creating module hash table.\n", __func__);
 	}
 	| module_settings WORD EQ WORD SEMICOLON {
 	    g_hash_table_insert((GHashTable *)$$, $2, $4);
@@ -214,7 +207,7 @@ module_settings: {
 	;
 
 target: TARGET OPEN rule END {
-        add_target($3);
+        define_target($3);
     }
     | TARGET DEFAULT ROUTE VIA QUOTE WORD QUOTE mac OPEN rule END {
 
@@ -223,13 +216,12 @@ target: TARGET OPEN rule END {
 			yyerror("\tTarget interface is not defined!\n");
 		}
 		
-		iface->target = $10;
-		iface->target->default_route=iface;
-		iface->target->default_route_ip = iface->ip;
-		iface->target->default_route_mac=$8;
+		$10->default_route=iface;
+		$10->default_route_ip = iface->ip;
+		$10->default_route_mac=$8;
 		
 		printdbg("\tAdding target with default link '%s'\n", $6);
-		add_target($10);
+		define_target($10);
 		free($6);
 	}
     | TARGET DEFAULT ROUTE VIA QUOTE WORD QUOTE mac SRC honeynet OPEN rule END {
@@ -239,13 +231,12 @@ target: TARGET OPEN rule END {
             yyerror("\tTarget interface is not defined!\n");
         }
         
-        iface->target = $12;
-        iface->target->default_route=iface;
-        iface->target->default_route_ip = $10;
-        iface->target->default_route_mac=$8;
+        $12->default_route=iface;
+        $12->default_route_ip = $10;
+        $12->default_route_mac=$8;
         
         printdbg("\tAdding target with default link '%s'\n", $6);
-        add_target($12);
+        define_target($12);
         free($6);
     }
 	;
@@ -253,10 +244,20 @@ target: TARGET OPEN rule END {
 rule: 	{
 		$$ = (struct target *)g_malloc0(sizeof(struct target));
 		$$->back_handlers = g_tree_new_full((GCompareDataFunc) intcmp,
-                    NULL, NULL, (GDestroyNotify) free_handler);
+                    NULL, NULL, NULL);
         $$->intra_handlers = g_tree_new((GCompareFunc) addr_cmp);		
 	}
-	| rule FRONTEND QUOTE WORD QUOTE honeynet mac netmask vlan SEMICOLON {
+	| rule ADDRESS EXPR SEMICOLON {
+		GSList *blocks = parse_address_block($3);
+		if(!blocks) {
+			yyerror("\tIllegal address block");
+		}
+		g_printerr("\tTarget address block %s (%u prefixes)\n", $3,
+			g_slist_length(blocks));
+		$$->addresses = g_slist_concat($$->addresses, blocks);
+		g_free($3);
+	}
+	| rule FRONTEND QUOTE WORD QUOTE prefix mac netmask vlan SEMICOLON {
 		$$->front_handler = g_malloc0(sizeof(struct handler));
 		$$->front_handler->iface = g_hash_table_lookup(links, $4);
 		
@@ -279,7 +280,7 @@ rule: 	{
 		g_free($4);	
 		free(mac);
 	}
-	| rule FRONTEND QUOTE WORD QUOTE honeynet mac netmask vlan QUOTE equation QUOTE SEMICOLON {
+	| rule FRONTEND QUOTE WORD QUOTE prefix mac netmask vlan QUOTE equation QUOTE SEMICOLON {
 	
 		$$->front_handler = g_malloc0(sizeof(struct handler));
 		$$->front_handler->iface = g_hash_table_lookup(links, $4);
@@ -292,7 +293,7 @@ rule: 	{
 		$$->front_handler->mac=$7;
 		$$->front_handler->netmask = $8;
         $$->front_handler->vlan.i = htons($9 & BIT_MASK(0,11));
-		$$->front_handler->rule = DE_create_tree($11->str);
+		$$->front_handler->rule = compile_rule($11->str);
 		
 		$$->front_handler->ip_str=g_strdup(addr_ntoa($6));
 		
@@ -307,10 +308,10 @@ rule: 	{
 	}
 	| rule BACKPICK QUOTE equation QUOTE SEMICOLON {
         g_printerr("\tCreating backend picking rule: %s\n", $4->str);
-		$$->back_picker = DE_create_tree($4->str);
+		$$->back_picker = compile_rule($4->str);
 		g_string_free($4, TRUE);
     }
-	| rule BACKEND QUOTE WORD QUOTE honeynet mac netmask vlan SEMICOLON {
+	| rule BACKEND QUOTE WORD QUOTE honeynet mac netmask vlan weight capacity SEMICOLON {
     	if($$->back_picker == NULL) {
     		yyerror("Backend needs a rule if no backend picking rule is defined!\n");
     	}
@@ -327,6 +328,8 @@ rule: 	{
        	back_handler->netmask = $8;
        	back_handler->vlan.i = htons($9 & BIT_MASK(0,11));    	
        	back_handler->ip_str=g_strdup(addr_ntoa($6));
+       	back_handler->weight = $10;
+       	back_handler->capacity = $11;
        	    
         add_back_handler($$, back_handler);
     		
@@ -338,7 +341,7 @@ rule: 	{
     	g_free($4);
     	free(mac);
     }
-	| rule BACKEND QUOTE WORD QUOTE honeynet mac netmask vlan QUOTE equation QUOTE SEMICOLON {
+	| rule BACKEND QUOTE WORD QUOTE honeynet mac netmask vlan weight capacity QUOTE equation QUOTE SEMICOLON {
 
 		struct interface *iface = g_hash_table_lookup(links, $4);
     	if(iface == NULL) {
@@ -346,23 +349,24 @@ rule: 	{
     	}
             
         struct handler *back_handler = g_malloc0(sizeof(struct handler));
-        back_handler->ID = ++($$->back_handler_count);
         back_handler->iface=g_hash_table_lookup(links, $4);
         back_handler->ip=$6;
        	back_handler->mac=$7;
        	back_handler->netmask = $8;
        	back_handler->vlan.i = htons($9 & BIT_MASK(0,11));  
-        back_handler->rule=DE_create_tree($11->str);        
+        back_handler->rule=compile_rule($13->str);        
         back_handler->ip_str=g_strdup(addr_ntoa($6));
+        back_handler->weight = $10;
+        back_handler->capacity = $11;
     
         add_back_handler($$, back_handler);
         
         char *mac = g_strdup(addr_ntoa(back_handler->mac));
         
         g_printerr("\tBackend #%lu defined at %s hw %s VLAN %u on '%s' with rule: %s\n", back_handler->ID, back_handler->ip_str,
-        	mac, $9, $4, $11->str);
+        	mac, $9, $4, $13->str);
                 
-        g_string_free($11, TRUE);
+        g_string_free($13, TRUE);
         g_free($4);
         free(mac);
     }
@@ -407,7 +411,7 @@ rule: 	{
        	intra_handler->mac=$9;
        	intra_handler->netmask = $10;
        	intra_handler->vlan.i = htons($11 & BIT_MASK(0,11));  
-        intra_handler->rule=DE_create_tree($13->str);
+        intra_handler->rule=compile_rule($13->str);
         intra_handler->exclusive = 1;
         intra_handler->ip_str=g_strdup(addr_ntoa($8));
     
@@ -428,13 +432,13 @@ rule: 	{
     }
 	| rule INTERNET QUOTE equation QUOTE SEMICOLON {
 		g_printerr("\tControl rule defined as: %s\n", $4->str);
-		$$->control_rule = DE_create_tree($4->str);
+		$$->control_rule = compile_rule($4->str);
 		g_string_free($4, TRUE);
 	}
 	
     | rule INTRALAN QUOTE equation QUOTE SEMICOLON {
         g_printerr("\tControl rule defined as: %s\n", $4->str);
-        $$->intra_rule = DE_create_tree($4->str);
+        $$->intra_rule = compile_rule($4->str);
         g_string_free($4, TRUE);
     }
 	;
@@ -449,6 +453,14 @@ honeynet: EXPR {
         g_free($1);
 	}
 	
+prefix: EXPR {
+        $$ = (struct addr *)g_malloc0(sizeof(struct addr));
+		if (addr_pton($1, $$) < 0 || $$->addr_type != ADDR_TYPE_IP) {
+            yyerror("\tIllegal IP address or prefix");
+        }
+        g_free($1);
+	}
+
 mac: HW EXPR {
 		$$ = (struct addr *)g_malloc0(sizeof(struct addr));
 		if (addr_pton($2, $$) < 0) {
@@ -482,6 +494,25 @@ vlan: {
 	}
 	;
 
+weight: {
+		$$ = 1;
+	}
+	| weight WEIGHT NUMBER {
+		if($3 <= 0) {
+			yyerror("Backend weight must be positive!\n");
+		}
+		$$ = $3;
+	}
+	;
+
+capacity: {
+		$$ = 0;
+	}
+	| capacity CAPACITY NUMBER {
+		$$ = $3;
+	}
+	;
+
 equation: { 
 		$$ = g_string_new("");
 	}
@@ -509,6 +540,80 @@ equation: {
 %%
 
 static void  yyerror(const char *msg) {
-        errx(1,"line %d: %s at '%s'", yylineno, msg, yytext);
+        parse_fatal("line %d: %s at '%s'", yylineno, msg, yytext);
+}
+
+/*! parse_fatal
+ \brief stop at an error in the configuration
+ *
+ * Honeybrid exits if it happens at startup, a reload is given up.
+ */
+static void parse_fatal(const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+
+	if (reloading) {
+		reloading->error = g_strdup_vprintf(format, args);
+		va_end(args);
+		longjmp(reloading->abort, 1);
+	}
+
+	verrx(1, format, args);
+}
+
+static struct rule *compile_rule(const char *equation) {
+	struct rule *rule = DE_create_rule(equation, module_table());
+	if (!rule) {
+		yyerror("\tInvalid rule");
+	}
+	return rule;
+}
+
+/*! define_target
+ \brief add a target at startup, or keep it for the swap when reloading
+ */
+static void define_target(struct target *target) {
+
+	target->configured = TRUE;
+
+	if (reloading) {
+		reloading->targets = g_slist_append(reloading->targets, target);
+		return;
+	}
+
+	/* A target with address blocks doesn't take over the whole link */
+	if (target->default_route
+			&& (!target->default_route->target || !target->addresses)) {
+		target->default_route->target = target;
+	}
+
+	add_target(target);
 }
 
+/*! config_parse_reload
+ \brief parse the configuration again into reload, without touching the running one
+ \return OK if the configuration is valid, NOK with reload->error set otherwise
+ */
+status_t config_parse_reload(FILE *fp, struct config_reload *reload) {
+
+	status_t ret = NOK;
+
+	if (setjmp(reload->abort)) {
+		/* what the interrupted rule of the grammar held is lost */
+		reloading = NULL;
+		return NOK;
+	}
+
+	reloading = reload;
+	yylineno = 1;
+	yyrestart(fp);
+
+	if (0 == yyparse()) {
+		ret = OK;
+	} else if (!reload->error) {
+		reload->error = g_strdup("syntax error");
+	}
+
+	reloading = NULL;
+	return ret;
+}
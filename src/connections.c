@@ -29,6 +29,12 @@
 #include "log.h"
 #include "globals.h"
 #include "convenience.h"
+#include "prefix.h"
+#include "modules.h"
+#include "balancer.h"
+#include "reload.h"
+#include "epoch.h"
+#include "feature_cache.h"
 
 /*!	\file connections.c
  \brief
@@ -190,6 +196,7 @@ void free_pkt(struct pkt_struct *pkt) {
 	free_0(pkt->original_headers.tcp);
 	free_0(pkt->original_headers.udp);
 	free_0(pkt->packet.FRAME);
+	free_pkt_features(pkt->features);
 	free_0(pkt);
 }
 
@@ -370,39 +377,97 @@ gboolean find_intra(struct addr *targetIP, struct handler *intra_handler,
 	return FALSE;
 }
 
-gboolean find_target(__attribute__ ((unused)) uint64_t *targetID,
-		struct target *target, struct target_search *s) {
+/*! find_handler
+ \brief check the honeypots registered at an address block matching the source
+ *
+ * Called by prefix_table_foreach_match on the lists of handler_addresses,
+ * longest prefix first.
+ */
+static gboolean find_handler(GSList *entries, struct target_search *s) {
 
 	struct pkt_struct *pkt = s->pkt;
-	s->target = target;
+	GSList *loop;
 
-	if (pkt->packet.ip->saddr == target->front_handler->ip->addr_ip) {
-		printdbg(
-				"%s This packet matches a LIH honeypot IP address of target with default route %s\n", H(0), target->default_route->tag);
-		pkt->origin = LIH;
-		s->found = TRUE;
-		return TRUE;
-	}
+	for (loop = entries; loop; loop = loop->next) {
+		struct handler_entry *entry = loop->data;
+		struct handler *handler = entry->handler;
 
-	g_tree_foreach(target->back_handlers, (GTraverseFunc) find_hih_src,
-			s->hih_search);
+		switch (entry->role) {
+		case LIH:
+			printdbg(
+					"%s This packet matches a LIH honeypot IP address of target with default route %s\n", H(0), entry->target->default_route->tag);
+			pkt->origin = LIH;
+			break;
+		case HIH:
+			find_hih_src(&handler->ID, handler, s->hih_search);
+			if (!s->hih_search->found) {
+				continue;
+			}
+			pkt->origin = HIH;
+			break;
+		case INTRA:
+			find_intra(handler->ip, handler, s->intra_search);
+			if (!s->intra_search->found) {
+				continue;
+			}
+			pkt->origin = INTRA;
+			break;
+		default:
+			continue;
+		}
 
-	if (s->hih_search->found) {
-		pkt->origin = HIH;
+		s->target = entry->target;
 		s->found = TRUE;
 		return TRUE;
 	}
 
-	g_tree_foreach(target->intra_handlers, (GTraverseFunc) find_intra,
-			s->intra_search);
+	return FALSE;
+}
 
-	if (s->intra_search->found) {
-		pkt->origin = INTRA;
-		s->found = TRUE;
-		return TRUE;
+/*! frontend_address
+ \brief map an address into the prefix of a frontend
+ *
+ * A frontend defined with a prefix answers for every address of it. The host
+ * part of the address is kept, so a darknet address block maps one to one on
+ * a frontend prefix of the same size.
+ */
+struct addr frontend_address(const struct handler *front, ip_addr_t ip) {
+
+	struct addr mapped = *front->ip;
+
+	if (front->ip->addr_bits < 32) {
+		ip_addr_t mask = prefix_mask(front->ip->addr_bits);
+		mapped.addr_ip = (front->ip->addr_ip & mask) | (ip & ~mask);
 	}
+	mapped.addr_bits = 32;
 
-	return FALSE;
+	return mapped;
+}
+
+/*! frontend_covers
+ \brief check if an address belongs to the frontend prefix
+ */
+static inline gboolean frontend_covers(const struct handler *front,
+		ip_addr_t ip) {
+	ip_addr_t mask = prefix_mask(front->ip->addr_bits);
+	return (ip & mask) == (front->ip->addr_ip & mask);
+}
+
+/*! from_frontend
+ \brief check if a packet was sent by the frontend serving the conn
+ */
+static inline gboolean from_frontend(const struct pkt_struct *pkt,
+		const struct conn_struct *conn) {
+
+	const struct handler *front = conn->target->front_handler;
+
+	return pkt->in == front->iface
+			&& pkt->packet.ip->saddr == conn->front_ip.addr_ip
+			&& ((pkt->packet.eth->ether_type == htons(ETHERTYPE_IP)
+					&& front->vlan.vid == 0)
+					|| (pkt->packet.eth->ether_type == htons(ETHERTYPE_VLAN)
+							&& front->vlan.vid
+									== pkt->packet.vlan->h_vlan_TCI.vid));
 }
 
 int conn_lookup(struct pkt_struct *pkt, struct conn_struct **conn_out) {
@@ -452,15 +517,7 @@ int conn_lookup(struct pkt_struct *pkt, struct conn_struct **conn_out) {
 		if (g_tree_lookup_extended(ext_tree2, &key.key, NULL,
 				(gpointer *) &conn)) {
 
-			if (pkt->in == conn->target->front_handler->iface
-					&& pkt->packet.ip->saddr
-							== conn->target->front_handler->ip->addr_ip
-					&& ((pkt->packet.eth->ether_type == htons(ETHERTYPE_IP)
-							&& conn->target->front_handler->vlan.vid == 0)
-							|| (pkt->packet.eth->ether_type
-									== htons(ETHERTYPE_VLAN)
-									&& conn->target->front_handler->vlan.vid
-											== pkt->packet.vlan->h_vlan_TCI.vid))) {
+			if (from_frontend(pkt, conn)) {
 				pkt->origin = LIH;
 			} else {
 				pkt->origin = HIH;
@@ -474,15 +531,7 @@ int conn_lookup(struct pkt_struct *pkt, struct conn_struct **conn_out) {
 		if (g_tree_lookup_extended(int_tree1, &key.key, NULL,
 				(gpointer *) &conn)) {
 
-			if (pkt->in == conn->target->front_handler->iface
-					&& pkt->packet.ip->saddr
-							== conn->target->front_handler->ip->addr_ip
-					&& ((pkt->packet.eth->ether_type == htons(ETHERTYPE_IP)
-							&& conn->target->front_handler->vlan.vid == 0)
-							|| (pkt->packet.eth->ether_type
-									== htons(ETHERTYPE_VLAN)
-									&& conn->target->front_handler->vlan.vid
-											== pkt->packet.vlan->h_vlan_TCI.vid))) {
+			if (from_frontend(pkt, conn)) {
 				pkt->origin = LIH;
 			} else {
 				pkt->origin = HIH;
@@ -496,15 +545,7 @@ int conn_lookup(struct pkt_struct *pkt, struct conn_struct **conn_out) {
 		if (g_tree_lookup_extended(intra_tree1, &key.key, NULL,
 				(gpointer *) &conn)) {
 
-			if (pkt->in == conn->target->front_handler->iface
-					&& pkt->packet.ip->saddr
-							== conn->target->front_handler->ip->addr_ip
-					&& ((pkt->packet.eth->ether_type == htons(ETHERTYPE_IP)
-							&& conn->target->front_handler->vlan.vid == 0)
-							|| (pkt->packet.eth->ether_type
-									== htons(ETHERTYPE_VLAN)
-									&& conn->target->front_handler->vlan.vid
-											== pkt->packet.vlan->h_vlan_TCI.vid))) {
+			if (from_frontend(pkt, conn)) {
 				pkt->origin = LIH;
 			} else {
 				pkt->origin = HIH;
@@ -578,6 +619,388 @@ int conn_lookup(struct pkt_struct *pkt, struct conn_struct **conn_out) {
 	return ret;
 }
 
+/*! conn_source
+ \brief the external source IP a connection is accounted to, 0 if it has none
+ */
+static inline ip_addr_t conn_source(const struct conn_struct *conn) {
+	return conn->initiator == EXT ? conn->first_pkt_src_ip.addr_ip : 0;
+}
+
+/*! index_conn
+ \brief add a connection to the reverse index of a target or handler
+ */
+static void index_conn(GQueue *conns, GList **link, struct conn_struct *conn) {
+	if (!*link) {
+		g_queue_push_tail(conns, conn);
+		*link = conns->tail;
+	}
+}
+
+/*! unindex_conn
+ \brief undo index_conn
+ */
+static void unindex_conn(GQueue *conns, GList **link) {
+	if (*link) {
+		g_queue_delete_link(conns, *link);
+		*link = NULL;
+	}
+}
+
+/*! source_conns
+ \brief the tracked connections of an external source IP, the values of
+ * conn_count_per_source
+ */
+struct source_conns {
+	guint count;
+	GQueue evictable[__MAX_EVICTABLE];
+};
+
+/*! evictlock
+ \brief protects the evictable queues and the evictable fields of the conns
+ *
+ * It's taken after connlock or after the lock of a connection, never the
+ * other way around, so switch_state can requeue a connection without connlock.
+ */
+static GMutex evictlock;
+
+/*! evictable_queue
+ \brief the queue of a class of evictable connections counted against a limit
+ *
+ \return the queue, NULL if the connections aren't counted against the limit
+ */
+static GQueue *evictable_queue(struct target *target,
+		struct source_conns *source, eviction_reason_t reason,
+		evictable_t class) {
+
+	switch (reason) {
+	case EVICTION_TOTAL_LIMIT:
+		return &conn_evictable[class];
+	case EVICTION_TARGET_LIMIT:
+		return &target->evictable[class];
+	case EVICTION_SOURCE_LIMIT:
+		return source ? &source->evictable[class] : NULL;
+	default:
+		return NULL;
+	}
+}
+
+/*! queue_evictable
+ \brief add a tracked connection to the evictable queues of its state
+ *
+ * The queues are ordered by the time the connections entered the class:
+ * the undecided ones by age, the dropped ones by the time they were dropped.
+ * evictlock must be held by the caller.
+ */
+static void queue_evictable(struct conn_struct *conn) {
+
+	eviction_reason_t reason;
+
+	conn->evictable = conn_evictable_class(conn->state);
+	if (conn->evictable == __MAX_EVICTABLE) {
+		return;
+	}
+
+	for (reason = EVICTION_TOTAL_LIMIT; reason < __MAX_EVICTION_REASON;
+			reason++) {
+		GQueue *queue = evictable_queue(conn->target, conn->source, reason,
+				conn->evictable);
+		if (queue) {
+			index_conn(queue, &conn->evictable_link[reason], conn);
+		}
+	}
+}
+
+/*! unqueue_evictable
+ \brief undo queue_evictable
+ *
+ * evictlock must be held by the caller.
+ */
+static void unqueue_evictable(struct conn_struct *conn) {
+
+	eviction_reason_t reason;
+
+	if (conn->evictable == __MAX_EVICTABLE) {
+		return;
+	}
+
+	for (reason = EVICTION_TOTAL_LIMIT; reason < __MAX_EVICTION_REASON;
+			reason++) {
+		GQueue *queue = evictable_queue(conn->target, conn->source, reason,
+				conn->evictable);
+		if (queue) {
+			unindex_conn(queue, &conn->evictable_link[reason]);
+		}
+	}
+	conn->evictable = __MAX_EVICTABLE;
+}
+
+/*! requeue_evictable
+ \brief move a connection to the evictable queues of its new state
+ *
+ * The lock of the connection must be held by the caller, so it can't be
+ * tracked or untracked meanwhile.
+ */
+void requeue_evictable(struct conn_struct *conn) {
+	g_mutex_lock(&evictlock);
+	if (conn->age_link
+			&& conn->evictable != conn_evictable_class(conn->state)) {
+		unqueue_evictable(conn);
+		queue_evictable(conn);
+	}
+	g_mutex_unlock(&evictlock);
+}
+
+/*! index_conn_handlers
+ \brief add a tracked connection to the reverse indexes of its handlers
+ *
+ * Called again whenever a handler gets assigned to a tracked connection.
+ * connlock must be held by the caller.
+ */
+static void index_conn_handlers(struct conn_struct *conn) {
+
+	if (!conn->age_link) {
+		return;
+	}
+
+	if (conn->hih.back_handler) {
+		index_conn(&conn->hih.back_handler->conns, &conn->back_handler_link,
+				conn);
+		balancer_update(conn->target->balancer, conn->hih.back_handler);
+	}
+
+	if (conn->intra_handler) {
+		index_conn(&conn->intra_handler->conns, &conn->intra_handler_link,
+				conn);
+	}
+}
+
+/*! track_conn
+ \brief account a connection that has just been inserted into the trees
+ *
+ * connlock must be held by the caller.
+ */
+static void track_conn(struct conn_struct *conn) {
+
+	ip_addr_t src = conn_source(conn);
+
+	g_queue_push_tail(conn_age_queue, conn);
+	conn->age_link = conn_age_queue->tail;
+	index_conn(&conn->target->conns, &conn->target_link, conn);
+	index_conn_handlers(conn);
+	conn_count++;
+
+	if (src) {
+		struct source_conns *source = g_hash_table_lookup(conn_count_per_source,
+				GUINT_TO_POINTER(src));
+		if (!source) {
+			source = g_malloc0(sizeof(struct source_conns));
+			g_hash_table_insert(conn_count_per_source, GUINT_TO_POINTER(src),
+					source);
+		}
+		source->count++;
+		conn->source = source;
+	}
+
+	g_mutex_lock(&evictlock);
+	queue_evictable(conn);
+	g_mutex_unlock(&evictlock);
+}
+
+/*! untrack_conn
+ \brief undo track_conn when a connection leaves the trees
+ *
+ * connlock must be held by the caller.
+ */
+static void untrack_conn(struct conn_struct *conn) {
+
+	if (!conn->age_link) {
+		return;
+	}
+
+	ip_addr_t src = conn_source(conn);
+
+	g_mutex_lock(&evictlock);
+	unqueue_evictable(conn);
+	g_mutex_unlock(&evictlock);
+
+	g_queue_delete_link(conn_age_queue, conn->age_link);
+	conn->age_link = NULL;
+	unindex_conn(&conn->target->conns, &conn->target_link);
+	if (conn->hih.back_handler) {
+		unindex_conn(&conn->hih.back_handler->conns, &conn->back_handler_link);
+		conn->hih.back_handler->bytes += conn->total_byte;
+		balancer_update(conn->target->balancer, conn->hih.back_handler);
+	}
+	if (conn->intra_handler) {
+		unindex_conn(&conn->intra_handler->conns, &conn->intra_handler_link);
+	}
+	conn_count--;
+
+	if (conn->source && !--conn->source->count) {
+		g_hash_table_remove(conn_count_per_source, GUINT_TO_POINTER(src));
+	}
+	conn->source = NULL;
+}
+
+static void release_conn(struct conn_struct *conn, gboolean log);
+
+/*! conn_limit_reached
+ \brief check which connection table limit, if any, a new connection would exceed
+ */
+static eviction_reason_t conn_limit_reached(const struct conn_struct *conn) {
+
+	if (max_connections && conn_count >= max_connections) {
+		return EVICTION_TOTAL_LIMIT;
+	}
+
+	if (max_connections_per_target
+			&& conn->target->conns.length >= max_connections_per_target) {
+		return EVICTION_TARGET_LIMIT;
+	}
+
+	ip_addr_t src = conn_source(conn);
+	struct source_conns *source;
+	if (max_connections_per_source && src
+			&& (source = g_hash_table_lookup(conn_count_per_source,
+					GUINT_TO_POINTER(src)))
+			&& source->count >= max_connections_per_source) {
+		return EVICTION_SOURCE_LIMIT;
+	}
+
+	return EVICTION_NONE;
+}
+
+/*! find_victim
+ \brief the oldest connection of a class to evict
+ *
+ * Only connections counted against the limit that was hit are queued there,
+ * so the first one is taken unless another thread is processing it.
+ *
+ \param[in] conn: the new connection we are making room for
+ \param[in] reason: the limit that was hit
+ \param[in] class: DROP connections or undecided (INIT/DECISION) ones
+ \return the victim, locked, or NULL if none was found
+ */
+static struct conn_struct *find_victim(const struct conn_struct *conn,
+		eviction_reason_t reason, evictable_t class) {
+
+	struct conn_struct *found = NULL;
+	ip_addr_t src = conn_source(conn);
+	struct source_conns *source =
+			src ? g_hash_table_lookup(conn_count_per_source,
+					GUINT_TO_POINTER(src)) : NULL;
+	GList *loop;
+
+	g_mutex_lock(&evictlock);
+	GQueue *queue = evictable_queue(conn->target, source, reason, class);
+	for (loop = queue ? queue->head : NULL; loop && !found; loop = loop->next) {
+		struct conn_struct *victim = loop->data;
+
+		if (g_mutex_trylock(&victim->lock)) {
+			found = victim;
+		}
+	}
+	g_mutex_unlock(&evictlock);
+
+	return found;
+}
+
+/*! evict_conn
+ \brief evict one connection according to the configured policy
+ *
+ * connlock must be held by the caller.
+ *
+ \return OK if a connection was evicted, NOK otherwise
+ */
+static status_t evict_conn(const struct conn_struct *conn,
+		eviction_reason_t reason) {
+
+	struct conn_struct *victim = NULL;
+
+	switch (eviction_policy) {
+	case EVICT_DROP_FIRST:
+		if ((victim = find_victim(conn, reason, EVICTABLE_DROP))) {
+			break;
+		}
+		/* no break */
+	case EVICT_OLDEST_UNDECIDED:
+		victim = find_victim(conn, reason, EVICTABLE_UNDECIDED);
+		break;
+	case EVICT_REFUSE:
+	default:
+		break;
+	}
+
+	if (!victim) {
+		return NOK;
+	}
+
+	printdbg(
+			"%s Evicting connection %u in state %s (%s reached)\n", H(conn->id), victim->id, lookup_state(victim->state), lookup_eviction_reason(reason));
+
+	victim->eviction = reason;
+	conn_evicted++;
+	release_conn(victim, TRUE);
+
+	return OK;
+}
+
+/*! admit_conn
+ \brief enforce the connection table limits before a new connection is inserted
+ *
+ * connlock must be held by the caller.
+ *
+ \return OK if there is room for the connection, NOK if it has to be refused
+ */
+static status_t admit_conn(const struct conn_struct *conn) {
+
+	eviction_reason_t reason;
+
+	while (EVICTION_NONE != (reason = conn_limit_reached(conn))) {
+		if (NOK == evict_conn(conn, reason)) {
+			conn_refused++;
+			printdbg(
+					"%s Connection refused, %s reached\n", H(conn->id), lookup_eviction_reason(reason));
+			return NOK;
+		}
+	}
+
+	return OK;
+}
+
+/*! init_conn_limits
+ \brief read the connection table limits from the configuration
+ */
+void init_conn_limits() {
+
+	const char *policy = CONFIG("conn_eviction");
+
+	max_connections = ICONFIG("max_connections") > 0 ? ICONFIG("max_connections") : 0;
+	max_connections_per_target =
+			ICONFIG("max_connections_per_target") > 0 ?
+					ICONFIG("max_connections_per_target") : 0;
+	max_connections_per_source =
+			ICONFIG("max_connections_per_source") > 0 ?
+					ICONFIG("max_connections_per_source") : 0;
+
+	eviction_policy = EVICT_OLDEST_UNDECIDED;
+	if (policy) {
+		for (eviction_policy = 0; eviction_policy < __MAX_EVICTION_POLICY;
+				eviction_policy++) {
+			if (!strcmp(policy, lookup_eviction_policy(eviction_policy))) {
+				break;
+			}
+		}
+
+		if (eviction_policy == __MAX_EVICTION_POLICY) {
+			errx(1, "%s: unknown conn_eviction policy '%s'", __func__, policy);
+		}
+	}
+
+	printdbg(
+			"%s Connection limits: total %u, per target %u, per source %u, eviction policy: %s\n", H(0), max_connections, max_connections_per_target, max_connections_per_source, lookup_eviction_policy(eviction_policy));
+}
+
 status_t create_conn(struct pkt_struct *pkt, struct conn_struct **conn,
 		gdouble microtime) {
 
@@ -608,7 +1031,17 @@ status_t create_conn(struct pkt_struct *pkt, struct conn_struct **conn,
 	// All other new connections are going to be dropped.
 	if (pkt->origin == EXT) {
 
-		target = pkt->in->target;
+		// Targets with address blocks only get the destinations they cover,
+		// the target without address blocks takes the rest of the link.
+		// The tables are published copies, no lock needed (see management.c)
+		target = prefix_table_lookup(g_atomic_pointer_get(&target_addresses),
+				pkt->packet.ip->daddr);
+		if (!target || target->default_route != pkt->in) {
+			target = g_atomic_pointer_get(&pkt->in->target);
+			if (target && target->addresses) {
+				target = NULL;
+			}
+		}
 
 		if (target) {
 			goto conn_init;
@@ -633,9 +1066,9 @@ status_t create_conn(struct pkt_struct *pkt, struct conn_struct **conn,
 	target_search.hih_search = &hih_search;
 	target_search.intra_search = &intra_search;
 
-	g_rw_lock_reader_lock(&targetlock);
-	g_tree_foreach(targets, (GTraverseFunc) find_target, &target_search);
-	g_rw_lock_reader_unlock(&targetlock);
+	prefix_table_foreach_match(g_atomic_pointer_get(&handler_addresses),
+			pkt->packet.ip->saddr, (prefix_match_func) find_handler,
+			&target_search);
 
 	if (target_search.found) {
 		target = target_search.target;
@@ -675,12 +1108,13 @@ status_t create_conn(struct pkt_struct *pkt, struct conn_struct **conn,
 
 	/*! statistics */
 	conn_init->start_microtime = microtime;
-	conn_init->stat_time[INIT] = microtime;
-	conn_init->stat_packet[INIT] = 1;
-	conn_init->stat_byte[INIT] = pkt->size;
+	conn_init->stats = g_malloc0(sizeof(struct conn_stats));
+	conn_init->stats->stat_time[INIT] = microtime;
+	conn_init->stats->stat_packet[INIT] = 1;
+	conn_init->stats->stat_byte[INIT] = pkt->size;
+	conn_init->stats->decision_rule = g_string_new("");
 	conn_init->total_packet = 1;
 	conn_init->total_byte = pkt->size;
-	conn_init->decision_rule = g_string_new("");
 
 	addr_pack(&conn_init->first_pkt_src_mac, ADDR_TYPE_ETH, ETH_ADDR_BITS,
 			&pkt->packet.eth->ether_shost, ETH_ALEN);
@@ -695,14 +1129,15 @@ status_t create_conn(struct pkt_struct *pkt, struct conn_struct **conn,
 	// in both headers
 	conn_init->first_pkt_src_port = pkt->packet.tcp->source;
 	conn_init->first_pkt_dst_port = pkt->packet.tcp->dest;
+	conn_init->front_ip = *target->front_handler->ip;
+	conn_init->front_ip.addr_bits = 32;
 
 	struct tm *tm;
 	struct timeval tv;
 	struct timezone tz;
 	gettimeofday(&tv, &tz);
 	tm = localtime(&tv.tv_sec);
-	conn_init->start_timestamp = g_string_new("");
-	g_string_printf(conn_init->start_timestamp,
+	snprintf(conn_init->start_timestamp, sizeof(conn_init->start_timestamp),
 			"%d-%02d-%02d %02d:%02d:%02d.%.6d", (1900 + tm->tm_year),
 			(1 + tm->tm_mon), tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec,
 			(int) tv.tv_usec);
@@ -714,6 +1149,8 @@ status_t create_conn(struct pkt_struct *pkt, struct conn_struct **conn,
 
 		// New EXT connections always go to the LIH first
 		conn_init->destination = LIH;
+		conn_init->front_ip = frontend_address(target->front_handler,
+				pkt->packet.ip->daddr);
 
 		// This is the incoming connection
 		conn_init->ext_key = g_malloc0(sizeof(struct conn_key));
@@ -727,14 +1164,14 @@ status_t create_conn(struct pkt_struct *pkt, struct conn_struct **conn,
 		conn_init->int_key = g_malloc0(sizeof(struct conn_key));
 		conn_init->int_key->protocol = pkt->packet.ip->protocol;
 		conn_init->int_key->vlan_id = target->front_handler->vlan.vid;
-		conn_init->int_key->src_ip = target->front_handler->ip->__addr_u.__ip;
+		conn_init->int_key->src_ip = conn_init->front_ip.addr_ip;
 		conn_init->int_key->src_port = pkt->packet.tcp->dest;
 		conn_init->int_key->dst_ip = pkt->packet.ip->saddr;
 		conn_init->int_key->dst_port = pkt->packet.tcp->source;
 
 		conn_init->pin_key = g_malloc0(sizeof(struct pin_key));
 		conn_init->pin_key->vlan_id = target->front_handler->vlan.vid;
-		conn_init->pin_key->handler_ip = target->front_handler->ip->addr_ip;
+		conn_init->pin_key->handler_ip = conn_init->front_ip.addr_ip;
 		conn_init->pin_key->target_ip = pkt->packet.ip->daddr;
 
 #ifdef HONEYBRID_DEBUG
@@ -744,8 +1181,14 @@ status_t create_conn(struct pkt_struct *pkt, struct conn_struct **conn,
 #endif
 
 		g_mutex_lock(&connlock);
+		if (NOK == admit_conn(conn_init)) {
+			g_mutex_unlock(&connlock);
+			goto done;
+		}
+
 		g_tree_insert(ext_tree1, &conn_init->ext_key->key, conn_init);
 		g_tree_insert(ext_tree2, &conn_init->int_key->key, conn_init);
+		track_conn(conn_init);
 
 		struct pin *pin = NULL;
 		if (!g_tree_lookup_extended(comm_pin_tree, &conn_init->pin_key->key,
@@ -776,8 +1219,10 @@ status_t create_conn(struct pkt_struct *pkt, struct conn_struct **conn,
 
 	} else if (pkt->origin == LIH) {
 		conn_init->state = CONTROL;
+		addr_pack(&conn_init->front_ip, ADDR_TYPE_IP, 32,
+				&pkt->packet.ip->saddr, sizeof(ip_addr_t));
 
-		if (g_tree_lookup(conn_init->target->intra_handlers,
+		if (g_tree_lookup(target_intra_handlers(conn_init->target),
 				&conn_init->first_pkt_dst_ip)) {
 			conn_init->destination = INTRA;
 			// Invalid destination
@@ -786,7 +1231,7 @@ status_t create_conn(struct pkt_struct *pkt, struct conn_struct **conn,
 			struct hih_search hih_search2;
 			hih_search2.found = FALSE;
 			hih_search2.pkt = pkt;
-			g_tree_foreach(target->back_handlers, (GTraverseFunc) find_hih_dst,
+			g_tree_foreach(target_back_handlers(target), (GTraverseFunc) find_hih_dst,
 					&hih_search2);
 
 			if (hih_search2.found) {
@@ -800,7 +1245,7 @@ status_t create_conn(struct pkt_struct *pkt, struct conn_struct **conn,
 
 		struct pin_key *comm_pin_key = g_malloc0(sizeof(struct pin_key));
 		comm_pin_key->vlan_id = target->front_handler->vlan.vid;
-		comm_pin_key->handler_ip = target->front_handler->ip->addr_ip;
+		comm_pin_key->handler_ip = pkt->packet.ip->saddr;
 		comm_pin_key->target_ip = pkt->packet.ip->daddr;
 
 		ip_addr_t snat_to;
@@ -839,6 +1284,7 @@ status_t create_conn(struct pkt_struct *pkt, struct conn_struct **conn,
 		g_mutex_lock(&connlock);
 		g_tree_insert(int_tree1, conn_init->int_key, conn_init);
 		g_tree_insert(int_tree2, conn_init->ext_key, conn_init);
+		track_conn(conn_init);
 		g_mutex_unlock(&connlock);
 
 		result = OK;
@@ -850,7 +1296,7 @@ status_t create_conn(struct pkt_struct *pkt, struct conn_struct **conn,
 		conn_init->hih.back_handler = hih_search.back_handler;
 
 		conn_init->intra_handler = g_tree_lookup(
-				conn_init->target->intra_handlers,
+				target_intra_handlers(conn_init->target),
 				&conn_init->first_pkt_dst_ip);
 
 		if (conn_init->intra_handler) {
@@ -868,7 +1314,8 @@ status_t create_conn(struct pkt_struct *pkt, struct conn_struct **conn,
 			conn_init->destination = INTRA;
 			result = OK;
 			goto done;
-		} else if (pkt->packet.ip->daddr == target->front_handler->ip->addr_ip) {
+		} else if (frontend_covers(target->front_handler,
+				pkt->packet.ip->daddr)) {
 			conn_init->destination = LIH;
 			// Invalid destination
 			goto done;
@@ -876,7 +1323,7 @@ status_t create_conn(struct pkt_struct *pkt, struct conn_struct **conn,
 			struct hih_search hih_search2;
 			hih_search2.found = FALSE;
 			hih_search2.pkt = pkt;
-			g_tree_foreach(target->back_handlers, (GTraverseFunc) find_hih_dst,
+			g_tree_foreach(target_back_handlers(target), (GTraverseFunc) find_hih_dst,
 					&hih_search2);
 
 			if (hih_search2.found) {
@@ -958,6 +1405,7 @@ status_t create_conn(struct pkt_struct *pkt, struct conn_struct **conn,
 			g_mutex_lock(&connlock);
 			g_tree_insert(int_tree1, conn_init->int_key, conn_init);
 			g_tree_insert(int_tree2, conn_init->ext_key, conn_init);
+			track_conn(conn_init);
 			g_mutex_unlock(&connlock);
 
 			result = OK;
@@ -1023,6 +1471,7 @@ status_t create_conn(struct pkt_struct *pkt, struct conn_struct **conn,
 			g_mutex_lock(&connlock);
 			g_tree_insert(intra_tree1, conn_init->int_key, conn_init);
 			g_tree_insert(intra_tree2, conn_init->intra_key, conn_init);
+			track_conn(conn_init);
 			g_mutex_unlock(&connlock);
 
 			result = OK;
@@ -1038,16 +1487,17 @@ status_t create_conn(struct pkt_struct *pkt, struct conn_struct **conn,
 		// We don't set governing (control) rule on these connections, we just PROXY them
 		// TODO?
 
-		if (g_tree_lookup(conn_init->target->intra_handlers,
+		if (g_tree_lookup(target_intra_handlers(conn_init->target),
 				&conn_init->first_pkt_dst_ip)) {
 			conn_init->destination = INTRA;
 			goto done;
-		} else if (pkt->packet.ip->daddr == target->front_handler->ip->addr_ip) {
+		} else if (frontend_covers(target->front_handler,
+				pkt->packet.ip->daddr)) {
 			conn_init->destination = LIH;
 			goto done;
 		} else {
 			hih_search.found = FALSE;
-			g_tree_foreach(target->back_handlers, (GTraverseFunc) find_hih_dst,
+			g_tree_foreach(target_back_handlers(target), (GTraverseFunc) find_hih_dst,
 					&hih_search);
 
 			if (hih_search.found) {
@@ -1101,6 +1551,7 @@ status_t create_conn(struct pkt_struct *pkt, struct conn_struct **conn,
 		g_mutex_lock(&connlock);
 		g_tree_insert(intra_tree1, conn_init->int_key, conn_init);
 		g_tree_insert(intra_tree2, conn_init->intra_key, conn_init);
+		track_conn(conn_init);
 		g_mutex_unlock(&connlock);
 
 		result = OK;
@@ -1132,9 +1583,16 @@ status_t update_conn(struct pkt_struct *pkt, struct conn_struct *conn,
 	}
 
 	/*! statistics */
-	conn->stat_time[state] = microtime;
-	conn->stat_packet[state] += 1;
-	conn->stat_byte[state] += pkt->size;
+	if (conn->stats) {
+		conn->stats->stat_time[state] = microtime;
+		conn->stats->stat_packet[state] += 1;
+		conn->stats->stat_byte[state] += pkt->size;
+	} else {
+		// Compacted conn, only the final state is counted
+		conn->tombstone->stat_time = microtime;
+		conn->tombstone->stat_packet += 1;
+		conn->tombstone->stat_byte += pkt->size;
+	}
 	conn->total_packet += 1;
 	conn->total_byte += pkt->size;
 	/*! We update the current connection access time */
@@ -1147,83 +1605,223 @@ status_t update_conn(struct pkt_struct *pkt, struct conn_struct *conn,
 	return OK;
 }
 
-void remove_conn(struct conn_struct *conn, gpointer delayp) {
+/*! unpin_hih
+ \brief release the pin a redirected connection holds on its HIH
+ *
+ * connlock must be held by the caller.
+ */
+static void unpin_hih(struct conn_struct *conn) {
 
-	int delay = GPOINTER_TO_INT(delayp);
+	struct pin *pin = NULL;
 
-	if (!delay) {
-		// This connection must expire
-		g_mutex_lock(&conn->lock);
-	} else if (FALSE == g_mutex_trylock(&conn->lock)) {
-		return;
+	if (conn->hih.target_pin_key
+			&& (pin = g_tree_lookup(target_pin_tree, conn->hih.target_pin_key))) {
+		pin->count--;
+		printdbg("%s HIH target pin count @ %lu\n", H(1), pin->count);
+		if (pin->count == 0) {
+			g_tree_remove(target_pin_tree, conn->hih.target_pin_key);
+			printdbg("%s Removing HIH target pin\n", H(1));
+			free_pin(pin);
+		}
+	}
+}
+
+/*! unpin_conn
+ \brief release the pins held by a connection, freeing the pins nobody else holds
+ *
+ * connlock must be held by the caller.
+ */
+void unpin_conn(struct conn_struct *conn) {
+
+	GTree *pin_tree = NULL;
+	const char *pin_type = NULL;
+
+	if (conn->initiator == EXT
+			|| ((conn->initiator == LIH || conn->initiator == HIH)
+					&& conn->destination == EXT)) {
+		pin_tree = comm_pin_tree;
+		pin_type = "Comm";
+	} else if (conn->initiator == INTRA
+			|| conn->destination == INTRA) {
+		pin_tree = intra_pin_tree;
+		pin_type = "Intra";
+	}
+
+	struct pin *pin = NULL;
+	if (pin_tree && conn->pin_key
+			&& (pin = g_tree_lookup(pin_tree, conn->pin_key))) {
+		pin->count--;
+		printdbg("%s %s pin count @ %lu\n", H(1), pin_type, pin->count);
+		if (pin->count == 0) {
+			printdbg("%s Removing %s pin\n", H(1), pin_type);
+			g_tree_remove(pin_tree, conn->pin_key);
+			free_pin(pin);
+		}
 	}
 
+	unpin_hih(conn);
+}
+
+/*! release_conn
+ \brief remove a locked connection from the trees, release its pins, log it and free it
+ *
+ * connlock must be held by the caller.
+ */
+static void release_conn(struct conn_struct *conn, gboolean log) {
+
+	untrack_conn(conn);
+
 	if (conn->initiator == EXT) {
 		g_tree_remove(ext_tree1, conn->ext_key);
 		g_tree_remove(ext_tree2, conn->int_key);
 		if (conn->hih.redirected_int_key) {
 			g_tree_remove(ext_tree2, conn->hih.redirected_int_key);
 		}
-
-		struct pin *pin = NULL;
-		if (conn->pin_key
-				&& (pin = g_tree_lookup(comm_pin_tree, conn->pin_key))) {
-			pin->count--;
-			printdbg("%s Comm pin count @ %lu\n", H(1), pin->count);
-			if (pin->count == 0) {
-				printdbg("%s Removing comm pin\n", H(1));
-				g_tree_remove(comm_pin_tree, conn->pin_key);
-				free_pin(pin);
-			}
-		}
 	} else if ((conn->initiator == LIH || conn->initiator == HIH)
 			&& conn->destination == EXT) {
 		g_tree_remove(int_tree2, conn->ext_key);
 		g_tree_remove(int_tree1, conn->int_key);
-
-		struct pin *pin = NULL;
-		if (conn->pin_key
-				&& (pin = g_tree_lookup(comm_pin_tree, conn->pin_key))) {
-			pin->count--;
-			printdbg("%s Comm pin count @ %lu\n", H(1), pin->count);
-			if (pin->count == 0) {
-				printdbg("%s Removing comm pin\n", H(1));
-				g_tree_remove(comm_pin_tree, conn->pin_key);
-				free_pin(pin);
-			}
-		}
 	} else if (conn->initiator == INTRA
-			|| (conn->initiator == HIH && conn->destination == INTRA)) {
+			|| conn->destination == INTRA) {
 		g_tree_remove(intra_tree1, conn->int_key);
 		g_tree_remove(intra_tree2, conn->intra_key);
+	}
 
-		struct pin *pin = NULL;
-		if (conn->pin_key
-				&& (pin = g_tree_lookup(intra_pin_tree, conn->pin_key))) {
-			pin->count--;
-			printdbg("%s Intra pin count @ %lu\n", H(1), pin->count);
-			if (pin->count == 0) {
-				printdbg("%s Removing intra pin\n", H(1));
-				g_tree_remove(intra_pin_tree, conn->pin_key);
-				free_pin(pin);
+	unpin_conn(conn);
+
+	if (log) {
+		connection_log(conn);
+	}
+	free_conn(conn);
+}
+
+void remove_conn(struct conn_struct *conn, gpointer delayp) {
+
+	int delay = GPOINTER_TO_INT(delayp);
+
+	if (!delay) {
+		// This connection must expire
+		g_mutex_lock(&conn->lock);
+	} else if (FALSE == g_mutex_trylock(&conn->lock)) {
+		return;
+	}
+
+	release_conn(conn, TRUE);
+}
+
+/*! retire_waiters, conn_released
+ \brief retire_conns sleeps on conn_released (with connlock) while a
+ * connection it retires is busy, unlock_conn wakes it up
+ */
+static gint retire_waiters;
+static GCond conn_released;
+
+/*! unlock_conn
+ \brief release a connection the decision thread is done with
+ *
+ * The connection may be freed as soon as its lock is released.
+ */
+void unlock_conn(struct conn_struct *conn) {
+	g_mutex_unlock(&conn->lock);
+
+	if (g_atomic_int_get(&retire_waiters)) {
+		g_mutex_lock(&connlock);
+		g_cond_broadcast(&conn_released);
+		g_mutex_unlock(&connlock);
+	}
+}
+
+/*! retire_conns
+ \brief remove, log and unpin every connection of a reverse index
+ *
+ * Used when the target or handler the connections point to goes away.
+ * Connections a decision thread is working on are retried when it releases
+ * them with unlock_conn, or after RETIRE_WAIT for the other lock holders.
+ * connlock must not be held by the caller.
+ *
+ \param[in] conns: the conns queue of a target or handler
+ \return the number of connections retired
+ */
+uint32_t retire_conns(GQueue *conns) {
+
+	uint32_t retired = 0;
+
+	g_mutex_lock(&connlock);
+	/* counted before the first try so that no release goes unnoticed */
+	g_atomic_int_inc(&retire_waiters);
+	while (conns->length) {
+		gboolean busy = FALSE;
+		GList *loop = conns->head;
+
+		while (loop) {
+			struct conn_struct *conn = (struct conn_struct *) loop->data;
+			loop = loop->next;
+
+			if (g_mutex_trylock(&conn->lock)) {
+				release_conn(conn, TRUE);
+				retired++;
+			} else {
+				busy = TRUE;
 			}
 		}
+
+		if (busy) {
+			g_cond_wait_until(&conn_released, &connlock,
+					g_get_monotonic_time()
+							+ RETIRE_WAIT * G_TIME_SPAN_MILLISECOND);
+		}
 	}
+	g_atomic_int_add(&retire_waiters, -1);
+	g_mutex_unlock(&connlock);
 
-	struct pin *pin = NULL;
-	if (conn->hih.target_pin_key
-			&& (pin = g_tree_lookup(target_pin_tree, conn->hih.target_pin_key))) {
-		pin->count--;
-		printdbg("%s HIH target pin count @ %lu\n", H(1), pin->count);
-		if (pin->count == 0) {
-			g_tree_remove(target_pin_tree, conn->pin_key);
-			printdbg("%s Removing HIH target pin\n", H(1));
-			free_pin(pin);
+	return retired;
+}
+
+/*! discard_conn
+ \brief like remove_conn but without logging, used when the connection was saved to a snapshot
+ */
+void discard_conn(struct conn_struct *conn,
+		__attribute__ ((unused)) gpointer data) {
+
+	g_mutex_lock(&conn->lock);
+	release_conn(conn, FALSE);
+}
+
+/*! restore_conn
+ \brief insert a connection restored from a snapshot into the trees
+ *
+ * The pins the connection refers to are restored with their saved counts,
+ * so they are not touched here. connlock must be held by the caller.
+ *
+ \return OK if the connection was inserted, NOK if it can't be tracked
+ */
+status_t restore_conn(struct conn_struct *conn) {
+
+	if (conn->initiator == EXT) {
+		g_tree_insert(ext_tree1, conn->ext_key, conn);
+		g_tree_insert(ext_tree2, conn->int_key, conn);
+		if (conn->hih.redirected_int_key) {
+			g_tree_insert(ext_tree2, conn->hih.redirected_int_key, conn);
 		}
+	} else if ((conn->initiator == LIH || conn->initiator == HIH)
+			&& conn->destination == EXT) {
+		g_tree_insert(int_tree1, conn->int_key, conn);
+		g_tree_insert(int_tree2, conn->ext_key, conn);
+	} else if (conn->initiator == INTRA
+			|| conn->destination == INTRA) {
+		g_tree_insert(intra_tree1, conn->int_key, conn);
+		g_tree_insert(intra_tree2, conn->intra_key, conn);
+	} else {
+		return NOK;
 	}
 
-	connection_log(conn);
-	free_conn(conn);
+	track_conn(conn);
+
+	if (conn->id > c_id) {
+		c_id = conn->id;
+	}
+
+	return OK;
 }
 
 gboolean expire_conn(__attribute__ ((unused)) char *key,
@@ -1272,6 +1870,39 @@ status_t init_conn(struct pkt_struct *pkt, struct conn_struct **conn) {
 	}
 }
 
+/*! free_conn_buffer
+ \brief free the packets stored for replay and the ones parked for a module
+ */
+static void free_conn_buffer(struct conn_struct *conn) {
+	GSList *current = conn->BUFFER;
+	struct pkt_struct* tmp;
+
+	while ((tmp = g_queue_pop_head(&conn->parked))) {
+		free_pkt(tmp);
+	}
+	if (current != NULL) {
+		do {
+			tmp = (struct pkt_struct*) g_slist_nth_data(current, 0);
+			free_pkt(tmp);
+		} while ((current = g_slist_next(current)) != NULL);
+
+		g_slist_free(conn->BUFFER);
+		conn->BUFFER = NULL;
+	}
+
+	conn->expected_data.payload = NULL;
+}
+
+/*! free_conn_stats
+ \brief free the per-state statistics of the connection
+ */
+static void free_conn_stats(struct conn_struct *conn) {
+	if (conn->stats) {
+		g_string_free(conn->stats->decision_rule, TRUE);
+		free_0(conn->stats);
+	}
+}
+
 /*! free_conn
  \brief called for each entry in the pointer array, each entry is a key that is deleted from the B-Tree
  \param[in] key, a pointer to the current B-Tree key value stored in the pointer table
@@ -1282,32 +1913,15 @@ void free_conn(struct conn_struct *conn) {
 
 		uint32_t id = conn->id;
 
-		GSList *current = conn->BUFFER;
-		struct pkt_struct* tmp;
-		if (current != NULL) {
-			do {
-				tmp = (struct pkt_struct*) g_slist_nth_data(current, 0);
-				free_pkt(tmp);
-			} while ((current = g_slist_next(current)) != NULL);
-
-			g_slist_free(conn->BUFFER);
-		}
-
-		current = conn->custom_data;
-		while (current != NULL) {
-			struct custom_conn_data *custom =
-					(struct custom_conn_data *) g_slist_nth_data(current, 0);
-			if (custom) {
-				if (custom->data && custom->data_free)
-					custom->data_free(custom->data);
-
-				free_0(custom);
-			}
+		free_conn_buffer(conn);
+		free_module_state(conn);
+		free_conn_stats(conn);
 
-			current = g_slist_next(current);
+		if (conn->tombstone) {
+			free_0(conn->tombstone->custom_data);
+			free_0(conn->tombstone);
 		}
 
-		g_slist_free(conn->custom_data);
 		g_mutex_clear(&conn->lock);
 		free_0(conn->int_key);
 		free_0(conn->ext_key);
@@ -1315,63 +1929,85 @@ void free_conn(struct conn_struct *conn) {
 		free_0(conn->intra_key);
 		free_0(conn->hih.redirected_int_key);
 		free_0(conn->hih.target_pin_key);
-		g_string_free(conn->start_timestamp, TRUE);
-		g_string_free(conn->decision_rule, TRUE);
 		free_0(conn);
 
 		printdbg("%s Connection %u entry removed\n", H(8), id);
 	}
 }
 
+/*! compact_conn
+ \brief shrink a connection that reached a final state
+ *
+ * DROP connections and PROXY connections without backends will never change
+ * state again. The log fields of their previous states are rendered into a
+ * tombstone and the per-state statistics, the replay buffer and the custom
+ * data of the modules are freed. Keys, pins, counters and NAT data are kept,
+ * so the conn is still dropped/proxied until it expires and its log line is
+ * the same as without compaction.
+ *
+ * The caller must hold the connection lock.
+ */
+void compact_conn(struct conn_struct *conn) {
+
+	if (conn->tombstone) {
+		return;
+	}
+
+	if (conn->state != DROP
+			&& (conn->state != PROXY
+					|| g_tree_nnodes(target_back_handlers(conn->target))
+					|| conn->target->back_picker)) {
+		return;
+	}
+
+	conn->tombstone = connection_tombstone(conn);
+
+	free_conn_buffer(conn);
+	free_module_state(conn);
+	free_conn_stats(conn);
+
+	printdbg("%s Connection compacted in state %s\n", H(conn->id), lookup_state(conn->state));
+}
+
 /*! clean
- \brief watchman for the b_tree, wake up every minute and check every entries
+ \brief watchman for the b_tree, the timers call it every minute to check
+ * every entries
  */
-void clean() {
+void clean(gpointer unused) {
 
 	int delay = ICONFIG("expiration_delay");
 	if (delay <= 0)
 		delay = 120;
-	gint64 sleep_cycle;
 
-	// Wait for timeout or signal
-	g_mutex_lock(&threading_cond_lock);
-	rewind: sleep_cycle = g_get_monotonic_time() + 60 * G_TIME_SPAN_SECOND;
-	while (OK == threading) {
-		if (!g_cond_wait_until(&threading_cond, &threading_cond_lock,
-				sleep_cycle)) {
+	printdbg("%s cleaning\n", H(8));
 
-			printdbg("%s cleaning\n", H(8));
-
-			/*! init the table*/
-			entrytoclean = g_ptr_array_new();
-
-			/*! call the clean function for each value */
-			g_mutex_lock(&connlock);
-			g_tree_foreach(ext_tree1, (GTraverseFunc) expire_conn,
-					GINT_TO_POINTER(delay));
+	/*! init the table*/
+	g_mutex_lock(&connlock);
+	entrytoclean = g_ptr_array_new();
 
-			g_tree_foreach(int_tree2, (GTraverseFunc) expire_conn,
-					GINT_TO_POINTER(delay));
+	/*! call the clean function for each value */
+	g_tree_foreach(ext_tree1, (GTraverseFunc) expire_conn,
+			GINT_TO_POINTER(delay));
 
-			g_tree_foreach(intra_tree1, (GTraverseFunc) expire_conn,
-					GINT_TO_POINTER(delay));
+	g_tree_foreach(int_tree2, (GTraverseFunc) expire_conn,
+			GINT_TO_POINTER(delay));
 
-			// remove each key listed from the btree
-			g_ptr_array_foreach(entrytoclean, (GFunc) remove_conn,
-					GINT_TO_POINTER(delay));
-			g_mutex_unlock(&connlock);
+	g_tree_foreach(intra_tree1, (GTraverseFunc) expire_conn,
+			GINT_TO_POINTER(delay));
 
-			// free the array */
-			g_ptr_array_free(entrytoclean, TRUE);
-			entrytoclean = NULL;
+	// remove each key listed from the btree
+	g_ptr_array_foreach(entrytoclean, (GFunc) remove_conn,
+			GINT_TO_POINTER(delay));
 
-			if (threading == OK) {
-				goto rewind;
-			}
-		}
-	}
-	g_mutex_unlock(&threading_cond_lock);
+	// free the array */
+	g_ptr_array_free(entrytoclean, TRUE);
+	entrytoclean = NULL;
+	g_mutex_unlock(&connlock);
 
+	/*! free the targets of older configurations that are done,
+	 * and the replaced lookup tables no thread reads anymore */
+	reap_retired();
+	epoch_reclaim();
 }
 
 /*! setup_redirection
@@ -1388,8 +2024,14 @@ status_t setup_redirection(struct conn_struct *conn, uint64_t hih_use) {
 	}
 
 	printdbg("%s [** Starting... **]\n", H(conn->id));
-	struct handler *back_handler = g_tree_lookup(conn->target->back_handlers,
-			&hih_use);
+	struct handler *back_handler = g_tree_lookup(
+			target_back_handlers(conn->target), &hih_use);
+
+	if (!back_handler) {
+		printdbg("%s [** Error, HIH %lu doesn't exist **]\n", H(conn->id),
+				hih_use);
+		return NOK;
+	}
 
 	if (back_handler->ip) {
 
@@ -1432,6 +2074,18 @@ status_t setup_redirection(struct conn_struct *conn, uint64_t hih_use) {
 			}
 		}
 
+		/* The capacity is checked and the slot taken under the same lock */
+		g_mutex_lock(&connlock);
+		if (back_handler->capacity
+				&& back_handler->conns.length >= back_handler->capacity) {
+			unpin_hih(conn);
+			g_mutex_unlock(&connlock);
+			free_0(conn->hih.target_pin_key);
+			printdbg(
+					"%s Can't setup redirection. HIH is at capacity\n", H(conn->id));
+			return NOK;
+		}
+
 		GTimeVal t;
 		g_get_current_time(&t);
 		gdouble microtime = 0.0;
@@ -1442,7 +2096,7 @@ status_t setup_redirection(struct conn_struct *conn, uint64_t hih_use) {
 		conn->hih.back_handler = back_handler;
 		conn->hih.port = conn->first_pkt_dst_port;
 		/*! We then update the status of the connection structure */
-		conn->stat_time[DECISION] = microtime;
+		conn->stats->stat_time[DECISION] = microtime;
 
 		conn->hih.redirected_int_key = g_malloc0(sizeof(struct conn_key));
 		conn->hih.redirected_int_key->protocol = conn->protocol;
@@ -1456,6 +2110,8 @@ status_t setup_redirection(struct conn_struct *conn, uint64_t hih_use) {
 		//		"%s Inserting redirected conn key to ext_tree2: %" PRIx64 "\n", H(conn->id), conn->hih.redirected_int_key->key);
 
 		g_tree_insert(ext_tree2, conn->hih.redirected_int_key, conn);
+		index_conn_handlers(conn);
+		g_mutex_unlock(&connlock);
 
 		switch_state(conn, REPLAY);
 
@@ -1516,6 +2172,7 @@ status_t switch_conn_to_intra(struct conn_struct *conn,
 	// And reinsert it into the intra_trees
 	g_tree_insert(intra_tree1, conn->int_key, conn);
 	g_tree_insert(intra_tree2, conn->intra_key, conn);
+	index_conn_handlers(conn);
 
 	g_mutex_unlock(&connlock);
 
@@ -1555,6 +2212,7 @@ status_t add_conn_to_intra(struct conn_struct *conn,
 	g_mutex_lock(&connlock);
 	g_tree_insert(intra_tree1, conn->int_key, conn);
 	g_tree_insert(intra_tree2, conn->intra_key, conn);
+	track_conn(conn);
 	g_mutex_unlock(&connlock);
 
 	return OK;
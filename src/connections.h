@@ -34,6 +34,8 @@ status_t init_pkt(struct interface *iface, uint16_t ethertype,
 
 void free_pkt(struct pkt_struct *pkt);
 
+struct addr frontend_address(const struct handler *front, ip_addr_t ip);
+
 status_t store_pkt(struct conn_struct *conn, struct pkt_struct *pkt);
 
 status_t init_conn(struct pkt_struct *pkt, struct conn_struct **conn);
@@ -42,11 +44,46 @@ gboolean expire_conn(char *key, struct conn_struct *conn, gpointer delay);
 
 void remove_conn(struct conn_struct *conn, gpointer data);
 
+void discard_conn(struct conn_struct *conn, gpointer data);
+
+#define RETIRE_WAIT 10 /* ms */
+
+uint32_t retire_conns(GQueue *conns);
+
+void unlock_conn(struct conn_struct *conn);
+
+/*! conn_evictable_class
+ \brief the evictable queues of the connections in a state, see find_victim
+ */
+static inline evictable_t conn_evictable_class(conn_status_t state) {
+	switch (state) {
+	case INIT:
+	case DECISION:
+		return EVICTABLE_UNDECIDED;
+	case DROP:
+		return EVICTABLE_DROP;
+	default:
+		return __MAX_EVICTABLE;
+	}
+}
+
+void requeue_evictable(struct conn_struct *conn);
+
+void unpin_conn(struct conn_struct *conn);
+
+status_t restore_conn(struct conn_struct *conn);
+
 void free_conn(struct conn_struct *conn);
 
+void compact_conn(struct conn_struct *conn);
+
 status_t init_mark(struct pkt_struct *pkt, const struct conn_struct *conn);
 
-void clean();
+#define CLEAN_INTERVAL 60000 /* ms */
+
+void clean(gpointer unused);
+
+void init_conn_limits();
 
 status_t setup_redirection(struct conn_struct *conn, uint64_t hih_id);
 
@@ -75,10 +75,46 @@ const char *conn_status_string[__MAX_CONN_STATUS] = {
 	[CONTROL] 	= "CONTROL"
 };
 
+const char *eviction_policy_string[__MAX_EVICTION_POLICY] = {
+	[EVICT_REFUSE]				= "refuse",
+	[EVICT_OLDEST_UNDECIDED]	= "oldest",
+	[EVICT_DROP_FIRST]			= "drop"
+};
+
+const char *balance_policy_string[__MAX_BALANCE_POLICY] = {
+	[BALANCE_LEAST_CONN]	= "least_conn",
+	[BALANCE_WEIGHTED]		= "weighted",
+	[BALANCE_RANDOM]		= "random"
+};
+
+const char *reload_policy_string[__MAX_RELOAD_POLICY] = {
+	[RELOAD_KEEP]	= "keep",
+	[RELOAD_RETIRE]	= "retire"
+};
+
+const char *digest_string[__MAX_DIGEST] = {
+	[DIGEST_SHA1]	= "sha1",
+	[DIGEST_XXH64]	= "xxh64"
+};
+
+const char *control_scope_string[__MAX_CONTROL_SCOPE] = {
+	[CONTROL_SOURCE]		= "source",
+	[CONTROL_DESTINATION]	= "destination",
+	[CONTROL_SERVICE]		= "service"
+};
+
+const char *eviction_reason_string[__MAX_EVICTION_REASON] = {
+	[EVICTION_NONE]			= "none",
+	[EVICTION_TOTAL_LIMIT]	= "max_connections",
+	[EVICTION_TARGET_LIMIT]	= "max_connections_per_target",
+	[EVICTION_SOURCE_LIMIT]	= "max_connections_per_source"
+};
+
 const char *mod_result_string[] = {
 	[DEFER] = "DEFER",
 	[ACCEPT] = "ACCEPT",
-	[REJECT] = "REJECT"
+	[REJECT] = "REJECT",
+	[PENDING] = "PENDING"
 };
 
 const char mac_broadcast_string[] = "FF:FF:FF:FF:FF:FF";
@@ -35,6 +35,18 @@ extern const char* role_string[__MAX_ROLE];
 
 extern const char* conn_status_string[__MAX_CONN_STATUS];
 
+extern const char* eviction_policy_string[__MAX_EVICTION_POLICY];
+
+extern const char* eviction_reason_string[__MAX_EVICTION_REASON];
+
+extern const char* balance_policy_string[__MAX_BALANCE_POLICY];
+
+extern const char* reload_policy_string[__MAX_RELOAD_POLICY];
+
+extern const char* digest_string[__MAX_DIGEST];
+
+extern const char* control_scope_string[__MAX_CONTROL_SCOPE];
+
 extern const char* mod_result_string[];
 
 extern const char mac_broadcast_string[];
@@ -51,6 +63,30 @@ static inline const char *lookup_state(conn_status_t state) {
 	return conn_status_string[state];
 }
 
+static inline const char *lookup_eviction_policy(eviction_policy_t policy) {
+	return eviction_policy_string[policy];
+}
+
+static inline const char *lookup_eviction_reason(eviction_reason_t reason) {
+	return eviction_reason_string[reason];
+}
+
+static inline const char *lookup_balance_policy(balance_policy_t policy) {
+	return balance_policy_string[policy];
+}
+
+static inline const char *lookup_reload_policy(reload_policy_t policy) {
+	return reload_policy_string[policy];
+}
+
+static inline const char *lookup_digest(digest_t digest) {
+	return digest_string[digest];
+}
+
+static inline const char *lookup_control_scope(control_scope_t scope) {
+	return control_scope_string[scope];
+}
+
 static inline const char *lookup_result(mod_result_t result) {
 	return mod_result_string[result];
 }
@@ -36,6 +36,7 @@
 #include "globals.h"
 #include "structs.h"
 #include "convenience.h"
+#include "connections.h"
 
 /*! config_lookup
  /brief lookup values from the config hash table. Make sure the required value is present
@@ -76,8 +77,16 @@ status_t switch_state(struct conn_struct *conn, conn_status_t new_state) {
 	printdbg(
 			"%s switching state from %s to %s\n", H(conn->id), lookup_state(conn->state), lookup_state(new_state));
 
+	gboolean requeue = conn_evictable_class(conn->state)
+			!= conn_evictable_class(new_state);
+
 	conn->state = new_state;
 
+	/* Only a change of class moves it between the evictable queues */
+	if (requeue) {
+		requeue_evictable(conn);
+	}
+
 	return OK;
 }
 
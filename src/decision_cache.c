@@ -0,0 +1,270 @@
+/*
+ * This file is part of the honeybrid project.
+ *
+ * 2007-2009 University of Maryland (http://www.umd.edu)
+ * Robin Berthier <robinb@umd.edu>, Thomas Coquelin <coquelin@umd.edu>
+ * and Julien Vehent <julien@linuxwall.info>
+ *
+ * 2012-2014 University of Connecticut (http://www.uconn.edu)
+ * Tamas K Lengyel <tamas.k.lengyel@gmail.com>
+ *
+ * Honeybrid is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "decision_cache.h"
+#include "log.h"
+
+/*!	\file decision_cache.c
+ \brief
+
+ Memo of rule results, keyed by the rule, the attacker and the service it
+ hits. Scanners open the same connection over and over, and most of the
+ modules they go through give the same answer every time: a cached result
+ is a single hash probe instead of a run of the rule.
+
+ Only the results the modules declare stable (see CACHE_RESULT) are stored,
+ for the smallest 'cache' time of the modules the evaluation went through.
+ The rule ID identifies the target and handler the rule belongs to, so a
+ rule replaced at runtime never hits the results of its predecessor.
+
+ The cache is split in shards with their own lock and their own bound, an
+ entry is dropped when it expires or when it's the oldest of a full shard.
+
+ */
+
+#define DECISION_CACHE_SHARDS	16
+
+struct decision_key {
+	uint32_t rule;
+	ip_addr_t saddr;
+	uint16_t dport;
+	uint8_t proto;
+	uint64_t backend_test;
+};
+
+struct decision_entry {
+	struct decision_key key;
+	decision_t result;
+	uint64_t backend_use;
+	gint64 expires;
+	gint64 cost;
+	GList link; // position in the shard's insertion order
+};
+
+struct decision_shard {
+	GMutex lock;
+	GHashTable *entries;
+	GQueue order; // oldest first
+	uint64_t hits, misses, stores, evictions, expired;
+	uint64_t eval_usec, saved_usec;
+};
+
+static struct decision_shard shards[DECISION_CACHE_SHARDS];
+static uint32_t shard_capacity;
+
+static guint decision_key_hash(gconstpointer k) {
+	const struct decision_key *key = k;
+	uint64_t h = ((uint64_t) key->rule << 32 | key->saddr)
+			* 0x9E3779B97F4A7C15ULL;
+	h ^= ((uint64_t) key->dport << 8 | key->proto)
+			+ key->backend_test * 0xC2B2AE3D27D4EB4FULL;
+	h ^= h >> 29;
+	return (guint) h;
+}
+
+static gboolean decision_key_equal(gconstpointer a, gconstpointer b) {
+	const struct decision_key *k1 = a, *k2 = b;
+	return k1->rule == k2->rule && k1->saddr == k2->saddr
+			&& k1->dport == k2->dport && k1->proto == k2->proto
+			&& k1->backend_test == k2->backend_test;
+}
+
+static inline void decision_key_init(struct decision_key *key,
+		const struct decision_holder *decision) {
+	const struct packet *packet = &decision->pkt->packet;
+
+	memset(key, 0, sizeof(struct decision_key));
+	key->rule = decision->rule->id;
+	key->saddr = packet->ip->saddr;
+	key->proto = packet->ip->protocol;
+	key->backend_test = decision->backend_test;
+
+	/* TCP and UDP keep the destination port at the same offset */
+	if (key->proto == IPPROTO_TCP || key->proto == IPPROTO_UDP) {
+		key->dport = ntohs(packet->udp->dest);
+	}
+}
+
+static inline struct decision_shard *get_shard(const struct decision_key *key) {
+	return &shards[(decision_key_hash(key) >> 24) % DECISION_CACHE_SHARDS];
+}
+
+static void drop_entry(struct decision_shard *shard,
+		struct decision_entry *entry) {
+	g_hash_table_remove(shard->entries, &entry->key);
+	g_queue_unlink(&shard->order, &entry->link);
+	g_free(entry);
+}
+
+/*! decision_cache_init
+ \brief set up the cache to hold up to capacity results, 0 disables it
+ */
+void decision_cache_init(uint32_t capacity) {
+	uint32_t i;
+
+	shard_capacity = capacity ? MAX(capacity / DECISION_CACHE_SHARDS, 1) : 0;
+
+	for (i = 0; i < DECISION_CACHE_SHARDS; i++) {
+		g_mutex_init(&shards[i].lock);
+		g_queue_init(&shards[i].order);
+		shards[i].entries = g_hash_table_new(decision_key_hash,
+				decision_key_equal);
+	}
+
+	printdbg("%s Decision cache of %u entries in %u shards\n", H(0),
+			shard_capacity * DECISION_CACHE_SHARDS, DECISION_CACHE_SHARDS);
+}
+
+void decision_cache_destroy() {
+	uint32_t i;
+
+	for (i = 0; i < DECISION_CACHE_SHARDS; i++) {
+		struct decision_shard *shard = &shards[i];
+
+		g_mutex_lock(&shard->lock);
+		while (shard->order.head) {
+			drop_entry(shard, shard->order.head->data);
+		}
+		g_hash_table_destroy(shard->entries);
+		shard->entries = NULL;
+		g_mutex_unlock(&shard->lock);
+	}
+
+	shard_capacity = 0;
+}
+
+/*! decision_cache_lookup
+ \brief fill in the result of the decision if it's cached
+ \return TRUE on a hit
+ */
+gboolean decision_cache_lookup(struct decision_holder *decision) {
+
+	if (!shard_capacity) {
+		return FALSE;
+	}
+
+	struct decision_key key;
+	decision_key_init(&key, decision);
+
+	struct decision_shard *shard = get_shard(&key);
+	gboolean hit = FALSE;
+
+	g_mutex_lock(&shard->lock);
+
+	struct decision_entry *entry = g_hash_table_lookup(shard->entries, &key);
+	if (entry) {
+		if (entry->expires > g_get_monotonic_time()) {
+			decision->result = entry->result;
+			if (entry->backend_use != 0) {
+				decision->backend_use = entry->backend_use;
+			}
+			shard->saved_usec += entry->cost;
+			shard->hits++;
+			hit = TRUE;
+		} else {
+			drop_entry(shard, entry);
+			shard->expired++;
+		}
+	}
+
+	if (!hit) {
+		shard->misses++;
+	}
+
+	g_mutex_unlock(&shard->lock);
+
+	return hit;
+}
+
+/*! decision_cache_store
+ \brief remember the result of a decision for ttl seconds
+ *
+ \param[in] decision: the evaluated decision
+ \param[in] backend_use: backend suggested by a module during the evaluation, 0 if none
+ \param[in] ttl: seconds the result stays valid
+ \param[in] cost: microseconds the evaluation took
+ */
+void decision_cache_store(const struct decision_holder *decision,
+		uint64_t backend_use, uint32_t ttl, gint64 cost) {
+
+	if (!shard_capacity) {
+		return;
+	}
+
+	struct decision_key key;
+	decision_key_init(&key, decision);
+
+	struct decision_shard *shard = get_shard(&key);
+
+	g_mutex_lock(&shard->lock);
+
+	/* another thread may have decided for the same key in the meantime */
+	struct decision_entry *entry = g_hash_table_lookup(shard->entries, &key);
+	if (entry) {
+		g_queue_unlink(&shard->order, &entry->link);
+	} else {
+		if (shard->order.length >= shard_capacity) {
+			drop_entry(shard, shard->order.head->data);
+			shard->evictions++;
+		}
+
+		entry = g_malloc0(sizeof(struct decision_entry));
+		entry->key = key;
+		entry->link.data = entry;
+		g_hash_table_insert(shard->entries, &entry->key, entry);
+	}
+
+	entry->result = decision->result;
+	entry->backend_use = backend_use;
+	entry->expires = g_get_monotonic_time() + (gint64) ttl * G_USEC_PER_SEC;
+	entry->cost = cost;
+	g_queue_push_tail_link(&shard->order, &entry->link);
+
+	shard->eval_usec += cost;
+	shard->stores++;
+
+	g_mutex_unlock(&shard->lock);
+}
+
+void decision_cache_get_stats(struct decision_cache_stats *stats) {
+	uint32_t i;
+
+	memset(stats, 0, sizeof(struct decision_cache_stats));
+	stats->capacity = shard_capacity * DECISION_CACHE_SHARDS;
+
+	for (i = 0; i < DECISION_CACHE_SHARDS; i++) {
+		struct decision_shard *shard = &shards[i];
+
+		g_mutex_lock(&shard->lock);
+		stats->entries += shard->order.length;
+		stats->hits += shard->hits;
+		stats->misses += shard->misses;
+		stats->stores += shard->stores;
+		stats->evictions += shard->evictions;
+		stats->expired += shard->expired;
+		stats->eval_usec += shard->eval_usec;
+		stats->saved_usec += shard->saved_usec;
+		g_mutex_unlock(&shard->lock);
+	}
+}
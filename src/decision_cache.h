@@ -0,0 +1,60 @@
+/*
+ * This file is part of the honeybrid project.
+ *
+ * 2007-2009 University of Maryland (http://www.umd.edu)
+ * Robin Berthier <robinb@umd.edu>, Thomas Coquelin <coquelin@umd.edu>
+ * and Julien Vehent <julien@linuxwall.info>
+ *
+ * 2012-2014 University of Connecticut (http://www.uconn.edu)
+ * Tamas K Lengyel <tamas.k.lengyel@gmail.com>
+ *
+ * Honeybrid is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DECISION_CACHE_H_
+#define __DECISION_CACHE_H_
+
+#include "types.h"
+#include "structs.h"
+
+#define DECISION_CACHE_SIZE	65536
+
+/*!
+ \def decision_cache_stats
+ \brief counters of the decision cache, summed over all its shards
+ */
+struct decision_cache_stats {
+	uint32_t capacity;
+	uint32_t entries;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t stores;
+	uint64_t evictions; // entries dropped to make room before they expired
+	uint64_t expired;
+	uint64_t eval_usec; // time spent evaluating the rules whose result got cached
+	uint64_t saved_usec; // evaluation time avoided by the hits
+};
+
+void decision_cache_init(uint32_t capacity);
+
+void decision_cache_destroy(void);
+
+gboolean decision_cache_lookup(struct decision_holder *decision);
+
+void decision_cache_store(const struct decision_holder *decision,
+		uint64_t backend_use, uint32_t ttl, gint64 cost);
+
+void decision_cache_get_stats(struct decision_cache_stats *stats);
+
+#endif /* __DECISION_CACHE_H_ */
@@ -25,7 +25,7 @@
 /*! \file decision_engine.c
  * \brief Decision Engine for honeybrid
  *
- * This engine creates boolean decision trees from a rule list and process incoming connection using those trees. If the tree return TRUE, the redirected value of the connection is set to 1.
+ * This engine compiles boolean equations of modules into rules and process incoming connection using those rules. If the rule accepts, the redirected value of the connection is set to 1.
  *
  *
  \author Julien Vehent, 2007
@@ -34,151 +34,464 @@
  */
 
 #include "decision_engine.h"
+#include "decision_cache.h"
 #include "modules.h"
 #include "connections.h"
 #include "log.h"
 #include "globals.h"
 #include "structs.h"
 #include "constants.h"
+#include "balancer.h"
+#include "profile.h"
 
-/*! build_subtree
- \param[in] expr, a part of the boolean equation
- *
- \brief recursively process the expression and creates the nodes */
-struct node *DE_build_subtree(const gchar *expr) {
+/*! expr
+ \brief parsed boolean equation, only lives while a rule is compiled
+ */
+struct expr {
+	enum {
+		EXPR_MODULE, EXPR_NOT, EXPR_AND, EXPR_OR
+	} op;
+	struct expr *left;
+	struct expr *right;
 	struct node *node;
-	node = (struct node *) g_malloc0(sizeof(struct node));
-	node->module = NULL;
-	char *modname;
-	const char *function;
-	module_function function_pointer;
-
-	/*! test presence of AND operator */
-	GRegex *and_regex = g_regex_new("\\sAND\\s", G_REGEX_CASELESS, 0, NULL);
-
-	/*! composed expression: separate the left part */
-	if (TRUE == g_regex_match(and_regex, expr, 0, NULL)) {
-#ifdef DEBUG
-		g_print("\t\tFound the AND operator, splitting...\n");
-#endif
-
-		/*! split on "AND" operator */
-		gchar **and = g_regex_split(and_regex, expr, 0);
-		/*! process left part of the AND */
-		modname = g_strdup(and[0]);
-		/*! call function with right side of expr */
-		node->true_branch = DE_build_subtree(and[1]);
-		node->false_branch = NULL;
-	} else {
-		/*! single module in expression, just add the leaf */
+};
+
+/*! Evaluations of rules that left a connection in its state, and the ones
+ * skipped because none of the triggers of their modules fired */
+static uint64_t evaluated, skipped;
+
+struct rule_parser {
+	gchar **tokens;
+	guint pos;
+	const gchar *equation;
+	GHashTable *modules;
+	GArray *steps;
+};
+
+static void free_node(struct node *node) {
+	if (node) {
+		if (node->module_name)
+			g_string_free(node->module_name, TRUE);
+		if (node->function)
+			g_string_free(node->function, TRUE);
+		g_free(node->param);
+		if (node->config)
+			g_hash_table_unref(node->config);
+		profile_free(node->profile);
+		g_free(node);
+	}
+}
+
+static void free_expr(struct expr *expr) {
+	if (expr) {
+		free_expr(expr->left);
+		free_expr(expr->right);
+		free_node(expr->node);
+		g_free(expr);
+	}
+}
+
+/*! tokenize
+ \brief split an equation into module names, operators and parentheses
+ */
+static gchar **tokenize(const gchar *equation) {
+	GPtrArray *tokens = g_ptr_array_new();
+	const gchar *c = equation;
+
+	while (*c) {
+		if (g_ascii_isspace(*c)) {
+			c++;
+		} else if (*c == '(' || *c == ')' || *c == '!') {
+			g_ptr_array_add(tokens, g_strndup(c, 1));
+			c++;
+		} else {
+			const gchar *start = c;
+			while (*c && !g_ascii_isspace(*c) && *c != '(' && *c != ')') {
+				c++;
+			}
+			g_ptr_array_add(tokens, g_strndup(start, c - start));
+		}
+	}
 
-#ifdef DEBUG
-		g_print("\t\tNo operator found in '%s'\n", expr);
-#endif
+	g_ptr_array_add(tokens, NULL);
+	return (gchar **) g_ptr_array_free(tokens, FALSE);
+}
 
-		modname = g_strdup(expr);
-		node->true_branch = NULL;
-		node->false_branch = NULL;
+static inline const gchar *peek(struct rule_parser *p) {
+	return p->tokens[p->pos];
+}
+
+static inline gboolean accept_token(struct rule_parser *p, const gchar *op) {
+	if (peek(p) && !g_ascii_strcasecmp(peek(p), op)) {
+		p->pos++;
+		return TRUE;
 	}
+	return FALSE;
+}
 
-	/*! get module structure from DE_rules
-	 */
-	if ((node->config = (GHashTable *) g_hash_table_lookup(module, modname))
-			== NULL) {
-		errx(1, "%s: Module '%s' unknown!", __func__, modname);
+/*! DE_create_node
+ \brief instantiate a module for a rule and parse its parameters
+ \return the node, NULL if the module is unknown or misconfigured
+ */
+static struct node *DE_create_node(GHashTable *modules, const gchar *modname) {
+	GHashTable *config;
+	const char *function;
+	const struct mod_def *def;
+
+	/*! get module structure from DE_rules */
+	if ((config = (GHashTable *) g_hash_table_lookup(modules, modname)) == NULL) {
+		printdbg("%s Module '%s' unknown!\n", H(0), modname);
+		return NULL;
 	}
-	if ((function = (const char *) g_hash_table_lookup(node->config, "function"))
+	if ((function = (const char *) g_hash_table_lookup(config, "function"))
 			== NULL) {
-		errx(1, "%s: Module function undefined!", __func__);
+		printdbg("%s Module function undefined!\n", H(0));
+		return NULL;
 	}
-	if ((function_pointer = get_module(function)) == NULL) {
-		errx(1, "%s: Module function pointer undefined!", __func__);
+	if ((def = get_module_def(function)) == NULL || def->function == NULL) {
+		printdbg("%s Module function pointer undefined!\n", H(0));
+		return NULL;
 	}
 
-	node->module = function_pointer;
-	node->module_name = g_string_new(NULL);
-	node->function = g_string_new(NULL);
-	g_string_printf(node->module_name, "%s", modname);
-	g_string_printf(node->function, "%s", function);
+	struct node *node = g_malloc0(sizeof(struct node));
+	node->module = def->function;
+	node->def = def;
+	/* Kept as long as the node: its parameters may point into it */
+	node->config = g_hash_table_ref(config);
+	node->constant = DEFER;
+	node->module_name = g_string_new(modname);
+	node->function = g_string_new(function);
+
+	if (def->parse_config && def->parse_config(node) != OK) {
+		printdbg("%s Module '%s' has invalid parameters!\n", H(0), modname);
+		free_node(node);
+		return NULL;
+	}
 
-	printdbg("\t\tModule function '%s' defined\n", function);
+	int ttl;
+	if (module_param_int(node, "cache", &ttl) && ttl > 0) {
+		if (def->cacheable) {
+			node->cache_ttl = ttl;
+		} else {
+			printdbg("%s Results of module '%s' can't be cached, ignoring its cache setting\n", H(0), modname);
+		}
+	}
+
+	use_module(def);
 
-	g_regex_unref(and_regex);
-	g_free(modname);
+	printdbg("\t\tModule function '%s' defined\n", function);
 
-	/*! return pointer to this leaf  */
 	return node;
 }
 
-/*! DE_create_tree
- \brief build a boolean decision tree for a given equation
+static struct expr *parse_or(struct rule_parser *p);
+
+static struct expr *parse_not(struct rule_parser *p) {
+	struct expr *expr;
+
+	if (accept_token(p, "NOT") || accept_token(p, "!")) {
+		struct expr *operand = parse_not(p);
+		if (!operand) {
+			return NULL;
+		}
+		expr = g_malloc0(sizeof(struct expr));
+		expr->op = EXPR_NOT;
+		expr->left = operand;
+		return expr;
+	}
+
+	if (accept_token(p, "(")) {
+		expr = parse_or(p);
+		if (expr && !accept_token(p, ")")) {
+			printdbg("%s Missing ')' in rule '%s'\n", H(0), p->equation);
+			free_expr(expr);
+			return NULL;
+		}
+		return expr;
+	}
+
+	if (!peek(p) || !g_ascii_strcasecmp(peek(p), ")")
+			|| !g_ascii_strcasecmp(peek(p), "AND")
+			|| !g_ascii_strcasecmp(peek(p), "OR")) {
+		printdbg("%s Module name expected in rule '%s'\n", H(0), p->equation);
+		return NULL;
+	}
+
+	struct node *node = DE_create_node(p->modules, peek(p));
+	if (!node) {
+		return NULL;
+	}
+	p->pos++;
+
+	expr = g_malloc0(sizeof(struct expr));
+	expr->op = EXPR_MODULE;
+	expr->node = node;
+	return expr;
+}
+
+static struct expr *parse_and(struct rule_parser *p) {
+	struct expr *expr = parse_not(p);
+
+	while (expr && accept_token(p, "AND")) {
+		struct expr *right = parse_not(p);
+		if (!right) {
+			free_expr(expr);
+			return NULL;
+		}
+		struct expr *and = g_malloc0(sizeof(struct expr));
+		and->op = EXPR_AND;
+		and->left = expr;
+		and->right = right;
+		expr = and;
+	}
+
+	return expr;
+}
+
+static struct expr *parse_or(struct rule_parser *p) {
+	struct expr *expr = parse_and(p);
+
+	while (expr && accept_token(p, "OR")) {
+		struct expr *right = parse_and(p);
+		if (!right) {
+			free_expr(expr);
+			return NULL;
+		}
+		struct expr *or = g_malloc0(sizeof(struct expr));
+		or->op = EXPR_OR;
+		or->left = expr;
+		or->right = right;
+		expr = or;
+	}
+
+	return expr;
+}
+
+/*! compile
+ \brief emit the steps of an expression, given where to go on each outcome
  *
- \param[in] equation a boolean equation
+ * The right side of AND/OR is emitted first so it can be jumped to, the
+ * steps are therefore emitted in reverse order of execution.
  *
- \return tree_root a pointer to the root of the boolean decision tree
+ \return the step to start the expression at, or the outcome if it is constant
  */
-struct node *DE_create_tree(const gchar *equation) {
+static int32_t compile(struct rule_parser *p, struct expr *expr,
+		int32_t on_accept, int32_t on_reject) {
 
-	if(!equation) return NULL;
+	int32_t right;
 
-	/*! create a glib table to store the equation */
-	gchar **subgroups;
+	switch (expr->op) {
+	case EXPR_MODULE:
+		if (expr->node->constant == ACCEPT) {
+			return on_accept;
+		}
+		if (expr->node->constant == REJECT) {
+			return on_reject;
+		}
 
-	GRegex *or_regex = g_regex_new("\\sOR\\s", G_REGEX_CASELESS, 0, NULL);
-	subgroups = g_regex_split(or_regex, equation, 0);
+		struct rule_step step = { .node = expr->node, .on_accept = on_accept,
+				.on_reject = on_reject };
+		g_array_append_val(p->steps, step);
+		expr->node = NULL; // owned by the step now
+		return p->steps->len - 1;
+	case EXPR_NOT:
+		return compile(p, expr->left, on_reject, on_accept);
+	case EXPR_AND:
+		right = compile(p, expr->right, on_accept, on_reject);
+		return compile(p, expr->left, right, on_reject);
+	case EXPR_OR:
+	default:
+		right = compile(p, expr->right, on_accept, on_reject);
+		return compile(p, expr->left, on_accept, right);
+	}
+}
 
-	struct node *node = DE_build_subtree(subgroups[0]);
+/*! link_rule
+ \brief put the emitted steps in execution order and drop the unreachable ones
+ *
+ * Steps made unreachable by constant folding (like the right side of
+ * "yes OR x") are freed.
+ */
+static void link_rule(struct rule *rule, GArray *emitted, int32_t entry) {
 
-	/*! for all the other subgroups */
-	int n = 1;
-	for (n = 1; subgroups[n] != NULL; n++) {
-		printdbg("\t\tAnalyzing subgroup %i: '%s'\n", n, subgroups[n]);
+	guint n = emitted->len, i;
+	int32_t *map = g_malloc(n * sizeof(int32_t));
+	gboolean *reachable = g_malloc0(n * sizeof(gboolean));
+	struct rule_step *steps = (struct rule_step *) emitted->data;
 
-		/*! get the pointer to the beginning of the new subtree */
-		struct node *headsubgroup;
-		headsubgroup = DE_build_subtree(subgroups[n]);
+	/* Jumps go from later emitted steps to earlier ones */
+	if (entry >= 0) {
+		reachable[entry] = TRUE;
+	}
+	for (i = n; i-- > 0;) {
+		if (!reachable[i]) {
+			continue;
+		}
+		if (steps[i].on_accept >= 0)
+			reachable[steps[i].on_accept] = TRUE;
+		if (steps[i].on_reject >= 0)
+			reachable[steps[i].on_reject] = TRUE;
+	}
 
-		/*! connect new subtree to the previous one
-		 * subtree (n) is a son of subtree(n-1) */
-		node->false_branch = headsubgroup;
+	rule->length = 0;
+	for (i = n; i-- > 0;) {
+		map[i] = reachable[i] ? (int32_t) rule->length++ : -1;
+	}
 
-		while (node->true_branch != NULL) {
-			/*! and go to the next one */
-			if (node->true_branch != NULL)
-				node = node->true_branch;
+	rule->steps = g_malloc0(rule->length * sizeof(struct rule_step));
+	for (i = 0; i < n; i++) {
+		if (!reachable[i]) {
+			free_node(steps[i].node);
+			continue;
+		}
+		struct rule_step *step = &rule->steps[map[i]];
+		step->node = steps[i].node;
+		step->on_accept =
+				steps[i].on_accept >= 0 ?
+						map[steps[i].on_accept] : steps[i].on_accept;
+		step->on_reject =
+				steps[i].on_reject >= 0 ?
+						map[steps[i].on_reject] : steps[i].on_reject;
+	}
 
-			/*! in subtree (n-1), each FALSE branch is
-			 * connected to the head of subtree(n) */
-			node->false_branch = headsubgroup;
+	rule->entry = entry >= 0 ? map[entry] : entry;
 
+	for (i = 0; i < rule->length; i++) {
+		if (rule->steps[i].node->cache_ttl) {
+			rule->cacheable = TRUE;
 		}
+	}
+
+	g_free(map);
+	g_free(reachable);
+}
+
+/*! DE_create_rule
+ \brief compile a boolean equation of modules into a rule
+ *
+ * Modules are combined with AND, OR and NOT (or '!'), by order of precedence,
+ * and can be grouped with parentheses. Evaluation is short-circuit, from left
+ * to right, and stops as soon as a module defers.
+ *
+ \param[in] equation a boolean equation
+ \param[in] modules the module definitions the names refer to
+ *
+ \return the compiled rule, NULL if the equation is invalid
+ */
+struct rule *DE_create_rule(const gchar *equation, GHashTable *modules) {
 
-		/*! this subtree is done, so n become n-1 */
-		node = headsubgroup;
+	if (!equation)
+		return NULL;
+
+	struct rule_parser parser = { .tokens = tokenize(equation), .pos = 0,
+			.equation = equation, .modules = modules };
+
+	struct expr *expr = parse_or(&parser);
+	if (expr && peek(&parser)) {
+		printdbg("%s Unexpected '%s' in rule '%s'\n", H(0), peek(&parser), equation);
+		free_expr(expr);
+		expr = NULL;
 	}
-	g_strfreev(subgroups);
-	g_regex_unref(or_regex);
-	or_regex = NULL;
+	g_strfreev(parser.tokens);
 
-	return node;
+	if (!expr) {
+		return NULL;
+	}
+
+	parser.steps = g_array_new(FALSE, FALSE, sizeof(struct rule_step));
+
+	static gint rule_ids;
+
+	struct rule *rule = g_malloc0(sizeof(struct rule));
+	rule->id = g_atomic_int_add(&rule_ids, 1) + 1;
+	rule->equation = g_strdup(equation);
+
+	int32_t entry = compile(&parser, expr, RULE_ACCEPT, RULE_REJECT);
+	link_rule(rule, parser.steps, entry);
 
+	printdbg("\t\tRule '%s' compiled to %u steps\n", equation, rule->length);
+
+	g_array_free(parser.steps, TRUE);
+	free_expr(expr);
+
+	return rule;
 }
 
-/*! DE_destroy_tree
- \brief destroy a boolean decision tree
+/*! DE_destroy_rule
+ \brief destroy a compiled rule
  *
- \param[in] root node
+ \param[in] rule
+ */
+void DE_destroy_rule(struct rule *rule) {
+	if (rule != NULL) {
+		uint32_t i;
+		for (i = 0; i < rule->length; i++) {
+			free_node(rule->steps[i].node);
+		}
+		g_free(rule->steps);
+		g_free(rule->equation);
+		g_free(rule);
+	}
+}
+
+/*! park_trail
+ \brief keep the results of the modules called so far with the job the
+ * pending module submitted
+ */
+static void park_trail(struct decision_holder *decision) {
+	struct module_job *job = decision->pkt->conn->pending;
+
+	if (job && !decision->trail_overflow && decision->trail_len) {
+		job->trail = g_memdup(decision->trail,
+				decision->trail_len * sizeof(struct decision_trail));
+		job->trail_len = decision->trail_len;
+	}
+}
+
+/*! resume_trail
+ \brief pick up the trail of the job the conn was parked for
+ */
+static void resume_trail(struct decision_holder *decision) {
+	struct module_job *job = decision->pkt->conn->pending;
+
+	if (job && g_atomic_int_get(&job->state) == JOB_RESUMED && job->trail) {
+		memcpy(decision->trail, job->trail,
+				job->trail_len * sizeof(struct decision_trail));
+		decision->trail_len = job->trail_len;
+
+		/* only the packet that was parked first replays it */
+		g_free(job->trail);
+		job->trail = NULL;
+		job->trail_len = 0;
+	}
+}
+
+/*! note_triggers
+ \brief remember what may change the answer a module just gave
  */
-void DE_destroy_tree(struct node *clean) {
-	if (clean != NULL) {
-		DE_destroy_tree(clean->false_branch);
-		DE_destroy_tree(clean->true_branch);
-		if (clean->module_name)
-			g_string_free(clean->module_name, TRUE);
-		if (clean->function)
-			g_string_free(clean->function, TRUE);
-		g_free(clean);
+static inline void note_triggers(struct decision_holder *decision,
+		const struct node *node, const struct mod_args *args,
+		gboolean replayed) {
+
+	uint8_t triggers = node->def->triggers ? node->def->triggers : TRIGGER_PACKET;
+
+	/* the thresholds of a replayed module are not known anymore */
+	if (replayed && (triggers & (TRIGGER_COUNT | TRIGGER_TIME))) {
+		triggers |= TRIGGER_PACKET;
+	}
+
+	if ((triggers & TRIGGER_COUNT) && args->wake_data_packets
+			&& (!decision->wake_data_packets
+					|| args->wake_data_packets < decision->wake_data_packets)) {
+		decision->wake_data_packets = args->wake_data_packets;
+	}
+
+	if ((triggers & TRIGGER_TIME) && args->wake_time
+			&& (!decision->wake_time || args->wake_time < decision->wake_time)) {
+		decision->wake_time = args->wake_time;
 	}
+
+	decision->triggers |= triggers;
 }
 
 /*! decide
@@ -190,74 +503,123 @@ void DE_destroy_tree(struct node *clean) {
 
 void decide(struct decision_holder *decision) {
 
+	const struct rule *rule = decision->rule;
+
+	/* a replay goes through the modules this rule went through the first time */
+	gboolean replaying = decision->replayed < decision->trail_len
+			&& decision->trail[decision->replayed].step >= rule->steps
+			&& decision->trail[decision->replayed].step
+					< rule->steps + rule->length;
+
+	if (rule->cacheable && !replaying && decision_cache_lookup(decision)) {
+		/* the cached result expires on its own */
+		decision->triggers |= TRIGGER_PACKET;
+		printdbg(
+				"%s >> Cached result is %s\n", H(decision->pkt->conn->id), lookup_result((mod_result_t) decision->result));
+		return;
+	}
+
 	struct mod_args args = { .pkt = decision->pkt, .backend_test =
 			decision->backend_test, .backend_use = 0 };
 
-	struct node *node = decision->node;
-	decision->result = DE_DEFER;
+	/* the result can be cached for as long as the shortest-lived module allows */
+	uint32_t ttl = rule->cacheable ? G_MAXUINT32 : 0;
+	gint64 start = rule->cacheable ? g_get_monotonic_time() : 0;
+	uint64_t suggested = 0;
 
-	/*! start processing the tree from the root */
-	while (1) {
+	int32_t next = rule->entry;
+
+	/*! run the program from its entry, steps only jump forward */
+	while (next >= 0) {
+
+		const struct rule_step *step = &rule->steps[next];
 
 		printdbg(
-				"%s >> Calling module %s at address %p\n", H(decision->pkt->conn->id), node->module_name->str, node->module);
+				"%s >> Calling module %s at address %p\n", H(decision->pkt->conn->id), step->node->module_name->str, step->node->module);
 
 		mod_result_t result;
-		args.node = node;
+		args.node = step->node;
+		args.wake_data_packets = 0;
+		args.wake_time = 0;
+
+		if (decision->replayed < decision->trail_len
+				&& decision->trail[decision->replayed].step != step) {
+			/* the evaluation took another way (a cached result expired),
+			 * the rest of the trail doesn't apply anymore */
+			decision->trail_len = decision->replayed;
+		}
 
-		run_module(node->module, &args, result);
+		if (decision->replayed < decision->trail_len) {
+			/* the packet is evaluated again after a module parked the conn */
+			result = decision->trail[decision->replayed].result;
+			args.backend_use = decision->trail[decision->replayed].backend_use;
+			decision->replayed++;
+			note_triggers(decision, step->node, &args, TRUE);
+		} else {
+			gint64 began = profile_clock();
+			run_module(step->node->module, &args, result);
+			profile_record(&step->node->profile, result,
+					profile_clock() - began);
+			note_triggers(decision, step->node, &args, FALSE);
+
+			if (result != PENDING && decision->trail_len < DE_TRAIL_MAX) {
+				struct decision_trail *trail =
+						&decision->trail[decision->trail_len];
+				trail->step = step;
+				trail->result = result;
+				trail->backend_use = args.backend_use;
+				decision->replayed = ++decision->trail_len;
+			} else if (result != PENDING) {
+				decision->trail_overflow = TRUE;
+			}
+		}
 
 		printdbg(
 				"%s >> Done, result is %s\n", H(decision->pkt->conn->id), lookup_result(result));
 
+		if (ttl && (step->node->def->cacheable & CACHE_RESULT(result))) {
+			ttl = MIN(ttl, step->node->cache_ttl);
+		} else {
+			ttl = 0;
+		}
+
 		switch (result) {
 		case ACCEPT:
-			/*! if result is true, forward to true node or exit with 1 */
-			/*! update decision_rule information */
-
 			/* Global multi-hih module that tells which HIH ID to use */
 			if (args.backend_use != 0) {
 				printdbg(
 						"%s >> Module suggested using HIH %lu\n", H(decision->pkt->conn->id), args.backend_use);
-				decision->backend_use = args.backend_use;
+				decision->backend_use = suggested = args.backend_use;
 			}
 
-			if (node->true_branch != NULL) {
-				/*! go to next node */
-				node = node->true_branch;
-			} else {
-				decision->result = DE_ACCEPT;
-				/*! end of the tree, exit */
-				goto done;
-			}
+			next = step->on_accept;
 			break;
 		case DEFER:
 			decision->result = DE_DEFER;
-			goto done;
-			break;
+			return;
+		case PENDING:
+			/* the rule is evaluated again when the work is done, replaying the trail */
+			decision->result = DE_PENDING;
+			park_trail(decision);
+			return;
 		case REJECT:
 		default:
-
-			if (node->false_branch != NULL) {
-				/*! go to next node */
-				node = node->false_branch;
-			} else {
-				decision->result = DE_REJECT;
-				/*! end of the tree, exit */
-				goto done;
-				break;
-			}
-
+			next = step->on_reject;
 			break;
 		}
 	}
 
-	done: return;
+	decision->result = next == RULE_ACCEPT ? DE_ACCEPT : DE_REJECT;
+
+	if (ttl) {
+		decision_cache_store(decision, suggested, ttl,
+				g_get_monotonic_time() - start);
+	}
 }
 
 static inline
 void get_decision(struct decision_holder *decision) {
-	if (decision->node == NULL) {
+	if (decision->rule == NULL) {
 		printdbg(
 				"%s rule is NULL for state %s on target %p\n", H(decision->pkt->conn->id), lookup_state(decision->pkt->conn->state), decision->pkt->conn->target);
 	} else {
@@ -271,8 +633,17 @@ void get_decision(struct decision_holder *decision) {
 
 int get_decision_backend(uint32_t *key, struct handler * back_handler,
 		struct decision_holder * decision) {
+
+	/* Saturated backends are not offered any more connections */
+	if (!balancer_has_room(decision->pkt->conn->target->balancer,
+			back_handler)) {
+		/* until one of their connections ends */
+		decision->triggers |= TRIGGER_PACKET;
+		return FALSE;
+	}
+
 	decision->backend_test = *key;
-	decision->node = back_handler->rule;
+	decision->rule = back_handler->rule;
 	get_decision(decision);
 
 	/* Stop searching on the first accept */
@@ -280,8 +651,69 @@ int get_decision_backend(uint32_t *key, struct handler * back_handler,
 		decision->backend_use = *key;
 		return TRUE;
 	} else {
-		return FALSE;
+		/* or when a module parks the connection, the search starts over when it resumes */
+		return decision->result == DE_PENDING;
+	}
+}
+
+/*! rule_wakes_up
+ \brief check if the rule that left the connection in its state can answer differently now
+ */
+static gboolean rule_wakes_up(const struct pkt_struct *pkt) {
+	const struct conn_struct *conn = pkt->conn;
+	const struct rule_wakeup *wakeup = &conn->wakeup;
+
+	if (!wakeup->armed || wakeup->state != conn->state
+			|| (wakeup->triggers & TRIGGER_PACKET)) {
+		return TRUE;
+	}
+
+	if ((wakeup->triggers & TRIGGER_DATA) && pkt->data) {
+		return TRUE;
+	}
+
+	if ((wakeup->triggers & TRIGGER_COUNT)
+			&& conn->count_data_pkt_from_intruder >= wakeup->data_packets) {
+		return TRUE;
+	}
+
+	if ((wakeup->triggers & TRIGGER_TIME)
+			&& g_get_monotonic_time() >= wakeup->time) {
+		return TRUE;
+	}
+
+	if ((wakeup->triggers & TRIGGER_DIRECTION)
+			&& pkt->origin != wakeup->origin) {
+		return TRUE;
 	}
+
+	return conn->target->back_handler_count != wakeup->backends;
+}
+
+/*! rule_sleep
+ \brief keep the connection in its state until a trigger of the rule fires
+ */
+static void rule_sleep(struct pkt_struct *pkt,
+		const struct decision_holder *decision) {
+	struct rule_wakeup *wakeup = &pkt->conn->wakeup;
+
+	wakeup->armed = TRUE;
+	wakeup->state = pkt->conn->state;
+	wakeup->triggers = decision->triggers;
+	wakeup->origin = pkt->origin;
+	/* without a threshold the count or the time can't make the answer change */
+	wakeup->data_packets =
+			decision->wake_data_packets ? decision->wake_data_packets : G_MAXUINT32;
+	wakeup->time = decision->wake_time ? decision->wake_time : G_MAXINT64;
+	wakeup->backends = pkt->conn->target->back_handler_count;
+}
+
+/*! DE_get_trigger_stats
+ \brief number of evaluations that kept a connection in its state, and of evaluations skipped
+ */
+void DE_get_trigger_stats(uint64_t *evaluations, uint64_t *skips) {
+	*evaluations = __sync_fetch_and_add(&evaluated, 0);
+	*skips = __sync_fetch_and_add(&skipped, 0);
 }
 
 /*! DE_process_packet
@@ -301,9 +733,22 @@ status_t DE_process_packet(struct pkt_struct *pkt) {
 
 	printdbg("%s Packet pushed to DE: %"PRIx32"\n", H(pkt->conn->id), pkt->packet.ip->saddr);
 
+	/* Nothing the rule depends on changed since it last kept the connection
+	 * in this state, so the packet gets the same answer */
+	if (!rule_wakes_up(pkt)) {
+		printdbg("%s No trigger of the rule fired, decision kept\n", H(pkt->conn->id));
+		__sync_fetch_and_add(&skipped, 1);
+		return OK;
+	}
+
+	conn_status_t state = pkt->conn->state;
+	pkt->conn->wakeup.armed = FALSE;
+
+	resume_trail(&decision);
+
 	switch (pkt->conn->state) {
 	case INIT:
-		decision.node = pkt->conn->target->front_handler->rule;
+		decision.rule = pkt->conn->target->front_handler->rule;
 		get_decision(&decision);
 
 		/* If we're in INIT, we need to get ACCEPT or REJECT from the frontend definition of the target */
@@ -316,7 +761,7 @@ status_t DE_process_packet(struct pkt_struct *pkt) {
 
 		/* Check if global rule for multi-hih available */
 		if (pkt->conn->target->back_picker != NULL) {
-			decision.node = pkt->conn->target->back_picker;
+			decision.rule = pkt->conn->target->back_picker;
 			get_decision(&decision);
 
 			if (decision.result == DE_ACCEPT && decision.backend_use != 0) {
@@ -325,20 +770,28 @@ status_t DE_process_packet(struct pkt_struct *pkt) {
 						"%s Global backend rule gave us a HIH: %lu\n", H(pkt->conn->id), decision.backend_use);
 
 				struct handler *back_handler = (struct handler *) g_tree_lookup(
-						pkt->conn->target->back_handlers,
+						target_back_handlers(pkt->conn->target),
 						&(decision.backend_use));
 
-				if (back_handler->rule) {
-					decision.node = back_handler->rule;
+				if (!back_handler) {
+					printdbg(
+							"%s Backend picking rule gave a HIH that doesn't exist, rejecting!\n", H(pkt->conn->id));
+					decision.result = DE_REJECT;
+				} else if (back_handler->rule) {
+					decision.rule = back_handler->rule;
 					get_decision(&decision);
 				}
-			} else {
+			} else if (decision.result != DE_PENDING) {
 				printdbg(
 						"%s Backend picking rule didn't specify HIH, rejecting!\n", H(pkt->conn->id));
 			}
+		} else if (!balancer_available(pkt->conn->target->balancer)) {
+			printdbg(
+					"%s All backends are saturated, keeping the connection on the LIH\n", H(pkt->conn->id));
+			decision.result = DE_REJECT;
 		} else {
-			/* Check each backend, first to accept will take it */
-			g_tree_foreach(pkt->conn->target->back_handlers,
+			/* Check each backend with room left, first to accept will take it */
+			g_tree_foreach(target_back_handlers(pkt->conn->target),
 					(GTraverseFunc) get_decision_backend,
 					(gpointer *) (&decision));
 		}
@@ -346,13 +799,13 @@ status_t DE_process_packet(struct pkt_struct *pkt) {
 		break;
 	case CONTROL:
 		if (pkt->conn->destination == EXT) {
-			decision.node = pkt->conn->target->control_rule;
+			decision.rule = pkt->conn->target->control_rule;
 			get_decision(&decision);
 		} else if (pkt->conn->destination == INTRA) {
 
 			// If the connection has a handler assigned, use its rule
 			// otherwise take the rule from the target
-			decision.node =
+			decision.rule =
 					pkt->conn->intra_handler ?
 							pkt->conn->intra_handler->rule :
 							pkt->conn->target->intra_rule;
@@ -417,8 +870,11 @@ status_t DE_process_packet(struct pkt_struct *pkt) {
 			printdbg(
 					"%s Redirecting to HIH: %lu\n", H(pkt->conn->id), decision.backend_use);
 			if (NOK == setup_redirection(pkt->conn, decision.backend_use)) {
+				/* the HIH is gone, pinned or full, so the LIH keeps the connection */
 				printdbg(
-						"%s setup_redirection() failed\n", H(pkt->conn->id));
+						"%s setup_redirection() failed, falling back to the LIH\n", H(pkt->conn->id));
+				switch_state(pkt->conn, PROXY);
+				result = OK;
 			}
 			break;
 		case CONTROL:
@@ -444,6 +900,18 @@ status_t DE_process_packet(struct pkt_struct *pkt) {
 		printdbg("%s Rule decides to drop\n", H(pkt->conn->id));
 		switch_state(pkt->conn, DROP);
 		break;
+	case DE_PENDING:
+		/*! a module is working on it, the caller parks the packet */
+		printdbg("%s Rule waits for a module\n", H(pkt->conn->id));
+		break;
+	}
+
+	/* The rule is evaluated again on the next packets only if they can change its answer */
+	if (result == OK && pkt->conn->state == state
+			&& (state == DECISION || state == CONTROL)
+			&& (decision.result == DE_DEFER || decision.result == DE_ACCEPT)) {
+		rule_sleep(pkt, &decision);
+		__sync_fetch_and_add(&evaluated, 1);
 	}
 
 	return result;
@@ -28,7 +28,7 @@
 #include "types.h"
 #include "structs.h"
 
-struct node *DE_create_tree(const gchar *equation);
+struct rule *DE_create_rule(const gchar *equation, GHashTable *modules);
 
 void DE_submit_packet();
 
@@ -36,6 +36,8 @@ void DE_push_pkt(struct pkt_struct *pkt);
 
 status_t DE_process_packet(struct pkt_struct *pkt);
 
-void DE_destroy_tree(struct node *clean);
+void DE_get_trigger_stats(uint64_t *evaluations, uint64_t *skips);
+
+void DE_destroy_rule(struct rule *rule);
 
 #endif
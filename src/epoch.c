@@ -0,0 +1,175 @@
+/*
+ * This file is part of the honeybrid project.
+ *
+ * 2007-2009 University of Maryland (http://www.umd.edu)
+ * Robin Berthier <robinb@umd.edu>, Thomas Coquelin <coquelin@umd.edu>
+ * and Julien Vehent <julien@linuxwall.info>
+ *
+ * 2012-2014 University of Connecticut (http://www.uconn.edu)
+ * Tamas K Lengyel <tamas.k.lengyel@gmail.com>
+ *
+ * Honeybrid is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "epoch.h"
+
+/*!	\file epoch.c
+ \brief
+
+ Grace periods for the structures the decision threads look up without
+ holding on to them, such as the targets replaced by a configuration
+ reload. Each decision thread publishes the global epoch it last saw
+ whenever it is between two packets, and 0 while it waits for one.
+
+ Something taken out of the lookup tables is stamped with epoch_retire(),
+ which moves the global epoch forward. Once every thread either waits for
+ a packet or has seen an epoch at least as recent as the stamp, none of
+ them can still use what it found before the retirement: epoch_passed()
+ tells when that's the case. Publishing costs a single atomic store.
+
+ epoch_defer() queues something to be destroyed once that is the case,
+ epoch_reclaim() destroys what is ready. Lookup tables that are replaced
+ by a new copy rather than changed in place (see management.c) are freed
+ that way, so the decision threads can read them without any lock.
+
+ */
+
+static guint global_epoch = 1;
+static guint *thread_epochs;
+static uint32_t epoch_threads;
+
+struct deferred {
+	gpointer data;
+	GDestroyNotify destroy;
+	guint stamp;
+};
+
+/*! What waits for the decision threads to move on, oldest first */
+static GMutex deferred_lock;
+static GQueue deferred = G_QUEUE_INIT;
+
+/*! epoch_init
+ \brief set up the epochs of the decision threads, before they start
+ */
+void epoch_init(uint32_t threads) {
+	thread_epochs = g_malloc0(threads * sizeof(guint));
+	epoch_threads = threads;
+}
+
+/*! epoch_online
+ \brief the thread starts working on a packet with the current tables
+ */
+void epoch_online(uint32_t thread) {
+	g_atomic_int_set(&thread_epochs[thread], g_atomic_int_get(&global_epoch));
+}
+
+/*! epoch_offline
+ \brief the thread holds nothing it looked up, until epoch_online
+ */
+void epoch_offline(uint32_t thread) {
+	g_atomic_int_set(&thread_epochs[thread], 0);
+}
+
+/*! epoch_retire
+ \brief call after taking something out of the lookup tables
+ \return the stamp to pass to epoch_passed
+ */
+guint epoch_retire(void) {
+	return g_atomic_int_add(&global_epoch, 1) + 1;
+}
+
+/*! epoch_passed
+ \brief check that no thread can still use what was retired with stamp
+ */
+gboolean epoch_passed(guint stamp) {
+	uint32_t i;
+
+	for (i = 0; i < epoch_threads; i++) {
+		guint seen = g_atomic_int_get(&thread_epochs[i]);
+		if (seen && seen < stamp) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*! epoch_defer
+ \brief destroy data once no decision thread can still be using it
+ *
+ * For what was just replaced in, or taken out of, a lookup table. The
+ * stamp only covers the lookups that start after it, so the data must not
+ * be reachable anymore when this is called.
+ */
+void epoch_defer(gpointer data, GDestroyNotify destroy) {
+
+	if (!data) {
+		return;
+	}
+
+	struct deferred *d = g_malloc(sizeof(struct deferred));
+	d->data = data;
+	d->destroy = destroy;
+
+	g_mutex_lock(&deferred_lock);
+	/* stamped under the lock so that the queue stays in epoch order */
+	d->stamp = epoch_retire();
+	g_queue_push_tail(&deferred, d);
+	g_mutex_unlock(&deferred_lock);
+}
+
+/*! epoch_reclaim
+ \brief destroy what was deferred and is no longer in use
+ \return the number of items destroyed
+ */
+uint32_t epoch_reclaim(void) {
+
+	uint32_t reclaimed = 0;
+	GSList *done = NULL;
+
+	g_mutex_lock(&deferred_lock);
+	struct deferred *d;
+	while ((d = g_queue_peek_head(&deferred)) && epoch_passed(d->stamp)) {
+		done = g_slist_prepend(done, g_queue_pop_head(&deferred));
+	}
+	g_mutex_unlock(&deferred_lock);
+
+	/* destroy functions may defer more, so they run without the lock */
+	done = g_slist_reverse(done);
+	while (done) {
+		d = done->data;
+		d->destroy(d->data);
+		g_free(d);
+		reclaimed++;
+		done = g_slist_delete_link(done, done);
+	}
+
+	return reclaimed;
+}
+
+/*! epoch_close
+ \brief destroy everything still deferred, once the decision threads are gone
+ */
+void epoch_close(void) {
+	struct deferred *d;
+
+	while ((d = g_queue_pop_head(&deferred))) {
+		d->destroy(d->data);
+		g_free(d);
+	}
+
+	g_free(thread_epochs);
+	thread_epochs = NULL;
+	epoch_threads = 0;
+}
@@ -0,0 +1,46 @@
+/*
+ * This file is part of the honeybrid project.
+ *
+ * 2007-2009 University of Maryland (http://www.umd.edu)
+ * Robin Berthier <robinb@umd.edu>, Thomas Coquelin <coquelin@umd.edu>
+ * and Julien Vehent <julien@linuxwall.info>
+ *
+ * 2012-2014 University of Connecticut (http://www.uconn.edu)
+ * Tamas K Lengyel <tamas.k.lengyel@gmail.com>
+ *
+ * Honeybrid is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __EPOCH_H_
+#define __EPOCH_H_
+
+#include "types.h"
+
+void epoch_init(uint32_t threads);
+
+void epoch_online(uint32_t thread);
+
+void epoch_offline(uint32_t thread);
+
+guint epoch_retire(void);
+
+gboolean epoch_passed(guint stamp);
+
+void epoch_defer(gpointer data, GDestroyNotify destroy);
+
+uint32_t epoch_reclaim(void);
+
+void epoch_close(void);
+
+#endif /* __EPOCH_H_ */
@@ -0,0 +1,463 @@
+/*
+ * This file is part of the honeybrid project.
+ *
+ * 2007-2009 University of Maryland (http://www.umd.edu)
+ * Robin Berthier <robinb@umd.edu>, Thomas Coquelin <coquelin@umd.edu>
+ * and Julien Vehent <julien@linuxwall.info>
+ *
+ * 2012-2014 University of Connecticut (http://www.uconn.edu)
+ * Tamas K Lengyel <tamas.k.lengyel@gmail.com>
+ *
+ * Honeybrid is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "feature_cache.h"
+
+#include <arpa/inet.h>
+
+#include "log.h"
+
+/*!	\file feature_cache.c
+ \brief
+
+ What the modules derive from a packet: the source address, the
+ destination port, what the payload looks like, the payload with its IP
+ addresses replaced and its digests. A rule that stacks several modules
+ computes each of them once per packet, on the first module that asks.
+
+ The normalization and the digests are also exported on their own, for the
+ modules that work on a copy of the payload outside of the decision thread.
+ */
+
+#define NORMALIZED_IP		"<0.0.0.0>"
+#define NORMALIZED_IP_LEN	(sizeof(NORMALIZED_IP) - 1)
+
+void free_pkt_features(struct pkt_features *features) {
+	if (!features) {
+		return;
+	}
+
+	g_free(features->normalized);
+	g_free(features);
+}
+
+static inline struct pkt_features *features_of(struct pkt_struct *pkt) {
+	if (!pkt->features) {
+		pkt->features = g_malloc0(sizeof(struct pkt_features));
+	}
+	return pkt->features;
+}
+
+/*! pkt_source_ip
+ \brief the source IP in dotted notation
+ */
+const char *pkt_source_ip(struct pkt_struct *pkt) {
+	struct pkt_features *f = features_of(pkt);
+
+	if (!(f->filled & FEATURE_SOURCE_IP)) {
+		inet_ntop(AF_INET, &(pkt->packet.ip->saddr), f->source_ip,
+				INET_ADDRSTRLEN);
+		f->filled |= FEATURE_SOURCE_IP;
+	}
+	return f->source_ip;
+}
+
+/*! pkt_dest_port
+ \brief the destination port, 0 if the packet is neither TCP nor UDP
+ */
+uint16_t pkt_dest_port(struct pkt_struct *pkt) {
+	struct pkt_features *f = features_of(pkt);
+
+	if (!(f->filled & FEATURE_PORT)) {
+		if (pkt->packet.ip->protocol == IPPROTO_TCP) {
+			f->dest_port = ntohs(pkt->packet.tcp->dest);
+		} else if (pkt->packet.ip->protocol == IPPROTO_UDP) {
+			f->dest_port = ntohs(pkt->packet.udp->dest);
+		}
+		f->filled |= FEATURE_PORT;
+	}
+	return f->dest_port;
+}
+
+/*! pkt_hints
+ \brief hint_t of what the payload looks like
+ */
+uint32_t pkt_hints(struct pkt_struct *pkt) {
+	struct pkt_features *f = features_of(pkt);
+
+	if (f->filled & FEATURE_HINTS) {
+		return f->hints;
+	}
+
+	if (pkt_dest_port(pkt) == 53 && pkt->data >= sizeof(struct dns_header)) {
+		const struct dns_header *dns =
+				(const struct dns_header *) pkt->packet.payload;
+
+		if (dns->qr == 0 && dns->q_count > 0 && ntohs(dns->opcode) < 6) {
+			f->hints |= HINT_DNS_QUERY;
+		}
+	}
+
+	f->filled |= FEATURE_HINTS;
+	return f->hints;
+}
+
+/*! match_ip
+ \brief length of the IPv4 address at p, four groups of 1 to 3 digits
+ * separated by dots, 0 if there is none
+ */
+static inline uint32_t match_ip(const char *p, const char *end) {
+	const char *start = p;
+	uint32_t group, digits;
+
+	for (group = 0; group < 4; group++) {
+		for (digits = 0; digits < 3 && p < end && g_ascii_isdigit(*p); digits++) {
+			p++;
+		}
+		if (!digits) {
+			return 0;
+		}
+		if (group < 3) {
+			if (p >= end || *p != '.') {
+				return 0;
+			}
+			p++;
+		}
+	}
+
+	return p - start;
+}
+
+/*! normalize_payload
+ \brief copy a payload of data bytes, with its IP addresses replaced by a
+ * generic one so that the same exploit against another host looks the same
+ *
+ * A single pass over the payload: the leftmost address wins, the scan goes
+ * on after it. An address is what \d{1,3}(\.\d{1,3}){3} matches, greedy,
+ * so "1234.5.6.7" becomes "1<0.0.0.0>".
+ *
+ \param[out] len, length of the copy
+ \return the NUL terminated copy, to free with g_free
+ */
+char *normalize_payload(const char *payload, uint32_t data, uint32_t *len) {
+	uint32_t copy = data ? data - 1 : 0;
+	const char *p = payload, *end = payload + copy;
+
+	/*! an address is at least 7 bytes long and grows by 2 */
+	char *normalized = g_malloc(copy + (copy / 7 + 1) * 2 + 1);
+	char *out = normalized;
+
+	while (p < end) {
+		/*! runs without digits are copied as they are */
+		const char *digit = p;
+		while (digit < end && !g_ascii_isdigit(*digit)) {
+			digit++;
+		}
+		memcpy(out, p, digit - p);
+		out += digit - p;
+		p = digit;
+
+		if (p == end) {
+			break;
+		}
+
+		uint32_t ip = match_ip(p, end);
+		if (ip) {
+			memcpy(out, NORMALIZED_IP, NORMALIZED_IP_LEN);
+			out += NORMALIZED_IP_LEN;
+			p += ip;
+		} else {
+			*out++ = *p++;
+		}
+	}
+
+	*out = '\0';
+	*len = out - normalized;
+	return normalized;
+}
+
+/*! pkt_normalized_payload
+ \brief the payload of the packet as normalize_payload() returns it, NULL
+ * if the packet has no data
+ */
+const char *pkt_normalized_payload(struct pkt_struct *pkt, uint32_t *len) {
+	struct pkt_features *f = features_of(pkt);
+
+	if (!(f->filled & FEATURE_NORMALIZED)) {
+		if (pkt->data) {
+			f->normalized = normalize_payload(pkt->packet.payload, pkt->data,
+					&f->normalized_len);
+		}
+		f->filled |= FEATURE_NORMALIZED;
+	}
+
+	if (len) {
+		*len = f->normalized_len;
+	}
+	return f->normalized;
+}
+
+gboolean payload_digest_available(digest_t type) {
+#ifdef HAVE_CRYPTO
+	return TRUE;
+#else
+	return type != DIGEST_SHA1;
+#endif
+}
+
+#define PRIME64_1	0x9E3779B185EBCA87ULL
+#define PRIME64_2	0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3	0x165667B19E3779F9ULL
+#define PRIME64_4	0x85EBCA77C2B2AE63ULL
+#define PRIME64_5	0x27D4EB2F165667C5ULL
+
+#define rotl64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static inline uint64_t read64(const uint8_t *p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return GUINT64_FROM_LE(v);
+}
+
+static inline uint32_t read32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return GUINT32_FROM_LE(v);
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+	acc += input * PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t val) {
+	acc ^= xxh64_round(0, val);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+static inline void xxh64_stripe(uint64_t *v, const uint8_t *p) {
+	v[0] = xxh64_round(v[0], read64(p));
+	v[1] = xxh64_round(v[1], read64(p + 8));
+	v[2] = xxh64_round(v[2], read64(p + 16));
+	v[3] = xxh64_round(v[3], read64(p + 24));
+}
+
+/*! xxh64_update
+ \brief XXH64 with a seed of 0, over bytes that come in pieces: whole
+ * stripes of 32 bytes are consumed as they come, the rest waits in buf
+ */
+static void xxh64_update(struct digest_ctx *ctx, const uint8_t *p, size_t len) {
+	const uint8_t *end = p + len;
+
+	ctx->xxh64.total += len;
+
+	if (ctx->xxh64.buffered + len < 32) {
+		memcpy(ctx->xxh64.buf + ctx->xxh64.buffered, p, len);
+		ctx->xxh64.buffered += len;
+		return;
+	}
+
+	if (ctx->xxh64.buffered) {
+		size_t fill = 32 - ctx->xxh64.buffered;
+		memcpy(ctx->xxh64.buf + ctx->xxh64.buffered, p, fill);
+		xxh64_stripe(ctx->xxh64.v, ctx->xxh64.buf);
+		ctx->xxh64.buffered = 0;
+		p += fill;
+	}
+
+	while (p + 32 <= end) {
+		xxh64_stripe(ctx->xxh64.v, p);
+		p += 32;
+	}
+
+	memcpy(ctx->xxh64.buf, p, end - p);
+	ctx->xxh64.buffered = end - p;
+}
+
+static uint64_t xxh64_final(const struct digest_ctx *ctx) {
+	const uint64_t *v = ctx->xxh64.v;
+	const uint8_t *p = ctx->xxh64.buf, *end = p + ctx->xxh64.buffered;
+	uint64_t h;
+
+	if (ctx->xxh64.total >= 32) {
+		h = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12)
+				+ rotl64(v[3], 18);
+		h = xxh64_merge(h, v[0]);
+		h = xxh64_merge(h, v[1]);
+		h = xxh64_merge(h, v[2]);
+		h = xxh64_merge(h, v[3]);
+	} else {
+		h = PRIME64_5;
+	}
+
+	h += ctx->xxh64.total;
+
+	while (p + 8 <= end) {
+		h ^= xxh64_round(0, read64(p));
+		h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+		p += 8;
+	}
+	if (p + 4 <= end) {
+		h ^= (uint64_t) read32(p) * PRIME64_1;
+		h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+	}
+	while (p < end) {
+		h ^= (*p) * PRIME64_5;
+		h = rotl64(h, 11) * PRIME64_1;
+		p++;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+/*! digest_init
+ \brief start a digest over data that comes in pieces
+ \return FALSE if the digest isn't available
+ */
+gboolean digest_init(struct digest_ctx *ctx, digest_t type) {
+	ctx->type = type;
+
+	switch (type) {
+	case DIGEST_XXH64:
+		ctx->xxh64.v[0] = PRIME64_1 + PRIME64_2;
+		ctx->xxh64.v[1] = PRIME64_2;
+		ctx->xxh64.v[2] = 0;
+		ctx->xxh64.v[3] = -PRIME64_1;
+		ctx->xxh64.total = 0;
+		ctx->xxh64.buffered = 0;
+		return TRUE;
+	case DIGEST_SHA1:
+#ifdef HAVE_CRYPTO
+		ctx->sha1 = EVP_MD_CTX_new();
+		if (ctx->sha1 && EVP_DigestInit_ex(ctx->sha1, EVP_sha1(), NULL)) {
+			return TRUE;
+		}
+		EVP_MD_CTX_free(ctx->sha1);
+#endif
+	default:
+		/*! updating or ending it does nothing */
+		ctx->type = __MAX_DIGEST;
+		return FALSE;
+	}
+}
+
+void digest_update(struct digest_ctx *ctx, const void *data, size_t len) {
+	switch (ctx->type) {
+	case DIGEST_XXH64:
+		xxh64_update(ctx, data, len);
+		break;
+#ifdef HAVE_CRYPTO
+	case DIGEST_SHA1:
+		EVP_DigestUpdate(ctx->sha1, data, len);
+		break;
+#endif
+	default:
+		break;
+	}
+}
+
+/*! digest_final
+ \brief end the digest, the context has to be initialized again to be reused
+ \param[out] digest, DIGEST_SIZE bytes, zero padded
+ */
+void digest_final(struct digest_ctx *ctx, uint8_t *digest) {
+	memset(digest, 0, DIGEST_SIZE);
+
+	switch (ctx->type) {
+	case DIGEST_XXH64: {
+		/*! big endian, as the canonical representation of XXH64 */
+		uint64_t h = GUINT64_TO_BE(xxh64_final(ctx));
+		memcpy(digest, &h, sizeof(h));
+		break;
+	}
+#ifdef HAVE_CRYPTO
+	case DIGEST_SHA1:
+		EVP_DigestFinal_ex(ctx->sha1, digest, NULL);
+		EVP_MD_CTX_free(ctx->sha1);
+		break;
+#endif
+	default:
+		break;
+	}
+}
+
+/*! digest_copy
+ \brief start a digest where another one is, both have to be ended or freed
+ */
+void digest_copy(struct digest_ctx *to, const struct digest_ctx *from) {
+	*to = *from;
+
+#ifdef HAVE_CRYPTO
+	if (from->type == DIGEST_SHA1) {
+		to->sha1 = EVP_MD_CTX_new();
+		EVP_MD_CTX_copy_ex(to->sha1, from->sha1);
+	}
+#endif
+}
+
+/*! digest_free
+ \brief drop a digest that won't be ended
+ */
+void digest_free(struct digest_ctx *ctx) {
+#ifdef HAVE_CRYPTO
+	if (ctx->type == DIGEST_SHA1) {
+		EVP_MD_CTX_free(ctx->sha1);
+	}
+#endif
+}
+
+/*! payload_digest
+ \brief digest of a normalized payload, without its last byte as the
+ * SHA-1 of the previous versions
+ \param[out] digest, DIGEST_SIZE bytes, zero padded
+ \return FALSE if the digest isn't available
+ */
+gboolean payload_digest(digest_t type, const char *payload, uint32_t len,
+		uint8_t *digest) {
+	struct digest_ctx ctx;
+
+	if (!digest_init(&ctx, type)) {
+		memset(digest, 0, DIGEST_SIZE);
+		return FALSE;
+	}
+
+	digest_update(&ctx, payload, len ? len - 1 : 0);
+	digest_final(&ctx, digest);
+	return TRUE;
+}
+
+/*! pkt_digest
+ \brief digest of the normalized payload of the packet, DIGEST_SIZE bytes
+ * \return NULL if the packet has no data or the digest isn't available
+ */
+const uint8_t *pkt_digest(struct pkt_struct *pkt, digest_t type) {
+	struct pkt_features *f = features_of(pkt);
+
+	if (!(f->filled & feature_digest(type))) {
+		uint32_t len;
+		const char *payload = pkt_normalized_payload(pkt, &len);
+		if (!payload || !payload_digest(type, payload, len, f->digest[type])) {
+			return NULL;
+		}
+		f->filled |= feature_digest(type);
+	}
+	return f->digest[type];
+}
@@ -0,0 +1,117 @@
+/*
+ * This file is part of the honeybrid project.
+ *
+ * 2007-2009 University of Maryland (http://www.umd.edu)
+ * Robin Berthier <robinb@umd.edu>, Thomas Coquelin <coquelin@umd.edu>
+ * and Julien Vehent <julien@linuxwall.info>
+ *
+ * 2012-2014 University of Connecticut (http://www.uconn.edu)
+ * Tamas K Lengyel <tamas.k.lengyel@gmail.com>
+ *
+ * Honeybrid is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FEATURE_CACHE_H_
+#define __FEATURE_CACHE_H_
+
+#include "types.h"
+#include "structs.h"
+
+#ifdef HAVE_CRYPTO
+#include <openssl/evp.h>
+#endif
+
+//DNS header structure
+struct dns_header {
+	unsigned short id; // identification number
+
+	unsigned char rd :1; // recursion desired
+	unsigned char tc :1; // truncated message
+	unsigned char aa :1; // authoritive answer
+	unsigned char opcode :4; // purpose of message
+	unsigned char qr :1; // query/response flag
+
+	unsigned char rcode :4; // response code
+	unsigned char cd :1; // checking disabled
+	unsigned char ad :1; // authenticated data
+	unsigned char z :1; // its z! reserved
+	unsigned char ra :1; // recursion available
+
+	unsigned short q_count; // number of question entries
+	unsigned short ans_count; // number of answer entries
+	unsigned short auth_count; // number of authority entries
+	unsigned short add_count; // number of resource entries
+};
+
+//Constant sized fields of query structure
+struct question {
+	unsigned short qtype;
+	unsigned short qclass;
+};
+
+/*!
+ \def digest_ctx
+ \brief a digest_t computed over data that comes in pieces, see digest_init()
+ */
+struct digest_ctx {
+	digest_t type;
+	union {
+#ifdef HAVE_CRYPTO
+		EVP_MD_CTX *sha1;
+#endif
+		struct {
+			uint64_t v[4];
+			uint64_t total;
+			uint8_t buf[32];
+			uint32_t buffered;
+		} xxh64;
+	};
+};
+
+void free_pkt_features(struct pkt_features *features);
+
+/*! pkt_has_feature
+ \brief TRUE if the feature of the packet was already computed
+ */
+#define pkt_has_feature(pkt, feature) \
+	((pkt)->features && ((pkt)->features->filled & (feature)))
+
+const char *pkt_source_ip(struct pkt_struct *pkt);
+
+uint16_t pkt_dest_port(struct pkt_struct *pkt);
+
+uint32_t pkt_hints(struct pkt_struct *pkt);
+
+const char *pkt_normalized_payload(struct pkt_struct *pkt, uint32_t *len);
+
+const uint8_t *pkt_digest(struct pkt_struct *pkt, digest_t type);
+
+char *normalize_payload(const char *payload, uint32_t data, uint32_t *len);
+
+gboolean payload_digest(digest_t type, const char *payload, uint32_t len,
+		uint8_t *digest);
+
+gboolean payload_digest_available(digest_t type);
+
+gboolean digest_init(struct digest_ctx *ctx, digest_t type);
+
+void digest_update(struct digest_ctx *ctx, const void *data, size_t len);
+
+void digest_final(struct digest_ctx *ctx, uint8_t *digest);
+
+void digest_copy(struct digest_ctx *to, const struct digest_ctx *from);
+
+void digest_free(struct digest_ctx *ctx);
+
+#endif /* __FEATURE_CACHE_H_ */
@@ -67,6 +67,14 @@ int64_t target_counter;
 /*! \brief global array of pointers to hold target structures */
 GTree *targets;
 
+/*! \brief longest-prefix-match tables for the target lookups, replaced by a changed
+ * copy under targetlock and read without locking (see management.c)
+ * target_addresses: address block -> struct target
+ * handler_addresses: honeypot address or frontend prefix -> GSList of struct handler_entry
+ */
+struct prefix_table *target_addresses;
+struct prefix_table *handler_addresses;
+
 /*! \brief global hash table that contain the values of the configuration file  */
 GHashTable *config;
 
@@ -102,23 +110,41 @@ GTree *intra_pin_tree;
  */
 GMutex connlock;
 
+/*!
+ \def connection table limits
+ * Maximum number of tracked connections in total, per target and per external
+ * source IP (0 = unlimited) and the policy applied when one of them is reached.
+ */
+uint32_t max_connections;
+uint32_t max_connections_per_target;
+uint32_t max_connections_per_source;
+eviction_policy_t eviction_policy;
+
+/*!
+ \def connection table occupancy
+ * All protected by connlock. The age queue holds every tracked connection,
+ * oldest first. The connections that can be evicted are also queued by class
+ * in conn_evictable, in their target and in their source (struct source_conns
+ * values of conn_count_per_source), so a victim is found in constant time
+ * whichever limit was reached.
+ */
+uint32_t conn_count;
+GHashTable *conn_count_per_source;
+GQueue *conn_age_queue;
+GQueue conn_evictable[__MAX_EVICTABLE];
+uint64_t conn_evicted;
+uint64_t conn_refused;
+
 /*! \brief security writing lock for the target table
  */
 GRWLock targetlock;
 
-/*! \def list of module to save
- */
-GHashTable *module_to_save;
+/*! \brief the configuration file, parsed again on reload */
+const char *config_file;
 
 /*! \brief pointer table for btree cleaning */
 GPtrArray *entrytoclean;
 
-/*!
- \def thread_clean
- \def thread_log */
-GThread *thread_clean;
-GThread *mod_backup;
-
 GThread *rpc_server;
 GThread *rpc_server_kill;
 
@@ -137,6 +163,14 @@ uint32_t decision_threads;
 GThread **de_threads;
 GAsyncQueue **de_queues;
 
+// Get the Queue ID the packet should be assigned to
+// based on the last byte of the external IP
+#define IP2QUEUEID(iface, ip) \
+    (iface->target) ? \
+            (((ip->saddr & 0xFF000000) >> 24) % decision_threads) \
+            : \
+            (((ip->daddr & 0xFF000000) >> 24) % decision_threads)
+
 /*!
  \def log level
  */
@@ -82,6 +82,7 @@
 #include <signal.h>
 #include <sys/stat.h>
 #include <execinfo.h>
+#include <semaphore.h>
 
 #include "constants.h"
 #include "structs.h"
@@ -91,17 +92,17 @@
 #include "log.h"
 #include "types.h"
 #include "decision_engine.h"
+#include "decision_cache.h"
 #include "modules.h"
 #include "connections.h"
+#include "snapshot.h"
+#include "prefix.h"
+#include "management.h"
 #include "rpc_server.h"
-
-// Get the Queue ID the packet should be assigned to
-// based on the last byte of the external IP
-#define IP2QUEUEID(iface, ip) \
-    (iface->target) ? \
-            (((ip->saddr & 0xFF000000) >> 24) % decision_threads) \
-            : \
-            (((ip->daddr & 0xFF000000) >> 24) % decision_threads)
+#include "reload.h"
+#include "epoch.h"
+#include "timers.h"
+#include "store.h"
 
 void pcap_looper(struct interface *iface);
 
@@ -151,6 +152,47 @@ static void term_signal_handler(int signal_nb, siginfo_t * siginfo,
 	}
 }
 
+/*! Configuration reloads asked for with SIGHUP, done by the reloader thread */
+static sem_t reload_sem;
+static GThread *thread_reload;
+
+/*! reload_signal_handler
+ \brief wake up the reloader, nothing else is safe to do in a signal handler */
+static void reload_signal_handler(__attribute__((unused)) int signal_nb) {
+	sem_post(&reload_sem);
+}
+
+/*! reloader
+ \brief reload the configuration file each time SIGHUP is received */
+static void reloader(void) {
+
+	while (threading == OK) {
+		if (sem_wait(&reload_sem) != 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (threading != OK)
+			break;
+
+		reload_policy_t policy = RELOAD_KEEP;
+		if (CONFIG("reload_policy")
+				&& NOK == find_reload_policy(CONFIG("reload_policy"), &policy)) {
+			syslog(LOG_INFO, "Unknown reload_policy %s, keeping connections\n",
+					CONFIG("reload_policy"));
+		}
+
+		uint32_t loaded = 0, replaced = 0;
+		if (OK == reload_config(config_file, policy, &loaded, &replaced)) {
+			syslog(LOG_INFO, "Configuration reloaded: %u targets replaced by %u\n",
+					replaced, loaded);
+		} else {
+			syslog(LOG_INFO, "Configuration reload of %s failed\n", config_file);
+		}
+	}
+}
+
 /*! init_signal
  \brief installs signal handlers
  \return 0 if exit with success, anything else if not */
@@ -163,10 +205,6 @@ void init_signal() {
 	sa_term.sa_flags = SA_SIGINFO | SA_RESETHAND;
 	sigfillset(&sa_term.sa_mask);
 
-	/*! SIGHUP*/
-	if (sigaction(SIGHUP, &sa_term, NULL) != 0)
-		errx(1, "%s: Failed to install sighandler for SIGHUP", __func__);
-
 	/*! SIGINT*/
 	if (sigaction(SIGINT, &sa_term, NULL) != 0)
 		errx(1, "%s: Failed to install sighandler for SIGINT", __func__);
@@ -217,7 +255,7 @@ void init_signal() {
 	struct sigaction sa_rotate_log;
 	memset(&sa_rotate_log, 0, sizeof(sa_rotate_log));
 
-	sa_rotate_log.sa_sigaction = (void *) rotate_connection_log;
+	sa_rotate_log.sa_sigaction = (void *) request_log_rotation;
 	//sa_rotate_log.sa_flags = SA_SIGINFO | SA_RESETHAND;
 	sa_rotate_log.sa_flags = SA_RESTART;
 	sigfillset(&sa_rotate_log.sa_mask);
@@ -225,6 +263,20 @@ void init_signal() {
 	/*! SIGUSR1*/
 	if (sigaction(SIGUSR1, &sa_rotate_log, NULL) != 0)
 		errx(1, "%s: Failed to install sighandler for SIGUSR1", __func__);
+
+	/*! reload the configuration: */
+	sem_init(&reload_sem, 0, 0);
+
+	struct sigaction sa_reload;
+	memset(&sa_reload, 0, sizeof(sa_reload));
+
+	sa_reload.sa_handler = reload_signal_handler;
+	sa_reload.sa_flags = SA_RESTART;
+	sigfillset(&sa_reload.sa_mask);
+
+	/*! SIGHUP*/
+	if (sigaction(SIGHUP, &sa_reload, NULL) != 0)
+		errx(1, "%s: Failed to install sighandler for SIGHUP", __func__);
 }
 
 /*! init_syslog
@@ -288,7 +340,7 @@ void init_variables() {
 	/*! create the hash table to store module information */
 	if (NULL
 			== (module = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
-					(GDestroyNotify) g_hash_table_destroy)))
+					(GDestroyNotify) g_hash_table_unref)))
 		errx(1, "%s: Fatal error while creating module hash table.\n",
 				__func__);
 
@@ -304,6 +356,10 @@ void init_variables() {
 					(GDestroyNotify) free_target)))
 		errx(1, "%s: Fatal error while target tree.\n", __func__);
 
+	/*! create the address lookup tables of the targets */
+	target_addresses = prefix_table_new(NULL);
+	handler_addresses = prefix_table_new((GDestroyNotify) free_handler_entries);
+
 	/*! create the trees that track connections */
 	if (NULL == (ext_tree1 = g_tree_new((GCompareFunc) conn_key_cmp)))
 		errx(1, "%s: Fatal error while creating tree.\n", __func__);
@@ -332,10 +388,14 @@ void init_variables() {
 	if (NULL == (intra_pin_tree = g_tree_new((GCompareFunc) pincmp)))
 		errx(1, "%s: Fatal error while creating tree.\n", __func__);
 
-	/*! create the hash table for the log engine */
-	if (NULL == (module_to_save = g_hash_table_new(g_str_hash, g_str_equal)))
-		errx(1, "%s: Fatal error while creating module_to_save hash table.\n",
-				__func__);
+	/*! create the structures that keep track of the connection table occupancy */
+	if (NULL == (conn_age_queue = g_queue_new()))
+		errx(1, "%s: Fatal error while creating queue.\n", __func__);
+
+	if (NULL
+			== (conn_count_per_source = g_hash_table_new_full(g_direct_hash,
+					g_direct_equal, NULL, g_free)))
+		errx(1, "%s: Fatal error while creating hash table.\n", __func__);
 
 	if (ICONFIG("max_packet_buffer") > 0) {
 		max_packet_buffer = ICONFIG("max_packet_buffer");
@@ -445,15 +505,16 @@ int close_thread() {
 		g_async_queue_push(de_queues[i], &raw);
 		printdbg("%s: Waiting for de_thread %i to terminate\n", H(0), i);
 		g_thread_join(de_threads[i]);
-		g_async_queue_unref(de_queues[i]);
 	}
 
 	/* Shut down other threads */
 	threading = NOK;
 	g_cond_broadcast(&threading_cond);
 
-	g_thread_join(mod_backup);
-	g_thread_join(thread_clean);
+	close_timers();
+
+	sem_post(&reload_sem);
+	g_thread_join(thread_reload);
 
 #ifdef HAVE_XMLRPC
 	close_rpc_server();
@@ -474,6 +535,10 @@ int close_hash() {
 		config = NULL;
 	}
 
+	/*! the replaced configurations go before what they were replaced with */
+	close_reload();
+	epoch_close();
+
 	if (module != NULL) {
 		printdbg("%s: Destroying table module\n", H(0));
 		g_hash_table_destroy(module);
@@ -485,10 +550,19 @@ int close_hash() {
 		links = NULL;
 	}
 
-	if (module_to_save != NULL) {
-		printdbg("%s: Destroying table module_to_save\n", H(0));
-		g_hash_table_destroy(module_to_save);
-		module_to_save = NULL;
+	/*! the backup thread is gone, write what the modules learned since */
+	close_stores();
+
+	if (handler_addresses != NULL) {
+		printdbg("%s: Destroying table handler_addresses\n", H(0));
+		prefix_table_free(handler_addresses);
+		handler_addresses = NULL;
+	}
+
+	if (target_addresses != NULL) {
+		printdbg("%s: Destroying table target_addresses\n", H(0));
+		prefix_table_free(target_addresses);
+		target_addresses = NULL;
 	}
 
 	if (targets != NULL) {
@@ -512,6 +586,15 @@ int close_conn_trees() {
 	int delay = 0;
 	entrytoclean = g_ptr_array_new();
 
+	/*! connections saved to the snapshot are logged when they end after the restart */
+	GFunc cleanup = (GFunc) remove_conn;
+	if (CONFIG("snapshot_file")) {
+		uint32_t saved, skipped;
+		if (OK == save_snapshot(CONFIG("snapshot_file"), &saved, &skipped)) {
+			cleanup = (GFunc) discard_conn;
+		}
+	}
+
 	g_mutex_lock(&connlock);
 
 	// call the clean function for each value
@@ -526,8 +609,7 @@ int close_conn_trees() {
 			GINT_TO_POINTER(delay));
 
 	/// remove each key listed from the btree
-	g_ptr_array_foreach(entrytoclean, (GFunc) remove_conn,
-			GINT_TO_POINTER(delay));
+	g_ptr_array_foreach(entrytoclean, cleanup, GINT_TO_POINTER(delay));
 
 	/// free the array
 	g_ptr_array_free(entrytoclean, TRUE);
@@ -543,6 +625,9 @@ int close_conn_trees() {
 	g_tree_destroy(intra_tree2);
 	g_tree_destroy(intra_pin_tree);
 
+	g_queue_free(conn_age_queue);
+	g_hash_table_destroy(conn_count_per_source);
+
 	return 0;
 }
 
@@ -553,6 +638,27 @@ void close_all(void) {
 	if (close_thread() < 0)
 		g_printerr("%s: Error when waiting for threads to close\n", H(0));
 
+	/*! nothing looks decisions up anymore */
+	struct decision_cache_stats cache;
+	decision_cache_get_stats(&cache);
+	g_printerr("Decision cache: %"PRIu64" hits, %"PRIu64" misses, %"PRIu64" ms of rule evaluation saved\n",
+			cache.hits, cache.misses, cache.saved_usec / 1000);
+	decision_cache_destroy();
+
+	uint64_t evaluations, skips;
+	DE_get_trigger_stats(&evaluations, &skips);
+	g_printerr("Rule triggers: %"PRIu64" evaluations kept the connection state, %"PRIu64" skipped\n",
+			evaluations, skips);
+
+	/*! nothing submits module jobs anymore, the running ones may still
+	 * queue their results, so the queues go after the modules */
+	close_modules();
+
+	uint32_t i;
+	for (i = 0; i < decision_threads; i++) {
+		g_async_queue_unref(de_queues[i]);
+	}
+
 	/*! delete conn_tree */
 	if (close_conn_trees() < 0)
 		g_printerr("%s: Error when closing conn_tree\n", H(0));
@@ -631,6 +737,7 @@ void pcap_cb(u_char *input, const struct pcap_pkthdr *header,
 	raw->packet = g_memdup(packet, header->caplen);
 	raw->iface = iface;
 	raw->last = FALSE;
+	raw->resume = NULL;
 
 	uint32_t queue_id = IP2QUEUEID(iface, ip);
 
@@ -715,6 +822,333 @@ status_t process_packet(struct interface *iface,
 	return OK;
 }
 
+/*! park_pkt
+ \brief hold the packet in its connection while a module works on the decision
+ \return TRUE if the packet was taken, the caller must not touch it anymore
+ */
+static gboolean park_pkt(struct conn_struct *conn, struct pkt_struct *pkt) {
+
+	if (!module_conn_waiting(conn)) {
+		return FALSE;
+	}
+
+	if (conn->parked.length < MAX_PARKED_PACKETS) {
+		g_queue_push_tail(&conn->parked, pkt);
+	} else {
+		printdbg("%s Too many packets parked, dropping\n", H(conn->id));
+		free_pkt(pkt);
+	}
+
+	return TRUE;
+}
+
+/*! handle_pkt
+ \brief run a packet through the state machine of its connection
+ *
+ * Packets arriving while a module works on the decision are parked in the
+ * connection, resume_conn runs them through here again once it's done.
+ * The caller holds the connection lock.
+ */
+static void handle_pkt(struct pkt_struct *pkt, struct conn_struct *conn) {
+
+	status_t decided;
+
+	/*! Check that there was no problem getting the current connection structure
+	 *  and make sure the STATE is valid */
+	if ((conn->state < INIT || conn->state >= __MAX_CONN_STATUS)
+			&& pkt->origin == EXT) {
+
+		printdbg("%s Packet not from a valid connection\n", H(conn->id));
+		if (pkt->origin == EXT && pkt->packet.ip->protocol == IPPROTO_TCP
+				&& reset_ext == 1) {
+			reply_reset(pkt, pkt->conn->target->default_route);
+		}
+
+		free_pkt(pkt);
+		return;
+	}
+
+	if (conn->state == DROP) {
+
+		printdbg("%s This connection is marked as DROPPED\n", H(conn->id));
+		if (pkt->origin == EXT && pkt->packet.ip->protocol == IPPROTO_TCP
+				&& reset_ext == 1) {
+			reply_reset(pkt, pkt->conn->target->default_route);
+		}
+
+		free_pkt(pkt);
+		return;
+	}
+
+	/*! Keep the packets in order behind the one a module is deciding on */
+	if (park_pkt(conn, pkt)) {
+		return;
+	}
+
+	switch (pkt->origin) {
+	/*! Packet is from the low interaction honeypot */
+	case LIH:
+		switch (conn->state) {
+		case INIT:
+			if (pkt->packet.ip->protocol == IPPROTO_TCP
+					&& pkt->packet.tcp->syn != 0) {
+				conn->hih.lih_syn_seq = ntohl(pkt->packet.tcp->seq);
+			}
+
+			proxy_int2ext(pkt);
+
+			// Only store packets if there are backends
+			if (conn->target->back_handler_count > 0
+					|| conn->target->back_picker) {
+				store_pkt(conn, pkt);
+			} else {
+				free_pkt(pkt);
+			}
+
+			break;
+		case DECISION:
+			if (pkt->packet.ip->protocol == IPPROTO_TCP
+					&& pkt->packet.tcp->syn != 0) {
+				conn->hih.lih_syn_seq = ntohl(pkt->packet.tcp->seq);
+			}
+
+			proxy_int2ext(pkt);
+
+			// Only store packets if there are backends
+			if (conn->target->back_handler_count > 0
+					|| conn->target->back_picker) {
+				store_pkt(conn, pkt);
+			} else {
+				free_pkt(pkt);
+			}
+
+			break;
+		case PROXY:
+			printdbg(
+					"%s Packet from LIH proxied directly to its destination\n", H(conn->id));
+			proxy_int2ext(pkt);
+			free_pkt(pkt);
+			break;
+		case CONTROL:
+			if (pkt->packet.ip->protocol == IPPROTO_TCP
+					&& pkt->packet.tcp->syn != 0) {
+				conn->hih.lih_syn_seq = ntohl(pkt->packet.tcp->seq);
+			}
+
+			decided = DE_process_packet(pkt);
+			if (park_pkt(conn, pkt)) {
+				break;
+			}
+			if (decided == OK && !pkt->answered) {
+				proxy_int2ext(pkt);
+			}
+
+			// Only store packets if there are backends
+			if (conn->target->back_handler_count > 0
+					|| conn->target->back_picker) {
+				store_pkt(conn, pkt);
+			} else {
+				free_pkt(pkt);
+			}
+			break;
+		default:
+			printdbg(
+					"%s Packet from LIH at wrong state => reset\n", H(conn->id));
+			if (pkt->packet.ip->protocol == IPPROTO_TCP)
+				reply_reset(pkt, pkt->conn->target->front_handler->iface);
+			free_pkt(pkt);
+			break;
+		}
+		break;
+
+	case HIH:
+		/*! Packet is from the high interaction honeypot */
+		switch (conn->state) {
+		case REPLAY:
+			/*! push the packet to the synchronization list in conn_struct */
+			if (pkt->packet.ip->protocol == IPPROTO_TCP
+					&& pkt->packet.tcp->syn == 1) {
+				conn->hih.delta = ~ntohl(pkt->packet.tcp->seq) + 1
+						+ conn->hih.lih_syn_seq;
+			}
+			replay(conn, pkt);
+			free_pkt(pkt);
+			break;
+		case FORWARD:
+			forward_hih2ext(pkt);
+			free_pkt(pkt);
+			break;
+			/*! This one should never occur because PROXY are only between EXT and LIH... but we never know! */
+		case PROXY:
+			if (pkt->conn->destination == EXT) {
+				printdbg(
+						"%s Packet from HIH proxied directly to its EXT destination\n", H(conn->id));
+				proxy_int2ext(pkt);
+				free_pkt(pkt);
+			} else if (pkt->conn->destination == INTRA) {
+				printdbg(
+						"%s Packet from HIH proxied directly to its INTRA destination\n", H(conn->id));
+				proxy_hih2intra(pkt);
+				free_pkt(pkt);
+			}
+			break;
+		case CONTROL:
+			decided = DE_process_packet(pkt);
+			if (park_pkt(conn, pkt)) {
+				break;
+			}
+			if (decided == OK && !pkt->answered) {
+				proxy_int2ext(pkt);
+			}
+			free_pkt(pkt);
+			break;
+		case INIT:
+		default:
+			/*! We are surely in the INIT state, so the HIH is initiating a connection to outside. We reset or control it */
+			if (deny_hih_init == 1) {
+				printdbg(
+						"%s Packet from HIH at wrong state, so we reset\n", H(conn->id));
+				if (pkt->packet.ip->protocol == IPPROTO_TCP) {
+					reply_reset(pkt, pkt->conn->hih.back_handler->iface);
+				}
+				switch_state(conn, DROP);
+				free_pkt(pkt);
+			} else {
+
+				printdbg(
+						"%s Packet from HIH is a new connection, so we control it\n", H(conn->id));
+				switch_state(conn, CONTROL);
+
+				decided = DE_process_packet(pkt);
+				if (park_pkt(conn, pkt)) {
+					break;
+				}
+				if (decided == OK && !pkt->answered) {
+					if (pkt->conn->destination == EXT) {
+						proxy_int2ext(pkt);
+					} else if (pkt->conn->destination == INTRA) {
+						proxy_hih2intra(pkt);
+					}
+				}
+
+				free_pkt(pkt);
+			}
+			break;
+		}
+		break;
+
+	case INTRA:
+		switch (conn->state) {
+		case PROXY:
+			printdbg(
+					"%s Packet from INTRA proxied directly to its destination\n", H(conn->id));
+			/*! what the internal DNS server answers may serve the next queries */
+			dns_control_learn(pkt);
+			proxy_intra2hih(pkt);
+			free_pkt(pkt);
+			break;
+		default:
+			free_pkt(pkt);
+			break;
+		}
+		break;
+
+	case EXT:
+	default:
+		/*! Packet is from the external attacker (origin == EXT) */
+		switch (conn->state) {
+		case INIT:
+		case DECISION:
+			//g_string_assign(conn->decision_rule, ";");
+			decided = DE_process_packet(pkt);
+			if (park_pkt(conn, pkt)) {
+				break;
+			}
+			if (decided == OK) {
+				proxy_ext2int(pkt);
+			}
+
+			// Only store packets if there are backends
+			if (conn->target->back_handler_count > 0
+					|| conn->target->back_picker) {
+				store_pkt(conn, pkt);
+			} else {
+				free_pkt(pkt);
+			}
+			break;
+		case FORWARD:
+			forward_ext2hih(pkt);
+			free_pkt(pkt);
+			break;
+		case PROXY:
+			printdbg(
+					"%s Packet from EXT proxied directly to its destination (PROXY)\n", H(conn->id));
+			proxy_ext2int(pkt);
+			free_pkt(pkt);
+			break;
+		case CONTROL:
+			printdbg(
+					"%s Packet from EXT proxied directly to its destination (CONTROL)\n", H(conn->id));
+			proxy_ext2int(pkt);
+			free_pkt(pkt);
+			break;
+		default:
+			free_pkt(pkt);
+			break;
+		}
+		break;
+	}
+}
+
+/*! resume_conn
+ \brief replay the packets parked while a module was working on the decision
+ *
+ * The connection may have been freed or compacted in the meantime, then the
+ * job is just dropped.
+ */
+static void resume_conn(struct module_job *job) {
+
+	struct conn_struct *conn;
+
+	g_mutex_lock(&connlock);
+	if ((conn = g_atomic_pointer_get(&job->conn))) {
+		g_mutex_lock(&conn->lock);
+	}
+	g_mutex_unlock(&connlock);
+
+	if (conn) {
+		if (conn->pending == job) {
+			printdbg("%s Module %s is done, resuming %u packets\n", H(conn->id), job->node->module_name->str, conn->parked.length);
+
+			GQueue parked = conn->parked;
+			g_queue_init(&conn->parked);
+			g_atomic_int_set(&job->state, JOB_RESUMED);
+
+			struct pkt_struct *pkt;
+			while ((pkt = g_queue_pop_head(&parked))) {
+				handle_pkt(pkt, conn);
+			}
+		}
+
+		compact_conn(conn);
+		unlock_conn(conn);
+	}
+
+	module_job_unref(job);
+}
+
+/*! pop_raw
+ \brief wait for the next packet, the thread holds no lookups meanwhile */
+static inline struct raw_pcap *pop_raw(uint32_t thread_id) {
+	struct raw_pcap *raw;
+
+	epoch_offline(thread_id);
+	raw = (struct raw_pcap *) g_async_queue_pop(de_queues[thread_id]);
+	epoch_online(thread_id);
+
+	return raw;
+}
+
 void de_thread(gpointer data) {
 
 	uint32_t thread_id = GPOINTER_TO_UINT(data);
@@ -722,7 +1156,7 @@ void de_thread(gpointer data) {
 
 	printdbg("%s: Decision engine thread %i started\n", H(0), thread_id);
 
-	while ((raw = (struct raw_pcap *) g_async_queue_pop(de_queues[thread_id]))) {
+	while ((raw = pop_raw(thread_id))) {
 
 		printdbg("%s Got a RAW packet from queue %u\n", H(0), thread_id);
 
@@ -732,9 +1166,17 @@ void de_thread(gpointer data) {
 		// Exit the thread
 		if (raw->last) {
 			printdbg("%s Shutting down thread %u\n", H(1), thread_id);
+			epoch_offline(thread_id);
 			return;
 		}
 
+		// A module finished its work
+		if (raw->resume) {
+			resume_conn(raw->resume);
+			free_raw_pcap(raw);
+			continue;
+		}
+
 		if (process_packet(raw->iface, raw->header, raw->packet, &pkt) == NOK) {
 			free_raw_pcap(raw);
 			goto done;
@@ -782,233 +1224,14 @@ void de_thread(gpointer data) {
 		printdbg(
 				"%s %s %s, %u bytes with %u bytes of data\n", H(conn->id), lookup_role(pkt->origin), lookup_state(conn->state), pkt->size, pkt->data);
 
-		/*! Check that there was no problem getting the current connection structure
-		 *  and make sure the STATE is valid */
-		if ((conn->state < INIT || conn->state >= __MAX_CONN_STATUS)
-				&& pkt->origin == EXT) {
-
-			printdbg("%s Packet not from a valid connection\n", H(conn->id));
-			if (pkt->origin == EXT && pkt->packet.ip->protocol == IPPROTO_TCP
-					&& reset_ext == 1) {
-				reply_reset(pkt, pkt->conn->target->default_route);
-			}
-
-			free_pkt(pkt);
-			goto done;
-		}
-
-		if (conn->state == DROP) {
-
-			printdbg("%s This connection is marked as DROPPED\n", H(conn->id));
-			if (pkt->origin == EXT && pkt->packet.ip->protocol == IPPROTO_TCP
-					&& reset_ext == 1) {
-				reply_reset(pkt, pkt->conn->target->default_route);
-			}
-
-			free_pkt(pkt);
-			goto done;
-		}
-
-		switch (pkt->origin) {
-		/*! Packet is from the low interaction honeypot */
-		case LIH:
-			switch (conn->state) {
-			case INIT:
-				if (pkt->packet.ip->protocol == IPPROTO_TCP
-						&& pkt->packet.tcp->syn != 0) {
-					conn->hih.lih_syn_seq = ntohl(pkt->packet.tcp->seq);
-				}
-
-				proxy_int2ext(pkt);
-
-				// Only store packets if there are backends
-				if (conn->target->back_handler_count > 0
-						|| conn->target->back_picker) {
-					store_pkt(conn, pkt);
-				} else {
-					free_pkt(pkt);
-				}
-
-				break;
-			case DECISION:
-				if (pkt->packet.ip->protocol == IPPROTO_TCP
-						&& pkt->packet.tcp->syn != 0) {
-					conn->hih.lih_syn_seq = ntohl(pkt->packet.tcp->seq);
-				}
-
-				proxy_int2ext(pkt);
-
-				// Only store packets if there are backends
-				if (conn->target->back_handler_count > 0
-						|| conn->target->back_picker) {
-					store_pkt(conn, pkt);
-				} else {
-					free_pkt(pkt);
-				}
-
-				break;
-			case PROXY:
-				printdbg(
-						"%s Packet from LIH proxied directly to its destination\n", H(conn->id));
-				proxy_int2ext(pkt);
-				free_pkt(pkt);
-				break;
-			case CONTROL:
-				if (pkt->packet.ip->protocol == IPPROTO_TCP
-						&& pkt->packet.tcp->syn != 0) {
-					conn->hih.lih_syn_seq = ntohl(pkt->packet.tcp->seq);
-				}
-
-				if (DE_process_packet(pkt) == OK) {
-					proxy_int2ext(pkt);
-				}
-
-				// Only store packets if there are backends
-				if (conn->target->back_handler_count > 0
-						|| conn->target->back_picker) {
-					store_pkt(conn, pkt);
-				} else {
-					free_pkt(pkt);
-				}
-				break;
-			default:
-				printdbg(
-						"%s Packet from LIH at wrong state => reset\n", H(conn->id));
-				if (pkt->packet.ip->protocol == IPPROTO_TCP)
-					reply_reset(pkt, pkt->conn->target->front_handler->iface);
-				free_pkt(pkt);
-				break;
-			}
-			break;
-
-		case HIH:
-			/*! Packet is from the high interaction honeypot */
-			switch (conn->state) {
-			case REPLAY:
-				/*! push the packet to the synchronization list in conn_struct */
-				if (pkt->packet.ip->protocol == IPPROTO_TCP
-						&& pkt->packet.tcp->syn == 1) {
-					conn->hih.delta = ~ntohl(pkt->packet.tcp->seq) + 1
-							+ conn->hih.lih_syn_seq;
-				}
-				replay(conn, pkt);
-				free_pkt(pkt);
-				break;
-			case FORWARD:
-				forward_hih2ext(pkt);
-				free_pkt(pkt);
-				break;
-				/*! This one should never occur because PROXY are only between EXT and LIH... but we never know! */
-			case PROXY:
-				if (pkt->conn->destination == EXT) {
-					printdbg(
-							"%s Packet from HIH proxied directly to its EXT destination\n", H(conn->id));
-					proxy_int2ext(pkt);
-					free_pkt(pkt);
-				} else if (pkt->conn->destination == INTRA) {
-					printdbg(
-							"%s Packet from HIH proxied directly to its INTRA destination\n", H(conn->id));
-					proxy_hih2intra(pkt);
-					free_pkt(pkt);
-				}
-				break;
-			case CONTROL:
-				if (DE_process_packet(pkt) == OK) {
-					proxy_int2ext(pkt);
-				}
-				free_pkt(pkt);
-				break;
-			case INIT:
-			default:
-				/*! We are surely in the INIT state, so the HIH is initiating a connection to outside. We reset or control it */
-				if (deny_hih_init == 1) {
-					printdbg(
-							"%s Packet from HIH at wrong state, so we reset\n", H(conn->id));
-					if (pkt->packet.ip->protocol == IPPROTO_TCP) {
-						reply_reset(pkt, pkt->conn->hih.back_handler->iface);
-					}
-					switch_state(conn, DROP);
-					free_pkt(pkt);
-				} else {
-
-					printdbg(
-							"%s Packet from HIH is a new connection, so we control it\n", H(conn->id));
-					switch_state(conn, CONTROL);
-
-					if (DE_process_packet(pkt) == OK) {
-						if (pkt->conn->destination == EXT) {
-							proxy_int2ext(pkt);
-						} else if (pkt->conn->destination == INTRA) {
-							proxy_hih2intra(pkt);
-						}
-					}
-
-					free_pkt(pkt);
-				}
-				break;
-			}
-			break;
-
-		case INTRA:
-			switch (conn->state) {
-			case PROXY:
-				printdbg(
-						"%s Packet from INTRA proxied directly to its destination\n", H(conn->id));
-				proxy_intra2hih(pkt);
-				free_pkt(pkt);
-				break;
-			default:
-				free_pkt(pkt);
-				break;
-			}
-			break;
-
-		case EXT:
-		default:
-			/*! Packet is from the external attacker (origin == EXT) */
-			switch (conn->state) {
-			case INIT:
-			case DECISION:
-				//g_string_assign(conn->decision_rule, ";");
-				if (DE_process_packet(pkt) == OK) {
-					proxy_ext2int(pkt);
-				}
-
-				// Only store packets if there are backends
-				if (conn->target->back_handler_count > 0
-						|| conn->target->back_picker) {
-					store_pkt(conn, pkt);
-				} else {
-					free_pkt(pkt);
-				}
-				break;
-			case FORWARD:
-				forward_ext2hih(pkt);
-				free_pkt(pkt);
-				break;
-			case PROXY:
-				printdbg(
-						"%s Packet from EXT proxied directly to its destination (PROXY)\n", H(conn->id));
-				proxy_ext2int(pkt);
-				free_pkt(pkt);
-				break;
-			case CONTROL:
-				printdbg(
-						"%s Packet from EXT proxied directly to its destination (CONTROL)\n", H(conn->id));
-				proxy_ext2int(pkt);
-				free_pkt(pkt);
-				break;
-			default:
-				free_pkt(pkt);
-				break;
-			}
-			break;
-		}
+		handle_pkt(pkt, conn);
 
 		done:
 
 		if (conn) {
-			g_mutex_unlock(&conn->lock);
+			/*! Free what the connection no longer needs if its state is final */
+			compact_conn(conn);
+			unlock_conn(conn);
 		}
 
 		printdbg("%s de_thread %u end of loop\n", H(1), thread_id);
@@ -1114,6 +1337,14 @@ int main(int argc, char *argv[]) {
 	init_variables();
 	/*! parse the configuration files and store values in memory */
 	init_parser(config_file_name);
+	config_file = config_file_name;
+	/*! read the connection table limits */
+	init_conn_limits();
+	/*! set up the cache of rule results */
+	decision_cache_init(
+			CONFIG("decision_cache_size") ?
+					MAX(ICONFIG("decision_cache_size"), 0) :
+					DECISION_CACHE_SIZE);
 	/*! initialize signal handlers */
 	init_signal();
 
@@ -1203,6 +1434,17 @@ int main(int argc, char *argv[]) {
 		de_queues[i] = g_async_queue_new();
 	}
 
+	epoch_init(decision_threads);
+
+	/*! start the timers, the cleaning, module backups and log rotation
+	 * run on them */
+	init_timers();
+
+	if (output == OUTPUT_LOGFILES) {
+		timer_add_periodic(LOG_ROTATION_TICK, (timer_func) log_rotation_timer,
+				NULL);
+	}
+
 	/*! init the Decision Engine threads */
 	for (i = 0; i < decision_threads; i++) {
 		if ((de_threads[i] = g_thread_new("de_thread", (void *) de_thread,
@@ -1223,22 +1465,34 @@ int main(int argc, char *argv[]) {
 	/*! initiate modules that can have only one instance */
 	init_modules();
 
+	/*! restore the connections saved at the last shutdown */
+	if (CONFIG("snapshot_file") && g_file_test(CONFIG("snapshot_file"), G_FILE_TEST_EXISTS)) {
+		uint32_t restored, dropped;
+		if (OK == load_snapshot(CONFIG("snapshot_file"), &restored, &dropped)) {
+			g_printerr("Restored %u connections (%u dropped) from %s\n",
+					restored, dropped, CONFIG("snapshot_file"));
+			/* a stale snapshot must not be restored again after a crash */
+			unlink(CONFIG("snapshot_file"));
+		}
+	}
+
 	/*! create the raw sockets for UDP/IP and TCP/IP */
 	//TODO: switch to pcap_inject
 	/*if (NOK == init_raw_sockets()) {
 	 errx(1, "%s: failed to create the raw sockets", __func__);
 	 }*/
 
-	/*! create a thread for the management, cleaning stuffs and so on */
-	if ((thread_clean = g_thread_new("cleaner", (void *) clean, NULL)) == NULL) {
-		errx(1, "%s Unable to start the cleaning thread", __func__);
-	} else {
-		printdbg("%s Cleaning thread started\n", H(0));
+	/*! clean the expired connections every minute */
+	timer_add_periodic(CLEAN_INTERVAL, (timer_func) clean, NULL);
+
+	/*! and one to reload the configuration on SIGHUP */
+	if ((thread_reload = g_thread_new("reloader", (void *) reloader, NULL)) == NULL) {
+		errx(1, "%s Unable to start the reloader thread", __func__);
 	}
 
 	init_pcap();
 	wait_pcap();
-	close_modules();
+
 	close_all();
 
 	g_printerr("Honeybrid exited successfully.\n");
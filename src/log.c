@@ -33,6 +33,7 @@
 #include "log.h"
 
 #include <fcntl.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <glib/gprintf.h>
 
@@ -40,6 +41,7 @@
 #include "globals.h"
 #include "structs.h"
 #include "convenience.h"
+#include "modules.h"
 
 #ifdef HAVE_MYSQL
 #include <mysql.h>
@@ -53,12 +55,18 @@ MYSQL *mysqlConn;
  */
 unsigned long last_rotation;
 
+/*! SIGUSR1 was received, the log is rotated at the next tick */
+static volatile sig_atomic_t rotation_requested;
+
 /*! 
  \Def file descriptor to log connections
  */
 
 FILE *logfd;
 
+/*! Keeps the log file from being rotated while a connection is written to it */
+static GMutex logfd_lock;
+
 /*! log_header
  *
  *\brief return a header for debug log messages, including
@@ -161,7 +169,11 @@ int close_debug_log(void) {
 }
 
 int close_connection_log(void) {
-    return fclose(logfd);
+    g_mutex_lock(&logfd_lock);
+    int ret = fclose(logfd);
+    logfd = NULL;
+    g_mutex_unlock(&logfd_lock);
+    return ret;
 }
 
 /*! open log file
@@ -192,8 +204,6 @@ void open_connection_log(void) {
  */
 //void rotate_connection_log(int signal_nb, void *siginfo, void *context)
 void rotate_connection_log(int signal_nb) {
-    L("rotate_connection_log()\tCalled\n", NULL, LOG_ALL, LOG_LOG);
-
     unsigned long timestamp;
     //char *logfile_name;
     //char *new_name;
@@ -235,6 +245,7 @@ void rotate_connection_log(int signal_nb) {
                     LOG_MED, LOG_LOG);
         }
 
+        g_mutex_lock(&logfd_lock);
         fclose(logfd);
 
         logfile_name = g_string_new(CONFIG_REQUIRED("log_file"));
@@ -264,6 +275,9 @@ void rotate_connection_log(int signal_nb) {
 
         //i = open(logfile_name, O_RDWR | O_CREAT, 0640);
         logfd = fopen(CONFIG_REQUIRED("log_file"), (char *) "a");
+        if (logfd)
+            setlinebuf(logfd);
+        g_mutex_unlock(&logfd_lock);
 
         if (chdir(CONFIG_REQUIRED("exec_directory")) < 0) errx(1,
                 "Failed to chdir to exec_directory!\n");
@@ -290,27 +304,24 @@ void rotate_connection_log(int signal_nb) {
     return;
 }
 
-const char *custom_conn_data(GSList *list) {
-    static char custom_conn_data[128];
-    GString *buff = g_string_new("");
-
-    while (list != NULL) {
-
-        struct custom_conn_data *custom =
-                (struct custom_conn_data *) g_slist_nth(list, 0);
-
-        if (custom && custom->data && custom->data_print) {
-            buff = g_string_append(buff, custom->data_print(custom->data));
-        }
+/*! request_log_rotation
+ *\brief SIGUSR1 handler, the rotation itself is left to log_rotation_timer
+ */
+void request_log_rotation(int signal_nb) {
+    rotation_requested = 1;
+}
 
-        list = g_slist_next(list);
+/*! log_rotation_timer
+ *\brief run by the timers every LOG_ROTATION_TICK, rotates the log when
+ * asked to with SIGUSR1 or, if log_rotation is set, when the hour changed
+ */
+void log_rotation_timer(gpointer unused) {
+    if (rotation_requested) {
+        rotation_requested = 0;
+        rotate_connection_log(SIGUSR1);
+    } else if (ICONFIG("log_rotation") > 0) {
+        rotate_connection_log(0);
     }
-
-    snprintf(custom_conn_data, 128, "%s", buff->str);
-    g_string_free(buff, TRUE);
-
-    return custom_conn_data;
-
 }
 
 /*! connection_stat
@@ -323,37 +334,82 @@ const char *custom_conn_data(GSList *list) {
  * FORWARD information: duration, packet, byte
  */
 
-void connection_log(const struct conn_struct *conn) {
+/*! connection_custom_data
+ *\brief the custom data of a connection as printed in the log
+ */
+static const char *connection_custom_data(const struct conn_struct *conn) {
+    static char custom_conn_data[128];
 
-    /*! if log rotation is configured, then we call rotate_connection_log()
-     */
-    if (ICONFIG("log_rotation")) {
-        rotate_connection_log(0);
+    if (conn->tombstone) {
+        return conn->tombstone->custom_data ? conn->tombstone->custom_data : "-";
+    }
+
+    char *state = module_state_string(conn);
+    if (!state) {
+        return "-";
     }
 
+    snprintf(custom_conn_data, sizeof(custom_conn_data), "%s", state);
+    g_free(state);
+
+    return custom_conn_data;
+}
+
+/*! connection_status_info
+ *\brief render the INIT to PROXY log fields of a connection
+ *
+ * Fields of a compacted connection are taken from its tombstone, only the
+ * final state has to be rendered again.
+ *
+ *\return the time of the last state change
+ */
+static gdouble connection_status_info(const struct conn_struct *conn,
+        GString **status_info) {
+
     conn_status_t i;
-    GString *status_info[6];
     gdouble lasttime = conn->start_microtime;
     gdouble duration = 0.0;
+
+    if (conn->tombstone) {
+        const char *field = conn->tombstone->status_info;
+        lasttime = conn->tombstone->lasttime;
+        for (i = INIT; i <= PROXY; i++) {
+            if (i < conn->state) {
+                status_info[i] = g_string_new(field);
+                field += strlen(field) + 1;
+            } else {
+                // PROXY is the only final state that is logged
+                if (conn->tombstone->stat_time > 0) {
+                    duration = (conn->tombstone->stat_time - lasttime);
+                    lasttime = conn->tombstone->stat_time;
+                }
+                status_info[i] = g_string_new("");
+                g_string_printf(status_info[i], "%.3f|%d|%d", duration,
+                        conn->tombstone->stat_packet, conn->tombstone->stat_byte);
+            }
+        }
+        return lasttime;
+    }
+
     for (i = INIT; i <= PROXY; i++) {
         status_info[i] = g_string_new("");
         if (i <= conn->state) {
-            if (conn->stat_time[i] > 0) {
-                duration = (conn->stat_time[i] - lasttime);
-                lasttime = conn->stat_time[i];
+            if (conn->stats->stat_time[i] > 0) {
+                duration = (conn->stats->stat_time[i] - lasttime);
+                lasttime = conn->stats->stat_time[i];
             } else {
                 duration = 0.0;
             }
             if (i == REPLAY && conn->replay_problem > 0) {
                 g_string_printf(status_info[i], "%.3f|%d|%d|error:%d", duration,
-                        conn->stat_packet[i], conn->stat_byte[i],
+                        conn->stats->stat_packet[i], conn->stats->stat_byte[i],
                         conn->replay_problem);
             } else if (i == DECISION) {
                 g_string_printf(status_info[i], "%.3f|%s", duration,
-                        conn->decision_rule->str);
+                        conn->stats->decision_rule->str);
             } else {
                 g_string_printf(status_info[i], "%.3f|%d|%d", duration,
-                        conn->stat_packet[i], conn->stat_byte[i]);
+                        conn->stats->stat_packet[i], conn->stats->stat_byte[i]);
             }
         } else {
             if (i == REPLAY) g_string_printf(status_info[i], ".|.|.|.");
@@ -362,26 +418,89 @@ void connection_log(const struct conn_struct *conn) {
         }
     }
 
+    return lasttime;
+}
+
+/*! connection_tombstone
+ *\brief render the log fields that can no longer change once a connection reached a final state
+ */
+struct conn_tombstone *connection_tombstone(const struct conn_struct *conn) {
+
+    conn_status_t i;
+    GString *status_info[6];
+    gsize size = 0;
+
+    connection_status_info(conn, status_info);
+
+    /*! The tombstone holds the fields of the states before the final one */
+    for (i = INIT; i <= PROXY && i < conn->state; i++) {
+        size += status_info[i]->len + 1;
+    }
+
+    struct conn_tombstone *tombstone = g_malloc0(
+            sizeof(struct conn_tombstone) + size);
+
+    char *field = tombstone->status_info;
+    for (i = INIT; i <= PROXY; i++) {
+        if (i < conn->state) {
+            memcpy(field, status_info[i]->str, status_info[i]->len + 1);
+            field += status_info[i]->len + 1;
+        }
+        g_string_free(status_info[i], TRUE);
+    }
+
+    /*! lasttime as it was when entering the final state */
+    gdouble lasttime = conn->start_microtime;
+    for (i = INIT; i <= PROXY && i < conn->state; i++) {
+        if (conn->stats->stat_time[i] > 0) {
+            lasttime = conn->stats->stat_time[i];
+        }
+    }
+
+    tombstone->lasttime = lasttime;
+    if (conn->state <= PROXY) {
+        tombstone->stat_time = conn->stats->stat_time[conn->state];
+        tombstone->stat_packet = conn->stats->stat_packet[conn->state];
+        tombstone->stat_byte = conn->stats->stat_byte[conn->state];
+    }
+
+    tombstone->custom_data = module_state_string(conn);
+
+    return tombstone;
+}
+
+void connection_log(const struct conn_struct *conn) {
+
+    GString *status_info[6];
+    gdouble lasttime = connection_status_info(conn, status_info);
+
     gdouble total_duration = (lasttime - conn->start_microtime);
     output_t output = (output_t) ICONFIG_REQUIRED("output");
 
+    /*! Evicted connections carry the limit that caused the eviction in their status */
+    GString *status = g_string_new(lookup_state(conn->state));
+    if (conn->eviction != EVICTION_NONE) {
+        g_string_append_printf(status, "|evicted:%s",
+                lookup_eviction_reason(conn->eviction));
+    }
+
     /*! Output according to the format configured */
     if (output == OUTPUT_MYSQL) {
-        log_mysql(conn, lookup_proto(conn->protocol), lookup_state(conn->state),
+        log_mysql(conn, lookup_proto(conn->protocol), status->str,
                 status_info, total_duration);
     } else if (output == OUTPUT_STDOUT || output == OUTPUT_LOGFILES) {
         if (NULL != CONFIG("log_format")
                 && !strcmp(CONFIG("log_format"), "csv")) {
-            log_csv(conn, lookup_proto(conn->protocol),
-                    lookup_state(conn->state), status_info, total_duration,
-                    output);
+            log_csv(conn, lookup_proto(conn->protocol), status->str,
+                    status_info, total_duration, output);
         } else {
-            log_std(conn, lookup_proto(conn->protocol),
-                    lookup_state(conn->state), status_info, total_duration,
-                    output);
+            log_std(conn, lookup_proto(conn->protocol), status->str,
+                    status_info, total_duration, output);
         }
     }
 
+    g_string_free(status, TRUE);
+
     g_string_free(status_info[INIT], TRUE);
     g_string_free(status_info[DECISION], TRUE);
     g_string_free(status_info[REPLAY], TRUE);
@@ -410,13 +529,13 @@ status_t log_csv(const struct conn_struct *conn, const char *proto,
 #else
             "%s,%.3f,%s,%s,%u,%s,%u,%d,%d,%s,%d,%s,%s,%s,%s,%s,%s\n",
 #endif
-            conn->start_timestamp->str, duration, proto, src, src_port, dst,
+            conn->start_timestamp, duration, proto, src, src_port, dst,
             dst_port, conn->total_packet, conn->total_byte, status, conn->id,
             //status_info[INVALID]->str,
             status_info[INIT]->str, status_info[DECISION]->str,
             status_info[REPLAY]->str, status_info[FORWARD]->str,
             status_info[PROXY]->str,
-            (conn->custom_data ? custom_conn_data(conn->custom_data) : "-")
+            connection_custom_data(conn)
 #ifdef HAVE_XMPP
             ,
             conn->dionaeaDownload,
@@ -432,13 +551,13 @@ status_t log_csv(const struct conn_struct *conn, const char *proto,
 #else
             "%s,%.3f,%s,%s,%u,%s,%u,%d,%d,%s,%d,%s,%s,%s,%s,%s,%s\n",
 #endif
-            conn->start_timestamp->str, duration, proto, src, src_port, dst,
+            conn->start_timestamp, duration, proto, src, src_port, dst,
             dst_port, conn->total_packet, conn->total_byte, status, conn->id,
             //status_info[INVALID]->str,
             status_info[INIT]->str, status_info[DECISION]->str,
             status_info[REPLAY]->str, status_info[FORWARD]->str,
             status_info[PROXY]->str,
-            (conn->custom_data ? custom_conn_data(conn->custom_data) : "-")
+            connection_custom_data(conn)
 #ifdef HAVE_XMPP
             ,
             conn->dionaeaDownload,
@@ -447,7 +566,11 @@ status_t log_csv(const struct conn_struct *conn, const char *proto,
             );
 
     if (output == OUTPUT_STDOUT) printf("%s", logbuf);
-    else if (output == OUTPUT_LOGFILES) fprintf(logfd, "%s", logbuf);
+    else if (output == OUTPUT_LOGFILES) {
+        g_mutex_lock(&logfd_lock);
+        fprintf(logfd, "%s", logbuf);
+        g_mutex_unlock(&logfd_lock);
+    }
 
     free(logbuf);
 
@@ -473,15 +596,14 @@ status_t log_std(const struct conn_struct *conn, const char *proto,
 #else
                     "%s %.3f %s %s:%u <-> %s:%u %d %d %s ** %d %s %s %s %s %s [%s]\n",
 #endif
-                    conn->start_timestamp->str, duration, proto, src, src_port,
+                    conn->start_timestamp, duration, proto, src, src_port,
                     dst, dst_port, conn->total_packet, conn->total_byte, status,
                     conn->id,
                     //status_info[INVALID]->str,
                     status_info[INIT]->str, status_info[DECISION]->str,
                     status_info[REPLAY]->str, status_info[FORWARD]->str,
                     status_info[PROXY]->str,
-                    (conn->custom_data ?
-                            custom_conn_data(conn->custom_data) : "-")
+                    connection_custom_data(conn)
 #ifdef HAVE_XMPP
                     ,
                     conn->dionaeaDownload,
@@ -497,13 +619,13 @@ status_t log_std(const struct conn_struct *conn, const char *proto,
 #else
             "%s %.3f %s %s:%u -> %s:%u %d %d %s ** %d %s %s %s %s %s [%s]\n",
 #endif
-            conn->start_timestamp->str, duration, proto, src, src_port, dst,
+            conn->start_timestamp, duration, proto, src, src_port, dst,
             dst_port, conn->total_packet, conn->total_byte, status, conn->id,
             //status_info[INVALID]->str,
             status_info[INIT]->str, status_info[DECISION]->str,
             status_info[REPLAY]->str, status_info[FORWARD]->str,
             status_info[PROXY]->str,
-            (conn->custom_data ? custom_conn_data(conn->custom_data) : "-")
+            connection_custom_data(conn)
 #ifdef HAVE_XMPP
             ,
             conn->dionaeaDownload,
@@ -512,7 +634,11 @@ status_t log_std(const struct conn_struct *conn, const char *proto,
             );
 
     if (output == OUTPUT_STDOUT) printf("%s", logbuf);
-    else g_fprintf(logfd, "%s", logbuf);
+    else {
+        g_mutex_lock(&logfd_lock);
+        g_fprintf(logfd, "%s", logbuf);
+        g_mutex_unlock(&logfd_lock);
+    }
 
     free(logbuf);
 
@@ -593,7 +719,7 @@ status_t log_mysql(const struct conn_struct *conn, const char *proto,
                 status_info[INIT]->str, status_info[DECISION]->str,
                 status_info[REPLAY]->str, status_info[FORWARD]->str,
                 status_info[PROXY]->str,
-                (conn->custom_data ? custom_conn_data(conn->custom_data) : "-")
+                connection_custom_data(conn)
 #ifdef HAVE_XMPP
                 conn->dionaeaDownload, conn->dionaeaDownloadTime
 #endif
@@ -618,7 +744,7 @@ status_t log_mysql(const struct conn_struct *conn, const char *proto,
                 conn->id, status_info[INIT]->str, status_info[DECISION]->str,
                 status_info[REPLAY]->str, status_info[FORWARD]->str,
                 status_info[PROXY]->str,
-                (conn->custom_data ? custom_conn_data(conn->custom_data) : "-")
+                connection_custom_data(conn)
 #ifdef HAVE_XMPP
                 ,conn->dionaeaDownload, conn->dionaeaDownloadTime
 #endif
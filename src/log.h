@@ -56,9 +56,17 @@ int close_connection_log(void);
 //void rotate_log(int signal_nb, void *siginfo, void *context);
 void rotate_connection_log(int signal_nb);
 
+#define LOG_ROTATION_TICK 1000 /* ms */
+
+void request_log_rotation(int signal_nb);
+
+void log_rotation_timer(gpointer unused);
+
 //void connection_stat(struct conn_struct *conn);
 void connection_log();
 
+struct conn_tombstone *connection_tombstone(const struct conn_struct *conn);
+
 status_t log_mysql(const struct conn_struct *conn, const char *proto,
         const char *status, GString **status_info, gdouble duration);
 
@@ -25,6 +25,345 @@
 #include "management.h"
 #include "globals.h"
 #include "convenience.h"
+#include "log.h"
+#include "prefix.h"
+#include "balancer.h"
+#include "epoch.h"
+
+/*!	\file management.c
+ \brief
+
+ Changes to the targets and their handlers. The lookup tables the decision
+ threads use (target_addresses, handler_addresses and the handler trees of
+ each target) are never changed in place: a copy is changed and published
+ with a single pointer store, and the replaced version is freed once no
+ decision thread can still be reading it (see epoch.c). The decision
+ threads therefore look them up without any lock, however often targets
+ and handlers are added or removed.
+
+ The writers are serialized by targetlock for the address tables and by
+ the lock of the target for its handlers.
+
+ */
+
+/*! The copies of the address tables being changed, protected by targetlock */
+static struct prefix_table *next_target_addresses;
+static struct prefix_table *next_handler_addresses;
+
+/*! The withdraw_hook functions of the modules (protected by hooks_lock) */
+static GMutex hooks_lock;
+static GSList *withdraw_hooks;
+
+void free_handler_entries(GSList *entries) {
+	g_slist_free_full(entries, g_free);
+}
+
+static gpointer copy_handler_entry(gconstpointer entry,
+		__attribute__ ((unused)) gpointer data) {
+	return g_memdup(entry, sizeof(struct handler_entry));
+}
+
+static gpointer copy_handler_entries(GSList *entries) {
+	return g_slist_copy_deep(entries, copy_handler_entry, NULL);
+}
+
+/*! edit_target_addresses
+ \brief the copy of target_addresses to change, made on first use
+ *
+ * targetlock must be held for writing.
+ */
+static struct prefix_table *edit_target_addresses(void) {
+	if (!next_target_addresses) {
+		next_target_addresses = prefix_table_copy(target_addresses, NULL);
+	}
+	return next_target_addresses;
+}
+
+/*! edit_handler_addresses
+ \brief the copy of handler_addresses to change, made on first use
+ *
+ * targetlock must be held for writing.
+ */
+static struct prefix_table *edit_handler_addresses(void) {
+	if (!next_handler_addresses) {
+		next_handler_addresses = prefix_table_copy(handler_addresses,
+				(GBoxedCopyFunc) copy_handler_entries);
+	}
+	return next_handler_addresses;
+}
+
+/*! publish_tables
+ \brief make the changed address tables the ones the decision threads use
+ *
+ * targetlock must be held for writing.
+ */
+static void publish_tables(void) {
+
+	struct prefix_table *old;
+
+	/* Swapped before they're deferred, see epoch_defer */
+	if (next_target_addresses) {
+		old = target_addresses;
+		g_atomic_pointer_set(&target_addresses, next_target_addresses);
+		epoch_defer(old, (GDestroyNotify) prefix_table_free);
+		next_target_addresses = NULL;
+	}
+
+	if (next_handler_addresses) {
+		old = handler_addresses;
+		g_atomic_pointer_set(&handler_addresses, next_handler_addresses);
+		epoch_defer(old, (GDestroyNotify) prefix_table_free);
+		next_handler_addresses = NULL;
+	}
+}
+
+static gboolean copy_handler(gpointer key, gpointer handler, GTree *copy) {
+	g_tree_insert(copy, key, handler);
+	return FALSE;
+}
+
+/*! edit_handlers
+ \brief the copy of a handler tree of a target to change, see publish_handlers
+ *
+ * The trees of a target that isn't added yet are changed in place.
+ * The lock of the target must be held.
+ */
+static GTree *edit_handlers(const struct target *target, GTree *tree,
+		GCompareDataFunc compare) {
+
+	if (!target->targetID) {
+		return tree;
+	}
+
+	GTree *copy = g_tree_new_full(compare, NULL, NULL, NULL);
+	g_tree_foreach(tree, (GTraverseFunc) copy_handler, copy);
+	return copy;
+}
+
+/*! publish_handlers
+ \brief replace a handler tree of a target by its changed copy
+ *
+ * The lock of the target must be held.
+ */
+static void publish_handlers(GTree **tree, GTree *next) {
+	GTree *old = *tree;
+
+	if (old != next) {
+		g_atomic_pointer_set(tree, next);
+		epoch_defer(old, (GDestroyNotify) g_tree_destroy);
+	}
+}
+
+/*! index_handler
+ \brief make a honeypot address findable in handler_addresses
+ *
+ * targetlock must be held for writing.
+ */
+static void index_handler(struct target *target, struct handler *handler,
+		role_t role) {
+
+	if (!handler || !handler->ip) {
+		return;
+	}
+
+	struct handler_entry *entry = g_malloc0(sizeof(struct handler_entry));
+	entry->target = target;
+	entry->handler = handler;
+	entry->role = role;
+
+	ip_addr_t ip = handler->ip->addr_ip;
+	uint8_t bits = role == LIH ? handler->ip->addr_bits : 32;
+
+	/* The list is owned by the table, steal it before appending */
+	struct prefix_table *table = edit_handler_addresses();
+	GSList *entries = prefix_table_exact(table, ip, bits);
+	if (entries) {
+		g_hash_table_steal(table->networks[bits],
+				GUINT_TO_POINTER(ip & prefix_mask(bits)));
+	}
+	prefix_table_insert(table, ip, bits, g_slist_append(entries, entry));
+}
+
+/*! unindex_handler
+ \brief undo index_handler
+ *
+ * targetlock must be held for writing.
+ */
+static void unindex_handler(struct handler *handler, role_t role) {
+
+	if (!handler || !handler->ip) {
+		return;
+	}
+
+	ip_addr_t ip = handler->ip->addr_ip;
+	uint8_t bits = role == LIH ? handler->ip->addr_bits : 32;
+
+	struct prefix_table *table = edit_handler_addresses();
+	GSList *entries = prefix_table_exact(table, ip, bits);
+	if (!entries) {
+		return;
+	}
+
+	g_hash_table_steal(table->networks[bits],
+			GUINT_TO_POINTER(ip & prefix_mask(bits)));
+
+	GSList *loop = entries;
+	while (loop) {
+		GSList *next = loop->next;
+		struct handler_entry *entry = loop->data;
+		if (entry->handler == handler) {
+			g_free(entry);
+			entries = g_slist_delete_link(entries, loop);
+		}
+		loop = next;
+	}
+
+	if (entries) {
+		prefix_table_insert(table, ip, bits, entries);
+	} else {
+		prefix_table_remove(table, ip, bits);
+	}
+}
+
+static gboolean index_back_handler(__attribute__ ((unused)) gpointer key,
+		struct handler *handler, struct target *target) {
+	index_handler(target, handler, HIH);
+	return FALSE;
+}
+
+static gboolean unindex_back_handler(__attribute__ ((unused)) gpointer key,
+		struct handler *handler, __attribute__ ((unused)) gpointer data) {
+	unindex_handler(handler, HIH);
+	return FALSE;
+}
+
+/*! index_target
+ \brief add the address blocks and honeypots of a target to the lookup tables
+ *
+ * targetlock must be held for writing.
+ */
+static void index_target(struct target *target) {
+
+	GSList *loop;
+
+	for (loop = target->addresses; loop; loop = loop->next) {
+		struct addr *block = loop->data;
+		struct prefix_table *table = edit_target_addresses();
+		if (prefix_table_exact(table, block->addr_ip, block->addr_bits)) {
+			printdbg("%s Address block %s is already assigned, overriding\n",
+					H(0), addr_ntoa(block));
+		}
+		prefix_table_insert(table, block->addr_ip, block->addr_bits, target);
+	}
+
+	index_handler(target, target->front_handler, LIH);
+	g_tree_foreach(target->back_handlers, (GTraverseFunc) index_back_handler,
+			target);
+	for (loop = target->intra_handlers_list; loop; loop = loop->next) {
+		index_handler(target, loop->data, INTRA);
+	}
+}
+
+/*! unindex_target
+ \brief undo index_target
+ *
+ * targetlock must be held for writing.
+ */
+static void unindex_target(struct target *target) {
+
+	GSList *loop;
+
+	for (loop = target->addresses; loop; loop = loop->next) {
+		struct addr *block = loop->data;
+		struct prefix_table *table = edit_target_addresses();
+		if (prefix_table_exact(table, block->addr_ip, block->addr_bits)
+				== target) {
+			prefix_table_remove(table, block->addr_ip, block->addr_bits);
+		}
+	}
+
+	unindex_handler(target->front_handler, LIH);
+	g_tree_foreach(target->back_handlers, (GTraverseFunc) unindex_back_handler,
+			NULL);
+	for (loop = target->intra_handlers_list; loop; loop = loop->next) {
+		unindex_handler(loop->data, INTRA);
+	}
+}
+
+/*! insert_target
+ \brief give a target its ID and make it findable
+ *
+ * targetlock must be held for writing.
+ */
+static status_t insert_target(struct target *target) {
+
+	target->targetID = ++target_counter;
+	if (g_tree_lookup(targets, &target->targetID))
+		return NOK;
+
+	g_mutex_init(&target->lock);
+
+	if (!target->back_handlers)
+		target->back_handlers = g_tree_new_full((GCompareDataFunc) intcmp,
+				NULL, NULL, NULL);
+
+	if (!target->intra_handlers)
+		target->intra_handlers = g_tree_new((GCompareFunc) addr_cmp);
+
+	g_tree_insert(targets, &target->targetID, target);
+	index_target(target);
+
+	return OK;
+}
+
+/*! withdraw_target
+ \brief undo insert_target, the target itself is left to the caller
+ *
+ * targetlock must be held for writing.
+ */
+static void withdraw_target(struct target *target) {
+
+	if (target->default_route && target->default_route->target == target) {
+		g_atomic_pointer_set(&target->default_route->target, NULL);
+	}
+
+	unindex_target(target);
+	g_tree_steal(targets, &target->targetID);
+	target->withdrawn = TRUE;
+}
+
+/*! add_withdraw_hook
+ \brief have hook called with each target taken out, for the modules that
+ * keep their own state about targets
+ *
+ * The hook runs without targetlock, once the decision threads can't find
+ * the target anymore and before it's freed.
+ */
+void add_withdraw_hook(withdraw_hook hook) {
+	g_mutex_lock(&hooks_lock);
+	withdraw_hooks = g_slist_append(withdraw_hooks, hook);
+	g_mutex_unlock(&hooks_lock);
+}
+
+/*! remove_withdraw_hook
+ \brief undo add_withdraw_hook, the hook isn't running anymore once it
+ * returns
+ */
+void remove_withdraw_hook(withdraw_hook hook) {
+	g_mutex_lock(&hooks_lock);
+	withdraw_hooks = g_slist_remove(withdraw_hooks, hook);
+	g_mutex_unlock(&hooks_lock);
+}
+
+static void run_withdraw_hooks(struct target *target) {
+	GSList *loop;
+
+	g_mutex_lock(&hooks_lock);
+	for (loop = withdraw_hooks; loop; loop = loop->next) {
+		((withdraw_hook) loop->data)(target);
+	}
+	g_mutex_unlock(&hooks_lock);
+}
 
 status_t add_target(struct target *target) {
 	status_t ret = NOK;
@@ -33,45 +372,113 @@ status_t add_target(struct target *target) {
 		goto done;
 
 	g_rw_lock_writer_lock(&targetlock);
-	target->targetID = ++target_counter;
-	if (!g_tree_lookup(targets, &target->targetID)) {
-		g_mutex_init(&target->lock);
+	ret = insert_target(target);
+	publish_tables();
+	g_rw_lock_writer_unlock(&targetlock);
 
-		if (!target->back_handlers)
-			target->back_handlers = g_tree_new_full((GCompareDataFunc) intcmp,
-					NULL, NULL, (GDestroyNotify) free_handler);
+	done: return ret;
+}
 
-		if (!target->intra_handlers)
-			target->intra_handlers = g_tree_new((GCompareFunc) addr_cmp);
+static gboolean collect_configured(__attribute__ ((unused)) gpointer key,
+		struct target *target, GSList **configured) {
+	if (target->configured) {
+		*configured = g_slist_prepend(*configured, target);
+	}
+	return FALSE;
+}
 
-		g_tree_insert(targets, &target->targetID, target);
+/*! replace_targets
+ \brief swap the targets defined in the configuration for a new set at once
+ *
+ * Targets added at runtime stay. The targets taken out are returned and
+ * are still used by their connections, see reload.c.
+ *
+ \param[in] fresh: the new targets, in the order of the configuration
+ \return the targets taken out
+ */
+GSList *replace_targets(GSList *fresh) {
 
-		ret = OK;
+	GSList *retired = NULL, *loop;
+
+	g_rw_lock_writer_lock(&targetlock);
+
+	g_tree_foreach(targets, (GTraverseFunc) collect_configured, &retired);
+	for (loop = retired; loop; loop = loop->next) {
+		withdraw_target(loop->data);
+	}
+
+	for (loop = fresh; loop; loop = loop->next) {
+		struct target *target = loop->data;
+
+		insert_target(target);
+
+		/* A target with address blocks doesn't take over the whole link */
+		if (target->default_route
+				&& (!target->default_route->target || !target->addresses)) {
+			g_atomic_pointer_set(&target->default_route->target, target);
+		}
 	}
+
+	publish_tables();
 	g_rw_lock_writer_unlock(&targetlock);
 
-	done: return ret;
+	for (loop = retired; loop; loop = loop->next) {
+		run_withdraw_hooks(loop->data);
+	}
+
+	return retired;
+}
+
+/*! reap_target
+ \brief free a removed target once no decision thread can still find it
+ *
+ * A thread that looked the target up before it was withdrawn may have
+ * bound new connections to it after remove_target retired them, those
+ * are retired now that no other one can be.
+ */
+static void reap_target(struct target *target) {
+	uint32_t retired = retire_conns(&target->conns);
+	if (retired) {
+		printdbg("%s Retired %u late connections of target %"PRIi64"\n",
+				H(0), retired, target->targetID);
+	}
+	free_target(target);
 }
 
 status_t remove_target(int64_t targetID) {
-	status_t ret = NOK;
 
 	g_rw_lock_writer_lock(&targetlock);
 	struct target *target = g_tree_lookup(targets, &targetID);
-	if (target && g_tree_remove(targets, &targetID)) {
-		if(target->default_route) {
-			target->default_route->target = NULL;
-		}
-
-		free_target(target);
-		ret = OK;
+	if (target) {
+		withdraw_target(target);
 	}
+	publish_tables();
 	g_rw_lock_writer_unlock(&targetlock);
 
-	return ret;
+	if (!target) {
+		return NOK;
+	}
+
+	run_withdraw_hooks(target);
+
+	/* Without targetlock: the threads holding these connections may need it */
+	uint32_t retired = retire_conns(&target->conns);
+	printdbg("%s Retired %u connections of target %"PRIi64"\n", H(0),
+			retired, targetID);
+
+	epoch_defer(target, (GDestroyNotify) reap_target);
+	epoch_reclaim();
+
+	return OK;
 }
 
-status_t add_back_handler(struct target *target, struct handler *handler) {
+/*! add_back_handler
+ \brief make handler a backend of the target
+ \param[in] balanced: FALSE to keep the balancer from picking it until the
+ * caller adds it with balancer_add
+ */
+status_t add_back_handler(struct target *target, struct handler *handler,
+		gboolean balanced) {
 	status_t ret = NOK;
 
 	if (!target || !handler)
@@ -79,9 +486,27 @@ status_t add_back_handler(struct target *target, struct handler *handler) {
 
 	g_mutex_lock(&target->lock);
 	handler->ID = ++(target->back_handler_count);
-	g_tree_insert(target->back_handlers, &handler->ID, handler);
+	GTree *back_handlers = edit_handlers(target, target->back_handlers,
+			(GCompareDataFunc) intcmp);
+	g_tree_insert(back_handlers, &handler->ID, handler);
+	publish_handlers(&target->back_handlers, back_handlers);
+	if (!target->balancer)
+		target->balancer = balancer_new();
 	g_mutex_unlock(&target->lock);
 
+	if (balanced)
+		balancer_add(target->balancer, handler);
+
+	/* Targets still being parsed are indexed as a whole by add_target */
+	if (target->targetID) {
+		g_rw_lock_writer_lock(&targetlock);
+		index_handler(target, handler, HIH);
+		publish_tables();
+		g_rw_lock_writer_unlock(&targetlock);
+
+		/* Not reclaimed here, see add_intra_handler */
+	}
+
 	ret = OK;
 
 	done: return ret;
@@ -93,12 +518,31 @@ status_t remove_back_handler(struct target *target, int64_t backendID) {
 
 	g_mutex_lock(&target->lock);
 	struct handler *handler = g_tree_lookup(target->back_handlers, &backendID);
-	if (handler && g_tree_remove(target->back_handlers, &backendID)) {
-		free_handler(handler);
+	if (handler) {
+		GTree *back_handlers = edit_handlers(target, target->back_handlers,
+				(GCompareDataFunc) intcmp);
+		g_tree_remove(back_handlers, &backendID);
+		publish_handlers(&target->back_handlers, back_handlers);
 		ret = OK;
 	}
 	g_mutex_unlock(&target->lock);
 
+	if (ret == OK) {
+		balancer_remove(target->balancer, handler);
+
+		g_rw_lock_writer_lock(&targetlock);
+		unindex_handler(handler, HIH);
+		publish_tables();
+		g_rw_lock_writer_unlock(&targetlock);
+
+		uint32_t retired = retire_conns(&handler->conns);
+		printdbg("%s Retired %u connections of backend %"PRIi64"\n", H(0),
+				retired, backendID);
+
+		epoch_defer(handler, (GDestroyNotify) free_handler);
+		epoch_reclaim();
+	}
+
 	return ret;
 }
 
@@ -117,34 +561,70 @@ status_t add_intra_handler(struct target *target, struct addr *target_ip,
 		handler->intra_target_ips = g_slist_append(handler->intra_target_ips,
 				target_ip);
 		target->intra_handlers_list = g_slist_append(target->intra_handlers_list, handler);
-		g_tree_insert(target->intra_handlers, target_ip, handler);
+		GTree *intra_handlers = edit_handlers(target, target->intra_handlers,
+				(GCompareDataFunc) addr_cmp);
+		g_tree_insert(intra_handlers, target_ip, handler);
+		publish_handlers(&target->intra_handlers, intra_handlers);
 		ret = OK;
 	}
 	g_mutex_unlock(&target->lock);
 
+	if (ret == OK && target->targetID) {
+		g_rw_lock_writer_lock(&targetlock);
+		index_handler(target, handler, INTRA);
+		publish_tables();
+		g_rw_lock_writer_unlock(&targetlock);
+
+		/* Not reclaimed here: modules add handlers from the decision
+		 * threads, where reap_target could wait on their own connection.
+		 * The replaced tables go with the next clean or removal. */
+	}
+
 	done: return ret;
 }
 
 status_t remove_intra_handler(struct target *target, int64_t intraID) {
 	status_t ret = NOK;
 
+	struct handler *handler = NULL;
+
 	g_mutex_lock(&target->lock);
 	GSList *loop = target->intra_handlers_list;
 	while(loop) {
 		struct handler *test = (struct handler *)loop->data;
 		if(test->ID==intraID) {
+			GTree *intra_handlers = edit_handlers(target,
+					target->intra_handlers, (GCompareDataFunc) addr_cmp);
 			GSList *loop2 = test->intra_target_ips;
 			while(loop2) {
-				g_tree_remove(target->intra_handlers, loop->data);
+				g_tree_remove(intra_handlers, loop2->data);
 				loop2=loop2->next;
 			}
+			publish_handlers(&target->intra_handlers, intra_handlers);
 
-			free_handler(test);
+			target->intra_handlers_list = g_slist_delete_link(
+					target->intra_handlers_list, loop);
+			handler = test;
+			ret = OK;
 			break;
 		}
 		loop=loop->next;
 	}
 	g_mutex_unlock(&target->lock);
 
+	if (handler) {
+		g_rw_lock_writer_lock(&targetlock);
+		unindex_handler(handler, INTRA);
+		publish_tables();
+		g_rw_lock_writer_unlock(&targetlock);
+
+		uint32_t retired = retire_conns(&handler->conns);
+		printdbg("%s Retired %u connections of intra handler %"PRIi64"\n",
+				H(0), retired, intraID);
+
+		epoch_defer(handler, (GDestroyNotify) free_handler);
+		epoch_reclaim();
+	}
+
 	return ret;
 }
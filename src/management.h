@@ -30,10 +30,22 @@
 #include "connections.h"
 #include "decision_engine.h"
 
+void free_handler_entries(GSList *entries);
+
+/*! withdraw_hook
+ \brief called with a target that was taken out, before it's freed
+ */
+typedef void (*withdraw_hook)(struct target *target);
+
+void add_withdraw_hook(withdraw_hook hook);
+void remove_withdraw_hook(withdraw_hook hook);
+
 status_t add_target(struct target *target);
 status_t remove_target(int64_t targetID);
+GSList *replace_targets(GSList *fresh);
 
-status_t add_back_handler(struct target *target, struct handler *handler);
+status_t add_back_handler(struct target *target, struct handler *handler,
+		gboolean balanced);
 status_t remove_back_handler(struct target *target, int64_t backendID);
 
 status_t add_intra_handler(struct target *target, struct addr *target_ip,
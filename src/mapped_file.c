@@ -0,0 +1,149 @@
+/*
+ * This file is part of the honeybrid project.
+ *
+ * 2007-2009 University of Maryland (http://www.umd.edu)
+ * Robin Berthier <robinb@umd.edu>, Thomas Coquelin <coquelin@umd.edu>
+ * and Julien Vehent <julien@linuxwall.info>
+ *
+ * 2012-2014 University of Connecticut (http://www.uconn.edu)
+ * Tamas K Lengyel <tamas.k.lengyel@gmail.com>
+ *
+ * Honeybrid is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mapped_file.h"
+
+#include <inttypes.h>
+
+#include "epoch.h"
+#include "log.h"
+#include "timers.h"
+
+/*!	\file mapped_file.c
+ \brief
+
+ Files that the modules map rather than load, such as the reputation lists
+ and the prefix maps, and map again when they are replaced. The module
+ switches to the new mapping with a single pointer store, and the old one
+ is unmapped once no decision thread can still be reading it (see
+ epoch.c). The files are checked by the timers, a replaced file that
+ isn't valid keeps the previous mapping until it changes again.
+
+ */
+
+static gboolean same_file(const struct stat *a, const struct stat *b) {
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino
+			&& a->st_mtime == b->st_mtime && a->st_size == b->st_size;
+}
+
+/*! check_files
+ \brief map the files that were replaced, run by the timers
+ */
+static void check_files(struct mapped_files *files) {
+	GHashTableIter i;
+	struct mapped_file *mapped;
+	struct stat st;
+
+	g_mutex_lock(&files->lock);
+	if (!files->files) {
+		g_mutex_unlock(&files->lock);
+		return;
+	}
+	g_hash_table_iter_init(&i, files->files);
+	while (g_hash_table_iter_next(&i, NULL, (gpointer *) &mapped)) {
+		if (stat(mapped->file, &st) || same_file(&st, &mapped->seen)) {
+			continue;
+		}
+		mapped->seen = st;
+
+		gpointer fresh = files->open(mapped->file);
+		if (!fresh) {
+			g_printerr("%s %s isn't a valid %s, keeping the previous one\n",
+					H(6), mapped->file, files->what);
+			continue;
+		}
+
+		gpointer old = mapped->current;
+		g_atomic_pointer_set(&mapped->current, fresh);
+		epoch_defer(old, files->close);
+
+		g_printerr("%s Reloaded %"PRIu64" %s from %s\n", H(6),
+				files->count(fresh), files->entries, mapped->file);
+	}
+	g_mutex_unlock(&files->lock);
+
+	epoch_reclaim();
+}
+
+/*! mapped_files_start
+ \brief check the files of the kind from now on, when the module starts
+ */
+void mapped_files_start(struct mapped_files *files) {
+	files->timer = timer_add_periodic(files->interval,
+			(timer_func) check_files, files);
+}
+
+/*! mapped_files_stop
+ \brief stop checking the files and unmap them, when the module shuts down
+ */
+void mapped_files_stop(struct mapped_files *files) {
+	GHashTableIter i;
+	struct mapped_file *mapped;
+
+	timer_cancel(files->timer);
+	files->timer = 0;
+
+	g_mutex_lock(&files->lock);
+	if (files->files) {
+		g_hash_table_iter_init(&i, files->files);
+		while (g_hash_table_iter_next(&i, NULL, (gpointer *) &mapped)) {
+			files->close(mapped->current);
+			g_free(mapped->file);
+			g_free(mapped);
+		}
+		g_hash_table_destroy(files->files);
+		files->files = NULL;
+	}
+	g_mutex_unlock(&files->lock);
+}
+
+/*! mapped_file_open
+ \brief the mapped file, mapped the first time it's used
+ \return NULL if it can't be mapped
+ */
+struct mapped_file *mapped_file_open(struct mapped_files *files,
+		const char *file) {
+	g_mutex_lock(&files->lock);
+	if (!files->files) {
+		files->files = g_hash_table_new(g_str_hash, g_str_equal);
+	}
+
+	struct mapped_file *mapped = g_hash_table_lookup(files->files, file);
+	if (!mapped) {
+		gpointer mapping = files->open(file);
+		if (mapping) {
+			mapped = g_malloc0(sizeof(struct mapped_file));
+			mapped->file = g_strdup(file);
+			mapped->current = mapping;
+			stat(file, &mapped->seen);
+			g_hash_table_insert(files->files, mapped->file, mapped);
+
+			g_printerr("%s Mapped %"PRIu64" %s from %s\n", H(6),
+					files->count(mapping), files->entries, file);
+		}
+	}
+	g_mutex_unlock(&files->lock);
+
+	return mapped;
+}
@@ -0,0 +1,85 @@
+/*
+ * This file is part of the honeybrid project.
+ *
+ * 2007-2009 University of Maryland (http://www.umd.edu)
+ * Robin Berthier <robinb@umd.edu>, Thomas Coquelin <coquelin@umd.edu>
+ * and Julien Vehent <julien@linuxwall.info>
+ *
+ * 2012-2014 University of Connecticut (http://www.uconn.edu)
+ * Tamas K Lengyel <tamas.k.lengyel@gmail.com>
+ *
+ * Honeybrid is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __MAPPED_FILE_H_
+#define __MAPPED_FILE_H_
+
+#include "types.h"
+
+#include <sys/stat.h>
+
+/*!
+ \def mapped_files
+ \brief the files of one kind the modules map, such as the lists of
+ * mod_reputation, shared by the module instances configured with the same
+ * file
+ *
+ * A module declares one with how to open, close and count a file, the
+ * other fields belong to mapped_files_start() and mapped_file_open().
+ *
+ \param what, the kind of file, for the log
+ \param entries, what count() counts, for the log
+ \param interval, ms between checks of the files
+ \param files, struct mapped_file by name (protected by lock)
+ */
+struct mapped_files {
+	const char *what;
+	const char *entries;
+	guint interval;
+	gpointer (*open)(const char *file);
+	GDestroyNotify close;
+	uint64_t (*count)(gconstpointer mapping);
+
+	GMutex lock;
+	GHashTable *files;
+	guint timer;
+};
+
+/*!
+ \def mapped_file
+ \brief a file mapped by one or more module instances
+ *
+ \param current, the mapping in use, replaced atomically on reload
+ \param seen, the file last mapped or found invalid, to try again only when
+ * it changes
+ */
+struct mapped_file {
+	gchar *file;
+	gpointer current;
+	struct stat seen;
+};
+
+/*! mapped_file_current
+ \brief the mapping to use, valid until the decision thread goes offline
+ */
+#define mapped_file_current(mapped) g_atomic_pointer_get(&(mapped)->current)
+
+void mapped_files_start(struct mapped_files *files);
+
+void mapped_files_stop(struct mapped_files *files);
+
+struct mapped_file *mapped_file_open(struct mapped_files *files,
+		const char *file);
+
+#endif /* __MAPPED_FILE_H_ */
@@ -0,0 +1,85 @@
+/*
+ * This file is part of the honeybrid project.
+ *
+ * 2007-2009 University of Maryland (http://www.umd.edu)
+ * Robin Berthier <robinb@umd.edu>, Thomas Coquelin <coquelin@umd.edu>
+ * and Julien Vehent <julien@linuxwall.info>
+ *
+ * 2012-2014 University of Connecticut (http://www.uconn.edu)
+ * Tamas K Lengyel <tamas.k.lengyel@gmail.com>
+ *
+ * Honeybrid is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file mod_backpick_balance.c
+ * \brief BACKPICK BALANCE module for honeybrid Decision Engine
+ *
+ * Picks the backend of a redirected connection from the load of the
+ * backends: 'policy' is least_conn (the default), weighted or random.
+ * Backends at their capacity are never picked, and the module rejects
+ * when all of them are, which keeps the connection on the LIH.
+ */
+
+#include "modules.h"
+#include "constants.h"
+#include "balancer.h"
+
+/*! parse_mod_backpick_balance
+ \brief parse the optional 'policy' parameter
+ */
+status_t parse_mod_backpick_balance(struct node *node) {
+    balance_policy_t policy = BALANCE_LEAST_CONN;
+    const char *name = g_hash_table_lookup(node->config, "policy");
+
+    if (name) {
+        for (policy = 0; policy < __MAX_BALANCE_POLICY; policy++) {
+            if (!strcmp(name, lookup_balance_policy(policy))) {
+                break;
+            }
+        }
+
+        if (policy == __MAX_BALANCE_POLICY) {
+            printdbg("%s unknown balancing policy '%s'!\n", H(6), name);
+            return NOK;
+        }
+    }
+
+    balance_policy_t *param = g_malloc(sizeof(balance_policy_t));
+    *param = policy;
+    node->param = param;
+    return OK;
+}
+
+/*! mod_backpick_balance
+ \param[in] args, struct that contain the node and the data to process
+ */
+mod_result_t mod_backpick_balance(struct mod_args *args) {
+    printdbg("%s Balancing backpick module called\n", H(args->pkt->conn->id));
+
+    const balance_policy_t *policy = args->node->param;
+    GRand *rand = module_thread_context(args);
+    int64_t pick = balancer_pick(args->pkt->conn->target->balancer, *policy,
+            rand);
+
+    if (!pick) {
+        printdbg("%s All backends are saturated, rejecting\n",
+                H(args->pkt->conn->id));
+        return REJECT;
+    }
+
+    printdbg("%s Picking backend %"PRIi64" (%s)\n", H(args->pkt->conn->id),
+            pick, lookup_balance_policy(*policy));
+    args->backend_use = pick;
+    return ACCEPT;
+}
@@ -29,30 +29,32 @@
  */
 
 #include "modules.h"
+#include "balancer.h"
 
 /*! mod_backpick_random
  \param[in] args, struct that contain the node and the data to process
+ *
+ * Backend IDs are not contiguous once backends come and go at runtime,
+ * so the pick is made among the backends the balancer knows about.
  */
 mod_result_t mod_backpick_random(struct mod_args *args) {
     printdbg("%s Random backpick module called\n", H(args->pkt->conn->id));
-    int n_backends = 0;
     mod_result_t result = DEFER;
 
-    if ((n_backends = g_tree_nnodes(args->pkt->conn->target->back_handlers))
-            <= 0) {
-        printdbg("%s No backends are defined for this target, rejecting\n",
+    GRand *rand = module_thread_context(args);
+    int64_t pick = balancer_pick(args->pkt->conn->target->balancer,
+            BALANCE_RANDOM, rand);
+
+    if (!pick) {
+        printdbg("%s No backend with room left for this target, rejecting\n",
                 H(args->pkt->conn->id));
         result = REJECT;
     } else {
-
-        uint32_t pick = rand() % n_backends + 1;
-
-        printdbg("%s Picking %d out of %d backends\n", H(args->pkt->conn->id),
-                pick, n_backends);
+        printdbg("%s Picking backend %"PRIi64"\n", H(args->pkt->conn->id),
+                pick);
         args->backend_use = pick;
         result = ACCEPT;
     }
 
     return result;
 }
-
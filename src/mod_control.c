@@ -23,133 +23,362 @@
  */
 
 /*! \file mod_control.c
- * \brief Source IP based control engine to rate limit high interaction honeypot
+ * \brief Token bucket rate limiter of the traffic of the high interaction honeypots
+ *
+ * Each scope (control_scope_t) can limit packets and bytes per second, with
+ * a burst of each. The buckets of a module instance live in a fixed table
+ * updated with compare and swap only, so the decision threads never wait on
+ * each other. A bucket is kept as GCRA does it: the theoretical arrival
+ * time of the next packet, full once that time has passed.
  *
  \author Robin Berthier 2009
  */
 
 #include "modules.h"
 
-/*! control
- \brief calculate the number of packets sent by a same source over a given period of time. If too many packets are sent, following packets are rejected
- Parameters required:
- function = hash;
- backup   = /etc/honeybrid/control.tb
- expiration = 600
- max_packet = 1000
- \param[in] pkts, struct that contain the packet to control
- \param[out] set result to 1 if rate limit reached, 0 otherwise
+#include "constants.h"
+#include "profile.h"
+
+#define CONTROL_BUCKETS 16384 // default number of buckets of a module instance
+#define CONTROL_PROBES 16 // slots looked at for the bucket of a key
+#define CONTROL_IDLE 1000000000ULL // ns after which a bucket may be recycled
+
+#define NSEC_PER_SEC 1000000000ULL
+
+/*! \brief the two limits of a scope */
+enum {
+	LIMIT_PACKETS,
+	LIMIT_BYTES,
+
+	__MAX_LIMIT
+};
+
+static const char *limit_names[__MAX_LIMIT][2] = {
+	[LIMIT_PACKETS] = { "pps", "pps_burst" },
+	[LIMIT_BYTES] = { "bps", "bps_burst" }
+};
+
+/*!
+ \def control_limit
+ \brief units allowed per period, and how far ahead of the clock the
+ * theoretical arrival time may run: the burst, in nanoseconds
  */
-mod_result_t mod_control(struct mod_args *args) {
-	gchar *backup_file;
+struct control_limit {
+	uint64_t units; // 0 for no limit
+	uint64_t period;
+	uint64_t tolerance;
+};
 
-	if (args->pkt == NULL) {
-		printdbg("%s Error, NULL packet\n", H(6));
-		return REJECT;
+/*!
+ \def control_bucket
+ \brief the theoretical arrival times of a key, one per limit
+ *
+ * The key is 0 while the slot is free.
+ */
+struct control_bucket {
+	uint64_t key;
+	uint64_t tat[__MAX_LIMIT];
+};
+
+struct control_params {
+	struct control_limit limit[__MAX_CONTROL_SCOPE][__MAX_LIMIT];
+	uint32_t mask;
+	struct control_bucket buckets[];
+};
+
+/*!
+ \def control_state
+ \brief what mod_control keeps on a connection, for the connection log
+ */
+struct control_state {
+	uint32_t limited;
+	char print[32];
+};
+
+static void set_limit(struct control_limit *limit, uint64_t units,
+		uint64_t period, uint64_t burst) {
+	limit->units = units;
+	limit->period = period;
+	limit->tolerance = burst * period / units;
+}
+
+/*! parse_mod_control
+ \brief parse the rate limits, <scope>_pps and <scope>_bps with their
+ * optional <scope>_pps_burst and <scope>_bps_burst (one second by default),
+ * where scope is source, destination or service
+ *
+ * Without any, the limit of the previous versions applies: max_packet
+ * (1000) packets per expiration (600) seconds from each source, all of
+ * them at once if it wants to.
+ */
+status_t parse_mod_control(struct node *node) {
+	int buckets = CONTROL_BUCKETS;
+	control_scope_t scope;
+	gboolean limited = FALSE;
+	uint32_t i, size;
+
+	module_param_int(node, "buckets", &buckets);
+	if (buckets < CONTROL_PROBES || buckets > (1 << 24)) {
+		printdbg("%s 'buckets' has to be between %u and %u!\n", H(6),
+				CONTROL_PROBES, 1 << 24);
+		return NOK;
 	}
 
-	printdbg("%s Module called\n", H(args->pkt->conn->id));
+	/*! a power of two, so the slot of a key is a mask away */
+	for (size = CONTROL_PROBES; size < (uint32_t) buckets; size <<= 1)
+		;
 
-	mod_result_t result = DEFER;
-	int expiration;
-	int max_packet;
-	gchar *param;
-	gchar **info;
-	GKeyFile *backup;
-
-	GTimeVal t;
-	g_get_current_time(&t);
-	gint now = (t.tv_sec);
-
-	char src[INET_ADDRSTRLEN];
-	inet_ntop(AF_INET, &(args->pkt->packet.ip->saddr), src, INET_ADDRSTRLEN);
-
-	/*! get the backup file for this module */
-	if (NULL
-			== (backup = (GKeyFile *) g_hash_table_lookup(args->node->config,
-					"backup"))) {
-		/*! We can't decide */
-		printdbg("%s mandatory argument 'backup' undefined!\n",
-				H(args->pkt->conn->id));
-		return result;
+	struct control_params *params = g_malloc0(
+			sizeof(struct control_params)
+					+ size * sizeof(struct control_bucket));
+	params->mask = size - 1;
+
+	for (scope = 0; scope < __MAX_CONTROL_SCOPE; scope++) {
+		for (i = 0; i < __MAX_LIMIT; i++) {
+			char *name = g_strdup_printf("%s_%s", lookup_control_scope(scope),
+					limit_names[i][0]);
+			char *burst_name = g_strdup_printf("%s_%s",
+					lookup_control_scope(scope), limit_names[i][1]);
+			int rate = 0, burst;
+
+			module_param_int(node, name, &rate);
+			burst = rate;
+			module_param_int(node, burst_name, &burst);
+
+			g_free(name);
+			g_free(burst_name);
+
+			if (rate < 0 || (rate && burst < 1)) {
+				printdbg("%s Invalid %s limit of the %s!\n", H(6),
+						limit_names[i][0], lookup_control_scope(scope));
+				g_free(params);
+				return NOK;
+			}
+			if (rate) {
+				set_limit(&params->limit[scope][i], rate, NSEC_PER_SEC, burst);
+				limited = TRUE;
+			}
+		}
 	}
-	/*! get the backup file path for this module */
-	if (NULL
-			== (backup_file = (gchar *) g_hash_table_lookup(args->node->config,
-					"backup_file"))) {
-		/*! We can't decide */
-		printdbg("%s error, backup file path missing\n",
-				H(args->pkt->conn->id));
-		return result;
+
+	if (!limited) {
+		int expiration = 600, max_packet = 1000;
+		module_param_int(node, "expiration", &expiration);
+		module_param_int(node, "max_packet", &max_packet);
+
+		if (expiration < 1 || max_packet < 1) {
+			printdbg("%s Invalid max_packet or expiration!\n", H(6));
+			g_free(params);
+			return NOK;
+		}
+		set_limit(&params->limit[CONTROL_SOURCE][LIMIT_PACKETS], max_packet,
+				expiration * NSEC_PER_SEC, max_packet);
 	}
 
-	/*! get control parameters */
-	if (NULL
-			== (param = (gchar *) g_hash_table_lookup(args->node->config,
-					"expiration"))) {
-		/*! no value set for expiration, we go with the default one */
-		expiration = 600;
-	} else {
-		expiration = atoi(param);
+	node->param = params;
+	return OK;
+}
+
+/*! control_key
+ \brief the key of a bucket, never 0
+ */
+static inline uint64_t control_key(control_scope_t scope, uint32_t addr,
+		uint16_t port) {
+	return ((uint64_t) (scope + 1) << 48) | ((uint64_t) port << 32) | addr;
+}
+
+static inline uint32_t control_slot(const struct control_params *params,
+		uint64_t key) {
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	return key & params->mask;
+}
+
+/*! find_bucket
+ \brief the bucket of a key, claimed if the key has none yet
+ *
+ * When the slots of the key are all taken, a bucket idle for long enough to
+ * be full again is recycled. A thread still holding it for its previous key
+ * may then charge one packet to the wrong bucket, which is fine for a limit.
+ *
+ \return NULL if there is no room for the key
+ */
+static struct control_bucket *find_bucket(struct control_params *params,
+		uint64_t key, uint64_t now) {
+	uint32_t first = control_slot(params, key), i;
+
+	for (i = 0; i < CONTROL_PROBES; i++) {
+		struct control_bucket *bucket = &params->buckets[(first + i)
+				& params->mask];
+		uint64_t current = *(volatile uint64_t *) &bucket->key;
+
+		if (current == key) {
+			return bucket;
+		}
+		if (!current) {
+			current = __sync_val_compare_and_swap(&bucket->key, 0, key);
+			if (!current || current == key) {
+				return bucket;
+			}
+		}
 	}
-	if (NULL
-			== (param = (gchar *) g_hash_table_lookup(args->node->config,
-					"max_packet"))) {
-		/*! no value set for expiration, we go with the default one */
-		max_packet = 1000;
-	} else {
-		max_packet = atoi(param);
+
+	for (i = 0; i < CONTROL_PROBES; i++) {
+		struct control_bucket *bucket = &params->buckets[(first + i)
+				& params->mask];
+		uint64_t current = bucket->key;
+		uint32_t l;
+
+		for (l = 0; l < __MAX_LIMIT; l++) {
+			if (bucket->tat[l] + CONTROL_IDLE > now) {
+				break;
+			}
+		}
+		if (l == __MAX_LIMIT
+				&& __sync_bool_compare_and_swap(&bucket->key, current, key)) {
+			return bucket;
+		}
 	}
 
-	if (NULL == (info = g_key_file_get_string_list(backup, "source", /* generic group name \todo: group by port number? */
-	src, NULL, NULL))) {
-		printdbg("%s IP not found... new entry created\n",
-				H(args->pkt->conn->id));
+	return NULL;
+}
+
+/*! bucket_take
+ \brief move the theoretical arrival time by the cost of the packet, unless
+ * it would run further ahead of now than the burst allows
+ */
+static inline gboolean bucket_take(uint64_t *tat, uint64_t cost,
+		uint64_t tolerance, uint64_t now) {
+	uint64_t old, next;
+
+	do {
+		old = *(volatile uint64_t *) tat;
+		next = MAX(old, now) + cost;
+		if (next - now > tolerance) {
+			return FALSE;
+		}
+	} while (!__sync_bool_compare_and_swap(tat, old, next));
+
+	return TRUE;
+}
+
+/*! control_admit
+ \brief take the packet from every bucket it goes through, or from none
+ \return the scope that limited the packet, __MAX_CONTROL_SCOPE if none did
+ */
+static control_scope_t control_admit(struct control_params *params,
+		const struct pkt_struct *pkt, uint16_t port, uint64_t now) {
+	struct {
+		uint64_t *tat;
+		uint64_t cost;
+	} taken[__MAX_CONTROL_SCOPE * __MAX_LIMIT];
+	uint64_t units[__MAX_LIMIT] = {
+		[LIMIT_PACKETS] = 1,
+		[LIMIT_BYTES] = ntohs(pkt->packet.ip->tot_len)
+	};
+	uint32_t count = 0, l;
+	control_scope_t scope;
+
+	for (scope = 0; scope < __MAX_CONTROL_SCOPE; scope++) {
+		const struct control_limit *limit = params->limit[scope];
+		struct control_bucket *bucket = NULL;
+
+		if (!limit[LIMIT_PACKETS].units && !limit[LIMIT_BYTES].units) {
+			continue;
+		}
+
+		switch (scope) {
+		case CONTROL_SOURCE:
+			bucket = find_bucket(params,
+					control_key(scope, pkt->packet.ip->saddr, 0), now);
+			break;
+		case CONTROL_DESTINATION:
+			bucket = find_bucket(params,
+					control_key(scope, pkt->packet.ip->daddr, 0), now);
+			break;
+		default:
+			bucket = find_bucket(params,
+					control_key(scope, pkt->packet.ip->saddr, port), now);
+			break;
+		}
+
+		for (l = 0; bucket && l < __MAX_LIMIT; l++) {
+			if (!limit[l].units) {
+				continue;
+			}
 
-		info = malloc(3 * sizeof(char *));
-
-		/*! 20 characters should be enough to hold even very large numbers */
-		info[0] = malloc(20 * sizeof(gchar));
-		info[1] = malloc(20 * sizeof(gchar));
-		info[2] = malloc(20 * sizeof(gchar));
-		g_snprintf(info[0], 20, "1"); /*! counter */
-		g_snprintf(info[1], 20, "%d", now); /*! first seen */
-		g_snprintf(info[2], 20, "0"); /*! duration */
-
-	} else {
-		/*! We check if we need to expire this entry */
-		int age = atoi(info[2]);
-		if (age > expiration) {
-			printdbg("%s IP found but expired... entry renewed\n",
-					H(args->pkt->conn->id));
-
-			g_snprintf(info[0], 20, "1"); /*! counter */
-			g_snprintf(info[1], 20, "%d", now); /*! first seen */
-			g_snprintf(info[2], 20, "0"); /*! duration */
-		} else {
-			printdbg("%s IP found... entry updated\n", H(args->pkt->conn->id));
-
-			g_snprintf(info[0], 20, "%d", atoi(info[0]) + 1); /*! counter */
-			g_snprintf(info[2], 20, "%d", now - atoi(info[1])); /*! duration */
+			uint64_t cost = units[l] * limit[l].period / limit[l].units;
+			if (!bucket_take(&bucket->tat[l], cost, limit[l].tolerance, now)) {
+				break;
+			}
+			taken[count].tat = &bucket->tat[l];
+			taken[count].cost = cost;
+			count++;
 		}
 
+		if (!bucket || l < __MAX_LIMIT) {
+			/*! give back what the packet took from the other buckets */
+			while (count--) {
+				__sync_fetch_and_sub(taken[count].tat, taken[count].cost);
+			}
+			return scope;
+		}
 	}
 
-	if (atoi(info[0]) > max_packet) {
-		printdbg("%s Rate limit reached! Packet rejected\n",
-				H(args->pkt->conn->id));
-		result = REJECT;
-	} else {
+	return __MAX_CONTROL_SCOPE;
+}
+
+/*! print_mod_control
+ \brief the packets the module limited on the connection, for its log
+ */
+const char *print_mod_control(struct control_state *state) {
+	snprintf(state->print, sizeof(state->print), "control_limited:%u",
+			state->limited);
+	return state->print;
+}
+
+/*! control
+ \brief rate limit the packets, see parse_mod_control() for the parameters
+ Parameters:
+ function = control;
+ source_pps = 100
+ source_bps = 100000
+ destination_pps = 10
+ service_pps = 20
+ service_pps_burst = 40
+ buckets = 16384
+ \param[in] pkts, struct that contain the packet to control
+ \param[out] set result to REJECT if a rate limit is reached, ACCEPT otherwise
+ */
+mod_result_t mod_control(struct mod_args *args) {
+
+	if (args->pkt == NULL) {
+		printdbg("%s Error, NULL packet\n", H(6));
+		return REJECT;
+	}
+
+	printdbg("%s Module called\n", H(args->pkt->conn->id));
+
+	struct control_params *params = args->node->param;
+	control_scope_t scope = control_admit(params, args->pkt,
+			pkt_dest_port(args->pkt), profile_clock());
+
+	if (scope == __MAX_CONTROL_SCOPE) {
 		printdbg("%s Rate limit not reached. Packet accepted\n",
 				H(args->pkt->conn->id));
-		result = ACCEPT;
+		return ACCEPT;
 	}
 
-	g_key_file_set_string_list(backup, "source", src,
-			(const gchar * const *) info, 3);
+	struct control_state **state = (struct control_state **) module_conn_state(
+			args);
+	if (!*state) {
+		*state = g_malloc0(sizeof(struct control_state));
+	}
+	(*state)->limited++;
 
-	save_backup(backup, backup_file);
+	printdbg("%s Rate limit of the %s reached! Packet rejected\n",
+			H(args->pkt->conn->id), lookup_control_scope(scope));
 
-	return result;
+	return REJECT;
 }
-
@@ -38,27 +38,33 @@
  - "counter", number of packet to receive before accepting
  */
 
+/*! parse_mod_counter
+ \brief parse the 'counter' parameter
+ */
+status_t parse_mod_counter(struct node *node) {
+    int counter;
+
+    if (!module_param_int(node, "counter", &counter) || counter < 0) {
+        printdbg("%s mandatory argument 'counter' undefined!\n", H(6));
+        return NOK;
+    }
+
+    uint32_t *pktval = g_malloc(sizeof(uint32_t));
+    *pktval = (uint32_t) counter;
+    node->param = pktval;
+    return OK;
+}
+
 /*! mod_counter
  \param[in] args, struct that contain the node and the datas to process
  \param[out] set result to 1 packet position match arg, 0 otherwise
  */
 mod_result_t mod_counter(struct mod_args *args) {
-    uint32_t pktval = 0;
-    gchar *param;
+    uint32_t pktval = *(const uint32_t *) args->node->param;
     mod_result_t result = DEFER;
 
     printdbg("%s Module called\n", H(args->pkt->conn->id));
 
-    if ((param = (char *) g_hash_table_lookup(args->node->config, "counter"))
-            == NULL) {
-        /*! We can't decide */
-        printdbg("%s mandatory argument 'counter' undefined!\n",
-                H(args->pkt->conn->id));
-        return result;
-    } else {
-        pktval = (uint32_t) atoi(param);
-    }
-
     if (pktval <= args->pkt->conn->count_data_pkt_from_intruder) {
         /*! We accept this packet */
         result = ACCEPT;
@@ -66,8 +72,9 @@ mod_result_t mod_counter(struct mod_args *args) {
                 H(args->pkt->conn->id), pktval,
                 args->pkt->conn->count_data_pkt_from_intruder);
     } else {
-        /*! We reject this packet */
+        /*! We reject this packet, until the counter is reached */
         result = REJECT;
+        args->wake_data_packets = pktval;
         printdbg(
                 "%s PACKET DOES NOT MATCH RULE for counter(%d) with value %d\n",
                 H(args->pkt->conn->id), pktval,
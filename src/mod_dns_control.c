@@ -27,39 +27,364 @@
  *          This module should only be placed in the "limit" section of a target configuration.
  *          Every subsequent connections to this IP will be redirected to the INTRA target
  *
+ *          The answers of the internal DNS server are cached for as long as
+ *          their TTL allows, a query it already answered is answered here
+ *          without being redirected.
+ *
  \author Tamas K Lengyel 2013
  */
 
 #include "modules.h"
 
-//DNS header structure
-struct dns_header {
-	unsigned short id; // identification number
-
-	unsigned char rd :1; // recursion desired
-	unsigned char tc :1; // truncated message
-	unsigned char aa :1; // authoritive answer
-	unsigned char opcode :4; // purpose of message
-	unsigned char qr :1; // query/response flag
-
-	unsigned char rcode :4; // response code
-	unsigned char cd :1; // checking disabled
-	unsigned char ad :1; // authenticated data
-	unsigned char z :1; // its z! reserved
-	unsigned char ra :1; // recursion available
-
-	unsigned short q_count; // number of question entries
-	unsigned short ans_count; // number of answer entries
-	unsigned short auth_count; // number of authority entries
-	unsigned short add_count; // number of resource entries
+#include "netcode.h"
+
+#define DNS_NAME_MAX 255 // bytes of a name in wire format
+#define DNS_CACHE_MAX 4096 // answers kept at once
+#define DNS_CACHE_MAX_TTL 86400 // seconds an answer is kept at most
+
+#define DNS_TYPE_OPT 41 // EDNS pseudo record, its TTL field holds flags
+
+#define DNS_RCODE_NOERROR 0
+#define DNS_RCODE_NXDOMAIN 3
+
+/*! dns_control_params
+ \brief internal DNS server the queries are switched to
+ */
+struct dns_control_params {
+	struct interface *iface;
+	struct addr ip;
+	struct addr mac;
+	gchar *ip_str;
+	uint16_t vlan;
+};
+
+/*! dns_key
+ \brief what an answer is cached for: the server that gave it and the
+ * question, with its name in lower case wire format
+ */
+struct dns_key {
+	uint32_t server;
+	uint16_t qtype;
+	uint16_t qclass;
+	uint32_t name_len;
+	uint8_t name[DNS_NAME_MAX];
 };
 
-//Constant sized fields of query structure
-struct question {
-	unsigned short qtype;
-	unsigned short qclass;
+/*! dns_answer
+ \brief a response of the internal DNS server, as it was received
+ */
+struct dns_answer {
+	struct dns_key key;
+	gint64 received; // monotonic time, in seconds
+	gint64 expires;
+	uint32_t len;
+	uint8_t msg[];
 };
 
+/*! Answers of the internal DNS servers, protected by dns_cache_lock */
+static GHashTable *dns_cache;
+static GMutex dns_cache_lock;
+
+static guint dns_key_hash(const struct dns_key *key) {
+	guint hash = 2166136261U ^ key->server ^ (key->qtype << 16) ^ key->qclass;
+	uint32_t i;
+
+	for (i = 0; i < key->name_len; i++) {
+		hash = (hash ^ key->name[i]) * 16777619U;
+	}
+	return hash;
+}
+
+static gboolean dns_key_equal(const struct dns_key *a, const struct dns_key *b) {
+	return a->server == b->server && a->qtype == b->qtype
+			&& a->qclass == b->qclass && a->name_len == b->name_len
+			&& !memcmp(a->name, b->name, a->name_len);
+}
+
+status_t init_mod_dns_control() {
+	dns_cache = g_hash_table_new_full((GHashFunc) dns_key_hash,
+			(GEqualFunc) dns_key_equal, NULL, g_free);
+	return OK;
+}
+
+void close_mod_dns_control() {
+	g_mutex_lock(&dns_cache_lock);
+	g_hash_table_destroy(dns_cache);
+	dns_cache = NULL;
+	g_mutex_unlock(&dns_cache_lock);
+}
+
+status_t parse_mod_dns_control(struct node *node) {
+	const char *our_server_iface = g_hash_table_lookup(node->config,
+			"interface");
+	const char *our_server_ip = g_hash_table_lookup(node->config, "ip");
+	const char *our_server_mac = g_hash_table_lookup(node->config, "mac");
+	int vlan;
+
+	if (!our_server_iface || !our_server_ip || !our_server_mac
+			|| !module_param_int(node, "vlan_id", &vlan)) {
+		printdbg("%s Incomplete configuration, 'interface', 'ip', 'mac' and 'vlan_id' are needed\n", H(6));
+		return NOK;
+	}
+
+	struct dns_control_params *params = g_malloc0(
+			sizeof(struct dns_control_params));
+
+	params->iface = g_hash_table_lookup(links, our_server_iface);
+	if (!params->iface || addr_pton(our_server_ip, &params->ip) < 0
+			|| addr_pton(our_server_mac, &params->mac) < 0) {
+		printdbg("%s Invalid DNS server definition\n", H(6));
+		g_free(params);
+		return NOK;
+	}
+
+	/* ip_str lives as long as the module configuration */
+	params->ip_str = (gchar *) our_server_ip;
+	params->vlan = htons(vlan & ((1 << 12) - 1));
+
+	node->param = params;
+	return OK;
+}
+
+
+/*! parse_question
+ \brief read the only question of a DNS message into key
+ \return the offset of the first byte after the question, 0 if the message
+ * has another number of questions or the question doesn't fit
+ */
+static uint32_t parse_question(const uint8_t *msg, uint32_t len,
+		struct dns_key *key) {
+	const struct dns_header *dns = (const struct dns_header *) msg;
+	uint32_t off = sizeof(struct dns_header);
+	uint16_t field;
+
+	if (len < sizeof(struct dns_header) || ntohs(dns->q_count) != 1) {
+		return 0;
+	}
+
+	/*! queries don't compress the name of their question */
+	key->name_len = 0;
+	for (;;) {
+		if (off >= len) {
+			return 0;
+		}
+
+		uint8_t label = msg[off++];
+		if (label > 63 || off + label > len
+				|| key->name_len + label + 1 > DNS_NAME_MAX) {
+			return 0;
+		}
+
+		key->name[key->name_len++] = label;
+		if (!label) {
+			break;
+		}
+		for (; label; label--) {
+			key->name[key->name_len++] = g_ascii_tolower(msg[off++]);
+		}
+	}
+
+	if (off + 2 * sizeof(field) > len) {
+		return 0;
+	}
+	memcpy(&field, msg + off, sizeof(field));
+	key->qtype = ntohs(field);
+	memcpy(&field, msg + off + sizeof(field), sizeof(field));
+	key->qclass = ntohs(field);
+
+	return off + 2 * sizeof(field);
+}
+
+/*! skip_name
+ \brief the offset after the name of a record, which may end with a
+ * compression pointer, 0 if it doesn't fit
+ */
+static uint32_t skip_name(const uint8_t *msg, uint32_t len, uint32_t off) {
+	while (off < len) {
+		uint8_t label = msg[off];
+
+		if ((label & 0xc0) == 0xc0) {
+			return off + 2 <= len ? off + 2 : 0;
+		}
+		if (label > 63) {
+			return 0;
+		}
+
+		off += label + 1;
+		if (!label) {
+			return off;
+		}
+	}
+	return 0;
+}
+
+/*! walk_records
+ \brief go through the records that follow the question at off, taking
+ * age seconds off their TTL if age isn't 0
+ \param[out] min_ttl, the lowest TTL of the answer and authority records
+ \return FALSE if the records don't fit the message
+ */
+static gboolean walk_records(uint8_t *msg, uint32_t len, uint32_t off,
+		uint32_t age, uint32_t *min_ttl) {
+	const struct dns_header *dns = (const struct dns_header *) msg;
+	uint32_t counted = ntohs(dns->ans_count) + ntohs(dns->auth_count);
+	uint32_t count = counted + ntohs(dns->add_count), i;
+
+	*min_ttl = DNS_CACHE_MAX_TTL;
+
+	for (i = 0; i < count; i++) {
+		uint16_t type, rdlength;
+		uint32_t ttl;
+
+		if (!(off = skip_name(msg, len, off)) || off + 10 > len) {
+			return FALSE;
+		}
+
+		memcpy(&type, msg + off, sizeof(type));
+		memcpy(&ttl, msg + off + 4, sizeof(ttl));
+		memcpy(&rdlength, msg + off + 8, sizeof(rdlength));
+
+		if (ntohs(type) != DNS_TYPE_OPT) {
+			ttl = ntohl(ttl);
+			if (age) {
+				uint32_t aged = htonl(ttl > age ? ttl - age : 0);
+				memcpy(msg + off + 4, &aged, sizeof(aged));
+			}
+			if (i < counted) {
+				*min_ttl = MIN(*min_ttl, ttl);
+			}
+		}
+
+		off += 10 + ntohs(rdlength);
+		if (off > len) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static gboolean dns_answer_expired(gpointer key, struct dns_answer *answer,
+		const gint64 *now) {
+	return answer->expires <= *now;
+}
+
+/*! dns_control_learn
+ \brief cache what the internal DNS server answers to a honeypot
+ *
+ * Only complete answers to a single question are kept, NOERROR or NXDOMAIN
+ * with at least one answer or authority record, for the lowest TTL of
+ * those records.
+ */
+void dns_control_learn(struct pkt_struct *pkt) {
+	const struct dns_header *dns =
+			(const struct dns_header *) pkt->packet.payload;
+	struct dns_key key;
+	uint32_t off, ttl;
+
+	if (!dns_cache || pkt->packet.ip->protocol != IPPROTO_UDP
+			|| ntohs(pkt->packet.udp->source) != 53
+			|| pkt->data < sizeof(struct dns_header)) {
+		return;
+	}
+
+	if (!dns->qr || dns->tc || dns->opcode
+			|| (dns->rcode != DNS_RCODE_NOERROR
+					&& dns->rcode != DNS_RCODE_NXDOMAIN)
+			|| !(ntohs(dns->ans_count) + ntohs(dns->auth_count))) {
+		return;
+	}
+
+	/*! walk_records only writes to the message when it ages it */
+	off = parse_question((const uint8_t *) dns, pkt->data, &key);
+	if (!off || !walk_records((uint8_t *) dns, pkt->data, off, 0, &ttl)
+			|| !ttl) {
+		return;
+	}
+
+	struct dns_answer *answer = g_malloc(
+			sizeof(struct dns_answer) + pkt->data);
+	answer->key = key;
+	answer->key.server = pkt->packet.ip->saddr;
+	answer->received = g_get_monotonic_time() / G_USEC_PER_SEC;
+	answer->expires = answer->received + ttl;
+	answer->len = pkt->data;
+	memcpy(answer->msg, dns, pkt->data);
+
+	g_mutex_lock(&dns_cache_lock);
+	if (dns_cache) {
+		if (g_hash_table_size(dns_cache) >= DNS_CACHE_MAX) {
+			g_hash_table_foreach_remove(dns_cache, (GHRFunc) dns_answer_expired,
+					&answer->received);
+		}
+		if (g_hash_table_size(dns_cache) < DNS_CACHE_MAX) {
+			/*! the key lives in the answer, so it is replaced with it */
+			g_hash_table_replace(dns_cache, &answer->key, answer);
+			printdbg("%s DNS answer cached for %u seconds\n", H(pkt->conn->id),
+					ttl);
+			answer = NULL;
+		}
+	}
+	g_mutex_unlock(&dns_cache_lock);
+
+	g_free(answer);
+}
+
+/*! dns_control_answer
+ \brief answer a query with what the internal DNS server answered to the
+ * same question before, its TTLs aged by the time it spent in the cache
+ \return TRUE if the query was answered
+ */
+static gboolean dns_control_answer(struct pkt_struct *pkt,
+		const struct dns_control_params *params) {
+	const uint8_t *query = (const uint8_t *) pkt->packet.payload;
+	const struct dns_header *dns = (const struct dns_header *) query;
+	struct dns_key key;
+	uint8_t *msg = NULL;
+	uint32_t off, len = 0, ttl;
+	gint64 age = 0;
+
+	if (pkt->packet.ip->protocol != IPPROTO_UDP
+			|| !(off = parse_question(query, pkt->data, &key))) {
+		return FALSE;
+	}
+
+	printdbg("%s DNS query ID %u type %u class %u\n", H(pkt->conn->id),
+			ntohs(dns->id), key.qtype, key.qclass);
+
+	key.server = params->ip.addr_ip;
+	gint64 now = g_get_monotonic_time() / G_USEC_PER_SEC;
+
+	g_mutex_lock(&dns_cache_lock);
+	struct dns_answer *answer =
+			dns_cache ? g_hash_table_lookup(dns_cache, &key) : NULL;
+	if (answer && answer->expires > now) {
+		msg = g_memdup(answer->msg, answer->len);
+		len = answer->len;
+		age = now - answer->received;
+	} else if (answer) {
+		g_hash_table_remove(dns_cache, &key);
+	}
+	g_mutex_unlock(&dns_cache_lock);
+
+	if (!msg) {
+		return FALSE;
+	}
+
+	/*! the same question may be asked with another case and ID */
+	struct dns_header *reply = (struct dns_header *) msg;
+	reply->id = dns->id;
+	reply->rd = dns->rd;
+	memcpy(msg + sizeof(struct dns_header), query + sizeof(struct dns_header),
+			off - sizeof(struct dns_header));
+	walk_records(msg, len, off, age, &ttl);
+
+	reply_udp(pkt, pkt->in, msg, len);
+	g_free(msg);
+
+	return TRUE;
+}
+
 mod_result_t mod_dns_control(struct mod_args *args) {
 
 	mod_result_t result = ACCEPT;
@@ -70,82 +395,49 @@ mod_result_t mod_dns_control(struct mod_args *args) {
 
 	printdbg("%s Module called\n", H(args->pkt->conn->id));
 
-	if ((args->pkt->packet.ip->protocol == IPPROTO_TCP
-			&& ntohs(args->pkt->packet.tcp->dest) != 53)
-			|| (args->pkt->packet.ip->protocol == IPPROTO_UDP
-					&& ntohs(args->pkt->packet.udp->dest) != 53)
-			|| args->pkt->data < sizeof(struct dns_header)) {
+	if (!(pkt_hints(args->pkt) & HINT_DNS_QUERY)) {
+		// It's not a DNS query
+		goto done;
+	}
 
-		// It's not DNS
+	const struct dns_control_params *params = args->node->param;
+
+	// The internal DNS server may have answered it already
+	if (dns_control_answer(args->pkt, params)) {
+		printdbg("%s DNS query answered from the cache\n",
+				H(args->pkt->conn->id));
+		args->pkt->answered = TRUE;
 		goto done;
 	}
 
-	struct dns_header *dns = (struct dns_header *) args->pkt->packet.payload;
+	// We will switch the query to our internal DNS server
+	switch_state(args->pkt->conn, PROXY);
+	args->pkt->conn->destination = INTRA;
 
-	if (dns && dns->qr == 0 && dns->q_count > 0 && ntohs(dns->opcode) < 6) {
-		// It looks like a DNS query
-		printdbg(
-				"%s DNS query ID %u OPCODE %u with %u questions\n", H(args->pkt->conn->id), ntohs(dns->id), ntohs(dns->opcode), ntohs(dns->q_count));
+	struct addr *target_ip = g_malloc(sizeof(struct addr));
+	addr_pack(target_ip, ADDR_TYPE_IP, 32, &args->pkt->packet.ip->daddr,
+			sizeof(ip_addr_t));
 
-#ifdef HONEYBRID_DEBUG
-		uint32_t qcount = 1;
-		char *query = (char *) dns + sizeof(struct dns_header);
-		struct question *question = (struct question *) ((char*) dns
-				+ sizeof(struct dns_header) + strlen(query) + 1);
-		while (qcount <= (ntohs(dns->q_count))) {
-			printdbg(
-					"%s DNS query type %u for %s\n", H(args->pkt->conn->id), ntohs(question->qtype), query);
-			query += strlen(query) + 1 + sizeof(struct question);
-			qcount++;
-		}
-#endif
-
-		// We will switch the query to our internal DNS server
-		char *our_server_iface = g_hash_table_lookup(args->node->config,
-				"interface");
-		char *our_server_ip = g_hash_table_lookup(args->node->config, "ip");
-		char *our_server_mac = g_hash_table_lookup(args->node->config, "mac");
-		int *vlan = g_hash_table_lookup(args->node->config, "vlan_id");
-
-		if (!our_server_iface || !our_server_ip || !our_server_mac || !vlan) {
-			// Incomplete configuration
-			goto done;
-		}
+	// Check if we have an internal handler defined for this target IP
+	struct handler *intra_handler = g_tree_lookup(
+			target_intra_handlers(args->pkt->conn->target), target_ip);
+	if (!intra_handler) {
+		intra_handler = g_malloc0(sizeof(struct handler));
+		intra_handler->iface = params->iface;
+		intra_handler->ip = g_memdup(&params->ip, sizeof(struct addr));
+		intra_handler->ip_str = g_strdup(params->ip_str);
+		intra_handler->mac = g_memdup(&params->mac, sizeof(struct addr));
+		intra_handler->vlan.i = params->vlan;
+		intra_handler->exclusive = 0; // allow this inra to act as multiple target IPs
+									  // since this is a DNS server, we don't expect it to initiate reverse connections
 
-		switch_state(args->pkt->conn, PROXY);
-		args->pkt->conn->destination = INTRA;
-
-		struct addr *target_ip = g_malloc(sizeof(struct addr));
-		addr_pack(target_ip, ADDR_TYPE_IP, 32, &args->pkt->packet.ip->daddr,
-				sizeof(ip_addr_t));
-
-		// Check if we have an internal handler defined for this target IP
-		struct handler *intra_handler = g_tree_lookup(
-				args->pkt->conn->target->intra_handlers, target_ip);
-		if (!intra_handler) {
-			struct addr *ip = g_malloc0(sizeof(struct addr));
-			addr_pton(our_server_ip, ip);
-
-			struct addr *mac = g_malloc0(sizeof(struct addr));
-			addr_pton(our_server_mac, mac);
-
-			intra_handler = g_malloc0(sizeof(struct handler));
-			intra_handler->iface = g_hash_table_lookup(links, our_server_iface);
-			intra_handler->ip = ip;
-			intra_handler->ip_str = g_strdup(our_server_ip);
-			intra_handler->mac = mac;
-			intra_handler->vlan.i = htons(*vlan & ((1 << 12) - 1));
-			intra_handler->exclusive = 0; // allow this inra to act as multiple target IPs
-										  // since this is a DNS server, we don't expect it to initiate reverse connections
-
-			add_intra_handler(args->pkt->conn->target, target_ip, intra_handler);
-		} else {
-			free(target_ip);
-		}
+		add_intra_handler(args->pkt->conn->target, target_ip, intra_handler);
+	} else {
+		free(target_ip);
+	}
 
-		if(OK == switch_conn_to_intra(args->pkt->conn, intra_handler)) {
-			result = ACCEPT;
-		}
+	if(OK == switch_conn_to_intra(args->pkt->conn, intra_handler)) {
+		result = ACCEPT;
 	}
 
 	done: return result;
@@ -23,9 +23,9 @@
  */
 
 /*! \file mod_hash.c
- * \brief SHA 1 Module for honeybrid Decision Engine
+ * \brief Hash Module for honeybrid Decision Engine
  *
- * This module is called by a boolean decision tree to process a message digest and try to find it in a search table
+ * This module is called by a boolean decision tree to process a message digest (SHA-1 or XXH64) and try to find it in a search table
  *
  *
  \author Julien Vehent, 2007
@@ -34,280 +34,605 @@
 
 #include "modules.h"
 
-#ifdef HAVE_CRYPTO
-
 #include <ctype.h>
-#include <openssl/evp.h>
+#include <inttypes.h>
+
+#include "constants.h"
+#include "profile.h"
 
 /*! New process:
  == Initialization ==
  - modules are parsed from the configuration file
- - for each module having the "backup" parameter, a new GKeyFile is initialized (and loaded!), pointer is added to the list of parameters
+ - for each module having the "backup" parameter, the store kept in that file is opened (and loaded!), pointer is added to the list of parameters
  - a pointer to the module processing function is added to the list of parameters
 
  == Processing ==
  - DE find the function to process the packet, then call the function with the following parameters:
  * Pkt structure
- * Module parameter (including GkeyFile to save/load)
- - the module processing function update the decision and the GKeyFile
- - the GkeyFile is added to a backup queue, in order to be written to a file when there is nothing else to do
+ * Module parameter (including the store to save/load)
+ - the module processing function update the decision and the store
+ - the store is marked as changed, in order to be written to a file by the backup thread
 
  ==> Advantages:
  - remove individual initialization functions
  - remove individual *.h files (use only modules.h to put processing function)
  */
 
-/*! \def OpenSSL structure */
-const EVP_MD *md;
-
-/*! \brief array indexes of variables to store for each hash 
- port number will be used as separator (group)
+/*! \brief what is stored for each hash
+ port number and digest type will be used as separator (group)
  hash will be used as key
+ the record keeps the counter, first seen, duration, packets and bytes
  */
-#define HASH_COUNTER 0
-#define HASH_FIRST_SEEN 1
-#define HASH_DURATION 2
-#define HASH_PACKET 3
-#define HASH_BYTE 4
-#define HASH_ASCII 5
-
-int init_mod_hash() {
+
+#define HASH_EXPIRATION (24 * 3600) // seconds a fingerprint stays known
+
+/*! the records of each port, digest and mode are kept apart */
+#define hash_group(port, digest, stream) \
+    ((port) | ((digest) << 16) | ((stream) << 24))
+
+#define STREAM_CHUNK 512 // default average size of the chunks of a stream
+#define STREAM_RUN_MAX 64 // digits and dots held back for the next packet
+
+/*! Throughput of the fingerprinting, over all the threads */
+static uint64_t hashed_bytes;
+static uint64_t hashed_nsec;
+
+/*! Random value of each byte, for the rolling hash that cuts the streams */
+static uint64_t gear[256];
+
+status_t init_mod_hash() {
+    uint64_t seed = 0;
+    uint32_t i;
+
     printdbg("%s Initializing Hash Module\n", H(0));
 
-    /*! init OpenSSL SHA-1 engine */
-    OpenSSL_add_all_digests();
-    md = EVP_get_digestbyname("sha1");
+    /*! splitmix64 from a fixed seed: a stream is cut at the same places
+     * on every run, or the chunks of the backup would never be seen again */
+    for (i = 0; i < 256; i++) {
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = z ^ (z >> 31);
+    }
 
-    return 0;
+    return OK;
 }
 
-/*! mod_hash
- \brief calculate a SHA1 hash value of a packet payload, and look for a possible match in a database of hashes.
- Parameters required:
- function = hash;
- backup	 = /etc/honeybrid/hash.tb
- \param[in] args, struct that contain the node and the datas to process
- \param[in] user_data, not used
- *
- \param[out] set result to 0 if datas's fingerprint is found in search table, 1 if not
+/*! close_mod_hash
+ \brief report how fast the payloads were fingerprinted
  */
-mod_result_t mod_hash(struct mod_args *args) {
-    GKeyFile *backup;
-    gchar *backup_file;
-    int expiration = 24 * 3600;
-    mod_result_t result = DEFER;
+void close_mod_hash() {
+    if (hashed_nsec) {
+        g_printerr("Hash module: %"PRIu64" KB of payload fingerprinted at %.1f MB/s per thread\n",
+                hashed_bytes >> 10, hashed_bytes * 1000.0 / hashed_nsec);
+    }
+}
 
-    /*! First, we make sure that we have data to work on */
-    if (args->pkt->data == 0) {
-        printdbg("%s No data to work on\n", H(args->pkt->conn->id));
-        return result;
+/*! hash_params
+ \brief configuration of a hash module instance
+ */
+struct hash_params {
+    struct module_backup backup;
+    int async;
+    digest_t digest;
+    int stream;
+    uint32_t chunk_min;
+    uint32_t chunk_max;
+    uint64_t chunk_mask;
+};
+
+/*! hash_job
+ \brief what is needed from the packet to fingerprint its payload, so the
+ * work can run on a module worker
+ *
+ * A job run in place takes the digest from the feature cache of the
+ * packet. A job submitted to the workers owns a copy of the payload, raw
+ * if the packet wasn't normalized yet: the worker does that and the digest.
+ */
+struct hash_job {
+    const struct hash_params *params;
+    char *raw;
+    char *payload; // normalized
+    uint32_t len;
+    gboolean digested;
+    uint8_t digest[DIGEST_SIZE];
+    uint32_t data;
+    uint16_t port;
+    uint32_t data_packets;
+    uint32_t conn_id;
+    mod_result_t result;
+};
+
+/*! parse_mod_hash
+ \brief get the backup the module keeps the fingerprints in, the digest
+ * to fingerprint with (digest = sha1 or xxh64), whether the
+ * fingerprinting runs on the module workers (async = 1) and whether it
+ * works on the stream of the intruder rather than on each packet
+ * (stream = 1, cut in chunks of 'chunk' bytes on average)
+ */
+status_t parse_mod_hash(struct node *node) {
+    const char *digest = g_hash_table_lookup(node->config, "digest");
+    struct hash_params *params = g_malloc0(sizeof(struct hash_params));
+    int chunk = STREAM_CHUNK;
+    uint32_t bits;
+
+    params->digest = DIGEST_SHA1;
+    if (digest) {
+        for (params->digest = 0; params->digest < __MAX_DIGEST;
+                params->digest++) {
+            if (!strcmp(digest, lookup_digest(params->digest))) {
+                break;
+            }
+        }
     }
 
-    /*! get the backup file for this module */
-    if (NULL
-            == (backup = (GKeyFile *) g_hash_table_lookup(args->node->config,
-                    "backup"))) {
-        /*! We can't decide */
-        printdbg("%s mandatory argument 'backup' undefined!\n",
-                H(args->pkt->conn->id));
-        return result;
+    if (params->digest == __MAX_DIGEST
+            || !payload_digest_available(params->digest)) {
+        printdbg("%s Digest '%s' isn't available!\n", H(6),
+                digest ? digest : lookup_digest(DIGEST_SHA1));
+        g_free(params);
+        return NOK;
     }
-    /*! get the backup file path for this module */
-    if (NULL
-            == (backup_file = (gchar *) g_hash_table_lookup(args->node->config,
-                    "backup_file"))) {
-        /*! We can't decide */
-        printdbg("%s error, backup file path missing\n",
-                H(args->pkt->conn->id));
-        return result;
+
+    if (module_param_backup(node, &params->backup) != OK) {
+        g_free(params);
+        return NOK;
     }
 
-    uint32_t ascii_len = 64;
-    gchar **info;
+    module_param_int(node, "async", &params->async);
+    module_param_int(node, "stream", &params->stream);
+    module_param_int(node, "chunk", &chunk);
 
-    char *hash;
-    unsigned char md_value[EVP_MAX_MD_SIZE];
-    unsigned int md_len = 20, i = 0;
+    if (chunk < 64 || chunk > 65536) {
+        printdbg("%s 'chunk' has to be between 64 and 65536 bytes!\n", H(6));
+        g_free(params);
+        return NOK;
+    }
 
-    char *payload = malloc(args->pkt->data + 1);
-    char *ascii;
+    /*! a boundary is where the top bits of the rolling hash are clear, one
+     * chance in the power of two below 'chunk' after the minimum size */
+    bits = 31 - __builtin_clz(chunk);
+    params->chunk_mask = ~0ULL << (64 - bits);
+    params->chunk_min = (1 << bits) >> 2;
+    params->chunk_max = (1 << bits) << 3;
 
-    /*! get the destination port */
-    gchar *port = g_malloc0(snprintf(NULL, 0, "%u", args->pkt->packet.tcp->dest) + 1);
-    sprintf(port, "%u", args->pkt->packet.tcp->dest);
+    node->param = params;
+    return OK;
+}
 
+static void free_hash_job(struct hash_job *job) {
+    g_free(job->raw);
+    g_free(job->payload);
+    g_free(job);
+}
+
+/*! hash_seen
+ \brief what mod_hash does with the record of the fingerprint, under its lock
+ */
+static void hash_seen(struct store_record *record, gboolean created,
+        struct hash_job *job) {
     GTimeVal t;
     g_get_current_time(&t);
     gint now = (t.tv_sec);
 
-    /*! get the payload from the packet */
-    memcpy(payload, args->pkt->packet.payload, args->pkt->data - 1);
-    payload[args->pkt->data] = '\0';
-
-    /*! replace all occurrences of IP addresses by a generic IP */
-    GRegex *ip_regex = g_regex_new("\\d{1,3}\\.\\d{1,3}\\.\\d{1,3}\\.\\d{1,3}",
-            0, 0, NULL);
-    if (TRUE == g_regex_match(ip_regex, payload, 0, NULL)) {
-        char *payload_tmp = g_strdup(payload);
-        printdbg("%s found an IP in the payload! Replacing it...\n",
-                H(args->pkt->conn->id));
-        payload = g_regex_replace(ip_regex, payload_tmp, -1, 0, "<0.0.0.0>", 0,
-                NULL);
-        g_free(payload_tmp);
+    if (created) {
+        /*! Unknown hash, so we accept the packet */
+        job->result = ACCEPT;
+        printdbg("%s Hash not found... packet accepted and new entry created\n",
+                H(job->conn_id));
+
+        record->counter = 1;
+        record->first_seen = now;
+        record->duration = 0;
+        record->bytes = job->data;
+
+    } else if (record->duration > HASH_EXPIRATION) {
+        /*! Known hash but entry expired, so we accept the packet */
+        job->result = ACCEPT;
+        printdbg(
+                "%s Hash found but expired... packet accepted and entry renewed\n",
+                H(job->conn_id));
+
+        record->counter = 1;
+        record->first_seen = now;
+        record->duration = 0;
+
+    } else {
+        /*! Known hash, so we reject the packet */
+        job->result = REJECT;
+        printdbg("%s Hash found... packet rejected and entry updated\n",
+                H(job->conn_id));
+
+        record->counter++;
+        record->duration = now - record->first_seen;
     }
-    g_regex_unref(ip_regex);
 
-    /* Old method: only taking care of the DST IP address
-     char *position;
-     int j, h, pos;
-     if (strlen(key_dst[0]) >= 7) {
-     while(NULL != (position = strstr(payload, key_dst[0]))) {
-     printdbg("%s found the dst ip in the payload! Replacing it...\n", H(args->pkt->conn->id));
+    record->packets = job->data_packets;
+}
 
-     pos = (int)(position-payload);
+/*! hash_work
+ \brief fingerprint the payload and look it up in the database of hashes
+ \return ACCEPT if the fingerprint is new or expired, REJECT if it's known
+ */
+static mod_result_t hash_work(struct hash_job *job,
+        __attribute__ ((unused)) uint64_t *backend_use) {
 
-     payload[pos+0] = '<';
-     payload[pos+1] = 'A';
-     payload[pos+2] = 'D';
-     payload[pos+3] = 'D';
-     payload[pos+4] = 'R';
-     payload[pos+5] = '>';
+    struct store *store = job->params->backup.store;
+    struct store_key key;
 
-     h=strlen(key_dst[0]) - 6;
+    /*! the packet wasn't normalized or digested on the decision thread */
+    if (!job->digested) {
+        gint64 start = profile_clock();
 
-     for(j=(pos+6); j<(strlen(payload)-h); j++) {
-     payload[j] = payload[j+h];
-     }
+        if (!job->payload) {
+            job->payload = normalize_payload(job->raw, job->data, &job->len);
+        }
+        printdbg("%s Computing payload digest\n", H(job->conn_id));
+        payload_digest(job->params->digest, job->payload, job->len,
+                job->digest);
+
+        __sync_fetch_and_add(&hashed_bytes, job->data);
+        __sync_fetch_and_add(&hashed_nsec, profile_clock() - start);
+    }
 
-     payload[strlen(payload)-h] = '\0';
-     }
-     }
-     */
+#ifdef HONEYBRID_DEBUG
+    uint32_t i, ascii_len = job->payload ? MIN(strlen(job->payload), 64) : 0;
+    char ascii[65], hex[(DIGEST_SIZE << 1) + 1];
 
-    if (strlen(payload) < ascii_len) {
-        ascii_len = strlen(payload);
+    for (i = 0; i < ascii_len; i++) {
+        ascii[i] = isprint(job->payload[i]) ? job->payload[i] : '.';
+    }
+    ascii[ascii_len] = '\0';
+    for (i = 0; i < DIGEST_SIZE; i++) {
+        sprintf(hex + (i << 1), "%02x", job->digest[i]);
     }
-    ascii = g_malloc0(ascii_len + 1);
 
-    printdbg("%s Computing payload digest\n", H(args->pkt->conn->id));
+    printdbg("%s ASCII of %d char [%s]\n", H(job->conn_id), ascii_len, ascii);
+    printdbg("%s Searching for %s fingerprint %s in %p on port %u\n",
+            H(job->conn_id), lookup_digest(job->params->digest), hex, store,
+            job->port);
+#endif
 
-    /*! digest the payload */
-    EVP_MD_CTX ctx;
-    EVP_MD_CTX_init(&ctx);
-    EVP_DigestInit_ex(&ctx, md, NULL);
-    EVP_DigestUpdate(&ctx, payload, args->pkt->data - 2);
-    EVP_DigestFinal_ex(&ctx, md_value, &md_len);
-    EVP_MD_CTX_cleanup(&ctx);
+    store_key_bytes(&key, hash_group(job->port, job->params->digest, 0),
+            job->digest, DIGEST_SIZE);
 
-    hash = malloc((md_len << 1) + 1);
+    job->result = DEFER;
+    store_update(store, &key, (store_update_func) hash_seen, job);
 
-    for (i = 0; i < md_len; i++)
-        sprintf(hash + (i << 1), "%02x", md_value[i]);
+    return job->result;
+}
 
-    printdbg("%s Computing payload ASCII representation\n",
-            H(args->pkt->conn->id));
+/*! hash_stream
+ \brief what mod_hash keeps of the stream of an intruder, in the state of
+ * its connection
+ *
+ * The stream is normalized and cut in chunks where its content says so:
+ * the chunks are the same however the intruder segments it, and each of
+ * them is looked up in the store. Only the digest of the chunk in progress
+ * is kept, with the digits and dots that end the last packet since they
+ * may be the start of an IP address, so the state doesn't grow with the
+ * stream.
+ */
+struct hash_stream {
+    const struct hash_params *params; // the module instance it belongs to
+    struct store *store;
+    uint32_t group;
+    uint32_t conn_id;
+    uint32_t data_packets;
+    gboolean tcp;
+    uint32_t next_seq; // TCP sequence number of the next byte of the stream
+    uint64_t gear; // rolling hash of the last 64 bytes
+    uint32_t chunk_len;
+    uint32_t chunks;
+    struct digest_ctx chunk; // digest of the chunk in progress
+    uint32_t held;
+    char run[STREAM_RUN_MAX];
+};
+
+/*! stream_chunk
+ \brief look up the chunk that just ended in the store, and start the next
+ */
+static mod_result_t stream_chunk(struct hash_stream *stream) {
+    struct hash_job job = {
+        .data = stream->chunk_len,
+        .data_packets = stream->data_packets,
+        .conn_id = stream->conn_id,
+        .result = DEFER
+    };
+    struct store_key key;
+    uint8_t digest[DIGEST_SIZE];
+
+    digest_final(&stream->chunk, digest);
+    digest_init(&stream->chunk, stream->params->digest);
+
+    store_key_bytes(&key, stream->group, digest, DIGEST_SIZE);
+    store_update(stream->store, &key, (store_update_func) hash_seen, &job);
+
+    stream->chunk_len = 0;
+    stream->chunks++;
+    return job.result;
+}
 
-    for (i = 0; i < ascii_len; i++) {
-        if (isprint(payload[i])) {
-            sprintf(&ascii[i], "%c", payload[i]);
-        } else {
-            sprintf(&ascii[i], ".");
+/*! stream_cut
+ \brief cut normalized bytes of the stream in chunks
+ *
+ * A chunk ends once it is chunk_min bytes long where the top bits of the
+ * gear hash are clear, or at chunk_max bytes.
+ *
+ \return ACCEPT if one of the chunks that ended is new, REJECT if they were
+ * all known, DEFER if none ended
+ */
+static mod_result_t stream_cut(struct hash_stream *stream, const uint8_t *p,
+        uint32_t len) {
+    const struct hash_params *params = stream->params;
+    const uint8_t *start = p, *end = p + len;
+    mod_result_t result = DEFER;
+
+    for (; p < end; p++) {
+        stream->gear = (stream->gear << 1) + gear[*p];
+
+        if (++stream->chunk_len < params->chunk_min
+                || ((stream->gear & params->chunk_mask)
+                        && stream->chunk_len < params->chunk_max)) {
+            continue;
+        }
+
+        digest_update(&stream->chunk, start, p + 1 - start);
+        start = p + 1;
+
+        mod_result_t chunk = stream_chunk(stream);
+        if (result != ACCEPT) {
+            result = chunk;
         }
     }
-    ascii[ascii_len] = '\0';
 
-    printdbg("%s ASCII of %d char [%s]\n", H(args->pkt->conn->id), ascii_len,
-            ascii);
-    printdbg("%s Searching for fingerprint in %p on port %s\n",
-            H(args->pkt->conn->id), backup, port);
+    digest_update(&stream->chunk, start, end - start);
+    return result;
+}
 
-    GError *error = NULL;
-    if (NULL
-            == (info = g_key_file_get_string_list(backup, port, hash, NULL,
-                    &error))) {
-        /*! Unknown hash, so we accept the packet */
-        result = ACCEPT;
-        printdbg("%s Hash not found because: %s\n", H(args->pkt->conn->id),
-                error->message);
-        printdbg("%s Packet accepted and new entry created\n",
-                H(args->pkt->conn->id));
-
-        info = malloc(6 * sizeof(char *));
-
-        info[HASH_COUNTER] = g_malloc0(20 * sizeof(char));
-        info[HASH_FIRST_SEEN] = g_malloc0(20 * sizeof(char));
-        info[HASH_DURATION] = g_malloc0(20 * sizeof(char));
-        info[HASH_PACKET] = g_malloc0(20 * sizeof(char));
-        info[HASH_BYTE] = g_malloc0(20 * sizeof(char));
-        info[HASH_ASCII] = g_malloc0(ascii_len * sizeof(char));
-
-        g_snprintf(info[HASH_COUNTER], 20, "1");
-        g_snprintf(info[HASH_FIRST_SEEN], 20, "%d", now);
-        g_snprintf(info[HASH_DURATION], 20, "0");
-        g_snprintf(info[HASH_PACKET], 20, "%d",
-                args->pkt->conn->count_data_pkt_from_intruder);
-        g_snprintf(info[HASH_BYTE], 20, "%d", args->pkt->data);
-        g_snprintf(info[HASH_ASCII], ascii_len, "%s", ascii);
+/*! stream_data
+ \brief normalize the next bytes of the stream and cut them in chunks
+ *
+ * An IP address is made of digits and dots only, so everything before the
+ * run of them that ends the data is normalized as it would be in the whole
+ * stream. The run waits for the next packet to tell where it ends, unless
+ * it is longer than STREAM_RUN_MAX.
+ */
+static mod_result_t stream_data(struct hash_stream *stream, const char *data,
+        uint32_t len) {
+    uint32_t total = stream->held + len, keep = 0, normalized_len;
+    char *buff = g_malloc(total);
+
+    memcpy(buff, stream->run, stream->held);
+    memcpy(buff + stream->held, data, len);
+
+    while (keep < total && keep < STREAM_RUN_MAX
+            && (g_ascii_isdigit(buff[total - keep - 1])
+                    || buff[total - keep - 1] == '.')) {
+        keep++;
+    }
+    if (keep == STREAM_RUN_MAX) {
+        keep = 0;
+    }
 
-    } else {
-        /*! We check if we need to expire this entry */
-        int age = atoi(info[HASH_DURATION]);
-        if (age > expiration) {
-            /*! Known hash but entry expired, so we accept the packet */
-            result = ACCEPT;
-            printdbg(
-                    "%s Hash found but expired... packet accepted and entry renewed\n",
-                    H(args->pkt->conn->id));
-
-            g_snprintf(info[HASH_COUNTER], 20, "1");
-            g_snprintf(info[HASH_FIRST_SEEN], 20, "%d", now);
-            g_snprintf(info[HASH_DURATION], 20, "0");
+    char *normalized = normalize_payload(buff, total - keep + 1,
+            &normalized_len);
 
-        } else {
-            /*! Known hash, so we reject the packet */
-            result = REJECT;
-            printdbg("%s Hash found... packet rejected and entry updated\n",
-                    H(args->pkt->conn->id));
+    memcpy(stream->run, buff + total - keep, keep);
+    stream->held = keep;
 
-            g_snprintf(info[HASH_COUNTER], 20, "%d",
-                    atoi(info[HASH_COUNTER]) + 1);
-            g_snprintf(info[HASH_DURATION], 20, "%d",
-                    now - atoi(info[HASH_DURATION]));
+    mod_result_t result = stream_cut(stream, (const uint8_t *) normalized,
+            normalized_len);
 
+    g_free(normalized);
+    g_free(buff);
+    return result;
+}
+
+/*! stream_tail
+ \brief digest of what follows the last chunk, as if the stream ended here
+ */
+static void stream_tail(const struct hash_stream *stream, uint8_t *digest) {
+    struct digest_ctx tail;
+    uint32_t len;
+    char *normalized = normalize_payload(stream->run, stream->held + 1, &len);
+
+    digest_copy(&tail, &stream->chunk);
+    digest_update(&tail, normalized, len);
+    digest_final(&tail, digest);
+    g_free(normalized);
+}
+
+/*! free_hash_stream
+ \brief remember how the stream ended, when its connection is done with it
+ *
+ * Where the tail of a stream is looked up depends on how it was segmented,
+ * so it is only recorded here, once.
+ */
+void free_hash_stream(struct hash_stream *stream) {
+    if (stream->chunk_len || stream->held) {
+        struct hash_job job = {
+            .data = stream->chunk_len + stream->held,
+            .data_packets = stream->data_packets,
+            .conn_id = stream->conn_id
+        };
+        struct store_key key;
+        uint8_t digest[DIGEST_SIZE];
+
+        stream_tail(stream, digest);
+        store_key_bytes(&key, stream->group, digest, DIGEST_SIZE);
+        store_update(stream->store, &key, (store_update_func) hash_seen, &job);
+    }
+
+    digest_free(&stream->chunk);
+    g_free(stream);
+}
+
+/*! fingerprint_stream
+ \brief fingerprint the stream the intruder sent so far rather than the
+ * packet
+ \return ACCEPT if a chunk that ended with the packet is new, REJECT if
+ * they were all known or if none ended but the stream would end like a
+ * known one, DEFER otherwise
+ */
+static mod_result_t fingerprint_stream(struct mod_args *args) {
+    const struct hash_params *params = args->node->param;
+    struct pkt_struct *pkt = args->pkt;
+    struct hash_stream **slot = (struct hash_stream **) module_conn_state(args);
+    struct hash_stream *stream = *slot;
+    const char *data = pkt->packet.payload;
+    uint32_t len = pkt->data;
+
+    /*! only what the intruder sends makes its stream */
+    if (pkt->origin != EXT) {
+        return DEFER;
+    }
+
+    if (!stream) {
+        stream = g_malloc0(sizeof(struct hash_stream));
+        stream->params = params;
+        stream->store = params->backup.store;
+        stream->group = hash_group(pkt_dest_port(pkt), params->digest, 1);
+        stream->conn_id = pkt->conn->id;
+        digest_init(&stream->chunk, params->digest);
+
+        if (pkt->packet.ip->protocol == IPPROTO_TCP) {
+            stream->tcp = TRUE;
+            stream->next_seq = ntohl(pkt->packet.tcp->seq);
         }
+        *slot = stream;
+    } else if (stream->params != params) {
+        printdbg("%s The stream is fingerprinted by another hash module\n",
+                H(pkt->conn->id));
+        return DEFER;
+    }
 
-        g_snprintf(info[HASH_PACKET], 20, "%d",
-                args->pkt->conn->count_data_pkt_from_intruder);
+    /*! retransmitted bytes are only part of the stream once, the bytes
+     * missing before an out of order segment are skipped */
+    if (stream->tcp) {
+        uint32_t seq = ntohl(pkt->packet.tcp->seq);
+        int32_t overlap = stream->next_seq - seq;
+
+        if (overlap > 0) {
+            if ((uint32_t) overlap >= len) {
+                printdbg("%s Retransmission, nothing new in the stream\n",
+                        H(pkt->conn->id));
+                return DEFER;
+            }
+            data += overlap;
+            len -= overlap;
+        }
+        stream->next_seq = seq + pkt->data;
+    }
+
+    stream->data_packets = pkt->conn->count_data_pkt_from_intruder;
+
+    gint64 start = profile_clock();
+    mod_result_t result = stream_data(stream, data, len);
+
+    if (result == DEFER) {
+        /*! no chunk ended, but the stream may stop here like a known one */
+        struct store_record record;
+        struct store_key key;
+        uint8_t digest[DIGEST_SIZE];
 
+        stream_tail(stream, digest);
+        store_key_bytes(&key, stream->group, digest, DIGEST_SIZE);
+        if (store_lookup(stream->store, &key, &record)
+                && record.duration <= HASH_EXPIRATION) {
+            result = REJECT;
+        }
     }
 
-    printdbg("%s Set string list...\n", H(args->pkt->conn->id));
-
-    g_key_file_set_string_list(backup, port, hash, (const gchar * const *) info,
-            6);
-
-    printdbg("%s ... done\n", H(args->pkt->conn->id));
-
-    /*! clean and exit */
-    g_free(payload);
-    //printerr("%s Free 1/5\n", H(args->pkt->conn->id));
-    g_free(ascii);
-    //printerr("%s Free 2/5\n", H(args->pkt->conn->id));
-    g_free(hash);
-    //printerr("%s Free 3/5\n", H(args->pkt->conn->id));
-    /*
-     printdbg("%s Free 4/5\n", H(args->pkt->conn->id));
-     g_free(key_dst[0]);
-     printdbg("%s Free 5/5\n", H(args->pkt->conn->id));
-     g_free(key_dst[1]);
-     printdbg("%s Free 6/5\n", H(args->pkt->conn->id));
-     g_free(key_dst);
-     printdbg("%s Free 7/5\n", H(args->pkt->conn->id));
-     */
-
-    free(port);
-    save_backup(backup, backup_file);
+    __sync_fetch_and_add(&hashed_bytes, len);
+    __sync_fetch_and_add(&hashed_nsec, profile_clock() - start);
+
+    printdbg("%s Stream of %u chunks and %u bytes, %s\n", H(pkt->conn->id),
+            stream->chunks, stream->chunk_len + stream->held,
+            lookup_result(result));
 
     return result;
 }
-#endif
+
+/*! mod_hash
+ \brief calculate a hash value of a packet payload, and look for a possible match in a database of hashes.
+ Parameters required:
+ function = hash;
+ backup	 = /etc/honeybrid/hash.tb
+ Optional:
+ digest   = sha1 (default, for the databases of previous versions) or xxh64
+ async    = 1 to fingerprint on the module workers while the connection is parked
+ stream   = 1 to fingerprint the stream of the intruder, see fingerprint_stream()
+ chunk    = average size of the chunks the stream is cut in (512)
+ \param[in] args, struct that contain the node and the datas to process
+ \param[in] user_data, not used
+ *
+ \param[out] set result to 0 if datas's fingerprint is found in search table, 1 if not
+ */
+mod_result_t mod_hash(struct mod_args *args) {
+    const struct hash_params *params = args->node->param;
+    mod_result_t result = DEFER;
+
+    /*! The conn was parked while we worked on its payload */
+    if (module_async_result(args, &result)) {
+        return result;
+    }
+
+    /*! First, we make sure that we have data to work on */
+    if (args->pkt->data == 0) {
+        printdbg("%s No data to work on\n", H(args->pkt->conn->id));
+        return result;
+    }
+
+    /*! the stream state belongs to the decision thread, it stays in place */
+    if (params->stream) {
+        return fingerprint_stream(args);
+    }
+
+    struct pkt_struct *pkt = args->pkt;
+    gboolean cached = pkt_has_feature(pkt, feature_digest(params->digest));
+
+    if (params->async && !cached) {
+        struct hash_job *job = g_malloc0(sizeof(struct hash_job));
+        job->params = params;
+        job->data = pkt->data;
+        job->data_packets = pkt->conn->count_data_pkt_from_intruder;
+        job->conn_id = pkt->conn->id;
+        job->port = pkt_dest_port(pkt);
+
+        /*! reuse what an earlier module of the rule derived, if any */
+        if (pkt_has_feature(pkt, FEATURE_NORMALIZED)) {
+            const char *payload = pkt_normalized_payload(pkt, &job->len);
+            job->payload = g_memdup(payload, job->len + 1);
+        } else {
+            job->raw = g_memdup(pkt->packet.payload, pkt->data);
+        }
+
+        return module_submit(args, (module_work) hash_work, job,
+                (GDestroyNotify) free_hash_job);
+    }
+
+    struct hash_job job = {
+        .params = params,
+        .digested = TRUE,
+        .data = pkt->data,
+        .port = pkt_dest_port(pkt),
+        .data_packets = pkt->conn->count_data_pkt_from_intruder,
+        .conn_id = pkt->conn->id
+    };
+
+    gint64 start = profile_clock();
+    const uint8_t *digest = pkt_digest(pkt, params->digest);
+    if (!digest) {
+        return DEFER;
+    }
+    if (!cached) {
+        __sync_fetch_and_add(&hashed_bytes, pkt->data);
+        __sync_fetch_and_add(&hashed_nsec, profile_clock() - start);
+    }
+
+    memcpy(job.digest, digest, DIGEST_SIZE);
+    job.payload = (char *) pkt_normalized_payload(pkt, &job.len);
+
+    return hash_work(&job, NULL);
+}
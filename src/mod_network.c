@@ -0,0 +1,181 @@
+/*
+ * This file is part of the honeybrid project.
+ *
+ * 2007-2009 University of Maryland (http://www.umd.edu)
+ * Robin Berthier <robinb@umd.edu>, Thomas Coquelin <coquelin@umd.edu>
+ * and Julien Vehent <julien@linuxwall.info>
+ *
+ * 2012-2014 University of Connecticut (http://www.uconn.edu)
+ * Tamas K Lengyel <tamas.k.lengyel@gmail.com>
+ *
+ * Honeybrid is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file mod_network.c
+ * \brief Network matching module for honeybrid Decision Engine
+ *
+ * Finds the longest prefix holding the source or destination address of
+ * the connection in a prefix map compiled by honeybrid-prefix-map, see
+ * prefix_map.c, and checks its label against the ones the module is
+ * configured with (ASN, country, customer...). A lookup costs at most two
+ * reads whatever the size of the map.
+ *
+ * Like the lists of mod_reputation, a map is mapped again when its file is
+ * replaced: the module switches with a single pointer store and the old
+ * mapping is unmapped once no decision thread can still be reading it.
+ *
+ */
+
+#include "modules.h"
+
+#include "mapped_file.h"
+#include "prefix_map.h"
+
+#define NETWORK_CHECK 5000 // ms between checks of the map files
+
+/*!
+ \def network_params
+ \brief labels are kept as hashes, the ids change from a map to the next
+ */
+struct network_params {
+	struct mapped_file *source;
+	gboolean destination;
+	mod_result_t listed;
+	mod_result_t unlisted;
+	uint32_t label_count;
+	uint64_t labels[];
+};
+
+static uint64_t network_count(gconstpointer mapping) {
+	return ((const struct prefix_map *) mapping)->header->prefixes;
+}
+
+static struct mapped_files network_files = {
+	.what = "prefix map",
+	.entries = "prefixes",
+	.interval = NETWORK_CHECK,
+	.open = (gpointer (*)(const char *)) prefix_map_open,
+	.close = (GDestroyNotify) prefix_map_close,
+	.count = network_count
+};
+
+status_t init_mod_network() {
+	mapped_files_start(&network_files);
+	return OK;
+}
+
+void close_mod_network() {
+	mapped_files_stop(&network_files);
+}
+
+/*! parse_mod_network
+ \brief map the prefix map of the module
+ Parameters:
+ file    = prefix map compiled by honeybrid-prefix-map (required)
+ labels  = comma separated labels to match, any label if not set
+ address = source (default) or destination
+ listed  = result when a prefix with one of the labels holds the address,
+ *         accept (default) or reject; the other addresses get the opposite
+ */
+status_t parse_mod_network(struct node *node) {
+	const gchar *file, *labels, *address, *listed;
+	gchar **names = NULL;
+	uint32_t count = 0;
+
+	if (NULL == (file = g_hash_table_lookup(node->config, "file"))) {
+		printdbg("%s mandatory argument 'file' undefined!\n", H(6));
+		return NOK;
+	}
+
+	if ((labels = g_hash_table_lookup(node->config, "labels"))) {
+		names = g_strsplit_set(labels, ", ", -1);
+	}
+
+	struct network_params *params = g_malloc0(
+			sizeof(struct network_params)
+					+ (names ? g_strv_length(names) : 0) * sizeof(uint64_t));
+	params->listed = ACCEPT;
+
+	gchar **name;
+	for (name = names; name && *name; name++) {
+		if (**name) {
+			params->labels[count++] = prefix_map_label_hash(*name);
+		}
+	}
+	params->label_count = count;
+	g_strfreev(names);
+
+	address = g_hash_table_lookup(node->config, "address");
+	if (address && !strcmp(address, "destination")) {
+		params->destination = TRUE;
+	} else if (address && strcmp(address, "source")) {
+		printdbg("%s unknown address '%s' (source/destination)!\n", H(6),
+				address);
+		goto fail;
+	}
+
+	listed = g_hash_table_lookup(node->config, "listed");
+	if (listed && !strcmp(listed, "reject")) {
+		params->listed = REJECT;
+	} else if (listed && strcmp(listed, "accept")) {
+		printdbg("%s unknown result '%s' (accept/reject)!\n", H(6), listed);
+		goto fail;
+	}
+	params->unlisted = params->listed == ACCEPT ? REJECT : ACCEPT;
+
+	if (NULL == (params->source = mapped_file_open(&network_files, file))) {
+		printdbg("%s can't map the prefix map %s!\n", H(6), file);
+		goto fail;
+	}
+
+	node->param = params;
+	return OK;
+
+	fail: g_free(params);
+	return NOK;
+}
+
+/*! mod_network
+ \brief check if the address of the connection is in one of the networks
+ * of the configured labels
+ \param[in] args, struct that contain the node and the data to process
+ *
+ \param[out] the 'listed' result if it is, the opposite otherwise
+ */
+mod_result_t mod_network(struct mod_args *args) {
+	const struct network_params *params = args->node->param;
+	const struct prefix_map *map = mapped_file_current(
+			params->source);
+	uint32_t ip = params->destination ?
+			args->pkt->packet.ip->daddr : args->pkt->packet.ip->saddr;
+
+	uint32_t label = prefix_map_lookup(map, ip);
+	if (!label) {
+		return params->unlisted;
+	}
+
+	uint32_t i;
+	gboolean match = !params->label_count;
+	for (i = 0; i < params->label_count && !match; i++) {
+		match = params->labels[i] == map->label_hashes[label];
+	}
+
+	if (match) {
+		printdbg("%s Address in a network of %s\n", H(args->pkt->conn->id),
+				prefix_map_label(map, label));
+		return params->listed;
+	}
+
+	return params->unlisted;
+}
@@ -37,6 +37,23 @@
  - "value", to define a basis for the probability to accept the packet, which is 1 out of value
  */
 
+/*! parse_mod_random
+ \brief parse the 'value' parameter
+ */
+status_t parse_mod_random(struct node *node) {
+    int value;
+
+    if (!module_param_int(node, "value", &value)) {
+        printdbg("%s mandatory argument 'value' undefined!\n", H(6));
+        return NOK;
+    }
+
+    uint32_t *param = g_malloc(sizeof(uint32_t));
+    *param = (uint32_t) value;
+    node->param = param;
+    return OK;
+}
+
 /*! mod_random
  \param[in] args, struct that contain the node and the data to process
  */
@@ -45,18 +62,10 @@ mod_result_t mod_random(struct mod_args *args) {
 
     unsigned int proba;
     uint32_t selector = 1;
-    const uint32_t *value;
+    const uint32_t *value = args->node->param;
+    GRand *rand = module_thread_context(args);
     mod_result_t result = DEFER;
 
-    /*! getting the value provided as parameter */
-    if ((value = (const uint32_t *) g_hash_table_lookup(args->node->config,
-            "value")) == NULL) {
-        /*! We can't decide */
-        printdbg(
-                "%s Incorrect value parameter: %d\n", H(args->pkt->conn->id), *value);
-        return result;
-    }
-
     if (*value < selector) {
         /*! We can't decide */
         result = REJECT;
@@ -66,7 +75,7 @@ mod_result_t mod_random(struct mod_args *args) {
     }
 
     /*! deciding based on a probability of 1 out of "value": */
-    proba = (int) (((double) *value) * (rand() / (RAND_MAX + 1.0)));
+    proba = g_rand_int_range(rand, 0, *value);
 
     if (proba == selector) {
         /*! We accept this packet */
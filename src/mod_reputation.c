@@ -0,0 +1,136 @@
+/*
+ * This file is part of the honeybrid project.
+ *
+ * 2007-2009 University of Maryland (http://www.umd.edu)
+ * Robin Berthier <robinb@umd.edu>, Thomas Coquelin <coquelin@umd.edu>
+ * and Julien Vehent <julien@linuxwall.info>
+ *
+ * 2012-2014 University of Connecticut (http://www.uconn.edu)
+ * Tamas K Lengyel <tamas.k.lengyel@gmail.com>
+ *
+ * Honeybrid is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file mod_reputation.c
+ * \brief IP reputation module for honeybrid Decision Engine
+ *
+ * Looks the source or destination address of the connection up in a list
+ * compiled by honeybrid-reputation, see reputation.c. The list is mapped,
+ * not loaded, and is mapped again when its file is replaced: the module
+ * switches to the new mapping with a single pointer store and the old one
+ * is unmapped once no decision thread can still be reading it.
+ *
+ */
+
+#include "modules.h"
+
+#include "mapped_file.h"
+#include "reputation.h"
+
+#define REPUTATION_CHECK 5000 // ms between checks of the list files
+
+struct reputation_params {
+	struct mapped_file *source;
+	gboolean destination;
+	mod_result_t listed;
+	mod_result_t unlisted;
+};
+
+static uint64_t reputation_count(gconstpointer mapping) {
+	return ((const struct reputation *) mapping)->header->count;
+}
+
+static struct mapped_files reputation_files = {
+	.what = "list",
+	.entries = "addresses",
+	.interval = REPUTATION_CHECK,
+	.open = (gpointer (*)(const char *)) reputation_open,
+	.close = (GDestroyNotify) reputation_close,
+	.count = reputation_count
+};
+
+status_t init_mod_reputation() {
+	mapped_files_start(&reputation_files);
+	return OK;
+}
+
+void close_mod_reputation() {
+	mapped_files_stop(&reputation_files);
+}
+
+/*! parse_mod_reputation
+ \brief map the list of the module
+ Parameters:
+ file    = list compiled by honeybrid-reputation (required)
+ address = source (default) or destination
+ listed  = result for the listed addresses, accept (default) or reject;
+ *         the others get the opposite
+ */
+status_t parse_mod_reputation(struct node *node) {
+	struct reputation_params params = { .listed = ACCEPT };
+	const gchar *file, *address, *listed;
+
+	if (NULL == (file = g_hash_table_lookup(node->config, "file"))) {
+		printdbg("%s mandatory argument 'file' undefined!\n", H(6));
+		return NOK;
+	}
+
+	address = g_hash_table_lookup(node->config, "address");
+	if (address && !strcmp(address, "destination")) {
+		params.destination = TRUE;
+	} else if (address && strcmp(address, "source")) {
+		printdbg("%s unknown address '%s' (source/destination)!\n", H(6),
+				address);
+		return NOK;
+	}
+
+	listed = g_hash_table_lookup(node->config, "listed");
+	if (listed && !strcmp(listed, "reject")) {
+		params.listed = REJECT;
+	} else if (listed && strcmp(listed, "accept")) {
+		printdbg("%s unknown result '%s' (accept/reject)!\n", H(6), listed);
+		return NOK;
+	}
+	params.unlisted = params.listed == ACCEPT ? REJECT : ACCEPT;
+
+	if (NULL == (params.source = mapped_file_open(&reputation_files, file))) {
+		printdbg("%s can't map the list %s!\n", H(6), file);
+		return NOK;
+	}
+
+	node->param = g_memdup(&params, sizeof(struct reputation_params));
+	return OK;
+}
+
+/*! mod_reputation
+ \brief check if the address of the connection is listed
+ \param[in] args, struct that contain the node and the data to process
+ *
+ \param[out] the 'listed' result if it is, the opposite otherwise
+ */
+mod_result_t mod_reputation(struct mod_args *args) {
+	const struct reputation_params *params = args->node->param;
+	const struct reputation *reputation = mapped_file_current(
+			params->source);
+	uint32_t ip = params->destination ?
+			args->pkt->packet.ip->daddr : args->pkt->packet.ip->saddr;
+
+	if (reputation_contains(reputation, ip)) {
+		printdbg("%s Address listed in %s\n", H(args->pkt->conn->id),
+				params->source->file);
+		return params->listed;
+	}
+
+	return params->unlisted;
+}
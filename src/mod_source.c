@@ -32,6 +32,66 @@
 
 #include "modules.h"
 
+/*! parse_mod_source
+ \brief get the backup the module keeps the seen sources in
+ */
+status_t parse_mod_source(struct node *node) {
+    struct module_backup *backup = g_malloc(sizeof(struct module_backup));
+
+    if (module_param_backup(node, backup) != OK) {
+        g_free(backup);
+        return NOK;
+    }
+
+    node->param = backup;
+    return OK;
+}
+
+/*! source_seen
+ \brief what mod_source does with the record of the source, under its lock
+ */
+struct source_seen {
+    uint32_t conn_id;
+    gint now;
+    int expiration;
+    mod_result_t result;
+};
+
+static void source_seen(struct store_record *record, gboolean created,
+        struct source_seen *seen) {
+
+    if (created) {
+        /*! Unknown IP, so we accept the packet */
+        seen->result = ACCEPT;
+        printdbg("%s IP not found... packet accepted and new entry created\n",
+                H(seen->conn_id));
+
+        record->counter = 1;
+        record->first_seen = seen->now;
+        record->duration = 0;
+
+    } else if (record->duration > seen->expiration) {
+        /*! Known IP but entry expired, so we accept the packet */
+        seen->result = ACCEPT;
+        printdbg(
+                "%s IP found but expired... packet accepted and entry renewed\n",
+                H(seen->conn_id));
+
+        record->counter = 1;
+        record->first_seen = seen->now;
+        record->duration = 0;
+
+    } else {
+        /*! Known IP, so we reject the packet */
+        seen->result = REJECT;
+        printdbg("%s IP found... packet rejected and entry updated\n",
+                H(seen->conn_id));
+
+        record->counter++;
+        record->duration = seen->now - record->first_seen;
+    }
+}
+
 /*! mod_source
  \brief check if the source IP has already been seen in a prior connection
  Parameters required:
@@ -45,94 +105,28 @@
 mod_result_t mod_source(struct mod_args *args) {
     printdbg("%s Module called\n", H(args->pkt->conn->id));
 
-    mod_result_t result = DEFER;
-    int expiration = 24 * 3600;
-    gchar *backup_file;
-    char *key_src;
-    gchar **info;
-    GKeyFile *backup;
+    const struct module_backup *params = args->node->param;
+    struct store_key key;
+    struct source_seen seen = {
+        .conn_id = args->pkt->conn->id,
+        .expiration = 24 * 3600,
+        .result = DEFER
+    };
 
     GTimeVal t;
     g_get_current_time(&t);
-    gint now = (t.tv_sec);
-
-    /*! get the IP address from the packet */
-    key_src = g_malloc0(snprintf(NULL, 0, "%u", args->pkt->packet.ip->saddr) + 1);
-    sprintf(key_src, "%u", args->pkt->packet.ip->saddr);
-
-    printdbg("%s source IP is %s\n", H(args->pkt->conn->id), key_src);
-
-    /*! get the backup file for this module */
-    if (NULL
-            == (backup = (GKeyFile *) g_hash_table_lookup(args->node->config,
-                    "backup"))) {
-        /*! We can't decide */
-        printdbg("%s mandatory argument 'backup' undefined!\n",
-                H(args->pkt->conn->id));
-        return result;
-    }
-    /*! get the backup file path for this module */
-    if (NULL
-            == (backup_file = (gchar *) g_hash_table_lookup(args->node->config,
-                    "backup_file"))) {
-        /*! We can't decide */
-        printdbg("%s error, backup file path missing\n",
-                H(args->pkt->conn->id));
-        return result;
-    }
+    seen.now = (t.tv_sec);
+
+    printdbg("%s source IP is %s\n", H(args->pkt->conn->id),
+            pkt_source_ip(args->pkt));
 
     printdbg("%s searching for this IP in the database...\n",
             H(args->pkt->conn->id));
 
-    if (NULL == (info = g_key_file_get_string_list(backup, "source", /* generic group name \todo: group by port number? */
-    key_src, NULL, NULL))) {
-        /*! Unknown IP, so we accept the packet */
-        result = ACCEPT;
-        printdbg("%s IP not found... packet accepted and new entry created\n",
-                H(args->pkt->conn->id));
-
-        info = malloc(3 * sizeof(char *));
-
-        /*! 20 characters should be enough to hold even very large numbers */
-        info[0] = malloc(20 * sizeof(gchar));
-        info[1] = malloc(20 * sizeof(gchar));
-        info[2] = malloc(20 * sizeof(gchar));
-        g_snprintf(info[0], 20, "1"); /*! counter */
-        g_snprintf(info[1], 20, "%d", now); /*! first seen */
-        g_snprintf(info[2], 20, "0"); /*! duration */
-
-    } else {
-        /*! We check if we need to expire this entry */
-        int age = atoi(info[2]);
-        if (age > expiration) {
-            /*! Known IP but entry expired, so we accept the packet */
-            result = ACCEPT;
-            printdbg(
-                    "%s IP found but expired... packet accepted and entry renewed\n",
-                    H(args->pkt->conn->id));
-
-            g_snprintf(info[0], 20, "1"); /*! counter */
-            g_snprintf(info[1], 20, "%d", now); /*! first seen */
-            g_snprintf(info[2], 20, "0"); /*! duration */
-        } else {
-            /*! Known IP, so we reject the packet */
-            result = REJECT;
-            printdbg("%s IP found... packet rejected and entry updated\n",
-                    H(args->pkt->conn->id));
-
-            g_snprintf(info[0], 20, "%d", atoi(info[0]) + 1); /*! counter */
-            g_snprintf(info[2], 20, "%d", now - atoi(info[1])); /*! duration */
-        }
-
-    }
-
-    g_key_file_set_string_list(backup, "source", key_src,
-            (const gchar * const *) info, 3);
+    /* generic group \todo: group by port number? */
+    store_key_ip(&key, 0, args->pkt->packet.ip->saddr);
+    store_update(params->store, &key, (store_update_func) source_seen, &seen);
 
-    save_backup(backup, backup_file);
 
-    /*! clean and exit */
-    free(key_src);
-    return result;
+    return seen.result;
 }
-
@@ -24,144 +24,139 @@
 
 #include "modules.h"
 
-/*! mod_source
- \brief check if the source IP has already been seen in a prior connection
- Parameters required:
- function = hash;
- backup   = /etc/honeybrid/source.tb
- \param[in] args, struct that contain the node and the data to process
- \param[in] user_data, not used
- *
- \param[out] set result to 0 if attacker ip is found in search table, 1 if not
+struct source_time_params {
+    struct module_backup backup;
+    int expiration;
+    int deny_after;
+    int allow_after;
+};
+
+/*! parse_mod_source_time
+ \brief parse the time-frame parameters, with their defaults
  */
-mod_result_t mod_source_time(struct mod_args *args) {
-    printdbg("%s Module called\n", H(args->pkt->conn->id));
-
-    mod_result_t result = DEFER;
-    int expiration = 24 * 3600; /* a day */
-    int deny_after = 1200; /* 20 minutes */
-    int allow_after = 0; /* accept after this many seconds elapsed since first seeing src */
-    gchar *backup_file, *exp, *timef, *timea;
-    char *key_src;
-    gchar **info;
-    GKeyFile *backup;
+status_t parse_mod_source_time(struct node *node) {
+    struct source_time_params *params = g_malloc(
+            sizeof(struct source_time_params));
 
-    GTimeVal t;
-    g_get_current_time(&t);
-    gint now = (t.tv_sec);
-
-    /*! get the IP address from the packet */
-    key_src =  g_malloc0(snprintf(NULL, 0, "%u", args->pkt->packet.ip->saddr)+1);
-    sprintf(key_src, "%u", args->pkt->packet.ip->saddr);
-
-    printdbg("%s source IP is %s\n", H(args->pkt->conn->id), key_src);
-
-    /*! get the backup file for this module */
-    if (NULL
-            == (backup = (GKeyFile *) g_hash_table_lookup(args->node->config,
-                    "backup"))) {
-        /*! We can't decide */
-        printdbg("%s mandatory argument 'backup' undefined!\n",
-                H(args->pkt->conn->id));
-        return result;
-    }
-    /*! get the backup file path for this module */
-    if (NULL
-            == (backup_file = (gchar *) g_hash_table_lookup(args->node->config,
-                    "backup_file"))) {
-        /*! We can't decide */
-        printdbg("%s error, backup file path missing\n",
-                H(args->pkt->conn->id));
-        return result;
+    if (module_param_backup(node, &params->backup) != OK) {
+        g_free(params);
+        return NOK;
     }
 
-    if ((exp = (char *) g_hash_table_lookup(args->node->config, "expiration"))
-            != NULL) {
-        expiration = atoi(exp);
+    params->expiration = 24 * 3600; /* a day */
+    params->deny_after = 1200; /* 20 minutes */
+    params->allow_after = 0; /* accept after this many seconds elapsed since first seeing src */
+    module_param_int(node, "expiration", &params->expiration);
+    module_param_int(node, "deny_after", &params->deny_after);
+    module_param_int(node, "allow_after", &params->allow_after);
+
+    if (params->allow_after >= params->deny_after) {
+        printdbg("%s Misconfiguration: allow_after is greater then deny_after!\n",
+                H(6));
+        g_free(params);
+        return NOK;
     }
 
-    if ((timef = (char *) g_hash_table_lookup(args->node->config, "deny_after"))
-            != NULL) {
-        deny_after = atoi(timef);
-    }
+    node->param = params;
+    return OK;
+}
 
-    if ((timea = (char *) g_hash_table_lookup(args->node->config, "allow_after"))
-            != NULL) {
-        allow_after = atoi(timea);
-    }
+/*! source_time_seen
+ \brief what mod_source_time does with the record of the source, under its lock
+ */
+struct source_time_seen {
+    const struct source_time_params *params;
+    uint32_t conn_id;
+    gint now;
+    gint first_seen;
+    mod_result_t result;
+};
+
+static void source_time_seen(struct store_record *record, gboolean created,
+        struct source_time_seen *seen) {
+    const struct source_time_params *params = seen->params;
+    gint now = seen->now;
+
+    if (created || record->duration > params->expiration) {
+        /*! Unknown IP, or known but the entry expired */
+        printdbg("%s IP %s... new entry created\n", H(seen->conn_id),
+                created ? "not found" : "found but expired");
+
+        record->counter = 1;
+        record->first_seen = now;
+        record->duration = 0;
+
+        if (params->allow_after == 0)
+            seen->result = ACCEPT;
+        else
+            seen->result = REJECT;
 
-    if (allow_after >= deny_after) {
-        printdbg(
-                "%s Misconfiguration: allow_after is greater then deny_after!\n",
-                H(args->pkt->conn->id));
-        return result;
+    } else {
+        /*! Known IP, check time allowed */
+        if (record->first_seen + params->deny_after >= now
+                && record->first_seen + params->allow_after <= now) {
+            printdbg("%s IP found within allowed time-frame\n",
+                    H(seen->conn_id));
+            seen->result = ACCEPT;
+        } else {
+            seen->result = REJECT;
+            printdbg("%s IP found not withing allowed time-frame\n",
+                    H(seen->conn_id));
+        }
+
+        record->counter++;
+        record->duration = now - record->first_seen;
     }
 
-    printdbg("%s searching for this IP in the database...\n",
-            H(args->pkt->conn->id));
+    seen->first_seen = record->first_seen;
+}
 
-    if (NULL == (info = g_key_file_get_string_list(backup, "source", /* generic group name \todo: group by port number? */
-    key_src, NULL, NULL))) {
-        /*! Unknown IP */
-        printdbg("%s IP not found... new entry created\n",
-                H(args->pkt->conn->id));
+/*! mod_source_time
+ \brief accept a source IP only within a time-frame after it was first seen
+ Parameters required:
+ function = source_time;
+ backup   = /etc/honeybrid/source.tb
+ Optional:
+ expiration, allow_after, deny_after in seconds
+ \param[in] args, struct that contain the node and the data to process
+ *
+ \param[out] ACCEPT within the time-frame, REJECT otherwise
+ */
+mod_result_t mod_source_time(struct mod_args *args) {
+    printdbg("%s Module called\n", H(args->pkt->conn->id));
 
-        info = malloc(3 * sizeof(char *));
+    const struct source_time_params *params = args->node->param;
+    struct store_key key;
+    struct source_time_seen seen = {
+        .params = params,
+        .conn_id = args->pkt->conn->id,
+        .result = DEFER
+    };
 
-        /*! 20 characters should be enough to hold even very large numbers */
-        info[0] = malloc(20 * sizeof(gchar));
-        info[1] = malloc(20 * sizeof(gchar));
-        info[2] = malloc(20 * sizeof(gchar));
-        g_snprintf(info[0], 20, "1"); /*! counter */
-        g_snprintf(info[1], 20, "%d", now); /*! first seen */
-        g_snprintf(info[2], 20, "0"); /*! duration */
+    GTimeVal t;
+    g_get_current_time(&t);
+    gint now = seen.now = (t.tv_sec);
 
-        if (allow_after == 0)
-            result = ACCEPT;
-        else
-            result = REJECT;
+    printdbg("%s source IP is %s\n", H(args->pkt->conn->id),
+            pkt_source_ip(args->pkt));
 
-    } else {
-        /*! We check if we need to expire this entry */
-        int age = atoi(info[2]);
-        if (age > expiration) {
-            /*! Known IP but entry expired */
-            printdbg("%s IP found but expired... entry renewed\n",
-                    H(args->pkt->conn->id));
-
-            g_snprintf(info[0], 20, "1"); /*! counter */
-            g_snprintf(info[1], 20, "%d", now); /*! first seen */
-            g_snprintf(info[2], 20, "0"); /*! duration */
-
-            if (allow_after == 0)
-                result = ACCEPT;
-            else
-                result = REJECT;
+    printdbg("%s searching for this IP in the database...\n",
+            H(args->pkt->conn->id));
 
-        } else {
-            /*! Known IP, check time allowed */
-            if (atoi(info[1]) + deny_after >= now
-                    && atoi(info[1]) + allow_after <= now) {
-                printdbg("%s IP found within allowed time-frame\n",
-                        H(args->pkt->conn->id));
-                result = ACCEPT;
-            } else {
-                result = REJECT;
-                printdbg("%s IP found not withing allowed time-frame\n",
-                        H(args->pkt->conn->id));
-            }
-
-            g_snprintf(info[0], 20, "%d", atoi(info[0]) + 1); /*! counter */
-            g_snprintf(info[2], 20, "%d", now - atoi(info[1])); /*! duration */
-        }
+    /* generic group \todo: group by port number? */
+    store_key_ip(&key, 0, args->pkt->packet.ip->saddr);
+    store_update(params->backup.store, &key,
+            (store_update_func) source_time_seen, &seen);
+
+    /*! the answer changes when the source enters or leaves its time-frame */
+    gint first_seen = seen.first_seen;
+    gint change = first_seen + params->allow_after > now ?
+            first_seen + params->allow_after : first_seen + params->deny_after + 1;
+    if (change > now) {
+        args->wake_time = g_get_monotonic_time()
+                + (gint64) (change - now) * G_TIME_SPAN_SECOND;
     }
 
-    g_key_file_set_string_list(backup, "source", key_src,
-            (const gchar * const *) info, 3);
 
-    save_backup(backup, backup_file);
-
-    free(key_src);
-    return result;
+    return seen.result;
 }
-
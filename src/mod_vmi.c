@@ -26,8 +26,9 @@
 
 #ifndef HAVE_XMLRPC
 
-int init_mod_vmi() {}
+status_t init_mod_vmi() { return OK; }
 void close_mod_vmi() {}
+status_t parse_mod_vmi(struct node *node) { return OK; }
 mod_result_t mod_vmi(struct mod_args *args) {
     return DEFER;
 }
@@ -36,8 +37,17 @@ mod_result_t mod_vmi(struct mod_args *args) {
 
 #include <errno.h>
 
+#include "management.h"
+#include "balancer.h"
+
 #define MAX_LIFE        600
 #define IDLE_TIMEOUT    60
+#define POOL_SIZE       4
+#define SERVICE_TICK    100 /* ms */
+#define SERVICE_POLL    10 /* ms */
+#define RELEASE_WAIT    100 /* ms given to the release requests on close */
+#define REFILL_BACKOFF  1000 /* ms before refilling a pool after a failure, doubled with each one */
+#define REFILL_BACKOFF_MAX 60000 /* ms */
 #define VLAN_TRUNK_INTERFACE "honeynet"
 
 #define check_lan_comm(ip, dst, netmask) \
@@ -57,132 +67,494 @@ dieIfFaultOccurred (xmlrpc_env * const envP) {
     }
 }
 
+/*!
+ \def vmi_vm
+ \brief a HIH clone, waiting in the pool or assigned to an attacker
+ *
+ * Clones in a pool are already backends of its target, but out of its
+ * balancer until they are picked. last_seen and close are updated by
+ * mod_vmi_control and read by the timer of the VM, both under vmi_lock.
+ * Once close is set the VM waits in vmi_closing for the service to shut it
+ * down. target is NULL once the target was withdrawn, its handler then
+ * belongs to nobody, or to the target being freed if it was a backend.
+ */
 struct vmi_vm {
 	ip_addr_t key_ext;
 	uint32_t logID;
 	uint64_t backendID;
 	char *name;
-	GTimer *start;
 
 	struct handler *handler;
 	struct target *target;
 
-	gboolean signal;
-	GCond timeout;
-	GMutex lock;
-
-	// To manipulate connections associated
-	// we need to keys
-	GSList *conn_keys;
-
+	gint64 started;
+	gint64 last_seen;
 	gboolean close;
+	guint timer;
+};
+
+/*!
+ \def vmi_stats
+ \brief how fast attackers got a clone, printed when the module closes
+ */
+struct vmi_stats {
+	uint64_t picks;
+	uint64_t misses;
+	uint64_t pick_usec;
+	uint64_t clones;
+	uint64_t clone_failures;
+	uint64_t clone_usec;
+	uint64_t expired;
 };
 
-static GString *vmi_server;
+static char *vmi_server;
+static xmlrpc_client *vmi_client;
 static gboolean initialized;
 static GMutex vmi_lock;
-static GTree *vmi_vms_ext;
-static GTree *vmi_vms_int;
+static GHashTable *vmi_vms_ext;
+static GHashTable *vmi_vms_int;
 static GMutex banned_lock;
 static GTree *bannedIPs;
 
-void* vm_timer(void* data) {
-	struct vmi_vm *vm = (struct vmi_vm*) data;
-	if (!vm)
+/*!
+ \def vmi_pool
+ \brief the clones ready to be picked for the attackers of a target
+ *
+ \param target, NULL once the target was withdrawn, the pool is then freed
+ * with its last pending request
+ \param pending, clones requested for the pool and not created yet
+ \param failures, clone requests that failed in a row
+ \param retry, when the pool is refilled again after a failure
+ */
+struct vmi_pool {
+	struct target *target;
+	GQueue ready;
+	uint32_t pending;
+	uint32_t failures;
+	gint64 retry;
+};
+
+/*!
+ \def vmi_request
+ \brief a clone requested for a pool
+ */
+struct vmi_request {
+	struct vmi_pool *pool;
+	gint64 sent;
+};
+
+/*! The pools of the targets mod_vmi picked for, by target (protected by vmi_lock) */
+static GHashTable *vmi_pools;
+static uint32_t vmi_pool_size;
+static struct vmi_stats vmi_stats;
+
+/*! Set to abort the XML-RPC calls in progress on close */
+static int vmi_interrupt;
+
+/*! The service makes all the XML-RPC calls and changes the backends: it
+ * refills the pools and shuts down the VMs in vmi_closing (protected by
+ * vmi_lock). vmi_service_lock is held while it runs, and by
+ * vmi_target_withdrawn. */
+static guint vmi_service;
+static GMutex vmi_service_lock;
+static GQueue vmi_closing;
+
+static void free_vmi_vm(struct vmi_vm *vm) {
+	if (vm) {
+		g_free(vm->name);
+		g_free(vm);
+	}
+}
+
+/*! close_vm
+ \brief hand the VM over to the service, with vmi_lock held
+ */
+static void close_vm(struct vmi_vm *vm) {
+	if (!vm->close) {
+		vm->close = TRUE;
+		g_queue_push_tail(&vmi_closing, vm);
+	}
+}
+
+/*! forget_vm
+ \brief take the VM out of the tables, with vmi_lock held
+ *
+ * A VM of a withdrawn target may have been replaced in them already.
+ */
+static void forget_vm(struct vmi_vm *vm) {
+	if (vm->handler && g_hash_table_lookup(vmi_vms_int, vm->handler) == vm) {
+		g_hash_table_remove(vmi_vms_int, vm->handler);
+	}
+	if (g_hash_table_lookup(vmi_vms_ext, &vm->key_ext) == vm) {
+		g_hash_table_remove(vmi_vms_ext, &vm->key_ext);
+	}
+}
+
+/*! refill_failed
+ \brief hold the refills of the pool back, with vmi_lock held
+ *
+ * The delay doubles with each failure in a row, so an overloaded or
+ * unreachable VMI-Honeymon isn't sent a request every tick.
+ */
+static void refill_failed(struct vmi_pool *pool) {
+	guint backoff = REFILL_BACKOFF_MAX;
+
+	if (pool->failures < 16) {
+		backoff = MIN(REFILL_BACKOFF << pool->failures, REFILL_BACKOFF_MAX);
+	}
+	pool->failures++;
+	pool->retry = g_get_monotonic_time()
+			+ (gint64) backoff * G_TIME_SPAN_MILLISECOND;
+}
+
+/*! parse_clone
+ \brief build the backend of a clone from the "name,ip,mac,vlan,logID"
+ * reply of VMI-Honeymon
+ */
+static struct vmi_vm *parse_clone(const char *reply) {
+	struct vmi_vm *vm = NULL;
+	gchar **fields = g_strsplit(reply, ",", 6);
+
+	if (g_strv_length(fields) != 5) {
+		printdbg("%s Malformed clone '%s'\n", H(22), reply);
+		goto done;
+	}
+
+	struct handler *handler = g_malloc0(sizeof(struct handler));
+	handler->ip = g_malloc0(sizeof(struct addr));
+	handler->mac = g_malloc0(sizeof(struct addr));
+	handler->netmask = g_malloc0(sizeof(struct addr));
+	addr_pton("255.255.255.0", handler->netmask);
+
+	if (addr_pton(fields[1], handler->ip) < 0
+			|| addr_pton(fields[2], handler->mac) < 0) {
+		printdbg("%s Malformed clone address in '%s'\n", H(22), reply);
+		free_handler(handler);
 		goto done;
+	}
+
+	handler->ip_str = g_strdup(addr_ntoa(handler->ip));
+	handler->iface = g_hash_table_lookup(links, VLAN_TRUNK_INTERFACE);
+	handler->vlan.i = htons(atoi(fields[3]) & ((1 << 12) - 1));
+	handler->exclusive = 1;
+
+	vm = g_malloc0(sizeof(struct vmi_vm));
+	vm->name = g_strdup(fields[0]);
+	vm->logID = atoi(fields[4]);
+	vm->handler = handler;
+
+	done: g_strfreev(fields);
+	return vm;
+}
 
-	gint64 sleep_cycle;
-	// Wait for timeout or signal
-	g_mutex_lock(&vm->lock);
-	rewind: sleep_cycle =
-			g_get_monotonic_time() + IDLE_TIMEOUT * G_TIME_SPAN_SECOND;
-	while (!vm->close) {
-		if (!g_cond_wait_until(&vm->timeout, &vm->lock, sleep_cycle)) {
-			printdbg(
-					"%s VM timer expired on %s. Sending close signal and shutting down HIH\n", H(1), vm->name);
-			break;
+/*! clone_ready
+ \brief response handler of request_clone, runs in the service thread
+ *
+ * The clone is made a backend of the target of its pool here, so that
+ * picking it costs the decision thread no more than taking it off the pool.
+ */
+static void clone_ready(const char *server_url, const char *method,
+		xmlrpc_value *params, void *data, xmlrpc_env * const fault,
+		xmlrpc_value *result) {
+
+	struct vmi_request *request = data;
+	struct vmi_pool *pool = request->pool;
+	struct vmi_vm *vm = NULL;
+
+	if (!fault->fault_occurred) {
+		const char *reply = NULL;
+		xmlrpc_env read_env;
+		xmlrpc_env_init(&read_env);
+		xmlrpc_read_string(&read_env, result, &reply);
+		if (!read_env.fault_occurred) {
+			vm = parse_clone(reply);
+			free((char *) reply);
+		}
+		xmlrpc_env_clean(&read_env);
+	} else {
+		printdbg("%s VMI-Honeymon refused a clone: %s (%d)\n", H(22),
+				fault->fault_string, fault->fault_code);
+	}
+
+	/* The service isn't holding vmi_lock, but the target of the pool can't
+	 * be withdrawn while it runs */
+	if (vm && pool->target) {
+		/* no connection is balanced to it before it's picked */
+		if (add_back_handler(pool->target, vm->handler, FALSE) == OK) {
+			vm->target = pool->target;
+			vm->backendID = vm->handler->ID;
 		} else {
-			if (vm->signal) {
-				vm->signal = FALSE;
+			free_handler(vm->handler);
+			free_vmi_vm(vm);
+			vm = NULL;
+		}
+	}
 
-				//event, restart the timer
-				if (!vm->close)
-					goto rewind;
-			}
+	g_mutex_lock(&vmi_lock);
+	if (vm && !vm->target) {
+		/* too late for its target, the service releases it */
+		free_handler(vm->handler);
+		vm->handler = NULL;
+		close_vm(vm);
+	} else if (vm) {
+		vmi_stats.clones++;
+		vmi_stats.clone_usec += g_get_monotonic_time() - request->sent;
+		pool->failures = 0;
+		g_queue_push_tail(&pool->ready, vm);
+	} else {
+		vmi_stats.clone_failures++;
+		refill_failed(pool);
+	}
+	pool->pending--;
+	if (!pool->target && !pool->pending) {
+		g_free(pool);
+	}
+	g_mutex_unlock(&vmi_lock);
+
+	g_free(request);
+}
+
+static void clone_released(const char *server_url, const char *method,
+		xmlrpc_value *params, void *data, xmlrpc_env * const fault,
+		xmlrpc_value *result) {
+	if (fault->fault_occurred) {
+		printdbg("%s VMI-Honeymon failed to release clone: %s (%d)\n", H(22),
+				fault->fault_string, fault->fault_code);
+	}
+}
+
+static void request_clone(struct vmi_pool *pool) {
+	struct vmi_request *request = g_malloc(sizeof(struct vmi_request));
+	request->pool = pool;
+	request->sent = g_get_monotonic_time();
+
+	xmlrpc_client_start_rpcf(&env, vmi_client, vmi_server, "request_clone",
+			clone_ready, request, "()");
+
+	if (env.fault_occurred) {
+		printdbg("%s Failed to request a clone: %s (%d)\n", H(22),
+				env.fault_string, env.fault_code);
+		xmlrpc_env_clean(&env);
+		xmlrpc_env_init(&env);
+		g_free(request);
+
+		g_mutex_lock(&vmi_lock);
+		pool->pending--;
+		vmi_stats.clone_failures++;
+		refill_failed(pool);
+		g_mutex_unlock(&vmi_lock);
+	}
+}
+
+static void release_clone(struct vmi_vm *vm) {
+	xmlrpc_client_start_rpcf(&env, vmi_client, vmi_server, "release_clone",
+			clone_released, NULL, "(si)", vm->name, (xmlrpc_int32) vm->logID);
+
+	if (env.fault_occurred) {
+		printdbg("%s Failed to release clone %s: %s (%d)\n", H(22), vm->name,
+				env.fault_string, env.fault_code);
+		xmlrpc_env_clean(&env);
+		xmlrpc_env_init(&env);
+	}
+}
+
+/*! vm_timer
+ \brief one-shot timer of a VM, due when it reaches its idle timeout or its
+ * max life
+ *
+ * The activity seen by mod_vmi_control only moves last_seen, the timer
+ * arms itself again for the new deadline when it finds the VM still alive.
+ */
+static void vm_timer(struct vmi_vm *vm) {
+	g_mutex_lock(&vmi_lock);
+	if (!vm->close) {
+		gint64 now = g_get_monotonic_time();
+		gint64 deadline = MIN(vm->started + MAX_LIFE * G_TIME_SPAN_SECOND,
+				vm->last_seen + IDLE_TIMEOUT * G_TIME_SPAN_SECOND);
+
+		if (now >= deadline) {
+			printdbg("%s VM timer expired on %s. Shutting down HIH\n", H(22),
+					vm->name);
+			vmi_stats.expired++;
+			close_vm(vm);
+		} else {
+			vm->timer = timer_add((deadline - now) / G_TIME_SPAN_MILLISECOND + 1,
+					(timer_func) vm_timer, vm);
+		}
+	}
+	g_mutex_unlock(&vmi_lock);
+}
+
+/*! vmi_service_tick
+ \brief keep the pools of clones full and shut down the closed VMs
+ *
+ * All the XML-RPC calls are made from this periodic timer, which never runs
+ * twice at the same time, so the client is only used by one thread at once.
+ */
+static void vmi_service_tick(gpointer unused) {
+
+	g_mutex_lock(&vmi_service_lock);
+
+	g_mutex_lock(&vmi_lock);
+	GList *closing = vmi_closing.head;
+	g_queue_init(&vmi_closing);
+
+	/* VMs are only ever freed here, take them out of both tables */
+	GList *loop;
+	for (loop = closing; loop; loop = loop->next) {
+		forget_vm(loop->data);
+	}
+
+	/* A pool that is withdrawn isn't in vmi_pools anymore, a failing one
+	 * is refilled one clone at a time once its backoff is over */
+	GSList *refill = NULL;
+	GHashTableIter i;
+	struct vmi_pool *pool;
+	gint64 now = g_get_monotonic_time();
+	g_hash_table_iter_init(&i, vmi_pools);
+	while (g_hash_table_iter_next(&i, NULL, (gpointer *) &pool)) {
+		if (pool->failures && (now < pool->retry || pool->pending)) {
+			continue;
+		}
+		while (pool->ready.length + pool->pending < vmi_pool_size
+				&& !(pool->failures && pool->pending)) {
+			pool->pending++;
+			refill = g_slist_prepend(refill, pool);
+		}
+	}
+	g_mutex_unlock(&vmi_lock);
+
+	for (loop = closing; loop; loop = loop->next) {
+		struct vmi_vm *vm = loop->data;
+		/* close is set, the timer doesn't arm itself again */
+		timer_cancel(vm->timer);
+		if (vm->target) {
+			remove_back_handler(vm->target, vm->backendID);
 		}
+		release_clone(vm);
+		free_vmi_vm(vm);
 	}
+	g_list_free(closing);
 
-	g_mutex_unlock(&vm->lock);
-	//close_vmi_vm(vm);
+	while (refill) {
+		request_clone(refill->data);
+		refill = g_slist_delete_link(refill, refill);
+	}
+
+	xmlrpc_client_event_loop_finish_timeout(vmi_client, SERVICE_POLL);
 
-	done: pthread_exit(NULL);
-	return NULL;
+	g_mutex_unlock(&vmi_service_lock);
 }
 
-struct vmi_vm *get_new_clone(struct pkt_struct *pkt, struct conn_struct *conn) {
+/*! vmi_target_withdrawn
+ \brief forget the pool and the VMs of a target that was taken out, before
+ * it's freed
+ *
+ * Waits for the service to be done with the target. The clones of its pool
+ * are released here, its VMs are shut down by the service like the ones
+ * that expired, their handlers are freed with the target.
+ */
+static void vmi_target_withdrawn(struct target *target) {
+	GQueue ready = G_QUEUE_INIT;
+	GHashTableIter i;
+	struct vmi_vm *vm;
+
+	g_mutex_lock(&vmi_service_lock);
+	g_mutex_lock(&vmi_lock);
 
-		struct vmi_vm *vm = g_malloc0(sizeof(struct vmi_vm));
+	struct vmi_pool *pool = g_hash_table_lookup(vmi_pools, target);
+	if (pool) {
+		g_hash_table_remove(vmi_pools, target);
+		ready = pool->ready;
+		pool->target = NULL;
+		if (!pool->pending) {
+			g_free(pool);
+		}
+	}
 
-		g_mutex_lock(&conn->target->lock);
+	g_hash_table_iter_init(&i, vmi_vms_int);
+	while (g_hash_table_iter_next(&i, NULL, (gpointer *) &vm)) {
+		if (vm->target == target) {
+			g_hash_table_iter_remove(&i);
+			if (g_hash_table_lookup(vmi_vms_ext, &vm->key_ext) == vm) {
+				g_hash_table_remove(vmi_vms_ext, &vm->key_ext);
+			}
+			vm->handler = NULL;
+			close_vm(vm);
+		}
+	}
 
-		// Add new backend handler dynamically to Honeybrid
+	/* the VMs that were already closing */
+	GList *loop;
+	for (loop = vmi_closing.head; loop; loop = loop->next) {
+		vm = loop->data;
+		if (vm->target == target) {
+			vm->target = NULL;
+			vm->handler = NULL;
+		}
+	}
 
-		/*conn->target->back_handler_count++;
-		uint64_t *key = malloc(sizeof(uint64_t));
-		*key = conn->target->back_handler_count;
+	g_mutex_unlock(&vmi_lock);
 
-		struct handler *new_handler = g_malloc0(sizeof(struct handler));
-		new_handler->mac = g_malloc0(sizeof(struct addr));
-		new_handler->ip = g_malloc0(sizeof(struct addr));
-		new_handler->netmask = g_malloc0(sizeof(struct addr));
-		addr_pton("255.255.255.0", new_handler->netmask);
+	while ((vm = g_queue_pop_head(&ready))) {
+		release_clone(vm);
+		free_vmi_vm(vm);
+	}
 
-		char *p;
-		char delim[] = ",";
-		vm->name = g_strdup(strtok_r(buf, delim, &p));
-		addr_pton(strtok_r(NULL, delim, &p), new_handler->ip);
-		new_handler->ip_str = g_strdup(addr_ntoa(new_handler->ip));
-		new_handler->iface = g_hash_table_lookup(links, VLAN_TRUNK_INTERFACE);
-		addr_pton(strtok_r(NULL, delim, &p), new_handler->mac);
-		new_handler->vlan.i = htons(
-				atoi(strtok_r(NULL, delim, &p)) & ((1 << 12) - 1));
-		uint32_t logID = atoi(strtok_r(NULL, delim, &p));
+	g_mutex_unlock(&vmi_service_lock);
+}
 
-		g_tree_insert(conn->target->back_handlers, key, new_handler);
-		g_mutex_unlock(&conn->target->lock);
+/*! get_new_clone
+ \brief hand the next clone of the pool of the target to the attacker,
+ * without waiting
+ \return the backend ID of the clone, 0 if the pool is empty
+ *
+ * The first attacker of a target finds its pool empty, the service fills it
+ * from then on.
+ */
+static uint64_t get_new_clone(struct pkt_struct *pkt,
+		struct conn_struct *conn) {
 
-		// We need to pin the attacker's ip and destination ip to this VM
+	g_mutex_lock(&vmi_lock);
+	struct vmi_pool *pool = g_hash_table_lookup(vmi_pools, conn->target);
+	if (!pool && conn->target->withdrawn) {
+		/* a pool created now could outlive the target */
+		g_mutex_unlock(&vmi_lock);
+		return 0;
+	}
+	if (!pool) {
+		pool = g_malloc0(sizeof(struct vmi_pool));
+		pool->target = conn->target;
+		g_queue_init(&pool->ready);
+		g_hash_table_insert(vmi_pools, pool->target, pool);
+	}
 
+	struct vmi_vm *vm = g_queue_pop_head(&pool->ready);
+	struct handler *handler = vm ? vm->handler : NULL;
+	uint64_t backendID = vm ? vm->backendID : 0;
+	if (vm) {
+		printdbg("%s Picking %s (%lu).\n", H(conn->id), vm->name, backendID);
 
+		// We need to pin the attacker's ip and destination ip to this VM
 		vm->key_ext = pkt->packet.ip->saddr;
-		vm->handler = new_handler;
-		vm->start = g_timer_new();
-		vm->logID = logID;
-		vm->backendID = *key;
-		vm->target = pkt->conn->target;
-		g_mutex_init(&vm->lock);
-		g_cond_init(&vm->timeout);
-		pthread_t c;
-		pthread_create(&c, NULL, (void *) vm_timer, (void *) vm);
-		pthread_detach(c);
+		vm->started = vm->last_seen = g_get_monotonic_time();
 
-		g_mutex_lock(&vmi_lock);
-		g_tree_insert(vmi_vms_ext, &vm->key_ext, vm);
-		g_tree_insert(vmi_vms_int, &vm->backendID, vm);
-		g_mutex_unlock(&vmi_lock);
+		g_hash_table_insert(vmi_vms_ext, &vm->key_ext, vm);
+		g_hash_table_insert(vmi_vms_int, vm->handler, vm);
+		vm->timer = timer_add(IDLE_TIMEOUT * 1000, (timer_func) vm_timer, vm);
+	}
+	g_mutex_unlock(&vmi_lock);
 
-		return vm;
+	/* The VM may be closing already if the target was withdrawn, but the
+	 * target of the connection is only freed once the packet is done */
+	if (vm) {
+		balancer_add(conn->target->balancer, handler);
+	}
 
-	} else {
-		g_mutex_lock(&vmi_lock);
-		uint32_t *banned = g_memdup(&pkt->packet.ip->saddr, sizeof(uint32_t));
-		g_tree_insert(bannedIPs, banned, NULL);
-		g_mutex_unlock(&vmi_lock);
-		return NULL;
-	}*/
+	return backendID;
 }
 
-int init_mod_vmi() {
+status_t init_mod_vmi() {
 
 	gchar *vmi_server_ip;
 	int *vmi_server_port;
@@ -192,7 +564,7 @@ int init_mod_vmi() {
 					"vmi_server_ip"))) {
 		// Not defined so skipping init
 		initialized = FALSE;
-		return 0;
+		return OK;
 	}
 
 	if (NULL
@@ -200,45 +572,122 @@ int init_mod_vmi() {
 		errx(1, "%s: VMI Server port not defined!!\n", __func__);
 	}
 
-	printdbg(
-			"%s Init mod_vmi. VMI-Honeymon is defined at %s:%i\n", H(22), vmi_server_ip, *vmi_server_port);
-
+	vmi_pool_size = ICONFIG("vmi_pool_size") > 0 ?
+			ICONFIG("vmi_pool_size") : POOL_SIZE;
 
-	g_string_printf(vmi_server, "http://%s:%i/RPC2", vmi_server_ip, *vmi_server_port);
+	printdbg(
+			"%s Init mod_vmi. VMI-Honeymon is defined at %s:%i, keeping %u clones ready\n", H(22), vmi_server_ip, *vmi_server_port, vmi_pool_size);
 
+	vmi_server = g_strdup_printf("http://%s:%i/RPC2", vmi_server_ip,
+			*vmi_server_port);
 
-	const char *test = NULL;
 	xmlrpc_env_init(&env);
-	xmlrpc_client_init2(&env, XMLRPC_CLIENT_NO_FLAGS, vmi_server->str, VERSION, NULL, 0);
+	xmlrpc_client_setup_global_const(&env);
+	dieIfFaultOccurred(&env);
+	xmlrpc_client_create(&env, XMLRPC_CLIENT_NO_FLAGS, "honeybrid", VERSION,
+			NULL, 0, &vmi_client);
+	dieIfFaultOccurred(&env);
+	xmlrpc_client_set_interrupt(vmi_client, &vmi_interrupt);
 
-	printf("Making 'ECHO TEST' XMLRPC call to VMI-Honeymon on URL '%s'\n", vmi_server->str);
+	printf("Making 'ECHO TEST' XMLRPC call to VMI-Honeymon on URL '%s'\n", vmi_server);
 
 	/* Make the remote procedure call */
-	xmlrpc_value *resultP = xmlrpc_client_call(&env, vmi_server->str, "echo_test", "(i)",
-			(xmlrpc_int32) 1);
+	const char *test = NULL;
+	xmlrpc_value *resultP = NULL;
+	xmlrpc_client_call2f(&env, vmi_client, vmi_server, "echo_test", &resultP,
+			"(i)", (xmlrpc_int32) 1);
+	dieIfFaultOccurred(&env);
 	xmlrpc_read_string(&env, resultP, &test);
 	dieIfFaultOccurred(&env);
 	printf("Got reply: %s\n", test);
+	free((char *) test);
+	xmlrpc_DECREF(resultP);
 
 	bannedIPs = g_tree_new_full((GCompareDataFunc) intcmp, NULL,
 			(GDestroyNotify) g_free, NULL);
+	vmi_vms_ext = g_hash_table_new(g_int_hash, g_int_equal);
+	vmi_vms_int = g_hash_table_new(g_direct_hash, g_direct_equal);
+	vmi_pools = g_hash_table_new(g_direct_hash, g_direct_equal);
+	g_queue_init(&vmi_closing);
+
+	vmi_service = timer_add_periodic(SERVICE_TICK,
+			(timer_func) vmi_service_tick, NULL);
+	add_withdraw_hook(vmi_target_withdrawn);
 
 	initialized = TRUE;
 
-	return 0;
+	return OK;
 }
 
 void close_mod_vmi() {
 	if (initialized) {
-		g_tree_destroy(vmi_vms_ext);
-		g_tree_destroy(vmi_vms_int);
+		remove_withdraw_hook(vmi_target_withdrawn);
+		timer_cancel(vmi_service);
+
+		/* Don't wait for the clones still being created, whatever is
+		 * done by now joins the pools and is released with them */
+		vmi_interrupt = 1;
+		xmlrpc_client_event_loop_finish(vmi_client);
+		vmi_interrupt = 0;
+
+		/* The handlers of the clones are freed with their target */
+		GList *vms, *loop;
+		g_mutex_lock(&vmi_lock);
+		vms = g_hash_table_get_values(vmi_vms_int);
+		for (loop = vms; loop; loop = loop->next) {
+			((struct vmi_vm *) loop->data)->close = TRUE;
+		}
+		g_hash_table_remove_all(vmi_vms_int);
+		g_mutex_unlock(&vmi_lock);
+
+		struct vmi_vm *vm;
+		for (loop = vms; loop; loop = loop->next) {
+			vm = loop->data;
+			timer_cancel(vm->timer);
+			release_clone(vm);
+			free_vmi_vm(vm);
+		}
+		g_list_free(vms);
+		g_queue_clear(&vmi_closing);
+
+		GHashTableIter i;
+		struct vmi_pool *pool;
+		g_hash_table_iter_init(&i, vmi_pools);
+		while (g_hash_table_iter_next(&i, NULL, (gpointer *) &pool)) {
+			while ((vm = g_queue_pop_head(&pool->ready))) {
+				release_clone(vm);
+				free_vmi_vm(vm);
+			}
+			g_free(pool);
+		}
+		g_hash_table_destroy(vmi_pools);
+
+		/* VMI-Honeymon gets the requests, shutting the VMs down is its job */
+		xmlrpc_client_event_loop_finish_timeout(vmi_client, RELEASE_WAIT);
+		vmi_interrupt = 1;
+		xmlrpc_client_event_loop_finish(vmi_client);
+
+		g_printerr("VMI: %"PRIu64" clones picked (%"PRIu64" ms mean), %"PRIu64" attackers found the pool empty\n",
+				vmi_stats.picks,
+				vmi_stats.picks ? vmi_stats.pick_usec / vmi_stats.picks / 1000 : 0,
+				vmi_stats.misses);
+		g_printerr("VMI: %"PRIu64" clones created (%"PRIu64" ms mean), %"PRIu64" failed, %"PRIu64" expired\n",
+				vmi_stats.clones,
+				vmi_stats.clones ? vmi_stats.clone_usec / vmi_stats.clones / 1000 : 0,
+				vmi_stats.clone_failures, vmi_stats.expired);
+
+		g_hash_table_destroy(vmi_vms_ext);
+		g_hash_table_destroy(vmi_vms_int);
 		g_tree_destroy(bannedIPs);
+		g_free(vmi_server);
+
+		xmlrpc_client_destroy(vmi_client);
 
 		/* Clean up our error-handling environment. */
 		xmlrpc_env_clean(&env);
 
 		/* Shutdown our XML-RPC client library. */
-		xmlrpc_client_cleanup();
+		xmlrpc_client_teardown_global_const();
 	}
 }
 
@@ -253,6 +702,8 @@ mod_result_t mod_vmi_pick(struct mod_args *args) {
 
 	mod_result_t result = REJECT;
 	struct vmi_vm *vm = NULL;
+	uint64_t backendID = 0;
+	gint64 start = g_get_monotonic_time();
 
 	if (args->pkt->in != args->pkt->conn->target->default_route) {
 		return result;
@@ -270,27 +721,37 @@ mod_result_t mod_vmi_pick(struct mod_args *args) {
 		//printf("Check if he already uses a clone\n");
 
 		g_mutex_lock(&vmi_lock);
-		vm = g_tree_lookup(vmi_vms_ext, &args->pkt->packet.ip->saddr);
+		vm = g_hash_table_lookup(vmi_vms_ext, &args->pkt->packet.ip->saddr);
+		backendID = vm ? vm->backendID : 0;
 		g_mutex_unlock(&vmi_lock);
-		if (!vm)
-			vm = get_new_clone(args->pkt, args->pkt->conn);
+
+		if (vm) {
+			args->backend_use = backendID;
+			return ACCEPT;
+		}
+
+		backendID = get_new_clone(args->pkt, args->pkt->conn);
 	}
 
-	if (vm != NULL) {
-		printdbg(
-				"%s Picking %s (%lu).\n", H(args->pkt->conn->id), vm->name, vm->backendID);
-		args->backend_use = vm->backendID;
+	g_mutex_lock(&vmi_lock);
+	if (backendID) {
+		vmi_stats.picks++;
+		vmi_stats.pick_usec += g_get_monotonic_time() - start;
+	} else {
+		vmi_stats.misses++;
+	}
+	g_mutex_unlock(&vmi_lock);
+
+	if (backendID) {
+		args->backend_use = backendID;
 		result = ACCEPT;
 
-		// save the conns here (they could get expired so don't trust this list)
-		g_mutex_lock(&vm->lock);
-		vm->conn_keys = g_slist_append(vm->conn_keys,
-				g_memdup(args->pkt->conn->ext_key, sizeof(struct conn_key)));
-		g_mutex_unlock(&vm->lock);
+		// the connections using the clone are indexed on its handler,
+		// removing the backend retires them
 
 	} else {
 		printdbg(
-				"%s No available backend found, rejecting!\n", H(args->pkt->conn->id));
+				"%s No clone ready, rejecting!\n", H(args->pkt->conn->id));
 		result = REJECT;
 	}
 
@@ -313,22 +774,23 @@ mod_result_t mod_vmi_control(struct mod_args *args) {
 	mod_result_t result = REJECT;
 
 	g_mutex_lock(&vmi_lock);
-	struct vmi_vm *vm = g_tree_lookup(vmi_vms_int, &args->pkt->conn->hih.hihID);
-	g_mutex_unlock(&vmi_lock);
+	struct vmi_vm *vm = g_hash_table_lookup(vmi_vms_int,
+			args->pkt->conn->hih.back_handler);
 
 	if (!vm) {
 		// Not a VMI HIH
+		g_mutex_unlock(&vmi_lock);
 		return ACCEPT;
 	}
 
-	g_mutex_lock(&vm->lock);
+	gint64 now = g_get_monotonic_time();
 
-	if (g_timer_elapsed(vm->start, NULL) > MAX_LIFE) {
+	if (now - vm->started > MAX_LIFE * G_TIME_SPAN_SECOND) {
 		printdbg(
-				"%s VM max life expired, sending signal!\n", H(args->pkt->conn->id));
+				"%s VM max life expired, closing it!\n", H(args->pkt->conn->id));
 
-		vm->close = TRUE;
-		goto signal;
+		close_vm(vm);
+		goto done;
 	}
 
 	struct addr dst;
@@ -346,14 +808,14 @@ mod_result_t mod_vmi_control(struct mod_args *args) {
 		// TODO: Don't touch DNS, we will use mod_dns_control.
 
 		printdbg(
-				"%s Cought network event, sending signal!\n", H(args->pkt->conn->id));
+				"%s Cought network event, closing the VM!\n", H(args->pkt->conn->id));
 
-		vm->close = TRUE;
+		close_vm(vm);
 	}
 
-	vm->signal = TRUE;
-	signal: g_cond_signal(&vm->timeout);
-	g_mutex_unlock(&vm->lock);
+	// event, push the idle timeout back
+	vm->last_seen = now;
+	done: g_mutex_unlock(&vmi_lock);
 
 	return result;
 }
@@ -362,28 +824,45 @@ mod_result_t mod_vmi_intra(struct mod_args *args) {
 	return DEFER;
 }
 
-mod_result_t mod_vmi(struct mod_args *args) {
+typedef enum {
+	VMI_PICK, VMI_CONTROL, VMI_INTRA
+} vmi_mode_t;
+
+status_t parse_mod_vmi(struct node *node) {
 
 	gchar *mode;
-	// get the backup file for this module
-	if (NULL
-			== (mode = (gchar *) g_hash_table_lookup(args->node->config, "mode"))) {
-		// We can't decide
-		printdbg(
-				"%s mandatory argument 'mode' undefined (back/control)!\n", H(args->pkt->conn->id));
-		return DEFER;
+	vmi_mode_t parsed;
+
+	if (NULL == (mode = (gchar *) g_hash_table_lookup(node->config, "mode"))) {
+		printdbg("%s mandatory argument 'mode' undefined (pick/control/intra)!\n", H(6));
+		return NOK;
 	}
-	//else
-	//printf("VMI Mode %s\n", mode);
 
-	else if (!strcmp(mode, "pick"))
-		return mod_vmi_pick(args);
-	//else if (!strcmp(mode, "back"))
-	//  mod_vmi_back(args);
+	if (!strcmp(mode, "pick"))
+		parsed = VMI_PICK;
 	else if (!strcmp(mode, "control"))
-		return mod_vmi_control(args);
+		parsed = VMI_CONTROL;
 	else if (!strcmp(mode, "intra"))
+		parsed = VMI_INTRA;
+	else {
+		printdbg("%s unknown mode '%s'!\n", H(6), mode);
+		return NOK;
+	}
+
+	node->param = g_memdup(&parsed, sizeof(vmi_mode_t));
+	return OK;
+}
+
+mod_result_t mod_vmi(struct mod_args *args) {
+
+	switch (*(const vmi_mode_t *) args->node->param) {
+	case VMI_PICK:
+		return mod_vmi_pick(args);
+	case VMI_CONTROL:
+		return mod_vmi_control(args);
+	case VMI_INTRA:
 		return mod_vmi_intra(args);
+	}
 
 	return DEFER;
 }
@@ -38,6 +38,21 @@
  - "value", if 0 it rejects everything, if 1 it accepts everything
  */
 
+/*! parse_mod_yesno
+ \brief the result is known in advance, so rules fold this module away
+ */
+status_t parse_mod_yesno(struct node *node) {
+    int value;
+
+    if (!module_param_int(node, "value", &value)) {
+        printdbg("%s mandatory argument 'value' undefined!\n", H(6));
+        return NOK;
+    }
+
+    node->constant = (0 == value) ? ACCEPT : REJECT;
+    return OK;
+}
+
 /*! mod_yesno
  \param[in] args, struct that contain the node and the datas to process
  *
@@ -46,26 +61,15 @@
 mod_result_t mod_yesno(struct mod_args *args) {
     printdbg("%s Module called\n", H(args->pkt->conn->id));
 
-    int *param;
-
-    if ((param = (int *) g_hash_table_lookup(args->node->config, "value"))
-            == NULL) {
-        /*! We can't decide */
-        printdbg("%s mandatory argument 'value' undefined!\n",
-                H(args->pkt->conn->id));
-        return DEFER;
-    }
-
-    if (0 == *param) {
+    if (ACCEPT == args->node->constant) {
         /*! We accept this packet */
-        printdbg("%s PACKET MATCH RULE for yesno(%d)\n", H(args->pkt->conn->id),
-                *param);
-        return ACCEPT;
+        printdbg("%s PACKET MATCH RULE for yesno\n", H(args->pkt->conn->id));
     } else {
         /*! We reject this packet */
-        printdbg("%s PACKET DOES NOT MATCH RULE for yesno(%d)\n",
-                H(args->pkt->conn->id), *param);
-        return REJECT;
+        printdbg("%s PACKET DOES NOT MATCH RULE for yesno\n",
+                H(args->pkt->conn->id));
     }
+
+    return args->node->constant;
 }
 
@@ -33,6 +33,7 @@
  */
 
 #include "modules.h"
+#include "constants.h"
 
 // Assign Module ID to each available module
 typedef enum {
@@ -55,11 +56,12 @@ typedef enum {
 
     MOD_BACKPICK_RANDOM,
 
-    MOD_DNS_CONTROL,
+    MOD_BACKPICK_BALANCE,
 
-#ifdef HAVE_CRYPTO
+    MOD_DNS_CONTROL,
     MOD_HASH,
-#endif
+    MOD_REPUTATION,
+    MOD_NETWORK,
 
 #ifdef HAVE_XMPP
     MOD_DIONAEA,
@@ -68,169 +70,594 @@ typedef enum {
     __MAX_HONEYBRID_MODULE
 } honeybrid_modules_t;
 
-// Define each module's name and main function
+// Define each module's name, main function and lifecycle hooks
 // The name can be used in the configuration of a module's function
 const struct mod_def module_definitions[__MAX_HONEYBRID_MODULE] = {
 
     // Initialize all modules to invalid and NULL, to be overwritten by actual definitions
     [0 ... __MAX_HONEYBRID_MODULE-1] = {.name = "invalid", .function = NULL},
 
-    [MOD_SOURCE] = {.name = "source", .function = mod_source},
+    // A known source stays known until its entry expires
+    [MOD_SOURCE] = {.name = "source", .function = mod_source,
+            .parse_config = parse_mod_source,
+            .cacheable = CACHE_RESULT(REJECT)},
+
+    // Cached results lag behind the time windows by up to 'cache' seconds
+    [MOD_SOURCE_TIME] = {.name = "source_time", .function = mod_source_time,
+            .parse_config = parse_mod_source_time,
+            .cacheable = CACHE_RESULT(ACCEPT) | CACHE_RESULT(REJECT),
+            .triggers = TRIGGER_TIME},
+
+    [MOD_RANDOM] = {.name = "random", .function = mod_random,
+            .parse_config = parse_mod_random,
+            .thread_init = (module_thread_init) g_rand_new,
+            .thread_free = (GDestroyNotify) g_rand_free},
+
+    [MOD_YESNO] = {.name = "yesno", .function = mod_yesno,
+            .parse_config = parse_mod_yesno},
+
+    [MOD_COUNTER] = { .name = "counter", .function = mod_counter,
+            .parse_config = parse_mod_counter,
+            .triggers = TRIGGER_COUNT},
+
+    [MOD_VMI] = {.name = "vmi", .function = mod_vmi,
+            .parse_config = parse_mod_vmi,
+            .init = init_mod_vmi, .shutdown = close_mod_vmi},
+
+    [MOD_CONTROL] = {.name = "control", .function = mod_control,
+            .parse_config = parse_mod_control,
+            .conn_state_free = g_free,
+            .conn_state_print = (module_state_print) print_mod_control},
+
+    [MOD_BACKPICK_RANDOM] = {.name = "backpick_random", .function = mod_backpick_random,
+            .thread_init = (module_thread_init) g_rand_new,
+            .thread_free = (GDestroyNotify) g_rand_free},
+
+    [MOD_BACKPICK_BALANCE] = {.name = "backpick_balance", .function = mod_backpick_balance,
+            .parse_config = parse_mod_backpick_balance,
+            .thread_init = (module_thread_init) g_rand_new,
+            .thread_free = (GDestroyNotify) g_rand_free},
+
+    // Answers the queries the internal DNS server already answered
+    [MOD_DNS_CONTROL] = {.name = "dns_control", .function = mod_dns_control,
+            .parse_config = parse_mod_dns_control,
+            .init = init_mod_dns_control, .shutdown = close_mod_dns_control},
+
+    // Only a payload gives it something to fingerprint
+    [MOD_HASH] = {.name = "hash", .function = mod_hash,
+            .parse_config = parse_mod_hash,
+            .init = init_mod_hash, .shutdown = close_mod_hash,
+            .conn_state_free = (GDestroyNotify) free_hash_stream,
+            .triggers = TRIGGER_DATA},
+
+    // Cached results lag behind a replaced list by up to 'cache' seconds
+    [MOD_REPUTATION] = {.name = "reputation", .function = mod_reputation,
+            .parse_config = parse_mod_reputation,
+            .init = init_mod_reputation, .shutdown = close_mod_reputation,
+            .cacheable = CACHE_RESULT(ACCEPT) | CACHE_RESULT(REJECT)},
+
+    // Cached results lag behind a replaced map by up to 'cache' seconds
+    [MOD_NETWORK] = {.name = "network", .function = mod_network,
+            .parse_config = parse_mod_network,
+            .init = init_mod_network, .shutdown = close_mod_network,
+            .cacheable = CACHE_RESULT(ACCEPT) | CACHE_RESULT(REJECT)},
 
-    [MOD_SOURCE_TIME] = {.name = "source_time", .function = mod_source_time},
+#ifdef HAVE_XMPP
+    [MOD_DIONAEA] = {.name = "hash", .function = mod_hash},
+#endif
+};
 
-    [MOD_RANDOM] = {.name = "random", .function = mod_random},
+#define module_id(def) ((def) - module_definitions)
 
-    [MOD_YESNO] = {.name = "yesno", .function = mod_yesno},
+/*! Lifecycle of the modules, protected by module_lock */
+static GMutex module_lock;
+static gboolean modules_running;
+static gboolean module_used[__MAX_HONEYBRID_MODULE];
+static gboolean module_initialized[__MAX_HONEYBRID_MODULE];
 
-    [MOD_COUNTER] = { .name = "counter", .function = mod_counter},
+static void free_thread_contexts(gpointer *contexts);
+static GPrivate thread_contexts = G_PRIVATE_INIT(
+        (GDestroyNotify) free_thread_contexts);
 
-    [MOD_VMI] = {.name = "vmi", .function = mod_vmi},
+/*! Module memory is saved every minute */
+#define BACKUP_INTERVAL 60000 /* ms */
 
-    [MOD_CONTROL] = {.name = "control", .function = mod_control},
+static guint backup_timer;
 
-    [MOD_BACKPICK_RANDOM] = {.name = "backpick_random", .function = mod_backpick_random},
+/*! Asynchronous work of the modules, see module_submit */
+#define ASYNC_WORKERS   4
+#define ASYNC_TIMEOUT   5
 
-    [MOD_DNS_CONTROL] = {.name = "dns_control", .function = mod_dns_control},
+static GThreadPool *module_workers;
+static GThread *module_watchdog;
+static gint64 job_timeout;
+static mod_result_t job_timeout_result;
 
-#ifdef HAVE_CRYPTO
-    [MOD_HASH] = {.name = "hash", .function = mod_hash},
-#endif
+/*! Jobs waiting to finish, by deadline since they all get the same timeout */
+static GMutex watch_lock;
+static GCond watch_cond;
+static GQueue watch_queue;
+static gboolean watching;
 
-#ifdef HAVE_XMPP
-    [MOD_DIONAEA] = {.name = "hash", .function = mod_hash},
-#endif
-};
+static void run_job(struct module_job *job, gpointer unused);
+static void watch_jobs();
 
-/*! \todo create two functions to handle module backup to file:
- - a function called by modules to add themselves to a backup queue
- - a timer event callback function to process the backup queue periodically, and save backups to files
- */
+static void start_module(const struct mod_def *def) {
+    uint32_t id = module_id(def);
+
+    if (!module_initialized[id]) {
+        printdbg("%s Initializing module %s\n", H(6), def->name);
+        if (def->init && def->init() != OK) {
+            errx(1, "%s Module %s failed to initialize", H(6), def->name);
+        }
+        module_initialized[id] = TRUE;
+    }
+}
 
 /*! init_modules
  \brief setup modules that need to be initialized
+ *
+ * Only the modules used by a rule are initialized. Modules that are first
+ * used by a rule added at runtime are initialized by use_module.
  */
-
-// TODO: Only init modules/threads here that are actually used by a target
 void init_modules() {
     printdbg("%s Initiate modules\n", H(6));
 
-    /*! create a thread that will save module memory every minute */
-    if ((mod_backup = g_thread_new("module_backup_saver",
-            (void *) save_backup_handler, NULL)) == NULL) {
-        errx(1, "%s Cannot create a thread to save module memory", H(6));
+    /*! save module memory every minute */
+    backup_timer = timer_add_periodic(BACKUP_INTERVAL,
+            (timer_func) save_backup_handler, NULL);
+
+    /*! start the workers modules submit their slow work to */
+    const char *policy = CONFIG("async_timeout_result");
+    job_timeout_result = DEFER;
+    if (policy) {
+        if (!strcmp(policy, "accept")) {
+            job_timeout_result = ACCEPT;
+        } else if (!strcmp(policy, "reject")) {
+            job_timeout_result = REJECT;
+        } else if (strcmp(policy, "defer")) {
+            errx(1, "%s Unknown async_timeout_result '%s'", H(6), policy);
+        }
     }
 
-#ifdef HAVE_CRYPTO
-    init_mod_hash();
-#endif
+    job_timeout = (ICONFIG("async_timeout") > 0 ?
+            ICONFIG("async_timeout") : ASYNC_TIMEOUT) * G_TIME_SPAN_SECOND;
+
+    module_workers = g_thread_pool_new((GFunc) run_job, NULL,
+            ICONFIG("async_workers") > 0 ? ICONFIG("async_workers") : ASYNC_WORKERS,
+            FALSE, NULL);
+
+    watching = TRUE;
+    if ((module_watchdog = g_thread_new("module_watchdog",
+            (void *) watch_jobs, NULL)) == NULL) {
+        errx(1, "%s Cannot create a thread to time out module jobs", H(6));
+    }
+
+    g_mutex_lock(&module_lock);
+
+    uint32_t i;
+    for (i = 0; i < __MAX_HONEYBRID_MODULE; ++i) {
+        if (module_used[i]) {
+            start_module(&module_definitions[i]);
+        }
+    }
+    modules_running = TRUE;
 
-    init_mod_vmi();
+    g_mutex_unlock(&module_lock);
 }
 
 void close_modules() {
-    close_mod_vmi();
+
+    timer_cancel(backup_timer);
+    backup_timer = 0;
+
+    /*! let the running jobs finish, the queued ones are dropped */
+    if (module_workers) {
+        g_thread_pool_free(module_workers, TRUE, TRUE);
+        module_workers = NULL;
+
+        g_mutex_lock(&watch_lock);
+        watching = FALSE;
+        g_cond_signal(&watch_cond);
+        g_mutex_unlock(&watch_lock);
+        g_thread_join(module_watchdog);
+    }
+
+    g_mutex_lock(&module_lock);
+
+    uint32_t i;
+    for (i = 0; i < __MAX_HONEYBRID_MODULE; ++i) {
+        if (module_initialized[i] && module_definitions[i].shutdown) {
+            module_definitions[i].shutdown();
+        }
+        module_initialized[i] = FALSE;
+    }
+    modules_running = FALSE;
+
+    g_mutex_unlock(&module_lock);
 }
 
-/*! run_module
- * \brief test of a new function to run module based on module name (without calling get_module)
+/*! use_module
+ \brief register that a rule uses a module
+ *
+ * Before init_modules the module is only marked, afterwards it is
+ * initialized right away if it wasn't already.
  */
+void use_module(const struct mod_def *def) {
+    g_mutex_lock(&module_lock);
 
-/*void run_module(const module_function module, struct mod_args *args)
- {
- if (module && args)
- {
- module(args);
- }
- }*/
+    module_used[module_id(def)] = TRUE;
+    if (modules_running) {
+        start_module(def);
+    }
 
-/*! get_module
- \brief return the module function pointer from name
+    g_mutex_unlock(&module_lock);
+}
+
+/*! get_module_def
+ \brief return the module definition from name
  \param[in] modname: module name
- \return function pointer to the module
+ \return definition of the module, NULL if there is none with that name
  */
-module_function get_module(const char *modname) {
+const struct mod_def *get_module_def(const char *modname) {
 
     uint32_t i = 0;
     for (; i < __MAX_HONEYBRID_MODULE; ++i) {
-        if (!strncmp(modname, module_definitions[i].name,
-                strlen(module_definitions[i].name))) {
-            return module_definitions[i].function;
+        if (module_definitions[i].function
+                && !strcmp(modname, module_definitions[i].name)) {
+            return &module_definitions[i];
         }
     }
 
-    errx(1, "%s No module could be found with the name: %s", H(6), modname);
+    printdbg("%s No module could be found with the name: %s\n", H(6), modname);
 
     return NULL;
 }
 
-/*! write_backup
- *  \brief This function write a module backup memory to a file
+/*! module_conn_state
+ \brief the state slot of the calling module on the connection of the packet
+ *
+ * The slot is freed with the connection (or when it is compacted) using the
+ * conn_state_free hook of the module. The caller holds the connection lock.
  */
+gpointer *module_conn_state(const struct mod_args *args) {
+    struct conn_struct *conn = args->pkt->conn;
 
-int write_backup(const char *filename, GKeyFile *data,
-        __attribute__((unused)) void *unused) {
-    printdbg("%s saving backup module %p to %s\n", H(6), data, filename);
-    gchar *buf;
-    buf = g_key_file_to_data(data, NULL, NULL);
+    if (!conn->module_state) {
+        conn->module_state = g_malloc0(
+                __MAX_HONEYBRID_MODULE * sizeof(gpointer));
+    }
 
-    FILE *file_fd;
-    if (NULL == (file_fd = fopen(filename, (char *) "w+"))) {
-        printdbg(
-                "%s Failed to save module backup \"%s\": can't open file for writing\n", H(0), filename);
-        return FALSE;
+    return &conn->module_state[module_id(args->node->def)];
+}
+
+static void detach_job(struct conn_struct *conn) {
+    struct module_job *job = conn->pending;
+
+    g_atomic_pointer_set(&job->conn, NULL);
+    conn->pending = NULL;
+    module_job_unref(job);
+}
+
+/*! free_module_state
+ \brief free the state the modules attached to a connection
+ *
+ * A job still running for the connection is detached, its result is
+ * discarded when it finishes.
+ */
+void free_module_state(struct conn_struct *conn) {
+    if (conn->pending) {
+        detach_job(conn);
     }
-    fprintf(file_fd, "%s", buf);
-    fclose(file_fd);
-    g_free(buf);
 
-    return TRUE;
+    if (conn->module_state) {
+        uint32_t i;
+        for (i = 0; i < __MAX_HONEYBRID_MODULE; ++i) {
+            if (conn->module_state[i] && module_definitions[i].conn_state_free) {
+                module_definitions[i].conn_state_free(conn->module_state[i]);
+            }
+        }
+        free_0(conn->module_state);
+    }
 }
 
-/*! save_backup_handler
- * \brief This function handles the automatic saving of modules to external files.
- * It works by checking an array in which modules to save have been registered
- * This array is updated after each module run
+/*! module_state_string
+ \brief render the state the modules attached to a connection for the log
+ \return NULL if no module has something to print
+ */
+char *module_state_string(const struct conn_struct *conn) {
+    if (!conn->module_state) {
+        return NULL;
+    }
+
+    GString *buff = NULL;
+    uint32_t i;
+    for (i = 0; i < __MAX_HONEYBRID_MODULE; ++i) {
+        if (conn->module_state[i] && module_definitions[i].conn_state_print) {
+            if (!buff) {
+                buff = g_string_new("");
+            }
+            g_string_append(buff,
+                    module_definitions[i].conn_state_print(conn->module_state[i]));
+        }
+    }
+
+    return buff ? g_string_free(buff, FALSE) : NULL;
+}
+
+static void free_thread_contexts(gpointer *contexts) {
+    uint32_t i;
+    for (i = 0; i < __MAX_HONEYBRID_MODULE; ++i) {
+        if (contexts[i] && module_definitions[i].thread_free) {
+            module_definitions[i].thread_free(contexts[i]);
+        }
+    }
+    g_free(contexts);
+}
+
+/*! module_thread_context
+ \brief the context of the calling module for the current thread
+ \return NULL if the module has no thread_init hook
+ */
+gpointer module_thread_context(const struct mod_args *args) {
+    const struct mod_def *def = args->node->def;
+    gpointer *contexts = g_private_get(&thread_contexts);
+
+    if (!def->thread_init) {
+        return NULL;
+    }
+
+    if (!contexts) {
+        contexts = g_malloc0(__MAX_HONEYBRID_MODULE * sizeof(gpointer));
+        g_private_set(&thread_contexts, contexts);
+    }
+
+    uint32_t id = module_id(def);
+    if (!contexts[id]) {
+        contexts[id] = def->thread_init();
+    }
+
+    return contexts[id];
+}
+
+/*! module_job_unref
+ \brief drop a reference to a job, the last one frees it
  */
-void save_backup_handler() {
-    int removed;
+void module_job_unref(struct module_job *job) {
+    if (g_atomic_int_dec_and_test(&job->refs)) {
+        if (job->data_free) {
+            job->data_free(job->data);
+        }
+        g_free(job->trail);
+        g_free(job);
+    }
+}
 
-    gint64 sleep_cycle;
+/*! resume_job
+ \brief ask the decision thread of the connection to replay its packets
+ */
+static void resume_job(struct module_job *job) {
+    struct raw_pcap *raw = calloc(1, sizeof(struct raw_pcap));
+    raw->resume = job;
 
-    while (OK == threading) {
-        g_mutex_lock(&threading_cond_lock);
-        sleep_cycle = g_get_monotonic_time() + 60 * G_TIME_SPAN_SECOND;
-        g_cond_wait_until(&threading_cond, &threading_cond_lock, sleep_cycle);
-        g_mutex_unlock(&threading_cond_lock);
+    g_atomic_int_inc(&job->refs);
+    g_async_queue_push(job->queue, raw);
+}
 
-        if (module_to_save != NULL) {
-            removed = g_hash_table_foreach_steal(module_to_save,
-                    (GHRFunc) write_backup, NULL);
+static void unwatch_job(struct module_job *job) {
+    gboolean watched;
 
-            if (removed)
-                printdbg(
-                        "%s %d entries saved and removed from module_to_save\n",
-                        H(0), removed);
+    g_mutex_lock(&watch_lock);
+    if ((watched = job->watched)) {
+        g_queue_unlink(&watch_queue, &job->watch_link);
+        job->watched = FALSE;
+    }
+    g_mutex_unlock(&watch_lock);
+
+    if (watched) {
+        module_job_unref(job);
+    }
+}
+
+/*! run_job
+ \brief worker pool function, the first of the worker and the watchdog to
+ * finish the job resumes the connection
+ */
+static void run_job(struct module_job *job,
+        __attribute__ ((unused)) gpointer unused) {
+
+    if (g_atomic_int_get(&job->state) == JOB_RUNNING) {
+        uint64_t backend_use = 0;
+        mod_result_t result = job->work(job->data, &backend_use);
+
+        if (g_atomic_int_compare_and_exchange(&job->state, JOB_RUNNING,
+                JOB_DONE)) {
+            unwatch_job(job);
+            job->result = result;
+            job->backend_use = backend_use;
+            resume_job(job);
         }
     }
 
-    g_thread_exit(0);
+    module_job_unref(job);
 }
 
-/*! save_backup
- *  \brief This function adds a module backup memory to a queue in order to be written to a file later
+/*! watch_jobs
+ \brief watchdog thread, resumes the jobs that didn't finish in time with
+ * the async_timeout_result
  */
-int save_backup(GKeyFile *data, char *filename) {
-    printdbg("%s called for %p (%s)\n", H(0), data, filename);
-    if (FALSE
-            == g_hash_table_lookup_extended(module_to_save, filename, NULL,
-                    NULL)) {
-        printdbg("%s adding a new entry in module_to_save\n", H(0));
-        g_hash_table_insert(module_to_save, filename, data);
-        return 1;
-    } else {
-        g_hash_table_replace(module_to_save, filename, data);
-        printdbg("%s module_to_save already had this entry, updated\n", H(0));
-        return 0;
+static void watch_jobs() {
+
+    g_mutex_lock(&watch_lock);
+    while (watching) {
+        struct module_job *job = g_queue_peek_head(&watch_queue);
+
+        if (!job) {
+            g_cond_wait(&watch_cond, &watch_lock);
+            continue;
+        }
+        if (g_get_monotonic_time() < job->deadline) {
+            g_cond_wait_until(&watch_cond, &watch_lock, job->deadline);
+            continue;
+        }
+
+        g_queue_unlink(&watch_queue, &job->watch_link);
+        job->watched = FALSE;
+        g_mutex_unlock(&watch_lock);
+
+        if (g_atomic_int_compare_and_exchange(&job->state, JOB_RUNNING,
+                JOB_DONE)) {
+            printdbg("%s Module %s timed out, resuming with %s\n", H(6),
+                    job->node->module_name->str,
+                    lookup_result(job_timeout_result));
+            job->result = job_timeout_result;
+            job->backend_use = 0;
+            resume_job(job);
+        }
+        module_job_unref(job);
+
+        g_mutex_lock(&watch_lock);
+    }
+    g_mutex_unlock(&watch_lock);
+}
+
+/*! module_submit
+ \brief run the slow part of a module on the worker pool
+ *
+ * The packets of the connection are parked until the work is done or times
+ * out, the other connections of the decision thread keep flowing. Then the
+ * parked packets are replayed: the rule is evaluated again and the module
+ * gets the result of its work from module_async_result.
+ *
+ * Without the worker pool (before init_modules) the work runs right away.
+ *
+ \param[in] args: arguments the module was called with
+ \param[in] work: called on a worker with data, it must not touch the packet or the conn
+ \param[in] data: freed with data_free once the job is over
+ \return PENDING, or the result of the work if it ran right away
+ */
+mod_result_t module_submit(struct mod_args *args, module_work work,
+        gpointer data, GDestroyNotify data_free) {
+
+    struct conn_struct *conn = args->pkt->conn;
+
+    if (!module_workers) {
+        uint64_t backend_use = 0;
+        mod_result_t result = work(data, &backend_use);
+        if (result == ACCEPT && backend_use) {
+            args->backend_use = backend_use;
+        }
+        if (data_free) {
+            data_free(data);
+        }
+        return result;
+    }
+
+    /*! a result the rule didn't go back to is stale */
+    if (conn->pending) {
+        detach_job(conn);
     }
+
+    struct module_job *job = g_malloc0(sizeof(struct module_job));
+    job->refs = 3; // the conn, the worker pool and the watchdog
+    job->state = JOB_RUNNING;
+    job->conn = conn;
+    job->node = args->node;
+    job->queue = de_queues[IP2QUEUEID(args->pkt->in, args->pkt->packet.ip)];
+    job->work = work;
+    job->data = data;
+    job->data_free = data_free;
+    job->deadline = g_get_monotonic_time() + job_timeout;
+    job->watch_link.data = job;
+
+    conn->pending = job;
+
+    g_mutex_lock(&watch_lock);
+    job->watched = TRUE;
+    g_queue_push_tail_link(&watch_queue, &job->watch_link);
+    g_cond_signal(&watch_cond);
+    g_mutex_unlock(&watch_lock);
+
+    g_thread_pool_push(module_workers, job, NULL);
+
+    printdbg("%s Module %s submitted its work, parking the connection\n",
+            H(conn->id), args->node->module_name->str);
+
+    return PENDING;
+}
+
+/*! module_async_result
+ \brief get the result of the work the calling module submitted for the conn
+ \return TRUE if there is one, it is consumed
+ */
+gboolean module_async_result(struct mod_args *args, mod_result_t *result) {
+    struct conn_struct *conn = args->pkt->conn;
+    struct module_job *job = conn->pending;
+
+    if (!job || job->node != args->node
+            || g_atomic_int_get(&job->state) != JOB_RESUMED) {
+        return FALSE;
+    }
+
+    *result = job->result;
+    if (job->result == ACCEPT && job->backend_use) {
+        args->backend_use = job->backend_use;
+    }
+
+    detach_job(conn);
+    return TRUE;
+}
+
+/*! module_param_int
+ \brief read a numeric module parameter
+ *
+ * The configuration parser stores numbers as int and everything else as
+ * strings, so this only has to be done once when a rule is compiled.
+ *
+ \param[in] node: module instance
+ \param[in] name: parameter name
+ \param[out] value: left untouched if the parameter isn't set
+ \return TRUE if the parameter is set
+ */
+gboolean module_param_int(const struct node *node, const char *name,
+        int *value) {
+
+    const int *param = g_hash_table_lookup(node->config, name);
+    if (param) {
+        *value = *param;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/*! module_param_backup
+ \brief get the store the module keeps its memory in
+ *
+ * Modules configured with the same 'backup' file share the store.
+ *
+ \return NOK if the module has no backup configured or it can't be loaded
+ */
+status_t module_param_backup(const struct node *node,
+        struct module_backup *backup) {
+
+    backup->file = g_hash_table_lookup(node->config, "backup");
+
+    if (!backup->file) {
+        printdbg("%s mandatory argument 'backup' undefined!\n", H(6));
+        return NOK;
+    }
+    if (!(backup->store = store_open(backup->file))) {
+        printdbg("%s backup '%s' can't be loaded!\n", H(6), backup->file);
+        return NOK;
+    }
+    return OK;
+}
+
+/*! save_backup_handler
+ * \brief This function handles the automatic saving of modules to external files.
+ * Every minute, the timers call it to write the stores the modules changed
+ * since the last time
+ */
+void save_backup_handler(gpointer unused) {
+    store_save_all();
 }
@@ -32,47 +32,104 @@
 #include "structs.h"
 #include "convenience.h"
 #include "management.h"
+#include "feature_cache.h"
+#include "store.h"
+#include "timers.h"
+
+/*! module_backup
+ \brief store a module keeps its memory in, and where it is saved
+ */
+struct module_backup {
+    struct store *store;
+    const gchar *file;
+};
 
 void init_modules();
 void close_modules();
 
+void use_module(const struct mod_def *def);
+
 #define run_module(module, args, result) \
 	(module) ? \
 			result=((module_function)module)((struct mod_args *)args) : \
 			errx(1, "No module function defined!\n")
 
-module_function get_module(const char *mod_name);
+const struct mod_def *get_module_def(const char *mod_name);
+
+gpointer *module_conn_state(const struct mod_args *args);
+
+void free_module_state(struct conn_struct *conn);
+
+char *module_state_string(const struct conn_struct *conn);
+
+gpointer module_thread_context(const struct mod_args *args);
+
+mod_result_t module_submit(struct mod_args *args, module_work work,
+        gpointer data, GDestroyNotify data_free);
 
-void save_backup_handler();
+gboolean module_async_result(struct mod_args *args, mod_result_t *result);
 
-int save_backup(GKeyFile *data, char *filename);
+void module_job_unref(struct module_job *job);
 
-int write_backup(const char *filename, GKeyFile *data, void *userdata);
+/*! module_conn_waiting
+ \brief TRUE while the packets of the connection have to be parked
+ */
+#define module_conn_waiting(conn) \
+    ((conn)->pending && g_atomic_int_get(&(conn)->pending->state) != JOB_RESUMED)
+
+gboolean module_param_int(const struct node *node, const char *name,
+        int *value);
+
+status_t module_param_backup(const struct node *node,
+        struct module_backup *backup);
+
+void save_backup_handler(gpointer unused);
 
 /*!************ [Basic Modules] **************/
 
 /*!** MODULE YESNO **/
+status_t parse_mod_yesno(struct node *node);
 mod_result_t mod_yesno(struct mod_args *args);
 
 /*!** MODULE COUNTER **/
+status_t parse_mod_counter(struct node *node);
 mod_result_t mod_counter(struct mod_args *args);
 
 /*!** MODULE RANDOM **/
+status_t parse_mod_random(struct node *node);
 mod_result_t mod_random(struct mod_args *args);
 
 /*!*********** [Advanced Modules] ************/
 
 /*!** MODULE HASH **/
-#ifdef HAVE_CRYPTO
-int init_mod_hash();
+status_t init_mod_hash();
+void close_mod_hash();
+status_t parse_mod_hash(struct node *node);
 mod_result_t mod_hash(struct mod_args *args);
-#endif
+struct hash_stream;
+void free_hash_stream(struct hash_stream *stream);
+
+/*!** MODULE REPUTATION **/
+status_t init_mod_reputation();
+void close_mod_reputation();
+status_t parse_mod_reputation(struct node *node);
+mod_result_t mod_reputation(struct mod_args *args);
+
+/*!** MODULE NETWORK **/
+status_t init_mod_network();
+void close_mod_network();
+status_t parse_mod_network(struct node *node);
+mod_result_t mod_network(struct mod_args *args);
 
 /*!** MODULE SOURCE **/
+status_t parse_mod_source(struct node *node);
 mod_result_t mod_source(struct mod_args *args);
 
 /*!** MODULE CONTROL **/
+status_t parse_mod_control(struct node *node);
 mod_result_t mod_control(struct mod_args *args);
+struct control_state;
+const char *print_mod_control(struct control_state *state);
 
 #ifdef HAVE_XMPP
 /*!** MODULE DIONAEA **/
@@ -81,17 +138,27 @@ mod_result_t mod_dionaea(struct mod_args *args);
 #endif
 
 /*!** MODULE TIMED SOURCE **/
+status_t parse_mod_source_time(struct node *node);
 mod_result_t mod_source_time(struct mod_args *args);
 
 /*!** MODULE BACKPICK RANDOM **/
 mod_result_t mod_backpick_random(struct mod_args *args);
 
+/*!** MODULE BACKPICK BALANCE **/
+status_t parse_mod_backpick_balance(struct node *node);
+mod_result_t mod_backpick_balance(struct mod_args *args);
+
 /*!** MODULE VMI **/
-int init_mod_vmi();
+status_t init_mod_vmi();
 void close_mod_vmi();
+status_t parse_mod_vmi(struct node *node);
 mod_result_t mod_vmi(struct mod_args *args);
 
 /*!** MODULE DNS CONTROL **/
+status_t init_mod_dns_control();
+void close_mod_dns_control();
+status_t parse_mod_dns_control(struct node *node);
 mod_result_t mod_dns_control(struct mod_args *args);
+void dns_control_learn(struct pkt_struct *pkt);
 
 #endif //_MODULES_H_
@@ -702,7 +702,7 @@ status_t proxy_ext2int(struct pkt_struct* pkt) {
         case EXT:
             pkt->out = pkt->conn->target->front_handler->iface;
             pkt->nat.dst_mac = pkt->conn->target->front_handler->mac;
-            pkt->nat.dst_ip = pkt->conn->target->front_handler->ip;
+            pkt->nat.dst_ip = &pkt->conn->front_ip;
             pkt->nat.dst_vlan = &pkt->conn->target->front_handler->vlan;
             pkt->destination = LIH;
             break;
@@ -1034,6 +1034,74 @@ void reply_reset(struct pkt_struct *pkt, struct interface *iface) {
     }
 }
 
+/*! reply_udp
+ *
+ \brief answer a UDP packet in place of its destination
+ \param[in] pkt: the packet to answer, its original headers are swapped
+ \param[in] iface: the interface to send the answer on
+ \param[in] payload: the UDP payload of the answer
+ \param[in] len: the size of the payload
+ */
+void reply_udp(struct pkt_struct *pkt, struct interface *iface,
+        const void *payload, uint32_t len) {
+
+    if (likely(pkt && iface && pkt->original_headers.udp)) {
+
+        uint32_t hlen = pkt->original_headers.vlan ? VLAN_ETH_HLEN : ETHER_HDR_LEN;
+        uint32_t size = hlen + sizeof(struct iphdr) + UDP_HDR_LEN + len;
+
+        if (size - hlen > iface->mtu) {
+            printdbg("%s UDP answer of %u bytes doesn't fit the MTU\n", H(5), len);
+            return;
+        }
+
+        unsigned char *frame = g_malloc0(size);
+        struct ether_header *eth = (struct ether_header *) frame;
+        struct iphdr *ip = (struct iphdr *) (frame + hlen);
+        struct udphdr *udp = (struct udphdr *) ((char *) ip + sizeof(struct iphdr));
+
+        if (pkt->original_headers.vlan) {
+            struct vlan_ethhdr *vlan = (struct vlan_ethhdr *) frame;
+            *vlan = *(pkt->original_headers.vlan);
+            memcpy(&vlan->h_source, &pkt->original_headers.vlan->h_dest,
+                    ETH_ALEN);
+            memcpy(&vlan->h_dest, &pkt->original_headers.vlan->h_source,
+                    ETH_ALEN);
+        } else {
+            memcpy(&eth->ether_shost, &pkt->original_headers.eth->ether_dhost,
+                    ETH_ALEN);
+            memcpy(&eth->ether_dhost, &pkt->original_headers.eth->ether_shost,
+                    ETH_ALEN);
+            eth->ether_type = htons(ETHERTYPE_IP);
+        }
+
+        /*! fill up the IP header */
+        ip->version = 4;
+        ip->ihl = sizeof(struct iphdr) >> 2;
+        ip->tot_len = htons(sizeof(struct iphdr) + UDP_HDR_LEN + len);
+        ip->frag_off = htons(0x4000);
+        ip->ttl = 0x40;
+        ip->protocol = IPPROTO_UDP;
+        ip->saddr = pkt->original_headers.ip->daddr;
+        ip->daddr = pkt->original_headers.ip->saddr;
+
+        /*! fill up the UDP header, without checksum as the proxied packets */
+        udp->source = pkt->original_headers.udp->dest;
+        udp->dest = pkt->original_headers.udp->source;
+        udp->len = htons(UDP_HDR_LEN + len);
+        udp->check = 0;
+        memcpy((char *) udp + UDP_HDR_LEN, payload, len);
+
+        set_ip_checksum(ip);
+
+        if (pcap_inject(iface->pcap, frame, size) == -1) {
+            printdbg("%s UDP answer failed!\n", H(5));
+        }
+
+        g_free(frame);
+    }
+}
+
 /*! reset_lih
  *
  \brief reset the LIH when redirected to HIH
@@ -41,6 +41,9 @@ status_t forward_ext2hih(struct pkt_struct* pkt);
 
 void reply_reset(struct pkt_struct *pkt, struct interface *iface);
 
+void reply_udp(struct pkt_struct *pkt, struct interface *iface,
+        const void *payload, uint32_t len);
+
 void reset_lih(struct conn_struct* connection_data);
 
 status_t replay(struct conn_struct* connection_data, struct pkt_struct* pkt);
@@ -0,0 +1,223 @@
+/*
+ * This file is part of the honeybrid project.
+ *
+ * 2007-2009 University of Maryland (http://www.umd.edu)
+ * Robin Berthier <robinb@umd.edu>, Thomas Coquelin <coquelin@umd.edu>
+ * and Julien Vehent <julien@linuxwall.info>
+ *
+ * 2012-2014 University of Connecticut (http://www.uconn.edu)
+ * Tamas K Lengyel <tamas.k.lengyel@gmail.com>
+ *
+ * Honeybrid is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "prefix.h"
+
+/*!	\file prefix.c
+ \brief
+
+ Longest-prefix-match table used to map addresses to the targets and
+ handlers configured for whole address blocks.
+
+ */
+
+struct prefix_table *prefix_table_new(GDestroyNotify value_free) {
+	struct prefix_table *table = g_malloc0(sizeof(struct prefix_table));
+	table->value_free = value_free;
+	return table;
+}
+
+void prefix_table_free(struct prefix_table *table) {
+	if (table) {
+		int bits;
+		for (bits = 0; bits <= 32; bits++) {
+			if (table->networks[bits]) {
+				g_hash_table_destroy(table->networks[bits]);
+			}
+		}
+		g_free(table);
+	}
+}
+
+/*! prefix_table_copy
+ \brief duplicate a table, to change the copy while the original is in use
+ \param[in] copy: duplicates a value, NULL to share the values
+ */
+struct prefix_table *prefix_table_copy(const struct prefix_table *table,
+		GBoxedCopyFunc copy) {
+
+	struct prefix_table *dup = prefix_table_new(table->value_free);
+	uint64_t lengths = table->lengths;
+
+	while (lengths) {
+		int bits = 63 - __builtin_clzll(lengths);
+		lengths &= ~(1ULL << bits);
+
+		GHashTableIter i;
+		gpointer network, value;
+		g_hash_table_iter_init(&i, table->networks[bits]);
+		while (g_hash_table_iter_next(&i, &network, &value)) {
+			prefix_table_insert(dup, GPOINTER_TO_UINT(network), bits,
+					copy ? copy(value) : value);
+		}
+	}
+
+	return dup;
+}
+
+/*! prefix_table_insert
+ \brief store value for network/bits, replacing the previous value if any
+ */
+void prefix_table_insert(struct prefix_table *table, ip_addr_t network,
+		uint8_t bits, gpointer value) {
+
+	if (bits > 32) {
+		return;
+	}
+
+	if (!table->networks[bits]) {
+		table->networks[bits] = g_hash_table_new_full(g_direct_hash,
+				g_direct_equal, NULL, table->value_free);
+	}
+
+	g_hash_table_insert(table->networks[bits],
+			GUINT_TO_POINTER(network & prefix_mask(bits)), value);
+	table->lengths |= 1ULL << bits;
+}
+
+gpointer prefix_table_exact(const struct prefix_table *table,
+		ip_addr_t network, uint8_t bits) {
+
+	if (bits > 32 || !table->networks[bits]) {
+		return NULL;
+	}
+
+	return g_hash_table_lookup(table->networks[bits],
+			GUINT_TO_POINTER(network & prefix_mask(bits)));
+}
+
+gboolean prefix_table_remove(struct prefix_table *table, ip_addr_t network,
+		uint8_t bits) {
+
+	if (bits > 32 || !table->networks[bits]) {
+		return FALSE;
+	}
+
+	gboolean ret = g_hash_table_remove(table->networks[bits],
+			GUINT_TO_POINTER(network & prefix_mask(bits)));
+
+	if (!g_hash_table_size(table->networks[bits])) {
+		table->lengths &= ~(1ULL << bits);
+	}
+
+	return ret;
+}
+
+/*! prefix_table_foreach_match
+ \brief call func on the values of the prefixes containing ip, longest first
+ \return TRUE if func returned TRUE
+ */
+gboolean prefix_table_foreach_match(const struct prefix_table *table,
+		ip_addr_t ip, prefix_match_func func, gpointer data) {
+
+	uint64_t lengths = table->lengths;
+
+	while (lengths) {
+		int bits = 63 - __builtin_clzll(lengths);
+		lengths &= ~(1ULL << bits);
+
+		gpointer value = g_hash_table_lookup(table->networks[bits],
+				GUINT_TO_POINTER(ip & prefix_mask(bits)));
+		if (value && func(value, data)) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static gboolean first_match(gpointer value, gpointer data) {
+	*(gpointer *) data = value;
+	return TRUE;
+}
+
+/*! prefix_table_lookup
+ \brief longest-prefix match
+ \return the value of the longest prefix containing ip, NULL if none does
+ */
+gpointer prefix_table_lookup(const struct prefix_table *table, ip_addr_t ip) {
+	gpointer value = NULL;
+	prefix_table_foreach_match(table, ip, first_match, &value);
+	return value;
+}
+
+static struct addr *new_prefix(uint32_t network, uint8_t bits) {
+	struct addr *prefix = g_malloc0(sizeof(struct addr));
+	prefix->addr_type = ADDR_TYPE_IP;
+	prefix->addr_bits = bits;
+	prefix->addr_ip = htonl(network);
+	return prefix;
+}
+
+/*! parse_address_block
+ \brief parse an address, a CIDR prefix or a first-last range
+ *
+ * Ranges are split into the smallest set of prefixes covering them.
+ *
+ \return list of struct addr with addr_bits set to the prefix length,
+ * NULL if block can't be parsed
+ */
+GSList *parse_address_block(const char *block) {
+
+	GSList *prefixes = NULL;
+	const char *dash = strchr(block, '-');
+
+	if (!dash) {
+		struct addr prefix;
+		if (addr_pton(block, &prefix) < 0 || prefix.addr_type != ADDR_TYPE_IP) {
+			return NULL;
+		}
+		return g_slist_append(NULL,
+				new_prefix(ntohl(prefix.addr_ip & prefix_mask(prefix.addr_bits)),
+						prefix.addr_bits));
+	}
+
+	struct addr first, last;
+	gchar *first_str = g_strndup(block, dash - block);
+	int ret = addr_pton(first_str, &first) | addr_pton(dash + 1, &last);
+	g_free(first_str);
+
+	if (ret < 0 || first.addr_type != ADDR_TYPE_IP
+			|| last.addr_type != ADDR_TYPE_IP) {
+		return NULL;
+	}
+
+	uint64_t start = ntohl(first.addr_ip);
+	uint64_t end = ntohl(last.addr_ip);
+
+	while (start <= end) {
+		uint8_t bits = 32;
+		while (bits > 0) {
+			uint64_t size = 1ULL << (33 - bits);
+			if ((start & (size - 1)) || start + size - 1 > end) {
+				break;
+			}
+			bits--;
+		}
+		prefixes = g_slist_append(prefixes, new_prefix(start, bits));
+		start += 1ULL << (32 - bits);
+	}
+
+	return prefixes;
+}
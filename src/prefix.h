@@ -0,0 +1,74 @@
+/*
+ * This file is part of the honeybrid project.
+ *
+ * 2007-2009 University of Maryland (http://www.umd.edu)
+ * Robin Berthier <robinb@umd.edu>, Thomas Coquelin <coquelin@umd.edu>
+ * and Julien Vehent <julien@linuxwall.info>
+ *
+ * 2012-2014 University of Connecticut (http://www.uconn.edu)
+ * Tamas K Lengyel <tamas.k.lengyel@gmail.com>
+ *
+ * Honeybrid is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PREFIX_H_
+#define __PREFIX_H_
+
+#include "types.h"
+
+/*!
+ \def prefix_table
+ \brief longest-prefix-match table of IPv4 prefixes
+ *
+ * One hash table per prefix length, keyed by the network address. A lookup
+ * probes the lengths in use from the longest to the shortest, so its cost
+ * depends on the number of distinct prefix lengths, not on the number of
+ * prefixes or addresses covered.
+ */
+struct prefix_table {
+	GHashTable *networks[33];
+	uint64_t lengths; // bit n is set if prefixes of length n are stored
+	GDestroyNotify value_free;
+};
+
+/*! Called for each matching prefix, longest first, until it returns TRUE */
+typedef gboolean (*prefix_match_func)(gpointer value, gpointer data);
+
+#define prefix_mask(bits) \
+	((bits) ? htonl(0xFFFFFFFFu << (32 - (bits))) : 0)
+
+struct prefix_table *prefix_table_new(GDestroyNotify value_free);
+
+void prefix_table_free(struct prefix_table *table);
+
+struct prefix_table *prefix_table_copy(const struct prefix_table *table,
+		GBoxedCopyFunc copy);
+
+void prefix_table_insert(struct prefix_table *table, ip_addr_t network,
+		uint8_t bits, gpointer value);
+
+gpointer prefix_table_exact(const struct prefix_table *table,
+		ip_addr_t network, uint8_t bits);
+
+gboolean prefix_table_remove(struct prefix_table *table, ip_addr_t network,
+		uint8_t bits);
+
+gpointer prefix_table_lookup(const struct prefix_table *table, ip_addr_t ip);
+
+gboolean prefix_table_foreach_match(const struct prefix_table *table,
+		ip_addr_t ip, prefix_match_func func, gpointer data);
+
+GSList *parse_address_block(const char *block);
+
+#endif /* __PREFIX_H_ */
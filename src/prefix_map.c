@@ -0,0 +1,236 @@
+/*
+ * This file is part of the honeybrid project.
+ *
+ * 2007-2009 University of Maryland (http://www.umd.edu)
+ * Robin Berthier <robinb@umd.edu>, Thomas Coquelin <coquelin@umd.edu>
+ * and Julien Vehent <julien@linuxwall.info>
+ *
+ * 2012-2014 University of Connecticut (http://www.uconn.edu)
+ * Tamas K Lengyel <tamas.k.lengyel@gmail.com>
+ *
+ * Honeybrid is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "prefix_map.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*!	\file prefix_map.c
+ \brief
+
+ Longest-prefix-match maps of labelled networks (ASN, country, customer
+ ranges...) compiled into a file that is mapped rather than loaded, in the
+ DIR-24-8 layout: a lookup is one read in the 2^24 entries table and, for
+ the /24 holding prefixes longer than /24, one read in a group of 256
+ entries. The cost doesn't depend on the number of prefixes, the 64MB table
+ is only paged in where addresses are looked up.
+
+ Unlike prefix_table (prefix.c), which holds the targets and is changed in
+ place, a map is built once by honeybrid-prefix-map and replaced as a whole.
+ prefix_table keeps a hash table on the heap per prefix length and probes
+ each length in use, which suits a few hundred targets but neither millions
+ of prefixes nor a file shared between the processes mapping it. The
+ compiler still parses the blocks and deduplicates them with prefix.c.
+
+ */
+
+static inline uint64_t tables_size(const struct prefix_map_header *header) {
+	return ((uint64_t) PREFIX_MAP_TBL24
+			+ (uint64_t) header->groups * PREFIX_MAP_GROUP) * sizeof(uint32_t)
+			+ (uint64_t) (header->labels + 1)
+					* (sizeof(uint64_t) + sizeof(uint32_t));
+}
+
+/*! prefix_map_open
+ \brief map a compiled prefix map
+ \return NULL if the file can't be mapped or isn't a valid map
+ */
+struct prefix_map *prefix_map_open(const char *file) {
+	const struct prefix_map_header *header;
+	struct stat st;
+	void *map;
+	int fd;
+
+	if ((fd = open(file, O_RDONLY)) < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) || st.st_size < (off_t) sizeof(*header)) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	header = map;
+	if (memcmp(header->magic, PREFIX_MAP_MAGIC, 4)
+			|| header->version != PREFIX_MAP_VERSION
+			|| header->labels >= PREFIX_MAP_MAX_LABELS
+			|| header->groups >= PREFIX_MAP_MAX_LABELS
+			|| sizeof(*header) + tables_size(header) + header->strings
+					!= (uint64_t) st.st_size) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	madvise(map, st.st_size, MADV_RANDOM);
+
+	struct prefix_map *prefix_map = g_malloc0(sizeof(struct prefix_map));
+	prefix_map->header = header;
+	prefix_map->tbl24 = (const uint32_t *) (header + 1);
+	prefix_map->groups = prefix_map->tbl24 + PREFIX_MAP_TBL24;
+	prefix_map->label_hashes = (const uint64_t *) (prefix_map->groups
+			+ (uint64_t) header->groups * PREFIX_MAP_GROUP);
+	prefix_map->label_offsets = (const uint32_t *) (prefix_map->label_hashes
+			+ header->labels + 1);
+	prefix_map->strings = (const char *) (prefix_map->label_offsets
+			+ header->labels + 1);
+	prefix_map->size = st.st_size;
+
+	/* a corrupted map must not send the lookups out of the mapping */
+	uint32_t i;
+	for (i = 0; i <= header->labels; i++) {
+		if (prefix_map->label_offsets[i] >= header->strings) {
+			prefix_map_close(prefix_map);
+			return NULL;
+		}
+	}
+	if (header->strings && prefix_map->strings[header->strings - 1]) {
+		prefix_map_close(prefix_map);
+		return NULL;
+	}
+
+	return prefix_map;
+}
+
+void prefix_map_close(struct prefix_map *map) {
+	if (map) {
+		munmap((void *) map->header, map->size);
+		g_free(map);
+	}
+}
+
+static gint prefix_entry_cmp(gconstpointer a, gconstpointer b) {
+	const struct prefix_entry *x = a, *y = b;
+	return (gint) x->bits - (gint) y->bits;
+}
+
+/*! prefix_map_write
+ \brief compile labelled prefixes into a map
+ *
+ * Prefixes are applied from the shortest to the longest, so a longer one
+ * overrides the shorter ones it's part of. The map is written next to file
+ * and renamed over it.
+ \param[in] labels: labels[i] names label i, labels[0] is unused
+ */
+status_t prefix_map_write(const char *file, struct prefix_entry *prefixes,
+		uint64_t count, char **labels, uint32_t label_count) {
+
+	struct prefix_map_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PREFIX_MAP_MAGIC, 4);
+	header.version = PREFIX_MAP_VERSION;
+	header.labels = label_count;
+	header.prefixes = count;
+
+	qsort(prefixes, count, sizeof(struct prefix_entry), prefix_entry_cmp);
+
+	uint32_t *tbl24 = g_try_malloc0(PREFIX_MAP_TBL24 * sizeof(uint32_t));
+	GArray *groups = g_array_new(FALSE, TRUE, sizeof(uint32_t));
+	if (!tbl24) {
+		g_array_free(groups, TRUE);
+		return NOK;
+	}
+
+	uint64_t i;
+	for (i = 0; i < count; i++) {
+		const struct prefix_entry *p = &prefixes[i];
+		uint32_t network = p->bits ?
+				p->network & (0xFFFFFFFFu << (32 - p->bits)) : 0;
+
+		if (p->bits <= 24) {
+			uint32_t first = network >> 8, n = 1u << (24 - p->bits), j;
+			for (j = 0; j < n; j++)
+				tbl24[first + j] = p->label;
+			continue;
+		}
+
+		uint32_t *entry = &tbl24[network >> 8];
+		if (!(*entry & PREFIX_MAP_IS_GROUP)) {
+			/* the group starts with what covered the whole /24 */
+			uint32_t group = groups->len / PREFIX_MAP_GROUP, j;
+			for (j = 0; j < PREFIX_MAP_GROUP; j++)
+				g_array_append_val(groups, *entry);
+			*entry = group | PREFIX_MAP_IS_GROUP;
+		}
+
+		uint32_t *group = &g_array_index(groups, uint32_t,
+				(*entry & ~PREFIX_MAP_IS_GROUP) * PREFIX_MAP_GROUP);
+		uint32_t first = network & 0xff, n = 1u << (32 - p->bits), j;
+		for (j = 0; j < n; j++)
+			group[first + j] = p->label;
+	}
+	header.groups = groups->len / PREFIX_MAP_GROUP;
+
+	uint64_t *label_hashes = g_malloc0((label_count + 1) * sizeof(uint64_t));
+	uint32_t *label_offsets = g_malloc0((label_count + 1) * sizeof(uint32_t));
+	GString *strings = g_string_new("");
+	g_string_append_c(strings, '\0'); /* label 0 */
+	uint32_t l;
+	for (l = 1; l <= label_count; l++) {
+		label_hashes[l] = prefix_map_label_hash(labels[l]);
+		label_offsets[l] = strings->len;
+		g_string_append_len(strings, labels[l], strlen(labels[l]) + 1);
+	}
+	header.strings = strings->len;
+
+	gchar *tmp = g_strdup_printf("%s.%u", file, (unsigned) getpid());
+	status_t ret = NOK;
+	FILE *out = fopen(tmp, "w");
+	if (!out) {
+		goto done;
+	}
+
+	gboolean written = fwrite(&header, sizeof(header), 1, out) == 1
+			&& fwrite(tbl24, sizeof(uint32_t), PREFIX_MAP_TBL24, out)
+					== PREFIX_MAP_TBL24
+			&& fwrite(groups->data, sizeof(uint32_t), groups->len, out)
+					== groups->len
+			&& fwrite(label_hashes, sizeof(uint64_t), label_count + 1, out)
+					== label_count + 1
+			&& fwrite(label_offsets, sizeof(uint32_t), label_count + 1, out)
+					== label_count + 1
+			&& fwrite(strings->str, 1, strings->len, out) == strings->len
+			&& !fflush(out) && !fsync(fileno(out));
+
+	if (fclose(out) || !written || rename(tmp, file)) {
+		unlink(tmp);
+		goto done;
+	}
+
+	ret = OK;
+
+	done: g_free(tmp);
+	g_free(tbl24);
+	g_array_free(groups, TRUE);
+	g_free(label_hashes);
+	g_free(label_offsets);
+	g_string_free(strings, TRUE);
+	return ret;
+}
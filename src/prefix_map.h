@@ -0,0 +1,132 @@
+/*
+ * This file is part of the honeybrid project.
+ *
+ * 2007-2009 University of Maryland (http://www.umd.edu)
+ * Robin Berthier <robinb@umd.edu>, Thomas Coquelin <coquelin@umd.edu>
+ * and Julien Vehent <julien@linuxwall.info>
+ *
+ * 2012-2014 University of Connecticut (http://www.uconn.edu)
+ * Tamas K Lengyel <tamas.k.lengyel@gmail.com>
+ *
+ * Honeybrid is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PREFIX_MAP_H_
+#define __PREFIX_MAP_H_
+
+#include "types.h"
+
+#define PREFIX_MAP_MAGIC	"HBPM"
+#define PREFIX_MAP_VERSION	1
+
+/*! DIR-24-8: the first table is indexed by the top 24 bits of an address,
+ * the longer prefixes get groups of 256 entries for the last 8 bits */
+#define PREFIX_MAP_TBL24	(1 << 24)
+#define PREFIX_MAP_GROUP	256
+#define PREFIX_MAP_IS_GROUP	0x80000000u
+#define PREFIX_MAP_MAX_LABELS	0x7fffffffu
+
+/*!
+ \def prefix_map_header
+ \brief start of a compiled prefix map
+ *
+ * It's followed by the 24-bit table, the groups, the hash of each label,
+ * the offset of each label in the strings and the strings. Label 0 means
+ * no prefix matched.
+ *
+ \param labels, distinct labels, not counting label 0
+ \param groups, of 256 entries for the prefixes longer than /24
+ \param prefixes, compiled in
+ \param strings, bytes of the label strings
+ */
+struct prefix_map_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t labels;
+	uint32_t groups;
+	uint64_t prefixes;
+	uint64_t strings;
+	uint8_t reserved[32];
+};
+
+/*!
+ \def prefix_map
+ \brief a compiled prefix map mapped in memory
+ */
+struct prefix_map {
+	const struct prefix_map_header *header;
+	const uint32_t *tbl24;
+	const uint32_t *groups;
+	const uint64_t *label_hashes;
+	const uint32_t *label_offsets;
+	const char *strings;
+	size_t size;
+};
+
+/*! prefix_map_label_hash
+ \brief what the labels are compared with, so the modules don't depend on
+ * the ids a compilation gave them (FNV-1a)
+ */
+static inline uint64_t prefix_map_label_hash(const char *label) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	while (*label) {
+		h ^= (uint8_t) *label++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+/*! prefix_map_lookup
+ \brief label of the longest prefix holding the address, in network byte
+ * order, 0 if none does
+ *
+ * The entries are checked here rather than when the map is opened, which
+ * would page in the whole 24-bit table: a corrupted one matches no prefix.
+ */
+static inline uint32_t prefix_map_lookup(const struct prefix_map *map,
+		uint32_t ip) {
+	uint32_t host = ntohl(ip);
+	uint32_t entry = map->tbl24[host >> 8];
+
+	if (entry & PREFIX_MAP_IS_GROUP) {
+		uint32_t group = entry & ~PREFIX_MAP_IS_GROUP;
+		if (group >= map->header->groups)
+			return 0;
+		entry = map->groups[(uint64_t) group * PREFIX_MAP_GROUP
+				+ (host & 0xff)];
+	}
+	return entry <= map->header->labels ? entry : 0;
+}
+
+#define prefix_map_label(map, label) \
+	((map)->strings + (map)->label_offsets[(label)])
+
+struct prefix_map *prefix_map_open(const char *file);
+
+void prefix_map_close(struct prefix_map *map);
+
+/*!
+ \def prefix_entry
+ \brief a prefix to compile, network in host byte order
+ */
+struct prefix_entry {
+	uint32_t network;
+	uint8_t bits;
+	uint32_t label;
+};
+
+status_t prefix_map_write(const char *file, struct prefix_entry *prefixes,
+		uint64_t count, char **labels, uint32_t label_count);
+
+#endif /* __PREFIX_MAP_H_ */
@@ -0,0 +1,185 @@
+/*
+ * This file is part of the honeybrid project.
+ *
+ * 2007-2009 University of Maryland (http://www.umd.edu)
+ * Robin Berthier <robinb@umd.edu>, Thomas Coquelin <coquelin@umd.edu>
+ * and Julien Vehent <julien@linuxwall.info>
+ *
+ * 2012-2014 University of Connecticut (http://www.uconn.edu)
+ * Tamas K Lengyel <tamas.k.lengyel@gmail.com>
+ *
+ * Honeybrid is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*!	\file prefix_map_compile.c
+ \brief
+
+ honeybrid-prefix-map compiles lists of labelled networks into the prefix
+ maps the network module maps. Each line has an address block, parsed as
+ the ones of the configuration (an address, a CIDR block or a first-last
+ range), and its label, such as "8.8.8.0/24 AS15169" or "5.10.0.0/16 FR".
+ The lines starting with # are ignored, a line without a label gets the one
+ given with -l. A block listed twice keeps its last label.
+
+ honeybrid-prefix-map [-l label] -o output list...
+
+ */
+
+#include "prefix_map.h"
+#include "prefix.h"
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+
+#define SEPARATORS	" \t\r\n,;"
+
+static void usage(const char *name) {
+	fprintf(stderr,
+			"Usage: %s [-l label] -o output list...\n"
+			" -l\tlabel of the lines that have none\n"
+			" -o\tfile to write, replaced atomically\n"
+			" list\tfiles of \"block label\" lines, - for stdin\n",
+			name);
+	exit(1);
+}
+
+struct compiler {
+	GArray *prefixes; /* struct prefix_entry */
+	struct prefix_table *known; /* value: index in prefixes + 1 */
+	GPtrArray *labels; /* label i at i, NULL at 0 */
+	GHashTable *label_ids; /* key: label, value: id */
+	const char *default_label;
+};
+
+static uint32_t label_id(struct compiler *c, const char *label) {
+	gpointer id = g_hash_table_lookup(c->label_ids, label);
+	if (!id) {
+		gchar *copy = g_strdup(label);
+		g_ptr_array_add(c->labels, copy);
+		id = GUINT_TO_POINTER(c->labels->len - 1);
+		g_hash_table_insert(c->label_ids, copy, id);
+	}
+	return GPOINTER_TO_UINT(id);
+}
+
+static void read_list(struct compiler *c, FILE *in, const char *name) {
+	char line[1024];
+	uint64_t lineno = 0, skipped = 0;
+
+	while (fgets(line, sizeof(line), in)) {
+		lineno++;
+
+		char *save = NULL;
+		char *block = strtok_r(line, SEPARATORS, &save);
+		if (!block || *block == '#')
+			continue;
+		const char *label = strtok_r(NULL, SEPARATORS, &save);
+		if (!label || *label == '#')
+			label = c->default_label;
+
+		GSList *blocks = parse_address_block(block), *b;
+		if (!label || !blocks) {
+			if (skipped++ < 10)
+				fprintf(stderr, "%s:%"PRIu64": skipping '%s'\n", name, lineno,
+						block);
+			g_slist_free_full(blocks, g_free);
+			continue;
+		}
+
+		uint32_t id = label_id(c, label);
+		for (b = blocks; b; b = b->next) {
+			const struct addr *prefix = b->data;
+			gsize known = GPOINTER_TO_SIZE(prefix_table_exact(c->known,
+					prefix->addr_ip, prefix->addr_bits));
+
+			if (known) {
+				g_array_index(c->prefixes, struct prefix_entry, known - 1).label =
+						id;
+			} else {
+				struct prefix_entry entry = {
+					.network = ntohl(prefix->addr_ip),
+					.bits = prefix->addr_bits,
+					.label = id
+				};
+				g_array_append_val(c->prefixes, entry);
+				prefix_table_insert(c->known, prefix->addr_ip,
+						prefix->addr_bits, GSIZE_TO_POINTER(c->prefixes->len));
+			}
+		}
+		g_slist_free_full(blocks, g_free);
+	}
+
+	if (skipped)
+		fprintf(stderr, "%s: %"PRIu64" lines skipped\n", name, skipped);
+}
+
+int main(int argc, char *argv[]) {
+	struct compiler c = {
+		.prefixes = g_array_new(FALSE, FALSE, sizeof(struct prefix_entry)),
+		.known = prefix_table_new(NULL),
+		.labels = g_ptr_array_new_with_free_func(g_free),
+		.label_ids = g_hash_table_new(g_str_hash, g_str_equal)
+	};
+	const char *output = NULL;
+	int opt;
+
+	g_ptr_array_add(c.labels, NULL);
+
+	while ((opt = getopt(argc, argv, "l:o:h")) != -1) {
+		switch (opt) {
+		case 'l':
+			c.default_label = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (!output || optind == argc)
+		usage(argv[0]);
+
+	int i;
+	for (i = optind; i < argc; i++) {
+		FILE *in = strcmp(argv[i], "-") ? fopen(argv[i], "r") : stdin;
+		if (!in)
+			err(1, "%s", argv[i]);
+		read_list(&c, in, argv[i]);
+		if (in != stdin)
+			fclose(in);
+	}
+
+	if (prefix_map_write(output, (struct prefix_entry *) c.prefixes->data,
+			c.prefixes->len, (char **) c.labels->pdata, c.labels->len - 1)
+			!= OK)
+		err(1, "%s", output);
+
+	struct prefix_map *map = prefix_map_open(output);
+	if (!map)
+		errx(1, "%s: can't map the prefix map that was written", output);
+
+	printf("%s: %"PRIu64" prefixes with %u labels, %u groups, %zu bytes\n",
+			output, map->header->prefixes, map->header->labels,
+			map->header->groups, map->size);
+
+	prefix_map_close(map);
+	g_hash_table_destroy(c.label_ids);
+	g_ptr_array_free(c.labels, TRUE);
+	prefix_table_free(c.known);
+	g_array_free(c.prefixes, TRUE);
+	return 0;
+}
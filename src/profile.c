@@ -0,0 +1,124 @@
+/*
+ * This file is part of the honeybrid project.
+ *
+ * 2007-2009 University of Maryland (http://www.umd.edu)
+ * Robin Berthier <robinb@umd.edu>, Thomas Coquelin <coquelin@umd.edu>
+ * and Julien Vehent <julien@linuxwall.info>
+ *
+ * 2012-2014 University of Connecticut (http://www.uconn.edu)
+ * Tamas K Lengyel <tamas.k.lengyel@gmail.com>
+ *
+ * Honeybrid is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "profile.h"
+#include "globals.h"
+
+/*!	\file profile.c
+ \brief
+
+ Always-on counters of the module runs of a rule node. Each decision thread
+ owns a slot of the counters of every node, so recording a run is a few
+ plain additions with no lock and no atomic: only the thread owning the
+ slot writes to it. Readers sum the slots without locking either, and may
+ see a run half recorded, which is good enough for statistics.
+
+ The slots of a node are allocated the first time it runs, there is one per
+ decision thread. Other threads calling decide() would share the slots.
+
+ */
+
+struct profile {
+	uint32_t slots;
+	struct profile_counters slot[];
+};
+
+static gint thread_count;
+
+static GPrivate thread_slot;
+
+/*! profile_slot
+ \brief index of the calling thread, assigned on its first record
+ */
+static inline uint32_t profile_slot(void) {
+	guint slot = GPOINTER_TO_UINT(g_private_get(&thread_slot));
+
+	if (!slot) {
+		slot = g_atomic_int_add(&thread_count, 1) + 1;
+		g_private_set(&thread_slot, GUINT_TO_POINTER(slot));
+	}
+
+	return slot - 1;
+}
+
+/*! profile_record
+ \brief account one run of a module taking nsec nanoseconds
+ */
+void profile_record(struct profile **profile, mod_result_t result,
+		gint64 nsec) {
+
+	struct profile *p = g_atomic_pointer_get(profile);
+
+	if (!p) {
+		uint32_t slots = MAX(decision_threads, 1);
+		p = g_malloc0(sizeof(struct profile)
+				+ slots * sizeof(struct profile_counters));
+		p->slots = slots;
+
+		if (!g_atomic_pointer_compare_and_exchange(profile, NULL, p)) {
+			/* another thread got there first */
+			g_free(p);
+			p = g_atomic_pointer_get(profile);
+		}
+	}
+
+	struct profile_counters *c = &p->slot[profile_slot() % p->slots];
+
+	if (nsec < 0)
+		nsec = 0;
+
+	gint bucket = g_bit_nth_msf((gulong) nsec >> 7, -1) + 1;
+
+	c->calls++;
+	c->results[result]++;
+	c->nsec += nsec;
+	c->histogram[MIN(bucket, PROFILE_BUCKETS - 1)]++;
+}
+
+/*! profile_sum
+ \brief add up the slots of all the threads
+ */
+void profile_sum(const struct profile *profile, struct profile_counters *sum) {
+
+	memset(sum, 0, sizeof(struct profile_counters));
+
+	if (!profile)
+		return;
+
+	uint32_t i, j;
+	for (i = 0; i < profile->slots; i++) {
+		const struct profile_counters *c = &profile->slot[i];
+
+		sum->calls += c->calls;
+		for (j = 0; j <= DE_PENDING; j++)
+			sum->results[j] += c->results[j];
+		sum->nsec += c->nsec;
+		for (j = 0; j < PROFILE_BUCKETS; j++)
+			sum->histogram[j] += c->histogram[j];
+	}
+}
+
+void profile_free(struct profile *profile) {
+	g_free(profile);
+}
@@ -0,0 +1,65 @@
+/*
+ * This file is part of the honeybrid project.
+ *
+ * 2007-2009 University of Maryland (http://www.umd.edu)
+ * Robin Berthier <robinb@umd.edu>, Thomas Coquelin <coquelin@umd.edu>
+ * and Julien Vehent <julien@linuxwall.info>
+ *
+ * 2012-2014 University of Connecticut (http://www.uconn.edu)
+ * Tamas K Lengyel <tamas.k.lengyel@gmail.com>
+ *
+ * Honeybrid is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PROFILE_H_
+#define __PROFILE_H_
+
+#include "types.h"
+#include <time.h>
+
+#define PROFILE_BUCKETS	20
+
+/*!
+ \def profile_counters
+ \brief what a decision thread recorded about the runs of a module
+ *
+ * Bucket 0 of the histogram counts the runs shorter than 128ns, bucket i
+ * the runs between 2^(i+6) and 2^(i+7) ns, the last bucket all the longer.
+ */
+struct profile_counters {
+	uint64_t calls;
+	uint64_t results[DE_PENDING + 1]; // indexed by mod_result_t
+	uint64_t nsec;
+	uint64_t histogram[PROFILE_BUCKETS];
+};
+
+struct profile;
+
+/*! profile_clock
+ \brief monotonic time in nanoseconds
+ */
+static inline gint64 profile_clock(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (gint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void profile_record(struct profile **profile, mod_result_t result,
+		gint64 nsec);
+
+void profile_sum(const struct profile *profile, struct profile_counters *sum);
+
+void profile_free(struct profile *profile);
+
+#endif /* __PROFILE_H_ */
@@ -0,0 +1,231 @@
+/*
+ * This file is part of the honeybrid project.
+ *
+ * 2007-2009 University of Maryland (http://www.umd.edu)
+ * Robin Berthier <robinb@umd.edu>, Thomas Coquelin <coquelin@umd.edu>
+ * and Julien Vehent <julien@linuxwall.info>
+ *
+ * 2012-2014 University of Connecticut (http://www.uconn.edu)
+ * Tamas K Lengyel <tamas.k.lengyel@gmail.com>
+ *
+ * Honeybrid is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "reload.h"
+#include <errno.h>
+#include "globals.h"
+#include "convenience.h"
+#include "log.h"
+#include "constants.h"
+#include "management.h"
+#include "connections.h"
+#include "epoch.h"
+
+/*!	\file reload.c
+ \brief
+
+ Live reload of the modules and targets of honeybrid.conf. The file is
+ parsed again off the data path into new module definitions and targets,
+ which replace the ones of the previous configuration in a single swap of
+ the lookup tables. The main configuration block and the links are only
+ read at startup.
+
+ The replaced targets keep serving the connections bound to them, with the
+ rules they were decided with, unless the reload policy retires those
+ connections. A replaced target is freed once the decision threads went
+ past the swap (see epoch.c) and its last connection ended. Each rule node
+ holds a reference on the module definition it was built from, so the
+ replaced definitions live as long as the rules of the replaced targets
+ and of the backends added at runtime.
+
+ The module definitions are swapped under reload_lock, the rules added at
+ runtime are compiled under it too, see create_current_rule.
+
+ */
+
+struct generation {
+	GSList *targets; /* replaced targets, freed once their connections are gone */
+	guint stamp; /* epoch of the swap */
+};
+
+/*! Reloads and the replaced generations, protected by reload_lock */
+static GMutex reload_lock;
+static GSList *generations;
+
+/*! find_reload_policy
+ \brief look up a reload policy by its name
+ \return OK if the name is known, NOK otherwise
+ */
+status_t find_reload_policy(const char *name, reload_policy_t *policy) {
+	reload_policy_t p;
+
+	for (p = 0; p < __MAX_RELOAD_POLICY; p++) {
+		if (!strcmp(name, lookup_reload_policy(p))) {
+			*policy = p;
+			return OK;
+		}
+	}
+
+	return NOK;
+}
+
+/*! reload_config
+ \brief replace the modules and targets by the ones currently in a configuration file
+ *
+ \param[in] file: the configuration file
+ \param[in] policy: what happens to the connections of the replaced targets
+ \param[out] loaded: number of targets loaded from the file
+ \param[out] replaced: number of targets replaced
+ \return OK when the new configuration is in use, NOK if it had errors
+ */
+status_t reload_config(const char *file, reload_policy_t policy,
+		uint32_t *loaded, uint32_t *replaced) {
+
+	status_t ret = NOK;
+	struct config_reload reload = { .config = NULL };
+	FILE *fp;
+
+	g_mutex_lock(&reload_lock);
+
+	if (!(fp = fopen(file, "r"))) {
+		g_printerr("%s Can't reload %s: %s\n", H(0), file, strerror(errno));
+		goto done;
+	}
+
+	g_printerr("--------------------------\nReloading configuration\n");
+
+	reload.config = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+			g_free);
+	reload.modules = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+			(GDestroyNotify) g_hash_table_unref);
+
+	ret = config_parse_reload(fp, &reload);
+	fclose(fp);
+
+	if (ret != OK) {
+		g_printerr("Configuration not reloaded: %s\n", reload.error);
+		g_slist_free_full(reload.targets, (GDestroyNotify) free_target);
+		g_hash_table_destroy(reload.modules);
+		goto done;
+	}
+
+	struct generation *gen = g_malloc0(sizeof(struct generation));
+
+	/* the rules built from the old definitions hold their own references */
+	g_hash_table_destroy(module);
+	module = reload.modules;
+	gen->targets = replace_targets(reload.targets);
+	gen->stamp = epoch_retire();
+
+	*loaded = g_slist_length(reload.targets);
+	*replaced = g_slist_length(gen->targets);
+	g_slist_free(reload.targets);
+
+	if (policy == RELOAD_RETIRE) {
+		GSList *loop;
+		for (loop = gen->targets; loop; loop = loop->next) {
+			retire_conns(&((struct target *) loop->data)->conns);
+		}
+	}
+
+	generations = g_slist_append(generations, gen);
+
+	g_printerr("Configuration reloaded: %u targets replaced by %u, %s their connections\n"
+			"--------------------------\n",
+			*replaced, *loaded, lookup_reload_policy(policy));
+
+	done:
+	if (reload.config)
+		g_hash_table_destroy(reload.config);
+	g_free(reload.error);
+	g_mutex_unlock(&reload_lock);
+
+	reap_retired();
+
+	return ret;
+}
+
+/*! create_current_rule
+ \brief compile a rule added at runtime against the module definitions in use
+ \return the compiled rule, NULL if the equation is invalid
+ */
+struct rule *create_current_rule(const gchar *equation) {
+	g_mutex_lock(&reload_lock);
+	struct rule *rule = DE_create_rule(equation, module);
+	g_mutex_unlock(&reload_lock);
+
+	return rule;
+}
+
+/*! reap_retired
+ \brief free the replaced targets nothing uses anymore
+ *
+ * Called after each reload and by the cleaning thread.
+ */
+void reap_retired(void) {
+
+	GSList *loop, *next;
+
+	g_mutex_lock(&reload_lock);
+
+	for (loop = generations; loop; loop = next) {
+		struct generation *gen = loop->data;
+		next = loop->next;
+
+		/* a decision thread may still be binding a new connection to them */
+		if (!epoch_passed(gen->stamp))
+			continue;
+
+		GSList *t, *t_next;
+		for (t = gen->targets; t; t = t_next) {
+			struct target *target = t->data;
+			t_next = t->next;
+
+			g_mutex_lock(&connlock);
+			guint left = target->conns.length;
+			g_mutex_unlock(&connlock);
+
+			if (!left) {
+				printdbg("%s Freeing replaced target %"PRIi64"\n", H(0),
+						target->targetID);
+				free_target(target);
+				gen->targets = g_slist_delete_link(gen->targets, t);
+			}
+		}
+
+		if (!gen->targets) {
+			g_free(gen);
+			generations = g_slist_delete_link(generations, loop);
+		}
+	}
+
+	g_mutex_unlock(&reload_lock);
+}
+
+/*! close_reload
+ \brief free what is left of the replaced configurations, once the connections are gone
+ */
+void close_reload(void) {
+
+	g_mutex_lock(&reload_lock);
+
+	while (generations) {
+		struct generation *gen = generations->data;
+		g_slist_free_full(gen->targets, (GDestroyNotify) free_target);
+		g_free(gen);
+		generations = g_slist_delete_link(generations, generations);
+	}
+
+	g_mutex_unlock(&reload_lock);
+}
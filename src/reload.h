@@ -0,0 +1,57 @@
+/*
+ * This file is part of the honeybrid project.
+ *
+ * 2007-2009 University of Maryland (http://www.umd.edu)
+ * Robin Berthier <robinb@umd.edu>, Thomas Coquelin <coquelin@umd.edu>
+ * and Julien Vehent <julien@linuxwall.info>
+ *
+ * 2012-2014 University of Connecticut (http://www.uconn.edu)
+ * Tamas K Lengyel <tamas.k.lengyel@gmail.com>
+ *
+ * Honeybrid is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RELOAD_H_
+#define __RELOAD_H_
+
+#include <setjmp.h>
+#include "types.h"
+#include "structs.h"
+
+/*!
+ \def config_reload
+ \brief what parsing the configuration again produced, see config_parse_reload
+ */
+struct config_reload {
+	GHashTable *config; // the main configuration, only read at startup
+	GHashTable *modules; // replaces the module definitions
+	GSList *targets; // replace the targets of the configuration
+	jmp_buf abort; // where errors in the configuration jump to
+	gchar *error;
+};
+
+status_t config_parse_reload(FILE *fp, struct config_reload *reload);
+
+status_t find_reload_policy(const char *name, reload_policy_t *policy);
+
+status_t reload_config(const char *file, reload_policy_t policy,
+		uint32_t *loaded, uint32_t *replaced);
+
+struct rule *create_current_rule(const gchar *equation);
+
+void reap_retired(void);
+
+void close_reload(void);
+
+#endif /* __RELOAD_H_ */
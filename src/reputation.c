@@ -0,0 +1,292 @@
+/*
+ * This file is part of the honeybrid project.
+ *
+ * 2007-2009 University of Maryland (http://www.umd.edu)
+ * Robin Berthier <robinb@umd.edu>, Thomas Coquelin <coquelin@umd.edu>
+ * and Julien Vehent <julien@linuxwall.info>
+ *
+ * 2012-2014 University of Connecticut (http://www.uconn.edu)
+ * Tamas K Lengyel <tamas.k.lengyel@gmail.com>
+ *
+ * Honeybrid is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "reputation.h"
+
+#include <math.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*!	\file reputation.c
+ \brief
+
+ Lists of addresses compiled into a file that is mapped rather than
+ loaded, so lists of tens of millions of addresses cost no heap and are
+ shared with the page cache.
+
+ A list is compiled either into a blocked bloom filter or into an exact
+ table. The bloom filter keeps about 10 bits per address for 1% of false
+ positives, and all the bits of an address are in the same 512-bit block,
+ so a lookup reads a single cache line. The exact table is an open
+ addressing table of the addresses themselves, at most half full, so a
+ lookup usually reads one or two slots. 0.0.0.0 marks an empty slot and
+ can't be listed.
+
+ Lists are written to a temporary file renamed over the old one, a list
+ being mapped is never changed under the reader.
+
+ */
+
+static inline uint64_t data_size(const struct reputation_header *header) {
+	if (header->kind == REPUTATION_BLOOM)
+		return header->slots * REPUTATION_BLOCK_WORDS * sizeof(uint64_t);
+	return header->slots * sizeof(uint32_t);
+}
+
+/*! reputation_open
+ \brief map a compiled list
+ \return NULL if the file can't be mapped or isn't a valid list
+ */
+struct reputation *reputation_open(const char *file) {
+	struct reputation *reputation = NULL;
+	const struct reputation_header *header;
+	struct stat st;
+	void *map;
+	int fd;
+
+	if ((fd = open(file, O_RDONLY)) < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) || st.st_size < (off_t) sizeof(*header)) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	header = map;
+	if (memcmp(header->magic, REPUTATION_MAGIC, 4)
+			|| header->version != REPUTATION_VERSION
+			|| (header->kind != REPUTATION_BLOOM
+					&& header->kind != REPUTATION_EXACT)
+			|| !header->slots || header->slots > UINT32_MAX
+			|| (header->kind == REPUTATION_EXACT
+					&& (header->slots & (header->slots - 1)))
+			|| (header->kind == REPUTATION_BLOOM
+					&& (!header->hashes
+							|| header->hashes > REPUTATION_MAX_HASHES))
+			|| sizeof(*header) + data_size(header) != (uint64_t) st.st_size) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	/* lookups are all over the table */
+	madvise(map, st.st_size, MADV_RANDOM);
+	madvise(map, st.st_size, MADV_WILLNEED);
+
+	reputation = g_malloc0(sizeof(struct reputation));
+	reputation->header = header;
+	reputation->mask = header->slots - 1;
+	reputation->size = st.st_size;
+	if (header->kind == REPUTATION_BLOOM)
+		reputation->bloom = (const uint64_t *) (header + 1);
+	else
+		reputation->exact = (const uint32_t *) (header + 1);
+
+	reputation->dev = st.st_dev;
+	reputation->ino = st.st_ino;
+	reputation->mtime = st.st_mtime;
+
+	return reputation;
+}
+
+void reputation_close(struct reputation *reputation) {
+	if (reputation) {
+		munmap((void *) reputation->header, reputation->size);
+		g_free(reputation);
+	}
+}
+
+/*! bloom_block
+ \brief block of an address in a bloom filter
+ *
+ * The block comes from a second round of mixing, scaled to the number of
+ * blocks with a multiplication so it doesn't have to be a power of 2.
+ */
+static inline uint64_t bloom_block(uint64_t h, uint64_t blocks) {
+	return ((reputation_hash((uint32_t) (h >> 32), h) >> 32) * blocks) >> 32;
+}
+
+#define BLOOM_BIT_SHIFT		9
+#define BLOOM_BITS_PER_HASH	(64 / BLOOM_BIT_SHIFT)
+
+/*! bloom_bit
+ \brief next bit of an address in its block
+ *
+ * Each bit takes its own 9 bits of the hash, which is mixed again when they
+ * run out. Deriving them from two values instead (double hashing) leaves
+ * too few distinct patterns for the addresses sharing a block.
+ */
+static inline uint32_t bloom_bit(uint64_t *h, uint32_t *left) {
+	if (!*left) {
+		*h = reputation_hash(0, *h + 0x9e3779b97f4a7c15ULL);
+		*left = BLOOM_BITS_PER_HASH;
+	}
+	uint32_t bit = *h & (REPUTATION_BLOCK_BITS - 1);
+	*h >>= BLOOM_BIT_SHIFT;
+	(*left)--;
+	return bit;
+}
+
+/*! reputation_contains
+ \brief is the address, in network byte order, listed
+ *
+ * A bloom filter answers TRUE for a few addresses that weren't listed.
+ */
+gboolean reputation_contains(const struct reputation *reputation,
+		uint32_t ip) {
+
+	const struct reputation_header *header = reputation->header;
+	uint64_t h = reputation_hash(ip, header->seed);
+
+	if (reputation->bloom) {
+		const uint64_t *block = reputation->bloom
+				+ bloom_block(h, header->slots) * REPUTATION_BLOCK_WORDS;
+		uint32_t i, left = BLOOM_BITS_PER_HASH;
+		for (i = 0; i < header->hashes; i++) {
+			uint32_t bit = bloom_bit(&h, &left);
+			if (!(block[bit >> 6] & (1ULL << (bit & 63))))
+				return FALSE;
+		}
+		return TRUE;
+	}
+
+	uint64_t slot = h & reputation->mask;
+	uint32_t entry;
+	while ((entry = reputation->exact[slot])) {
+		if (entry == ip)
+			return TRUE;
+		slot = (slot + 1) & reputation->mask;
+	}
+	return FALSE;
+}
+
+static uint64_t round_pow2(uint64_t n) {
+	uint64_t p = 1;
+	while (p < n)
+		p <<= 1;
+	return p;
+}
+
+/*! reputation_write
+ \brief compile addresses, in network byte order, into a list
+ *
+ * The list is written next to file and renamed over it, so the modules
+ * mapping the previous list keep reading it until they switch.
+ \param[in] false_positives: share of the addresses a bloom filter may
+ * wrongly answer for, 0.01 if 0
+ */
+status_t reputation_write(const char *file, reputation_kind_t kind,
+		const uint32_t *ips, uint64_t count, double false_positives) {
+
+	struct reputation_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, REPUTATION_MAGIC, 4);
+	header.version = REPUTATION_VERSION;
+	header.kind = kind;
+	header.seed = g_random_int() | ((uint64_t) g_random_int() << 32);
+
+	if (false_positives <= 0 || false_positives >= 1)
+		false_positives = 0.01;
+
+	if (kind == REPUTATION_BLOOM) {
+		/* blocking costs about 10% more bits than a plain filter */
+		double bits = -log(false_positives) / (M_LN2 * M_LN2) * 1.1;
+		header.slots = MAX(1,
+				(uint64_t) ceil(count * bits / REPUTATION_BLOCK_BITS));
+		bits = (double) header.slots * REPUTATION_BLOCK_BITS / MAX(count, 1);
+		header.hashes = CLAMP((uint32_t) lround(bits * M_LN2), 1,
+				REPUTATION_MAX_HASHES);
+	} else {
+		header.slots = round_pow2(MAX(count * 2, 16));
+	}
+
+	uint64_t size = data_size(&header);
+	uint8_t *table = g_try_malloc0(size);
+	if (!table) {
+		return NOK;
+	}
+
+	uint64_t i;
+	for (i = 0; i < count; i++) {
+		uint32_t ip = ips[i];
+		uint64_t h = reputation_hash(ip, header.seed);
+
+		if (kind == REPUTATION_BLOOM) {
+			uint64_t *block = (uint64_t *) table
+					+ bloom_block(h, header.slots) * REPUTATION_BLOCK_WORDS;
+			uint32_t j, left = BLOOM_BITS_PER_HASH;
+			for (j = 0; j < header.hashes; j++) {
+				uint32_t bit = bloom_bit(&h, &left);
+				block[bit >> 6] |= 1ULL << (bit & 63);
+			}
+			header.count++;
+		} else if (ip) {
+			uint32_t *exact = (uint32_t *) table;
+			uint64_t slot = h & (header.slots - 1);
+			while (exact[slot] && exact[slot] != ip)
+				slot = (slot + 1) & (header.slots - 1);
+			if (!exact[slot]) {
+				exact[slot] = ip;
+				header.count++;
+			}
+		}
+	}
+
+	gchar *tmp = g_strdup_printf("%s.%u", file, (unsigned) getpid());
+	status_t ret = NOK;
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		goto done;
+	}
+
+	gboolean written = write(fd, &header, sizeof(header)) == sizeof(header);
+	uint64_t off = 0;
+	while (written && off < size) {
+		ssize_t w = write(fd, table + off, MIN(size - off, 1 << 30));
+		if (w <= 0)
+			written = FALSE;
+		else
+			off += w;
+	}
+
+	if (written && fsync(fd))
+		written = FALSE;
+	if (close(fd) || !written || rename(tmp, file)) {
+		unlink(tmp);
+		goto done;
+	}
+
+	ret = OK;
+
+	done: g_free(tmp);
+	g_free(table);
+	return ret;
+}
@@ -0,0 +1,103 @@
+/*
+ * This file is part of the honeybrid project.
+ *
+ * 2007-2009 University of Maryland (http://www.umd.edu)
+ * Robin Berthier <robinb@umd.edu>, Thomas Coquelin <coquelin@umd.edu>
+ * and Julien Vehent <julien@linuxwall.info>
+ *
+ * 2012-2014 University of Connecticut (http://www.uconn.edu)
+ * Tamas K Lengyel <tamas.k.lengyel@gmail.com>
+ *
+ * Honeybrid is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __REPUTATION_H_
+#define __REPUTATION_H_
+
+#include "types.h"
+
+#include <sys/types.h>
+
+#define REPUTATION_MAGIC	"HBRP"
+#define REPUTATION_VERSION	1
+
+/*! Bits of a bloom filter block, a lookup touches a single cache line */
+#define REPUTATION_BLOCK_BITS	512
+#define REPUTATION_BLOCK_WORDS	(REPUTATION_BLOCK_BITS / 64)
+#define REPUTATION_MAX_HASHES	16
+
+typedef enum {
+	REPUTATION_BLOOM = 1, REPUTATION_EXACT = 2
+} reputation_kind_t;
+
+/*!
+ \def reputation_header
+ \brief start of a compiled reputation list, the table follows it
+ *
+ \param hashes, bits set in its block for each address of a bloom filter
+ \param count, addresses compiled in
+ \param slots, blocks of the bloom filter, or entries of the exact table
+ * which are a power of 2
+ \param seed, of reputation_hash
+ */
+struct reputation_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t kind;
+	uint32_t hashes;
+	uint64_t count;
+	uint64_t slots;
+	uint64_t seed;
+	uint8_t reserved[24];
+};
+
+/*!
+ \def reputation
+ \brief a compiled list mapped in memory, with the identity of its file
+ */
+struct reputation {
+	const struct reputation_header *header;
+	const uint64_t *bloom;
+	const uint32_t *exact;
+	uint64_t mask;
+	size_t size;
+
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+};
+
+/*! reputation_hash
+ \brief mix an address, in network byte order, into 64 bits (murmur3 finalizer)
+ */
+static inline uint64_t reputation_hash(uint32_t ip, uint64_t seed) {
+	uint64_t h = seed ^ ip;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+struct reputation *reputation_open(const char *file);
+
+void reputation_close(struct reputation *reputation);
+
+gboolean reputation_contains(const struct reputation *reputation, uint32_t ip);
+
+status_t reputation_write(const char *file, reputation_kind_t kind,
+		const uint32_t *ips, uint64_t count, double false_positives);
+
+#endif /* __REPUTATION_H_ */
@@ -0,0 +1,167 @@
+/*
+ * This file is part of the honeybrid project.
+ *
+ * 2007-2009 University of Maryland (http://www.umd.edu)
+ * Robin Berthier <robinb@umd.edu>, Thomas Coquelin <coquelin@umd.edu>
+ * and Julien Vehent <julien@linuxwall.info>
+ *
+ * 2012-2014 University of Connecticut (http://www.uconn.edu)
+ * Tamas K Lengyel <tamas.k.lengyel@gmail.com>
+ *
+ * Honeybrid is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*!	\file reputation_compile.c
+ \brief
+
+ honeybrid-reputation compiles lists of IPv4 addresses into the files the
+ reputation module maps. The lists have an address or a CIDR block of /16
+ or longer at the start of each line, the rest of the line and the lines
+ starting with # are ignored.
+
+ honeybrid-reputation [-e] [-p false_positives] -o output list...
+
+ */
+
+#include "reputation.h"
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+
+#define MAX_EXPANDED_BITS	16
+
+static void usage(const char *name) {
+	fprintf(stderr,
+			"Usage: %s [-e] [-p false_positives] -o output list...\n"
+			" -e\tcompile an exact table instead of a bloom filter\n"
+			" -p\tshare of false positives of the bloom filter (default 0.01)\n"
+			" -o\tfile to write, replaced atomically\n"
+			" list\tfiles of addresses or CIDR blocks, - for stdin\n", name);
+	exit(1);
+}
+
+static uint64_t read_list(FILE *in, const char *name, GArray *ips) {
+	char line[256];
+	uint64_t lineno = 0, skipped = 0;
+
+	while (fgets(line, sizeof(line), in)) {
+		lineno++;
+
+		char *start = line + strspn(line, " \t");
+		if (*start == '#' || *start == '\n' || *start == '\0')
+			continue;
+		start[strcspn(start, " \t\r\n,;#")] = '\0';
+
+		int bits = 32;
+		char *slash = strchr(start, '/');
+		if (slash) {
+			*slash = '\0';
+			bits = atoi(slash + 1);
+		}
+
+		struct in_addr addr;
+		if (inet_pton(AF_INET, start, &addr) != 1 || bits > 32
+				|| bits < 32 - MAX_EXPANDED_BITS) {
+			if (skipped++ < 10)
+				fprintf(stderr, "%s:%"PRIu64": skipping '%s'\n", name, lineno,
+						start);
+			continue;
+		}
+
+		uint32_t first = ntohl(addr.s_addr) & (0xFFFFFFFFu << (32 - bits));
+		uint32_t n = 1u << (32 - bits), i;
+		for (i = 0; i < n; i++) {
+			uint32_t ip = htonl(first + i);
+			g_array_append_val(ips, ip);
+		}
+	}
+
+	if (skipped)
+		fprintf(stderr, "%s: %"PRIu64" lines skipped\n", name, skipped);
+	return lineno;
+}
+
+static gint ip_cmp(gconstpointer a, gconstpointer b) {
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[]) {
+	reputation_kind_t kind = REPUTATION_BLOOM;
+	double false_positives = 0.01;
+	const char *output = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "ep:o:h")) != -1) {
+		switch (opt) {
+		case 'e':
+			kind = REPUTATION_EXACT;
+			break;
+		case 'p':
+			false_positives = atof(optarg);
+			if (false_positives <= 0 || false_positives >= 1)
+				usage(argv[0]);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (!output || optind == argc)
+		usage(argv[0]);
+
+	GArray *ips = g_array_new(FALSE, FALSE, sizeof(uint32_t));
+	int i;
+	for (i = optind; i < argc; i++) {
+		FILE *in = strcmp(argv[i], "-") ? fopen(argv[i], "r") : stdin;
+		if (!in)
+			err(1, "%s", argv[i]);
+		read_list(in, argv[i], ips);
+		if (in != stdin)
+			fclose(in);
+	}
+
+	/* sorted so duplicates are compiled in once */
+	g_array_sort(ips, ip_cmp);
+	guint unique = 0, j;
+	for (j = 0; j < ips->len; j++) {
+		uint32_t ip = g_array_index(ips, uint32_t, j);
+		if (ip && (!unique || ip != g_array_index(ips, uint32_t, unique - 1)))
+			g_array_index(ips, uint32_t, unique++) = ip;
+	}
+
+	if (reputation_write(output, kind, (const uint32_t *) ips->data, unique,
+			false_positives) != OK)
+		err(1, "%s", output);
+
+	struct reputation *reputation = reputation_open(output);
+	if (!reputation)
+		errx(1, "%s: can't map the list that was written", output);
+
+	printf("%s: %"PRIu64" addresses in %s of %zu bytes",
+			output, reputation->header->count,
+			kind == REPUTATION_BLOOM ? "a bloom filter" : "an exact table",
+			reputation->size);
+	if (kind == REPUTATION_BLOOM)
+		printf(", %u bits set per address", reputation->header->hashes);
+	printf("\n");
+
+	reputation_close(reputation);
+	g_array_free(ips, TRUE);
+	return 0;
+}
@@ -27,6 +27,11 @@
 #include "log.h"
 #include "convenience.h"
 #include "globals.h"
+#include "constants.h"
+#include "snapshot.h"
+#include "decision_cache.h"
+#include "profile.h"
+#include "reload.h"
 
 #ifdef HAVE_XMLRPC
 
@@ -119,7 +124,6 @@ rpc_add_target(xmlrpc_env * const envP, xmlrpc_value * const paramArrayP,
 			goto error;
 		}
 
-		iface->target = new_target;
 		new_target->default_route = iface;
 		new_target->default_route_ip = src_ip;
 		new_target->default_route_mac = mac_addr;
@@ -128,6 +132,10 @@ rpc_add_target(xmlrpc_env * const envP, xmlrpc_value * const paramArrayP,
 	if (NOK == add_target(new_target))
 		goto error;
 
+	/* only once it's complete, the decision threads read it without locking */
+	if (new_target->default_route)
+		g_atomic_pointer_set(&new_target->default_route->target, new_target);
+
 	return xmlrpc_build_value(envP, "i", new_target->targetID);
 
 error:
@@ -238,7 +246,10 @@ rpc_add_backend(xmlrpc_env * const envP, xmlrpc_value * const paramArrayP,
 			const char *rule = NULL;
 			xmlrpc_array_read_item(envP, paramArrayP, i, &rulep);
 			xmlrpc_read_string(envP, rulep, &rule);
-			backend->rule = DE_create_tree(rule);
+			backend->rule = create_current_rule(rule);
+			if (!backend->rule) {
+				goto error;
+			}
 			break;
 		}
 		case 7: {
@@ -252,7 +263,7 @@ rpc_add_backend(xmlrpc_env * const envP, xmlrpc_value * const paramArrayP,
 		}
 	}
 
-	if(OK==add_back_handler(target, backend)) {
+	if(OK==add_back_handler(target, backend, TRUE)) {
 		xmlrpc_build_value(envP, "i", backend->ID);
 	}
 
@@ -367,7 +378,10 @@ rpc_add_intra(xmlrpc_env * const envP, xmlrpc_value * const paramArrayP,
 			const char *rule = NULL;
 			xmlrpc_array_read_item(envP, paramArrayP, i, &rulep);
 			xmlrpc_read_string(envP, rulep, &rule);
-			intra->rule = DE_create_tree(rule);
+			intra->rule = create_current_rule(rule);
+			if (!intra->rule) {
+				goto error;
+			}
 			break;
 		}
 		case 7: {
@@ -423,6 +437,293 @@ rpc_remove_intra(xmlrpc_env * const envP, xmlrpc_value * const paramArrayP,
 	return xmlrpc_build_value(envP, "i", 0);
 }
 
+static gboolean rpc_backend_connections(__attribute__((unused)) gpointer key,
+		struct handler *backend, gpointer data) {
+	xmlrpc_env * const envP = ((gpointer *) data)[0];
+	xmlrpc_value * const arrayP = ((gpointer *) data)[1];
+
+	/* Bytes of the connections that ended plus the ones still going on */
+	uint64_t bytes = backend->bytes;
+	GList *loop = backend->conns.head;
+	while (loop) {
+		bytes += ((struct conn_struct *) loop->data)->total_byte;
+		loop = loop->next;
+	}
+
+	xmlrpc_value *itemP = xmlrpc_build_value(envP, "{s:I,s:i,s:I,s:i,s:i}",
+			"backend", (xmlrpc_int64) backend->ID,
+			"connections", (xmlrpc_int32) backend->conns.length,
+			"bytes", (xmlrpc_int64) bytes,
+			"weight", (xmlrpc_int32) backend->weight,
+			"capacity", (xmlrpc_int32) backend->capacity);
+	xmlrpc_array_append_item(envP, arrayP, itemP);
+	xmlrpc_DECREF(itemP);
+
+	return FALSE;
+}
+
+static gboolean rpc_target_connections(__attribute__((unused)) gpointer key,
+		struct target *target, gpointer data) {
+	xmlrpc_env * const envP = ((gpointer *) data)[0];
+	xmlrpc_value * const arrayP = ((gpointer *) data)[1];
+
+	xmlrpc_value *backendsP = xmlrpc_array_new(envP);
+	gpointer backends[2] = { envP, backendsP };
+
+	g_mutex_lock(&target->lock);
+	g_tree_foreach(target->back_handlers,
+			(GTraverseFunc) rpc_backend_connections, backends);
+	g_mutex_unlock(&target->lock);
+
+	xmlrpc_value *itemP = xmlrpc_build_value(envP, "{s:I,s:i,s:V}", "target",
+			(xmlrpc_int64) target->targetID, "connections",
+			(xmlrpc_int32) target->conns.length, "backends", backendsP);
+	xmlrpc_array_append_item(envP, arrayP, itemP);
+	xmlrpc_DECREF(itemP);
+	xmlrpc_DECREF(backendsP);
+
+	return FALSE;
+}
+
+static xmlrpc_value *
+rpc_get_connection_stats(xmlrpc_env * const envP,
+		__attribute__((unused))   xmlrpc_value * const paramArrayP,
+		__attribute__((unused)) void * const serverInfo,
+		__attribute__((unused)) void * const channelInfo) {
+	printdbg("%s called!\n", H(9));
+
+	xmlrpc_value *targetsP = xmlrpc_array_new(envP);
+	gpointer data[2] = { envP, targetsP };
+
+	g_rw_lock_reader_lock(&targetlock);
+	g_mutex_lock(&connlock);
+
+	g_tree_foreach(targets, (GTraverseFunc) rpc_target_connections, data);
+
+	xmlrpc_value *statsP = xmlrpc_build_value(envP,
+			"{s:i,s:i,s:i,s:i,s:i,s:s,s:I,s:I,s:V}",
+			"connections", (xmlrpc_int32) conn_count,
+			"sources", (xmlrpc_int32) g_hash_table_size(conn_count_per_source),
+			"max_connections", (xmlrpc_int32) max_connections,
+			"max_connections_per_target", (xmlrpc_int32) max_connections_per_target,
+			"max_connections_per_source", (xmlrpc_int32) max_connections_per_source,
+			"eviction_policy", lookup_eviction_policy(eviction_policy),
+			"evicted", (xmlrpc_int64) conn_evicted,
+			"refused", (xmlrpc_int64) conn_refused,
+			"targets", targetsP);
+
+	g_mutex_unlock(&connlock);
+	g_rw_lock_reader_unlock(&targetlock);
+
+	xmlrpc_DECREF(targetsP);
+	return statsP;
+}
+
+static xmlrpc_value *
+rpc_save_snapshot(xmlrpc_env * const envP,
+		__attribute__((unused))   xmlrpc_value * const paramArrayP,
+		__attribute__((unused)) void * const serverInfo,
+		__attribute__((unused)) void * const channelInfo) {
+	printdbg("%s called!\n", H(9));
+
+	uint32_t saved = 0, skipped = 0;
+	const char *file = CONFIG("snapshot_file");
+
+	if (!file || OK != save_snapshot(file, &saved, &skipped)) {
+		return xmlrpc_build_value(envP, "i", 0);
+	}
+
+	return xmlrpc_build_value(envP, "{s:i,s:i}",
+			"saved", (xmlrpc_int32) saved,
+			"skipped", (xmlrpc_int32) skipped);
+}
+
+static xmlrpc_value *
+rpc_get_decision_cache_stats(xmlrpc_env * const envP,
+		__attribute__((unused))   xmlrpc_value * const paramArrayP,
+		__attribute__((unused)) void * const serverInfo,
+		__attribute__((unused)) void * const channelInfo) {
+	printdbg("%s called!\n", H(9));
+
+	struct decision_cache_stats stats;
+	decision_cache_get_stats(&stats);
+
+	return xmlrpc_build_value(envP,
+			"{s:i,s:i,s:I,s:I,s:I,s:I,s:I,s:I,s:I}",
+			"capacity", (xmlrpc_int32) stats.capacity,
+			"entries", (xmlrpc_int32) stats.entries,
+			"hits", (xmlrpc_int64) stats.hits,
+			"misses", (xmlrpc_int64) stats.misses,
+			"stores", (xmlrpc_int64) stats.stores,
+			"evictions", (xmlrpc_int64) stats.evictions,
+			"expired", (xmlrpc_int64) stats.expired,
+			"eval_usec", (xmlrpc_int64) stats.eval_usec,
+			"saved_usec", (xmlrpc_int64) stats.saved_usec);
+}
+
+static void rpc_rule_stats(xmlrpc_env * const envP, xmlrpc_value * const arrayP,
+		const struct target *target, const char *role, int64_t handlerID,
+		const struct rule *rule) {
+
+	if (!rule)
+		return;
+
+	xmlrpc_value *nodesP = xmlrpc_array_new(envP);
+
+	uint32_t i, b;
+	for (i = 0; i < rule->length; i++) {
+		const struct node *node = rule->steps[i].node;
+
+		struct profile_counters c;
+		profile_sum(node->profile, &c);
+
+		xmlrpc_value *histogramP = xmlrpc_array_new(envP);
+		for (b = 0; b < PROFILE_BUCKETS; b++) {
+			xmlrpc_value *bucketP = xmlrpc_i8_new(envP,
+					(xmlrpc_int64) c.histogram[b]);
+			xmlrpc_array_append_item(envP, histogramP, bucketP);
+			xmlrpc_DECREF(bucketP);
+		}
+
+		xmlrpc_value *nodeP = xmlrpc_build_value(envP,
+				"{s:s,s:s,s:I,s:I,s:I,s:I,s:I,s:I,s:V}",
+				"module", node->module_name->str,
+				"function", node->function->str,
+				"calls", (xmlrpc_int64) c.calls,
+				"accept", (xmlrpc_int64) c.results[ACCEPT],
+				"reject", (xmlrpc_int64) c.results[REJECT],
+				"defer", (xmlrpc_int64) c.results[DEFER],
+				"pending", (xmlrpc_int64) c.results[PENDING],
+				"nsec", (xmlrpc_int64) c.nsec,
+				"histogram", histogramP);
+		xmlrpc_array_append_item(envP, nodesP, nodeP);
+		xmlrpc_DECREF(nodeP);
+		xmlrpc_DECREF(histogramP);
+	}
+
+	xmlrpc_value *ruleP = xmlrpc_build_value(envP, "{s:I,s:s,s:I,s:s,s:V}",
+			"target", (xmlrpc_int64) target->targetID,
+			"role", role,
+			"handler", (xmlrpc_int64) handlerID,
+			"equation", rule->equation,
+			"nodes", nodesP);
+	xmlrpc_array_append_item(envP, arrayP, ruleP);
+	xmlrpc_DECREF(ruleP);
+	xmlrpc_DECREF(nodesP);
+}
+
+static gboolean rpc_backend_rule_stats(__attribute__((unused)) gpointer key,
+		struct handler *backend, gpointer data) {
+	xmlrpc_env * const envP = ((gpointer *) data)[0];
+	xmlrpc_value * const arrayP = ((gpointer *) data)[1];
+	const struct target *target = ((gpointer *) data)[2];
+
+	rpc_rule_stats(envP, arrayP, target, "backend", backend->ID, backend->rule);
+	return FALSE;
+}
+
+static gboolean rpc_target_rule_stats(__attribute__((unused)) gpointer key,
+		struct target *target, gpointer data) {
+	xmlrpc_env * const envP = ((gpointer *) data)[0];
+	xmlrpc_value * const arrayP = ((gpointer *) data)[1];
+	gpointer backends[3] = { envP, arrayP, target };
+
+	g_mutex_lock(&target->lock);
+
+	if (target->front_handler)
+		rpc_rule_stats(envP, arrayP, target, "frontend",
+				target->front_handler->ID, target->front_handler->rule);
+	rpc_rule_stats(envP, arrayP, target, "backpick", 0, target->back_picker);
+	g_tree_foreach(target->back_handlers,
+			(GTraverseFunc) rpc_backend_rule_stats, backends);
+	rpc_rule_stats(envP, arrayP, target, "internet", 0, target->control_rule);
+	rpc_rule_stats(envP, arrayP, target, "intranet", 0, target->intra_rule);
+
+	GSList *loop = target->intra_handlers_list;
+	while (loop) {
+		struct handler *intra = loop->data;
+		rpc_rule_stats(envP, arrayP, target, "internal", intra->ID,
+				intra->rule);
+		loop = loop->next;
+	}
+
+	g_mutex_unlock(&target->lock);
+
+	return FALSE;
+}
+
+static xmlrpc_value *
+rpc_get_rule_stats(xmlrpc_env * const envP,
+		__attribute__((unused))   xmlrpc_value * const paramArrayP,
+		__attribute__((unused)) void * const serverInfo,
+		__attribute__((unused)) void * const channelInfo) {
+	printdbg("%s called!\n", H(9));
+
+	xmlrpc_value *rulesP = xmlrpc_array_new(envP);
+	gpointer data[2] = { envP, rulesP };
+
+	g_rw_lock_reader_lock(&targetlock);
+	g_tree_foreach(targets, (GTraverseFunc) rpc_target_rule_stats, data);
+	g_rw_lock_reader_unlock(&targetlock);
+
+	return rulesP;
+}
+
+static xmlrpc_value *
+rpc_get_trigger_stats(xmlrpc_env * const envP,
+		__attribute__((unused))   xmlrpc_value * const paramArrayP,
+		__attribute__((unused)) void * const serverInfo,
+		__attribute__((unused)) void * const channelInfo) {
+	printdbg("%s called!\n", H(9));
+
+	uint64_t evaluations, skips;
+	DE_get_trigger_stats(&evaluations, &skips);
+
+	return xmlrpc_build_value(envP, "{s:I,s:I}",
+			"evaluated", (xmlrpc_int64) evaluations,
+			"skipped", (xmlrpc_int64) skips);
+}
+
+static xmlrpc_value *
+rpc_reload_config(xmlrpc_env * const envP, xmlrpc_value * const paramArrayP,
+		__attribute__((unused)) void * const serverInfo,
+		__attribute__((unused)) void * const channelInfo) {
+	printdbg("%s called!\n", H(9));
+
+	reload_policy_t policy = RELOAD_KEEP;
+	const char *name = CONFIG("reload_policy");
+	uint32_t loaded = 0, replaced = 0;
+	status_t ret = OK;
+
+	if (xmlrpc_array_size(envP, paramArrayP) == 1) {
+		xmlrpc_value *policyp = NULL;
+		xmlrpc_array_read_item(envP, paramArrayP, 0, &policyp);
+		xmlrpc_read_string(envP, policyp, &name);
+		xmlrpc_DECREF(policyp);
+	}
+
+	if (name && NOK == find_reload_policy(name, &policy)) {
+		printdbg("%s Unknown reload policy %s\n", H(9), name);
+		ret = NOK;
+	}
+
+	if (ret == OK) {
+		ret = reload_config(config_file, policy, &loaded, &replaced);
+	}
+
+	if (name != CONFIG("reload_policy")) {
+		free((char *) name);
+	}
+
+	if (ret != OK) {
+		return xmlrpc_build_value(envP, "i", 0);
+	}
+
+	return xmlrpc_build_value(envP, "{s:i,s:i}",
+			"loaded", (xmlrpc_int32) loaded,
+			"replaced", (xmlrpc_int32) replaced);
+}
+
 /******************************************************************************/
 
 enum honeybrid_rpc_function {
@@ -434,6 +735,12 @@ enum honeybrid_rpc_function {
 	REMOVE_BACKEND,
 	ADD_INTRA,
 	REMOVE_INTRA,
+	GET_CONNECTION_STATS,
+	SAVE_SNAPSHOT,
+	GET_DECISION_CACHE_STATS,
+	GET_RULE_STATS,
+	RELOAD_CONFIG,
+	GET_TRIGGER_STATS,
 
 	__MAX_RPC_FUNCTIONS
 };
@@ -464,6 +771,24 @@ const method[__MAX_RPC_FUNCTIONS] = {
 	[REMOVE_INTRA] =
 		{ 	.methodName = "remove_intra",
 			.methodFunction = &rpc_remove_intra },
+	[GET_CONNECTION_STATS] =
+		{ 	.methodName = "get_connection_stats",
+			.methodFunction = &rpc_get_connection_stats },
+	[SAVE_SNAPSHOT] =
+		{ 	.methodName = "save_snapshot",
+			.methodFunction = &rpc_save_snapshot },
+	[GET_DECISION_CACHE_STATS] =
+		{ 	.methodName = "get_decision_cache_stats",
+			.methodFunction = &rpc_get_decision_cache_stats },
+	[GET_RULE_STATS] =
+		{ 	.methodName = "get_rule_stats",
+			.methodFunction = &rpc_get_rule_stats },
+	[RELOAD_CONFIG] =
+		{ 	.methodName = "reload_config",
+			.methodFunction = &rpc_reload_config },
+	[GET_TRIGGER_STATS] =
+		{ 	.methodName = "get_trigger_stats",
+			.methodFunction = &rpc_get_trigger_stats },
 };
 
 /******************************************************************************/
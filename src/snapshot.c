@@ -0,0 +1,988 @@
+/*
+ * This file is part of the honeybrid project.
+ *
+ * 2007-2009 University of Maryland (http://www.umd.edu)
+ * Robin Berthier <robinb@umd.edu>, Thomas Coquelin <coquelin@umd.edu>
+ * and Julien Vehent <julien@linuxwall.info>
+ *
+ * 2012-2014 University of Connecticut (http://www.uconn.edu)
+ * Tamas K Lengyel <tamas.k.lengyel@gmail.com>
+ *
+ * Honeybrid is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "snapshot.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+#include "connections.h"
+#include "log.h"
+#include "globals.h"
+#include "convenience.h"
+
+/*!	\file snapshot.c
+ \brief
+
+ Checkpoint and restore of the connection table.
+
+ A snapshot holds the pins and every tracked connection, oldest first, with
+ the packets buffered for replay. Targets and handlers are referenced by
+ their IP and VLAN rather than by their IDs, so a snapshot taken before a
+ restart can be restored even if the targets were defined in another order.
+ Each connection record is prefixed with its length so that newer fields
+ can be appended without breaking older readers.
+
+ The custom data attached to live connections by the modules is not saved.
+
+ */
+
+#define SNAPSHOT_MAGIC		"HBSNAP"
+#define SNAPSHOT_VERSION	1
+
+struct snapshot_header {
+	char magic[6];
+	uint16_t version;
+	uint32_t pins;
+	uint32_t conns;
+	uint64_t c_id;
+}__attribute__ ((packed));
+
+/*! Pin trees as numbered in the snapshot */
+enum snapshot_pin_tree {
+	SNAPSHOT_PIN_NONE,
+	SNAPSHOT_PIN_COMM,
+	SNAPSHOT_PIN_TARGET,
+	SNAPSHOT_PIN_INTRA,
+
+	__MAX_SNAPSHOT_PIN_TREE
+};
+
+/*! Keys present in a connection record */
+#define SNAPSHOT_EXT_KEY			(1 << 0)
+#define SNAPSHOT_INT_KEY			(1 << 1)
+#define SNAPSHOT_INTRA_KEY			(1 << 2)
+#define SNAPSHOT_PIN_KEY			(1 << 3)
+#define SNAPSHOT_REDIRECTED_INT_KEY	(1 << 4)
+#define SNAPSHOT_TARGET_PIN_KEY		(1 << 5)
+
+#define SNAPSHOT_STATS		1
+#define SNAPSHOT_TOMBSTONE	2
+
+#define SNAPSHOT_NULL_STRING	0xFFFFFFFF
+
+static GTree *pin_tree(uint8_t tree) {
+	switch (tree) {
+	case SNAPSHOT_PIN_COMM:
+		return comm_pin_tree;
+	case SNAPSHOT_PIN_TARGET:
+		return target_pin_tree;
+	case SNAPSHOT_PIN_INTRA:
+		return intra_pin_tree;
+	default:
+		return NULL;
+	}
+}
+
+/******************************************************************************/
+
+#define PUT(rec, value) \
+	g_byte_array_append(rec, (const guint8 *) &(value), sizeof(value))
+
+static void put_string(GByteArray *rec, const char *str, gsize len) {
+	uint32_t size = str ? len : SNAPSHOT_NULL_STRING;
+	PUT(rec, size);
+	if (str) {
+		g_byte_array_append(rec, (const guint8 *) str, len);
+	}
+}
+
+static void put_handler(GByteArray *rec, const struct handler *handler) {
+	uint8_t present = handler && handler->ip;
+	ip_addr_t ip = present ? handler->ip->addr_ip : 0;
+	uint16_t vid = present ? handler->vlan.vid : 0;
+	PUT(rec, present);
+	PUT(rec, ip);
+	PUT(rec, vid);
+}
+
+struct snapshot_pins {
+	FILE *fp;
+	uint8_t tree;
+	uint32_t count;
+};
+
+static gboolean save_pin(__attribute__ ((unused)) gpointer key,
+		struct pin *pin, struct snapshot_pins *pins) {
+	fwrite(&pins->tree, sizeof(pins->tree), 1, pins->fp);
+	fwrite(pin->pin_key, sizeof(struct pin_key), 1, pins->fp);
+	fwrite(&pin->ip, sizeof(struct addr), 1, pins->fp);
+	fwrite(&pin->count, sizeof(pin->count), 1, pins->fp);
+	pins->count++;
+	return FALSE;
+}
+
+/*! pin_reference
+ \brief find the pin whose IP the connection impersonates
+ \return the tree of the pin, SNAPSHOT_PIN_NONE if the conn has no pin IP,
+ * __MAX_SNAPSHOT_PIN_TREE if the pin can't be found
+ */
+static uint8_t pin_reference(const struct conn_struct *conn,
+		const struct pin_key **key) {
+
+	const struct {
+		uint8_t tree;
+		const struct pin_key *key;
+	} candidates[] = {
+		{ SNAPSHOT_PIN_COMM, conn->pin_key },
+		{ SNAPSHOT_PIN_INTRA, conn->pin_key },
+		{ SNAPSHOT_PIN_TARGET, conn->pin_key },
+		{ SNAPSHOT_PIN_TARGET, conn->hih.target_pin_key },
+	};
+	guint i;
+
+	if (!conn->pin_ip) {
+		return SNAPSHOT_PIN_NONE;
+	}
+
+	for (i = 0; i < G_N_ELEMENTS(candidates); i++) {
+		struct pin *pin;
+		if (candidates[i].key
+				&& (pin = g_tree_lookup(pin_tree(candidates[i].tree),
+						candidates[i].key)) && &pin->ip == conn->pin_ip) {
+			*key = candidates[i].key;
+			return candidates[i].tree;
+		}
+	}
+
+	return __MAX_SNAPSHOT_PIN_TREE;
+}
+
+static void put_pkt(GByteArray *rec, const struct pkt_struct *pkt) {
+
+	uint16_t l2_len =
+			pkt->packet.eth->ether_type == htons(ETHERTYPE_VLAN) ?
+					VLAN_ETH_HLEN : ETHER_HDR_LEN;
+	uint32_t frame_len = l2_len + ntohs(pkt->packet.ip->tot_len);
+	uint8_t flags = (pkt->fragmented ? 1 : 0) | (pkt->broadcast ? 2 : 0);
+	uint8_t origin = pkt->origin;
+	uint8_t destination = pkt->destination;
+	int32_t DE = pkt->DE;
+	int32_t position = pkt->position;
+	uint32_t data = pkt->data;
+	uint32_t size = pkt->size;
+
+	put_string(rec, pkt->in->tag, strlen(pkt->in->tag));
+	PUT(rec, flags);
+	PUT(rec, origin);
+	PUT(rec, destination);
+	PUT(rec, DE);
+	PUT(rec, position);
+	PUT(rec, data);
+	PUT(rec, size);
+	PUT(rec, frame_len);
+	g_byte_array_append(rec, (const guint8 *) pkt->packet.eth, frame_len);
+
+	uint8_t vlan = pkt->original_headers.vlan ? 1 : 0;
+	PUT(rec, vlan);
+	if (vlan) {
+		g_byte_array_append(rec, (const guint8 *) pkt->original_headers.vlan,
+				VLAN_ETH_HLEN);
+	} else {
+		g_byte_array_append(rec, (const guint8 *) pkt->original_headers.eth,
+				ETHER_HDR_LEN);
+	}
+
+	uint8_t ip_len = pkt->original_headers.ip->ihl << 2;
+	PUT(rec, ip_len);
+	g_byte_array_append(rec, (const guint8 *) pkt->original_headers.ip, ip_len);
+
+	uint8_t l4 = 0;
+	if (pkt->original_headers.tcp) {
+		l4 = IPPROTO_TCP;
+		PUT(rec, l4);
+		g_byte_array_append(rec, (const guint8 *) pkt->original_headers.tcp,
+				sizeof(struct tcphdr));
+	} else if (pkt->original_headers.udp) {
+		l4 = IPPROTO_UDP;
+		PUT(rec, l4);
+		g_byte_array_append(rec, (const guint8 *) pkt->original_headers.udp,
+				sizeof(struct udphdr));
+	} else {
+		PUT(rec, l4);
+	}
+}
+
+/*! put_conn
+ \brief serialize a locked connection into rec
+ \return OK if the connection can be restored from the record
+ */
+static status_t put_conn(GByteArray *rec, const struct conn_struct *conn) {
+
+	const struct pin_key *pin_ip_key = NULL;
+	uint8_t pin_ip_tree = pin_reference(conn, &pin_ip_key);
+
+	if (pin_ip_tree == __MAX_SNAPSHOT_PIN_TREE) {
+		return NOK;
+	}
+
+	uint32_t id = conn->id;
+	uint8_t protocol = conn->protocol;
+	uint8_t state = conn->state;
+	uint8_t initiator = conn->initiator;
+	uint8_t destination = conn->destination;
+	gint access_time = conn->access_time;
+	gdouble start_microtime = conn->start_microtime;
+	int64_t tcp_ts_diff = conn->tcp_ts_diff;
+	uint32_t replay_id = conn->replay_id;
+	uint32_t count_lih = conn->count_data_pkt_from_lih;
+	uint32_t count_intruder = conn->count_data_pkt_from_intruder;
+
+	PUT(rec, id);
+	PUT(rec, protocol);
+	PUT(rec, state);
+	PUT(rec, initiator);
+	PUT(rec, destination);
+	PUT(rec, access_time);
+	PUT(rec, start_microtime);
+	PUT(rec, conn->start_timestamp);
+	PUT(rec, tcp_ts_diff);
+	PUT(rec, replay_id);
+	PUT(rec, count_lih);
+	PUT(rec, count_intruder);
+
+	PUT(rec, conn->first_pkt_vlan);
+	PUT(rec, conn->first_pkt_src_mac);
+	PUT(rec, conn->first_pkt_dst_mac);
+	PUT(rec, conn->first_pkt_src_ip);
+	PUT(rec, conn->first_pkt_dst_ip);
+	PUT(rec, conn->first_pkt_src_port);
+	PUT(rec, conn->first_pkt_dst_port);
+
+	put_handler(rec, conn->target->front_handler);
+	put_handler(rec, conn->hih.back_handler);
+	put_handler(rec, conn->intra_handler);
+
+	uint16_t hih_port = conn->hih.port;
+	uint32_t lih_syn_seq = conn->hih.lih_syn_seq;
+	uint32_t delta = conn->hih.delta;
+	PUT(rec, hih_port);
+	PUT(rec, lih_syn_seq);
+	PUT(rec, delta);
+
+	uint8_t keys = (conn->ext_key ? SNAPSHOT_EXT_KEY : 0)
+			| (conn->int_key ? SNAPSHOT_INT_KEY : 0)
+			| (conn->intra_key ? SNAPSHOT_INTRA_KEY : 0)
+			| (conn->pin_key ? SNAPSHOT_PIN_KEY : 0)
+			| (conn->hih.redirected_int_key ? SNAPSHOT_REDIRECTED_INT_KEY : 0)
+			| (conn->hih.target_pin_key ? SNAPSHOT_TARGET_PIN_KEY : 0);
+	PUT(rec, keys);
+	if (conn->ext_key)
+		PUT(rec, *conn->ext_key);
+	if (conn->int_key)
+		PUT(rec, *conn->int_key);
+	if (conn->intra_key)
+		PUT(rec, *conn->intra_key);
+	if (conn->pin_key)
+		PUT(rec, *conn->pin_key);
+	if (conn->hih.redirected_int_key)
+		PUT(rec, *conn->hih.redirected_int_key);
+	if (conn->hih.target_pin_key)
+		PUT(rec, *conn->hih.target_pin_key);
+
+	PUT(rec, pin_ip_tree);
+	if (pin_ip_key)
+		PUT(rec, *pin_ip_key);
+
+	/*! The expected payload points into one of the buffered packets */
+	int32_t expected_pkt = -1;
+	if (conn->expected_data.payload) {
+		GSList *loop = conn->BUFFER;
+		int32_t i = 0;
+		for (; loop; loop = loop->next, i++) {
+			struct pkt_struct *pkt = (struct pkt_struct *) loop->data;
+			if (pkt->packet.payload == conn->expected_data.payload) {
+				expected_pkt = i;
+				break;
+			}
+		}
+	}
+
+	uint16_t ip_proto = conn->expected_data.ip_proto;
+	uint32_t tcp_seq = conn->expected_data.tcp_seq;
+	uint32_t tcp_ack_seq = conn->expected_data.tcp_ack_seq;
+	int64_t tcp_ts = conn->expected_data.tcp_ts;
+	PUT(rec, ip_proto);
+	PUT(rec, tcp_seq);
+	PUT(rec, tcp_ack_seq);
+	PUT(rec, tcp_ts);
+	PUT(rec, expected_pkt);
+
+	uint32_t total_packet = conn->total_packet;
+	uint32_t total_byte = conn->total_byte;
+	int32_t decision_packet_id = conn->decision_packet_id;
+	int32_t replay_problem = conn->replay_problem;
+	PUT(rec, total_packet);
+	PUT(rec, total_byte);
+	PUT(rec, decision_packet_id);
+	PUT(rec, replay_problem);
+
+	uint8_t kind = conn->tombstone ? SNAPSHOT_TOMBSTONE : SNAPSHOT_STATS;
+	PUT(rec, kind);
+	if (conn->tombstone) {
+		const struct conn_tombstone *tombstone = conn->tombstone;
+		gsize status_len = 0;
+		conn_status_t i;
+
+		for (i = INIT; i <= PROXY && i < conn->state; i++) {
+			status_len += strlen(tombstone->status_info + status_len) + 1;
+		}
+
+		PUT(rec, tombstone->lasttime);
+		PUT(rec, tombstone->stat_time);
+		PUT(rec, tombstone->stat_packet);
+		PUT(rec, tombstone->stat_byte);
+		put_string(rec, tombstone->custom_data,
+				tombstone->custom_data ? strlen(tombstone->custom_data) : 0);
+		put_string(rec, tombstone->status_info, status_len);
+	} else {
+		PUT(rec, conn->stats->stat_time);
+		PUT(rec, conn->stats->stat_packet);
+		PUT(rec, conn->stats->stat_byte);
+		put_string(rec, conn->stats->decision_rule->str,
+				conn->stats->decision_rule->len);
+	}
+
+	uint32_t buffered = g_slist_length(conn->BUFFER);
+	PUT(rec, buffered);
+	GSList *loop = conn->BUFFER;
+	for (; loop; loop = loop->next) {
+		put_pkt(rec, (struct pkt_struct *) loop->data);
+	}
+
+	PUT(rec, conn->front_ip);
+
+	return OK;
+}
+
+/*! save_snapshot
+ \brief write the pins and the tracked connections to file
+ *
+ * The snapshot is written to a temporary file which then replaces file, so
+ * an interrupted save never leaves a truncated snapshot behind. Connections
+ * that are being processed by a decision thread while the snapshot is taken
+ * are skipped.
+ *
+ \param[in] file: path of the snapshot
+ \param[out] saved: number of connections written
+ \param[out] skipped: number of connections that couldn't be written
+ \return OK on success
+ */
+status_t save_snapshot(const char *file, uint32_t *saved, uint32_t *skipped) {
+
+	status_t ret = NOK;
+	struct snapshot_header header = { .magic = SNAPSHOT_MAGIC, .version =
+			SNAPSHOT_VERSION };
+	gchar *tmp = g_strdup_printf("%s.tmp", file);
+	GByteArray *rec = g_byte_array_sized_new(4096);
+
+	*saved = *skipped = 0;
+
+	FILE *fp = fopen(tmp, "wb");
+	if (!fp) {
+		printdbg("%s Can't open snapshot file %s: %s\n", H(0), tmp,
+				strerror(errno));
+		goto done;
+	}
+	setvbuf(fp, NULL, _IOFBF, 1 << 20);
+
+	/*! The counts are filled in once everything is written */
+	fwrite(&header, sizeof(header), 1, fp);
+
+	g_rw_lock_reader_lock(&targetlock);
+	g_mutex_lock(&connlock);
+
+	struct snapshot_pins pins = { .fp = fp };
+	for (pins.tree = SNAPSHOT_PIN_COMM; pins.tree < __MAX_SNAPSHOT_PIN_TREE;
+			pins.tree++) {
+		g_tree_foreach(pin_tree(pins.tree), (GTraverseFunc) save_pin, &pins);
+	}
+
+	GList *loop = conn_age_queue->head;
+	for (; loop; loop = loop->next) {
+		struct conn_struct *conn = (struct conn_struct *) loop->data;
+
+		if (!g_mutex_trylock(&conn->lock)) {
+			(*skipped)++;
+			continue;
+		}
+
+		g_byte_array_set_size(rec, 0);
+		status_t put = put_conn(rec, conn);
+		g_mutex_unlock(&conn->lock);
+
+		if (put == NOK) {
+			(*skipped)++;
+			continue;
+		}
+
+		uint32_t len = rec->len;
+		fwrite(&len, sizeof(len), 1, fp);
+		fwrite(rec->data, rec->len, 1, fp);
+		(*saved)++;
+	}
+
+	header.pins = pins.count;
+	header.conns = *saved;
+	header.c_id = c_id;
+
+	g_mutex_unlock(&connlock);
+	g_rw_lock_reader_unlock(&targetlock);
+
+	if (fseek(fp, 0, SEEK_SET) == 0) {
+		fwrite(&header, sizeof(header), 1, fp);
+	}
+
+	if (ferror(fp)) {
+		printdbg("%s Error while writing snapshot file %s\n", H(0), tmp);
+		fclose(fp);
+		unlink(tmp);
+		goto done;
+	}
+
+	if (fclose(fp) != 0 || rename(tmp, file) != 0) {
+		printdbg("%s Can't write snapshot file %s: %s\n", H(0), file,
+				strerror(errno));
+		unlink(tmp);
+		goto done;
+	}
+
+	printdbg("%s Saved %u connections and %u pins to %s, %u skipped\n", H(0),
+			*saved, pins.count, file, *skipped);
+
+	ret = OK;
+
+	done:
+	g_byte_array_free(rec, TRUE);
+	g_free(tmp);
+	return ret;
+}
+
+/******************************************************************************/
+
+struct snapshot_reader {
+	const char *pos;
+	const char *end;
+	gboolean error;
+};
+
+static const char *take(struct snapshot_reader *r, gsize len) {
+	if (r->error || (gsize) (r->end - r->pos) < len) {
+		r->error = TRUE;
+		return NULL;
+	}
+	const char *data = r->pos;
+	r->pos += len;
+	return data;
+}
+
+static void get(struct snapshot_reader *r, void *out, gsize len) {
+	const char *data = take(r, len);
+	if (data) {
+		memcpy(out, data, len);
+	} else {
+		memset(out, 0, len);
+	}
+}
+
+#define GET(r, value) get(r, &(value), sizeof(value))
+
+static char *get_string(struct snapshot_reader *r, uint32_t *len_out) {
+	uint32_t len = 0;
+	const char *data;
+
+	GET(r, len);
+	if (len == SNAPSHOT_NULL_STRING || !(data = take(r, len))) {
+		return NULL;
+	}
+
+	if (len_out) {
+		*len_out = len;
+	}
+
+	char *str = g_malloc(len + 1);
+	memcpy(str, data, len);
+	str[len] = '\0';
+	return str;
+}
+
+static gpointer get_key(struct snapshot_reader *r, gsize len) {
+	const char *data = take(r, len);
+	return data ? g_memdup(data, len) : NULL;
+}
+
+struct snapshot_handler {
+	uint8_t present;
+	ip_addr_t ip;
+	uint16_t vid;
+};
+
+static void get_handler(struct snapshot_reader *r, struct snapshot_handler *h) {
+	GET(r, h->present);
+	GET(r, h->ip);
+	GET(r, h->vid);
+}
+
+static gboolean handler_matches(const struct handler *handler,
+		const struct snapshot_handler *h) {
+	return handler && handler->ip && handler->ip->addr_ip == h->ip
+			&& handler->vlan.vid == h->vid;
+}
+
+static gboolean find_target_by_handler(__attribute__ ((unused)) gpointer key,
+		struct target *target, gpointer data) {
+	const struct snapshot_handler *h = ((gpointer *) data)[0];
+	if (handler_matches(target->front_handler, h)) {
+		((gpointer *) data)[1] = target;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+static gboolean find_back_handler(__attribute__ ((unused)) gpointer key,
+		struct handler *handler, gpointer data) {
+	const struct snapshot_handler *h = ((gpointer *) data)[0];
+	if (handler_matches(handler, h)) {
+		((gpointer *) data)[1] = handler;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+static struct handler *find_intra_handler(const struct target *target,
+		const struct snapshot_handler *h) {
+	GSList *loop = target->intra_handlers_list;
+	for (; loop; loop = loop->next) {
+		if (handler_matches(loop->data, h)) {
+			return loop->data;
+		}
+	}
+	return NULL;
+}
+
+static struct pkt_struct *get_pkt(struct snapshot_reader *r,
+		struct conn_struct *conn, gboolean *resolved) {
+
+	struct pkt_struct *pkt = g_malloc0(sizeof(struct pkt_struct));
+	uint8_t flags = 0, origin = 0, destination = 0, vlan = 0, ip_len = 0,
+			l4 = 0;
+	int32_t DE = 0, position = 0;
+	uint32_t frame_len = 0;
+	const char *frame;
+
+	char *tag = get_string(r, NULL);
+	pkt->in = tag ? g_hash_table_lookup(links, tag) : NULL;
+	g_free(tag);
+
+	GET(r, flags);
+	GET(r, origin);
+	GET(r, destination);
+	GET(r, DE);
+	GET(r, position);
+	GET(r, pkt->data);
+	GET(r, pkt->size);
+	GET(r, frame_len);
+
+	if (frame_len < VLAN_ETH_HLEN + sizeof(struct iphdr)
+			|| !(frame = take(r, frame_len))) {
+		goto error;
+	}
+
+	/*! The interface the packet came in on is gone */
+	if (!pkt->in) {
+		*resolved = FALSE;
+	}
+
+	pkt->fragmented = (flags & 1) ? TRUE : FALSE;
+	pkt->broadcast = (flags & 2) ? TRUE : FALSE;
+	pkt->origin = origin;
+	pkt->destination = destination;
+	pkt->DE = DE;
+	pkt->position = position;
+	pkt->conn = conn;
+
+	/*! Same layout as init_pkt: untagged frames keep room for a VLAN header */
+	pkt->packet.FRAME = malloc(frame_len + VLAN_HLEN);
+	uint16_t l2_len;
+	if (((const struct ether_header *) frame)->ether_type
+			== htons(ETHERTYPE_VLAN)) {
+		memcpy(pkt->packet.FRAME, frame, frame_len);
+		pkt->packet.vlan = (struct vlan_ethhdr *) pkt->packet.FRAME;
+		l2_len = VLAN_ETH_HLEN;
+	} else {
+		memcpy(pkt->packet.FRAME + VLAN_HLEN, frame, frame_len);
+		pkt->packet.eth =
+				(struct ether_header *) (pkt->packet.FRAME + VLAN_HLEN);
+		l2_len = ETHER_HDR_LEN;
+	}
+
+	pkt->packet.ip = (struct iphdr *) ((char *) pkt->packet.eth + l2_len);
+
+	uint32_t l3_len = frame_len - l2_len;
+	uint32_t l4_offset = pkt->packet.ip->ihl << 2;
+	if (pkt->packet.ip->protocol == IPPROTO_TCP) {
+		pkt->packet.tcp = (struct tcphdr *) ((char *) pkt->packet.ip
+				+ l4_offset);
+		if (l4_offset + sizeof(struct tcphdr) > l3_len
+				|| l4_offset + (pkt->packet.tcp->doff << 2) > l3_len) {
+			goto error;
+		}
+		pkt->packet.payload = (char *) pkt->packet.tcp
+				+ (pkt->packet.tcp->doff << 2);
+	} else if (pkt->packet.ip->protocol == IPPROTO_UDP) {
+		if (l4_offset + UDP_HDR_LEN > l3_len) {
+			goto error;
+		}
+		pkt->packet.udp = (struct udphdr *) ((char *) pkt->packet.ip
+				+ l4_offset);
+		pkt->packet.payload = (char *) pkt->packet.udp + UDP_HDR_LEN;
+	} else {
+		goto error;
+	}
+
+	GET(r, vlan);
+	if (vlan) {
+		pkt->original_headers.vlan = get_key(r, VLAN_ETH_HLEN);
+	} else {
+		pkt->original_headers.eth = get_key(r, ETHER_HDR_LEN);
+	}
+
+	GET(r, ip_len);
+	pkt->original_headers.ip = get_key(r, ip_len);
+
+	GET(r, l4);
+	if (l4 == IPPROTO_TCP) {
+		pkt->original_headers.tcp = get_key(r, sizeof(struct tcphdr));
+	} else if (l4 == IPPROTO_UDP) {
+		pkt->original_headers.udp = get_key(r, sizeof(struct udphdr));
+	}
+
+	if (r->error || !pkt->original_headers.ip) {
+		goto error;
+	}
+
+	return pkt;
+
+	error:
+	r->error = TRUE;
+	free_pkt(pkt);
+	return NULL;
+}
+
+/*! get_conn
+ \brief rebuild a connection from its record
+ *
+ * targetlock and connlock must be held by the caller.
+ *
+ \return the connection, with its target and handlers resolved if they
+ * still exist, or NULL if the record is corrupt
+ */
+static struct conn_struct *get_conn(struct snapshot_reader *r,
+		gboolean *resolved) {
+
+	struct conn_struct *conn = g_malloc0(sizeof(struct conn_struct));
+	struct snapshot_handler front, back, intra;
+	uint8_t protocol = 0, state = 0, initiator = 0, destination = 0, keys = 0,
+			pin_ip_tree = 0, kind = 0;
+	uint16_t ip_proto = 0, hih_port = 0;
+	uint32_t lih_syn_seq = 0, delta = 0;
+	int32_t expected_pkt = -1, decision_packet_id = 0, replay_problem = 0;
+	gpointer search[2];
+
+	g_mutex_init(&conn->lock);
+	*resolved = TRUE;
+
+	GET(r, conn->id);
+	GET(r, protocol);
+	GET(r, state);
+	GET(r, initiator);
+	GET(r, destination);
+	GET(r, conn->access_time);
+	GET(r, conn->start_microtime);
+	GET(r, conn->start_timestamp);
+	GET(r, conn->tcp_ts_diff);
+	GET(r, conn->replay_id);
+	GET(r, conn->count_data_pkt_from_lih);
+	GET(r, conn->count_data_pkt_from_intruder);
+
+	conn->protocol = protocol;
+	conn->state = state;
+	conn->initiator = initiator;
+	conn->destination = destination;
+	conn->start_timestamp[sizeof(conn->start_timestamp) - 1] = '\0';
+
+	GET(r, conn->first_pkt_vlan);
+	GET(r, conn->first_pkt_src_mac);
+	GET(r, conn->first_pkt_dst_mac);
+	GET(r, conn->first_pkt_src_ip);
+	GET(r, conn->first_pkt_dst_ip);
+	GET(r, conn->first_pkt_src_port);
+	GET(r, conn->first_pkt_dst_port);
+
+	get_handler(r, &front);
+	get_handler(r, &back);
+	get_handler(r, &intra);
+
+	GET(r, hih_port);
+	GET(r, lih_syn_seq);
+	GET(r, delta);
+	conn->hih.port = hih_port;
+	conn->hih.lih_syn_seq = lih_syn_seq;
+	conn->hih.delta = delta;
+
+	GET(r, keys);
+	if (keys & SNAPSHOT_EXT_KEY)
+		conn->ext_key = get_key(r, sizeof(struct conn_key));
+	if (keys & SNAPSHOT_INT_KEY)
+		conn->int_key = get_key(r, sizeof(struct conn_key));
+	if (keys & SNAPSHOT_INTRA_KEY)
+		conn->intra_key = get_key(r, sizeof(struct conn_key));
+	if (keys & SNAPSHOT_PIN_KEY)
+		conn->pin_key = get_key(r, sizeof(struct pin_key));
+	if (keys & SNAPSHOT_REDIRECTED_INT_KEY)
+		conn->hih.redirected_int_key = get_key(r, sizeof(struct conn_key));
+	if (keys & SNAPSHOT_TARGET_PIN_KEY)
+		conn->hih.target_pin_key = get_key(r, sizeof(struct pin_key));
+
+	GET(r, pin_ip_tree);
+	if (pin_ip_tree != SNAPSHOT_PIN_NONE) {
+		struct pin_key pin_ip_key;
+		struct pin *pin = NULL;
+		GET(r, pin_ip_key);
+		if (pin_tree(pin_ip_tree)
+				&& (pin = g_tree_lookup(pin_tree(pin_ip_tree), &pin_ip_key))) {
+			conn->pin_ip = &pin->ip;
+		} else {
+			*resolved = FALSE;
+		}
+	}
+
+	GET(r, ip_proto);
+	GET(r, conn->expected_data.tcp_seq);
+	GET(r, conn->expected_data.tcp_ack_seq);
+	GET(r, conn->expected_data.tcp_ts);
+	GET(r, expected_pkt);
+	conn->expected_data.ip_proto = ip_proto;
+
+	GET(r, conn->total_packet);
+	GET(r, conn->total_byte);
+	GET(r, decision_packet_id);
+	GET(r, replay_problem);
+	conn->decision_packet_id = decision_packet_id;
+	conn->replay_problem = replay_problem;
+
+	GET(r, kind);
+	if (kind == SNAPSHOT_TOMBSTONE) {
+		struct conn_tombstone tombstone;
+		uint32_t status_len = 0;
+
+		GET(r, tombstone.lasttime);
+		GET(r, tombstone.stat_time);
+		GET(r, tombstone.stat_packet);
+		GET(r, tombstone.stat_byte);
+		tombstone.custom_data = get_string(r, NULL);
+		char *status_info = get_string(r, &status_len);
+
+		conn->tombstone = g_malloc0(sizeof(struct conn_tombstone) + status_len);
+		*conn->tombstone = tombstone;
+		if (status_info) {
+			memcpy(conn->tombstone->status_info, status_info, status_len);
+			g_free(status_info);
+		}
+	} else {
+		uint32_t rule_len = 0;
+
+		conn->stats = g_malloc0(sizeof(struct conn_stats));
+		GET(r, conn->stats->stat_time);
+		GET(r, conn->stats->stat_packet);
+		GET(r, conn->stats->stat_byte);
+
+		char *rule = get_string(r, &rule_len);
+		conn->stats->decision_rule = g_string_new_len(rule, rule ? rule_len : 0);
+		g_free(rule);
+	}
+
+	uint32_t buffered = 0, i;
+	GET(r, buffered);
+	for (i = 0; i < buffered && !r->error; i++) {
+		struct pkt_struct *pkt = get_pkt(r, conn, resolved);
+		if (pkt) {
+			conn->BUFFER = g_slist_append(conn->BUFFER, pkt);
+		}
+	}
+
+	GET(r, conn->front_ip);
+
+	if (r->error) {
+		free_conn(conn);
+		return NULL;
+	}
+
+	if (expected_pkt >= 0) {
+		struct pkt_struct *pkt = g_slist_nth_data(conn->BUFFER, expected_pkt);
+		conn->expected_data.payload = pkt ? pkt->packet.payload : NULL;
+	}
+
+	/*! Bind the connection to the current target and handlers */
+	search[0] = &front;
+	search[1] = NULL;
+	g_tree_foreach(targets, (GTraverseFunc) find_target_by_handler, search);
+	conn->target = search[1];
+
+	if (!conn->target) {
+		*resolved = FALSE;
+		return conn;
+	}
+
+	if (back.present) {
+		search[0] = &back;
+		search[1] = NULL;
+		g_tree_foreach(conn->target->back_handlers,
+				(GTraverseFunc) find_back_handler, search);
+		conn->hih.back_handler = search[1];
+		if (conn->hih.back_handler) {
+			conn->hih.hihID = conn->hih.back_handler->ID;
+		} else {
+			*resolved = FALSE;
+		}
+	}
+
+	if (intra.present) {
+		conn->intra_handler = find_intra_handler(conn->target, &intra);
+		if (!conn->intra_handler) {
+			*resolved = FALSE;
+		}
+	}
+
+	return conn;
+}
+
+/*! load_snapshot
+ \brief restore the pins and connections saved by save_snapshot
+ *
+ * Must be called before packets are captured. Connections whose target or
+ * handlers no longer exist are dropped and release their pins as if they had
+ * expired.
+ *
+ \param[in] file: path of the snapshot
+ \param[out] restored: number of connections restored
+ \param[out] dropped: number of connections that couldn't be restored
+ \return OK if the snapshot could be read
+ */
+status_t load_snapshot(const char *file, uint32_t *restored, uint32_t *dropped) {
+
+	status_t ret = NOK;
+	GError *error = NULL;
+	struct snapshot_header header;
+	uint32_t i;
+
+	*restored = *dropped = 0;
+
+	GMappedFile *map = g_mapped_file_new(file, FALSE, &error);
+	if (!map) {
+		printdbg("%s Can't open snapshot file %s: %s\n", H(0), file,
+				error->message);
+		g_error_free(error);
+		return NOK;
+	}
+
+	struct snapshot_reader r = { .pos = g_mapped_file_get_contents(map), .end =
+			g_mapped_file_get_contents(map) + g_mapped_file_get_length(map) };
+
+	GET(&r, header);
+	if (r.error || memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic))
+			|| header.version != SNAPSHOT_VERSION) {
+		printdbg("%s %s is not a snapshot this version can read\n", H(0), file);
+		goto done;
+	}
+
+	g_rw_lock_reader_lock(&targetlock);
+	g_mutex_lock(&connlock);
+
+	for (i = 0; i < header.pins && !r.error; i++) {
+		uint8_t tree = 0;
+		struct pin_key key;
+		struct pin *pin = g_malloc0(sizeof(struct pin));
+
+		GET(&r, tree);
+		GET(&r, key);
+		GET(&r, pin->ip);
+		GET(&r, pin->count);
+
+		if (r.error || !pin_tree(tree) || g_tree_lookup(pin_tree(tree), &key)) {
+			free_0(pin);
+			continue;
+		}
+
+		pin->pin_key = g_memdup(&key, sizeof(struct pin_key));
+		g_tree_insert(pin_tree(tree), pin->pin_key, pin);
+	}
+
+	for (i = 0; i < header.conns && !r.error; i++) {
+		uint32_t len = 0;
+		gboolean resolved;
+
+		GET(&r, len);
+		struct snapshot_reader record = { .pos = take(&r, len) };
+		if (!record.pos) {
+			break;
+		}
+		record.end = record.pos + len;
+
+		struct conn_struct *conn = get_conn(&record, &resolved);
+		if (!conn) {
+			(*dropped)++;
+			continue;
+		}
+
+		if (!resolved || restore_conn(conn) == NOK) {
+			unpin_conn(conn);
+			free_conn(conn);
+			(*dropped)++;
+			continue;
+		}
+
+		(*restored)++;
+	}
+
+	if (header.c_id > c_id) {
+		c_id = header.c_id;
+	}
+
+	g_mutex_unlock(&connlock);
+	g_rw_lock_reader_unlock(&targetlock);
+
+	if (r.error) {
+		printdbg("%s Snapshot %s is truncated\n", H(0), file);
+	}
+
+	printdbg("%s Restored %u connections from %s, %u dropped\n", H(0),
+			*restored, file, *dropped);
+
+	ret = OK;
+
+	done:
+	g_mapped_file_unref(map);
+	return ret;
+}
@@ -0,0 +1,776 @@
+/*
+ * This file is part of the honeybrid project.
+ *
+ * 2007-2009 University of Maryland (http://www.umd.edu)
+ * Robin Berthier <robinb@umd.edu>, Thomas Coquelin <coquelin@umd.edu>
+ * and Julien Vehent <julien@linuxwall.info>
+ *
+ * 2012-2014 University of Connecticut (http://www.uconn.edu)
+ * Tamas K Lengyel <tamas.k.lengyel@gmail.com>
+ *
+ * Honeybrid is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "store.h"
+
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "convenience.h"
+
+/*!	\file store.c
+ \brief
+
+ Where the modules remember the attackers and the payloads they saw, in
+ place of a GKeyFile per module. Records have a fixed binary layout and
+ are kept in a hash table split into shards, each behind its own lock, so
+ the decision threads and the module workers only contend when they touch
+ the same shard. store_update() changes a record while its shard is held:
+ reading the counters, deciding and writing them back is a single step.
+
+ A store belongs to its backup file: modules configured with the same
+ 'backup' share it, and a configuration reload finds it again.
+
+ On disk a store is a snapshot, the backup file itself, and a journal next
+ to it (backup.journal). Every minute the module backup thread appends the
+ records that changed since the last time to the journal, so the I/O
+ follows the changes and not the size of the store. Once the journal grew
+ larger than the snapshot, a new snapshot is written to a temporary file
+ and renamed over the old one, and the journal starts over. Both carry a
+ generation: a journal only applies to the snapshot of its generation, so
+ a crash between the rename and the new journal doesn't replay records
+ the snapshot already has. A record torn by a crash at the end of the
+ journal is dropped.
+
+ Opening a store maps the snapshot and replays the journal. A backup in the
+ GKeyFile format of the previous versions is imported and written back as
+ a snapshot.
+ */
+
+#define STORE_SHARD_BITS	6
+#define STORE_SHARDS		(1 << STORE_SHARD_BITS)
+
+#define STORE_MAGIC		"HBST"
+#define JOURNAL_MAGIC	"HBJL"
+#define STORE_VERSION	2
+
+/*! the journal is compacted once larger than the snapshot and this */
+#define STORE_COMPACT_MIN	(1 << 20)
+
+/*! a record as it is written to the snapshot and the journal */
+struct store_entry {
+	struct store_key key;
+	struct store_record record;
+};
+
+struct store_item {
+	struct store_entry entry;
+	gboolean queued; // waits in the changed list of its shard
+};
+
+/*! store_shard
+ \param items, store_item by key
+ \param changed, the store_item changed since they were last written
+ */
+struct store_shard {
+	GMutex lock;
+	GHashTable *items;
+	GPtrArray *changed;
+};
+
+/*! store
+ \param dirty, set when a record changed, cleared by store_save
+ \param save_lock, serializes store_save
+ \param journal, descriptor the changes are appended to
+ \param generation, of the snapshot the journal applies to
+ \param journal_size, bytes of records in the journal
+ \param snapshot_size, bytes of records in the snapshot
+ */
+struct store {
+	gchar *file;
+	gchar *journal_file;
+	gint dirty;
+	GMutex save_lock;
+	int journal;
+	uint64_t generation;
+	uint64_t journal_size;
+	uint64_t snapshot_size;
+	struct store_shard shards[STORE_SHARDS];
+};
+
+/*! header of a snapshot, followed by count store_entry */
+struct store_header {
+	char magic[4];
+	uint32_t version;
+	uint64_t count;
+	uint64_t generation;
+};
+
+/*! header of a journal, followed by store_entry until the end of the file */
+struct journal_header {
+	char magic[4];
+	uint32_t version;
+	uint64_t generation;
+};
+
+/*! The stores by backup file, protected by stores_lock */
+static GMutex stores_lock;
+static GHashTable *stores;
+
+static guint key_hash(gconstpointer data) {
+	const uint32_t *word = data;
+	uint32_t hash = 2166136261U;
+	uint32_t i;
+
+	for (i = 0; i < sizeof(struct store_key) / sizeof(uint32_t); i++) {
+		hash = (hash ^ word[i]) * 16777619U;
+	}
+	return hash ^ (hash >> 15);
+}
+
+static gboolean key_equal(gconstpointer a, gconstpointer b) {
+	return !memcmp(a, b, sizeof(struct store_key));
+}
+
+static inline struct store_shard *shard_of(struct store *store,
+		const struct store_key *key) {
+	return &store->shards[key_hash(key) >> (32 - STORE_SHARD_BITS)];
+}
+
+static struct store *store_new(const char *file) {
+	struct store *store = g_malloc0(sizeof(struct store));
+	uint32_t i;
+
+	store->file = g_strdup(file);
+	store->journal_file = g_strdup_printf("%s.journal", file);
+	store->journal = -1;
+	g_mutex_init(&store->save_lock);
+	for (i = 0; i < STORE_SHARDS; i++) {
+		g_mutex_init(&store->shards[i].lock);
+		store->shards[i].items = g_hash_table_new_full(key_hash, key_equal,
+				NULL, g_free);
+		store->shards[i].changed = g_ptr_array_new();
+	}
+
+	return store;
+}
+
+static void store_free(struct store *store) {
+	uint32_t i;
+
+	for (i = 0; i < STORE_SHARDS; i++) {
+		g_ptr_array_free(store->shards[i].changed, TRUE);
+		g_hash_table_destroy(store->shards[i].items);
+		g_mutex_clear(&store->shards[i].lock);
+	}
+	if (store->journal >= 0) {
+		close(store->journal);
+	}
+	g_mutex_clear(&store->save_lock);
+	g_free(store->journal_file);
+	g_free(store->file);
+	g_free(store);
+}
+
+/*! find_item
+ \brief the item of key, created zeroed if needed, with its shard held
+ */
+static struct store_item *find_item(struct store_shard *shard,
+		const struct store_key *key, gboolean *created) {
+	struct store_item *item = g_hash_table_lookup(shard->items, key);
+
+	*created = (item == NULL);
+	if (!item) {
+		item = g_malloc0(sizeof(struct store_item));
+		item->entry.key = *key;
+		g_hash_table_insert(shard->items, &item->entry.key, item);
+	}
+	return item;
+}
+
+/*! load_entries
+ \brief put records read from the disk in the store, the last one of a
+ * key wins
+ */
+static void load_entries(struct store *store, const struct store_entry *entries,
+		uint64_t count) {
+	uint64_t i;
+	gboolean created;
+
+	for (i = 0; i < count; i++) {
+		const struct store_key *key = &entries[i].key;
+		find_item(shard_of(store, key), key, &created)->entry.record =
+				entries[i].record;
+	}
+}
+
+void store_key_ip(struct store_key *key, uint32_t group, uint32_t addr) {
+	memset(key, 0, sizeof(struct store_key));
+	key->group = group;
+	memcpy(key->id, &addr, sizeof(addr));
+}
+
+/*! store_key_bytes
+ \brief key of a binary digest, zero padded when shorter than the id
+ */
+void store_key_bytes(struct store_key *key, uint32_t group, const uint8_t *id,
+		size_t len) {
+	memset(key, 0, sizeof(struct store_key));
+	key->group = group;
+	memcpy(key->id, id, MIN(len, STORE_ID_SIZE));
+}
+
+/*! store_key_digest
+ \brief key of a hex SHA-1 digest
+ \return NOK if hex isn't one
+ */
+status_t store_key_digest(struct store_key *key, uint32_t group,
+		const char *hex) {
+	uint32_t i;
+
+	if (!hex || strlen(hex) != STORE_ID_SIZE * 2) {
+		return NOK;
+	}
+
+	memset(key, 0, sizeof(struct store_key));
+	key->group = group;
+	for (i = 0; i < STORE_ID_SIZE; i++) {
+		int high = g_ascii_xdigit_value(hex[i << 1]);
+		int low = g_ascii_xdigit_value(hex[(i << 1) + 1]);
+		if (high < 0 || low < 0) {
+			return NOK;
+		}
+		key->id[i] = (high << 4) | low;
+	}
+
+	return OK;
+}
+
+/*! store_update
+ \brief run update on the record of key, with no other thread touching it,
+ * and queue the record to be written to the journal
+ */
+void store_update(struct store *store, const struct store_key *key,
+		store_update_func update, gpointer data) {
+	struct store_shard *shard = shard_of(store, key);
+	gboolean created;
+
+	g_mutex_lock(&shard->lock);
+	struct store_item *item = find_item(shard, key, &created);
+	update(&item->entry.record, created, data);
+	if (!item->queued) {
+		item->queued = TRUE;
+		g_ptr_array_add(shard->changed, item);
+	}
+	g_mutex_unlock(&shard->lock);
+
+	if (!g_atomic_int_get(&store->dirty)) {
+		g_atomic_int_set(&store->dirty, 1);
+	}
+}
+
+/*! store_lookup
+ \brief copy the record of key
+ \return FALSE if there is none
+ */
+gboolean store_lookup(struct store *store, const struct store_key *key,
+		struct store_record *record) {
+	struct store_shard *shard = shard_of(store, key);
+
+	g_mutex_lock(&shard->lock);
+	struct store_item *item = g_hash_table_lookup(shard->items, key);
+	if (item) {
+		*record = item->entry.record;
+	}
+	g_mutex_unlock(&shard->lock);
+
+	return item != NULL;
+}
+
+uint64_t store_size(struct store *store) {
+	uint64_t size = 0;
+	uint32_t i;
+
+	for (i = 0; i < STORE_SHARDS; i++) {
+		g_mutex_lock(&store->shards[i].lock);
+		size += g_hash_table_size(store->shards[i].items);
+		g_mutex_unlock(&store->shards[i].lock);
+	}
+	return size;
+}
+
+static status_t write_all(int fd, const void *data, size_t len) {
+	const char *buf = data;
+
+	while (len) {
+		ssize_t done = write(fd, buf, len);
+		if (done < 0) {
+			if (errno == EINTR)
+				continue;
+			return NOK;
+		}
+		buf += done;
+		len -= done;
+	}
+	return OK;
+}
+
+/*! new_journal
+ \brief start an empty journal for the current generation, in place of the
+ * one there was
+ */
+static status_t new_journal(struct store *store) {
+	struct journal_header header = { .magic = JOURNAL_MAGIC, .version =
+			STORE_VERSION, .generation = store->generation };
+	gchar *tmp = g_strdup_printf("%s.tmp", store->journal_file);
+	status_t ret = NOK;
+	int fd;
+
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+		g_printerr("%s Can't create journal %s: %s\n", H(6), tmp,
+				g_strerror(errno));
+		goto done;
+	}
+	if (write_all(fd, &header, sizeof(header)) != OK || fdatasync(fd)
+			|| rename(tmp, store->journal_file)) {
+		g_printerr("%s Can't write journal %s: %s\n", H(6),
+				store->journal_file, g_strerror(errno));
+		close(fd);
+		unlink(tmp);
+		goto done;
+	}
+
+	/*! the descriptor still points at the renamed file, appends go there */
+	if (store->journal >= 0) {
+		close(store->journal);
+	}
+	store->journal = fd;
+	store->journal_size = 0;
+	ret = OK;
+
+done:
+	g_free(tmp);
+	return ret;
+}
+
+/*! compact_store
+ \brief write every record to a new snapshot and start a new journal
+ *
+ * The records still waiting for the journal are in the snapshot: they are
+ * taken off their list while their shard is written. What changes after
+ * its shard was written is journaled after the new snapshot.
+ */
+static status_t compact_store(struct store *store) {
+	struct store_header header = { .magic = STORE_MAGIC, .version =
+			STORE_VERSION, .generation = store->generation + 1 };
+	GHashTableIter iter;
+	struct store_item *item;
+	status_t ret = NOK;
+	uint32_t i;
+
+	gchar *tmp = g_strdup_printf("%s.tmp", store->file);
+	FILE *fp = fopen(tmp, "w");
+	if (!fp) {
+		printdbg("%s Failed to save module backup \"%s\": can't open file for writing\n",
+				H(6), tmp);
+		goto done;
+	}
+
+	fwrite(&header, sizeof(header), 1, fp);
+	for (i = 0; i < STORE_SHARDS; i++) {
+		struct store_shard *shard = &store->shards[i];
+		g_mutex_lock(&shard->lock);
+		g_hash_table_iter_init(&iter, shard->items);
+		while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &item)) {
+			fwrite(&item->entry, sizeof(struct store_entry), 1, fp);
+			item->queued = FALSE;
+			header.count++;
+		}
+		g_ptr_array_set_size(shard->changed, 0);
+		g_mutex_unlock(&shard->lock);
+	}
+
+	rewind(fp);
+	fwrite(&header, sizeof(header), 1, fp);
+
+	if (fflush(fp) || ferror(fp) || fsync(fileno(fp))) {
+		printdbg("%s Failed to save module backup \"%s\"\n", H(6), tmp);
+		fclose(fp);
+		unlink(tmp);
+		goto done;
+	}
+	fclose(fp);
+
+	if (rename(tmp, store->file)) {
+		printdbg("%s Failed to replace module backup \"%s\"\n", H(6),
+				store->file);
+		unlink(tmp);
+		goto done;
+	}
+
+	printdbg("%s saved %"PRIu64" records to %s\n", H(6), header.count,
+			store->file);
+
+	store->generation = header.generation;
+	store->snapshot_size = header.count * sizeof(struct store_entry);
+	ret = new_journal(store);
+
+done:
+	if (ret != OK) {
+		/*! the records are only in memory, write them all next time */
+		for (i = 0; i < STORE_SHARDS; i++) {
+			struct store_shard *shard = &store->shards[i];
+			g_mutex_lock(&shard->lock);
+			g_hash_table_iter_init(&iter, shard->items);
+			while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &item)) {
+				if (!item->queued) {
+					item->queued = TRUE;
+					g_ptr_array_add(shard->changed, item);
+				}
+			}
+			g_mutex_unlock(&shard->lock);
+		}
+		g_atomic_int_set(&store->dirty, 1);
+	}
+	g_free(tmp);
+	return ret;
+}
+
+/*! flush_journal
+ \brief append the records that changed to the journal
+ */
+static status_t flush_journal(struct store *store) {
+	GArray *batch = g_array_new(FALSE, FALSE, sizeof(struct store_entry));
+	status_t ret = OK;
+	uint32_t i, j;
+
+	for (i = 0; i < STORE_SHARDS; i++) {
+		struct store_shard *shard = &store->shards[i];
+		g_mutex_lock(&shard->lock);
+		for (j = 0; j < shard->changed->len; j++) {
+			struct store_item *item = g_ptr_array_index(shard->changed, j);
+			g_array_append_val(batch, item->entry);
+			item->queued = FALSE;
+		}
+		g_ptr_array_set_size(shard->changed, 0);
+		g_mutex_unlock(&shard->lock);
+	}
+
+	if (batch->len) {
+		size_t len = batch->len * sizeof(struct store_entry);
+		if (store->journal < 0 || write_all(store->journal, batch->data, len) != OK
+				|| fdatasync(store->journal)) {
+			printdbg("%s Failed to append to journal \"%s\"\n", H(6),
+					store->journal_file);
+			ret = NOK;
+		} else {
+			store->journal_size += len;
+			printdbg("%s journaled %u records to %s\n", H(6), batch->len,
+					store->journal_file);
+		}
+	}
+
+	g_array_free(batch, TRUE);
+	return ret;
+}
+
+/*! import_keyfile
+ \brief load a backup written by the GKeyFile based modules
+ *
+ * Addresses were keyed in decimal or dotted notation under the 'source'
+ * group, digests in hex under the port they were sent to, with the port in
+ * network order. The values are the counter, first seen, duration, and for
+ * mod_hash the packets and bytes.
+ */
+static status_t import_keyfile(struct store *store) {
+	GKeyFile *keyfile = g_key_file_new();
+	GError *error = NULL;
+	gchar **groups, **keys;
+	uint32_t g, k;
+
+	g_key_file_set_list_separator(keyfile, '\t');
+	if (!g_key_file_load_from_file(keyfile, store->file, G_KEY_FILE_NONE,
+			&error)) {
+		g_printerr("%s Can't load backup file %s: %s\n", H(6), store->file,
+				error->message);
+		g_error_free(error);
+		g_key_file_free(keyfile);
+		return NOK;
+	}
+
+	groups = g_key_file_get_groups(keyfile, NULL);
+	for (g = 0; groups[g]; g++) {
+		uint32_t group = 0;
+		if (strcmp(groups[g], "source")) {
+			group = ntohs(strtoul(groups[g], NULL, 10));
+		}
+
+		keys = g_key_file_get_keys(keyfile, groups[g], NULL, NULL);
+		for (k = 0; keys && keys[k]; k++) {
+			struct store_key key;
+			struct in_addr addr;
+			gsize n = 0;
+			gboolean created;
+
+			if (inet_pton(AF_INET, keys[k], &addr) == 1) {
+				store_key_ip(&key, group, addr.s_addr);
+			} else if (store_key_digest(&key, group, keys[k]) != OK) {
+				store_key_ip(&key, group, strtoul(keys[k], NULL, 10));
+			}
+
+			gchar **values = g_key_file_get_string_list(keyfile, groups[g],
+					keys[k], &n, NULL);
+			struct store_record *record = &find_item(shard_of(store, &key),
+					&key, &created)->entry.record;
+
+			if (n > 0)
+				record->counter = atoi(values[0]);
+			if (n > 1)
+				record->first_seen = g_ascii_strtoll(values[1], NULL, 10);
+			if (n > 2)
+				record->duration = g_ascii_strtoll(values[2], NULL, 10);
+			if (n > 3)
+				record->packets = atoi(values[3]);
+			if (n > 4)
+				record->bytes = atoi(values[4]);
+
+			g_strfreev(values);
+		}
+		g_strfreev(keys);
+	}
+	g_strfreev(groups);
+	g_key_file_free(keyfile);
+
+	g_printerr("%s Imported %"PRIu64" records from the key file %s\n", H(6),
+			store_size(store), store->file);
+
+	/*! written back in the binary format right away */
+	return compact_store(store);
+}
+
+/*! map_file
+ \brief map a whole file to read it
+ \return the mapping to unmap, NULL if the file is empty or can't be mapped
+ */
+static const char *map_file(const char *file, size_t *size) {
+	struct stat st;
+	void *map;
+	int fd;
+
+	*size = 0;
+	if ((fd = open(file, O_RDONLY)) < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) || st.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	*size = st.st_size;
+	return map;
+}
+
+/*! replay_journal
+ \brief apply the journal of the snapshot and keep appending to it
+ *
+ * A journal of another generation was written before the snapshot that
+ * was loaded, it is started over.
+ */
+static status_t replay_journal(struct store *store) {
+	const struct journal_header *header;
+	size_t size;
+	const char *map = map_file(store->journal_file, &size);
+
+	if (!map) {
+		return new_journal(store);
+	}
+
+	header = (const struct journal_header *) map;
+	if (size < sizeof(*header) || memcmp(header->magic, JOURNAL_MAGIC, 4)
+			|| header->version != STORE_VERSION
+			|| header->generation != store->generation) {
+		munmap((void *) map, size);
+		return new_journal(store);
+	}
+
+	uint64_t count = (size - sizeof(*header)) / sizeof(struct store_entry);
+	load_entries(store, (const struct store_entry *) (map + sizeof(*header)),
+			count);
+	munmap((void *) map, size);
+
+	store->journal_size = count * sizeof(struct store_entry);
+	if ((store->journal = open(store->journal_file, O_WRONLY | O_APPEND))
+			< 0) {
+		g_printerr("%s Can't open journal %s: %s\n", H(6),
+				store->journal_file, g_strerror(errno));
+		return NOK;
+	}
+
+	/*! drop the end of a record torn by a crash, appends stay aligned */
+	if (sizeof(*header) + store->journal_size != size) {
+		g_printerr("%s Journal %s ends with a partial record, dropped\n",
+				H(6), store->journal_file);
+		if (ftruncate(store->journal, sizeof(*header) + store->journal_size)) {
+			/*! what was replayed goes to a new snapshot instead */
+			return compact_store(store);
+		}
+	}
+
+	printdbg("%s replayed %"PRIu64" records from %s\n", H(6), count,
+			store->journal_file);
+	return OK;
+}
+
+/*! load_store
+ \brief fill a new store from its snapshot and journal, if it has them
+ */
+static status_t load_store(struct store *store) {
+	const struct store_header *header;
+	size_t size, offset = sizeof(struct store_header);
+	const char *map = map_file(store->file, &size);
+
+	if (!map) {
+		/*! no snapshot yet, the journal belongs to generation 0 */
+		if (g_file_test(store->file, G_FILE_TEST_EXISTS)
+				&& access(store->file, R_OK)) {
+			g_printerr("%s Can't read backup file %s\n", H(6), store->file);
+			return NOK;
+		}
+		return replay_journal(store);
+	}
+
+	header = (const struct store_header *) map;
+	if (size < 16 || memcmp(header->magic, STORE_MAGIC, 4)) {
+		munmap((void *) map, size);
+		return import_keyfile(store);
+	}
+
+	if (header->version != STORE_VERSION || size < offset) {
+		g_printerr("%s Backup file %s has unknown version %u\n", H(6),
+				store->file, header->version);
+		munmap((void *) map, size);
+		return NOK;
+	}
+	store->generation = header->generation;
+
+	uint64_t count = MIN(header->count,
+			(size - offset) / sizeof(struct store_entry));
+	if (count < header->count) {
+		g_printerr("%s Backup file %s is truncated after %"PRIu64" records\n",
+				H(6), store->file, count);
+	}
+
+	load_entries(store, (const struct store_entry *) (map + offset), count);
+	store->snapshot_size = count * sizeof(struct store_entry);
+	munmap((void *) map, size);
+
+	return replay_journal(store);
+}
+
+/*! store_open
+ \brief the store kept in file, loaded the first time it is asked for
+ \return NULL if the file can't be read or the journal can't be written
+ */
+struct store *store_open(const char *file) {
+	struct store *store;
+
+	g_mutex_lock(&stores_lock);
+
+	if (!stores) {
+		stores = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+				(GDestroyNotify) store_free);
+	}
+
+	if (NULL == (store = g_hash_table_lookup(stores, file))) {
+		store = store_new(file);
+		if (load_store(store) == OK) {
+			g_hash_table_insert(stores, store->file, store);
+		} else {
+			store_free(store);
+			store = NULL;
+		}
+	}
+
+	g_mutex_unlock(&stores_lock);
+	return store;
+}
+
+/*! store_save
+ \brief journal the records that changed, and compact the journal into a
+ * new snapshot once it is larger than the snapshot
+ */
+status_t store_save(struct store *store) {
+	status_t ret;
+
+	g_mutex_lock(&store->save_lock);
+
+	/*! changes made while we write are saved the next time */
+	g_atomic_int_set(&store->dirty, 0);
+
+	ret = flush_journal(store);
+
+	if (ret != OK || (store->journal_size > store->snapshot_size
+			&& store->journal_size > STORE_COMPACT_MIN)) {
+		ret = compact_store(store);
+	}
+
+	g_mutex_unlock(&store->save_lock);
+	return ret;
+}
+
+/*! store_save_all
+ \brief write the stores that changed since they were last written
+ */
+void store_save_all(void) {
+	GHashTableIter i;
+	char *file = NULL;
+	struct store *store = NULL;
+
+	g_mutex_lock(&stores_lock);
+	if (stores) {
+		ghashtable_foreach(stores, i, file, store)
+		{
+			if (g_atomic_int_get(&store->dirty)) {
+				store_save(store);
+			}
+		}
+	}
+	g_mutex_unlock(&stores_lock);
+}
+
+/*! close_stores
+ \brief write what changed and free the stores, once nothing uses them
+ */
+void close_stores(void) {
+	store_save_all();
+
+	g_mutex_lock(&stores_lock);
+	if (stores) {
+		g_hash_table_destroy(stores);
+		stores = NULL;
+	}
+	g_mutex_unlock(&stores_lock);
+}
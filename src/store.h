@@ -0,0 +1,96 @@
+/*
+ * This file is part of the honeybrid project.
+ *
+ * 2007-2009 University of Maryland (http://www.umd.edu)
+ * Robin Berthier <robinb@umd.edu>, Thomas Coquelin <coquelin@umd.edu>
+ * and Julien Vehent <julien@linuxwall.info>
+ *
+ * 2012-2014 University of Connecticut (http://www.uconn.edu)
+ * Tamas K Lengyel <tamas.k.lengyel@gmail.com>
+ *
+ * Honeybrid is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __STORE_H_
+#define __STORE_H_
+
+#include "types.h"
+
+#define STORE_ID_SIZE	20
+
+/*!
+ \def store_key
+ \brief what a store record is about: an IPv4 address or a payload digest
+ *
+ * The group separates records of the same store, mod_hash keeps the
+ * digests of each destination port apart.
+ */
+struct store_key {
+	uint32_t group;
+	uint8_t id[STORE_ID_SIZE];
+};
+
+/*!
+ \def store_record
+ \brief what the modules remember about an attacker or a payload
+ *
+ \param counter, times it was seen since first_seen
+ \param first_seen, unix time it was first seen
+ \param duration, seconds between first_seen and the last time it was seen
+ \param packets, data packets of the connection that sent it last
+ \param bytes, size of the payload that was digested
+ */
+struct store_record {
+	uint32_t counter;
+	uint32_t packets;
+	uint32_t bytes;
+	uint32_t reserved;
+	int64_t first_seen;
+	int64_t duration;
+};
+
+struct store;
+
+/*! store_update_func
+ \brief change a record in place, created is TRUE if the record was
+ * zeroed for the occasion
+ */
+typedef void (*store_update_func)(struct store_record *record,
+		gboolean created, gpointer data);
+
+struct store *store_open(const char *file);
+
+void store_update(struct store *store, const struct store_key *key,
+		store_update_func update, gpointer data);
+
+gboolean store_lookup(struct store *store, const struct store_key *key,
+		struct store_record *record);
+
+uint64_t store_size(struct store *store);
+
+status_t store_save(struct store *store);
+
+void store_save_all(void);
+
+void close_stores(void);
+
+void store_key_ip(struct store_key *key, uint32_t group, uint32_t addr);
+
+status_t store_key_digest(struct store_key *key, uint32_t group,
+		const char *hex);
+
+void store_key_bytes(struct store_key *key, uint32_t group, const uint8_t *id,
+		size_t len);
+
+#endif /* __STORE_H_ */
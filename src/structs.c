@@ -25,6 +25,7 @@
 #include "structs.h"
 #include "convenience.h"
 #include "decision_engine.h"
+#include "balancer.h"
 
 /*!	\file structs.c
  \brief
@@ -61,15 +62,23 @@ void free_handler(struct handler *handler) {
         g_slist_free(handler->intra_target_ips);
 
         free_0(handler->netmask);
-        DE_destroy_tree(handler->rule);
+        DE_destroy_rule(handler->rule);
         free_0(handler);
     }
 }
 
+static gboolean free_back_handler(__attribute__((unused)) gpointer key,
+        struct handler *handler, __attribute__((unused)) gpointer data) {
+    free_handler(handler);
+    return FALSE;
+}
+
 void free_target(struct target *t) {
     g_mutex_lock(&t->lock);
     free_handler(t->front_handler);
     free_0(t->default_route_mac);
+    /* the trees don't own the handlers, their older versions share them */
+    g_tree_foreach(t->back_handlers, (GTraverseFunc) free_back_handler, NULL);
     g_tree_destroy(t->back_handlers);
     g_tree_destroy(t->intra_handlers);
     GSList *loop = t->intra_handlers_list;
@@ -78,8 +87,11 @@ void free_target(struct target *t) {
     	loop=loop->next;
     }
     g_slist_free(t->intra_handlers_list);
-    DE_destroy_tree(t->control_rule);
-    DE_destroy_tree(t->intra_rule);
+    g_slist_free_full(t->addresses, g_free);
+    DE_destroy_rule(t->back_picker);
+    balancer_free(t->balancer);
+    DE_destroy_rule(t->control_rule);
+    DE_destroy_rule(t->intra_rule);
     g_mutex_clear(&t->lock);
     free_0(t);
 }
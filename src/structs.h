@@ -60,6 +60,18 @@ struct vlan_ethhdr {
 	__be16 h_vlan_encapsulated_proto;
 }__attribute__ ((__packed__));
 
+/*!
+ \def balancer_slot
+ \brief where a backend stands in the balancer of its target, see balancer.c
+ */
+struct balancer_slot {
+	gboolean listed; // the backend was added to the balancer
+	uint32_t active; // live redirected connections as last seen by the balancer
+	uint64_t pass; // virtual time of the next weighted turn of the backend
+	GSequenceIter *by_load; // NULL while the backend is saturated or unlisted
+	GSequenceIter *by_pass;
+};
+
 /*!
  \def handler
  \brief structure to hold target handler information (decision rule and interface information)
@@ -72,13 +84,20 @@ struct handler {
 	struct addr *netmask;
 	struct vlan_tci vlan;
 	struct interface *iface;
-	struct node *rule;
+	struct rule *rule;
 	uint8_t exclusive;
 
 	// If non-exclusive we can have multiple IPs handled by this handler
 	// otherwise this list has a single element.
 	// It's a list of struct addr*
 	GSList *intra_target_ips;
+
+	GQueue conns; // tracked connections using this handler as backend or intra (protected by connlock)
+
+	uint32_t weight; // share of the new connections given to this backend by the balancer, 1 if unset
+	uint32_t capacity; // maximum number of concurrent redirected connections, 0 for unlimited
+	uint64_t bytes; // bytes of the redirected connections that already ended (protected by connlock)
+	struct balancer_slot slot; // position in the balancer of its target (protected by the balancer)
 };
 void free_handler(struct handler *);
 
@@ -93,19 +112,35 @@ struct target {
 	struct addr *default_route_ip; /* Default SOURCE IP to send upstream packets from */
 	struct addr *default_route_mac; /* Default MAC address to send upstream packets TO */
 
-	struct handler *front_handler; /* Honeypot frontend handling the first response */
+	struct handler *front_handler; /* Honeypot frontend handling the first response, its IP can be a prefix */
 
-	GTree *back_handlers; /* Honeypot backends handling the second response with key: hihID, value: struct handler */
+	GSList *addresses; /* Address blocks (struct addr prefixes) this target answers for, NULL for any address on its link */
+
+	GTree *back_handlers; /* Honeypot backends handling the second response with key: hihID, value: struct handler (copy-on-write) */
 	int64_t back_handler_count; /* Number of backends defined in the GTree, used to generate hihIDs */
-	struct node *back_picker; /* Rule(s) to pick which backend to use (such as VM name, etc.) */
+	struct rule *back_picker; /* Rule(s) to pick which backend to use (such as VM name, etc.) */
+	struct balancer *balancer; /* Load of the backends, used to pick the least loaded one with room left */
 
-	GTree *intra_handlers; /* IPs to be handled with intra handlers */
+	GTree *intra_handlers; /* IPs to be handled with intra handlers (copy-on-write) */
 	GSList *intra_handlers_list; /* The list of actual intra handlers */
 
-	struct node *control_rule; /* Rules of decision modules to limit outbound packets from honeypots */
-	struct node *intra_rule; /* Rules of decision modules to control intra-lan connections */
+	struct rule *control_rule; /* Rules of decision modules to limit outbound packets from honeypots */
+	struct rule *intra_rule; /* Rules of decision modules to control intra-lan connections */
+
+	GQueue conns; /* Tracked connections bound to this target (protected by connlock) */
+	GQueue evictable[__MAX_EVICTABLE]; /* The ones that can be evicted, by class (protected by connlock) */
+
+	gboolean configured; /* Defined in honeybrid.conf, replaced when the configuration is reloaded */
+	gboolean withdrawn; /* Taken out of the lookup tables, set under targetlock before the withdraw hooks run */
 };
 
+/*! The handler trees of a published target are replaced, never changed in
+ * place, so the decision threads read them without locks (see management.c) */
+#define target_back_handlers(target) \
+	((GTree *) g_atomic_pointer_get(&(target)->back_handlers))
+#define target_intra_handlers(target) \
+	((GTree *) g_atomic_pointer_get(&(target)->intra_handlers))
+
 void free_target(struct target *t);
 
 /*!
@@ -281,6 +316,16 @@ struct intra_search {
 	struct handler *intra_handler;
 };
 
+/*!
+ \def handler_entry
+ \brief what a honeypot address in the handler_addresses table belongs to
+ */
+struct handler_entry {
+	struct target *target;
+	struct handler *handler;
+	role_t role; // LIH for the frontend, HIH or INTRA
+};
+
 struct target_search {
 	gboolean found;
 	struct pkt_struct *pkt;
@@ -305,17 +350,55 @@ struct expected_data_struct {
 	const char* payload;
 };
 
-/*! custom_conn_data
- \brief Extra information to be attached to a conn_struct by a module
+/*! conn_stats
+ \brief Per-state statistics of a connection that can still change state
+
+ \param stat_time, time of the last packet seen in each state
+ \param stat_packet, nb of packets seen in each state
+ \param stat_byte, nb of bytes seen in each state
+ \param decision_rule, the rule that made the decision
+ */
+struct conn_stats {
+	gdouble stat_time[__MAX_CONN_STATUS ];
+	int stat_packet[__MAX_CONN_STATUS ];
+	int stat_byte[__MAX_CONN_STATUS ];
+	GString *decision_rule;
+};
+
+/*! conn_tombstone
+ \brief What is left of the statistics of a connection once it reached a final state
 
- \param data, pointer to the data
- \param data_free, function pointer to free the data when the conn_struct is destroyed
- \param data_print, function pointer to convert the data to a string
+ \param lasttime, time of the last state change logged before the final state
+ \param stat_time, time of the last packet seen in the final state
+ \param stat_packet, nb of packets seen in the final state
+ \param stat_byte, nb of bytes seen in the final state
+ \param custom_data, the custom data of the modules as printed in the log, NULL if there was none
+ \param status_info, the log fields of the states before the final state, NUL separated
  */
-struct custom_conn_data {
-	gpointer data; // the actual data
-	gpointer (*data_free)(gpointer data); // define function to free data (if any)
-	const char* (*data_print)(gpointer data); // define function to print data in log (if any)
+struct conn_tombstone {
+	gdouble lasttime;
+	gdouble stat_time;
+	uint32_t stat_packet;
+	uint32_t stat_byte;
+	char *custom_data;
+	char status_info[];
+};
+
+/*!
+ \def rule_wakeup
+ \brief when a rule that left a connection in its state has to be evaluated again
+ *
+ * Set by DE_process_packet from the triggers of the modules the rule called.
+ * Until one fires the packets keep the previous decision.
+ */
+struct rule_wakeup {
+	gboolean armed;
+	conn_status_t state; // state the rule was evaluated in
+	uint8_t triggers; // trigger_t
+	role_t origin; // origin of the packet it was evaluated on, for TRIGGER_DIRECTION
+	uint32_t data_packets; // for TRIGGER_COUNT
+	gint64 time; // for TRIGGER_TIME
+	int64_t backends; // number of backends of the target, a new one gets its chance
 };
 
 /*! conn_struct
@@ -344,7 +427,7 @@ struct conn_struct {
 	GMutex lock;
 
 	uint8_t protocol;
-	GString *start_timestamp;
+	char start_timestamp[27];
 	gdouble start_microtime;
 	gint access_time;
 
@@ -382,20 +465,32 @@ struct conn_struct {
 	struct target *target;
 
 	struct addr *pin_ip; //impersonate (SNAT/DNAT) this IP
+	struct addr front_ip; // frontend address serving this conn, picked from the frontend prefix
 
 	/* statistics */
-	gdouble stat_time[__MAX_CONN_STATUS ];
-	int stat_packet[__MAX_CONN_STATUS ];
-	int stat_byte[__MAX_CONN_STATUS ];
+	struct conn_stats *stats; // freed when the conn is compacted
+	struct conn_tombstone *tombstone; // set when the conn is compacted
 	uint32_t total_packet;
 	uint32_t total_byte;
 	int decision_packet_id;
-	GString *decision_rule;
 	replay_problem_t replay_problem;
 	int invalid_problem; //unused
 
-	GSList *custom_data; // allow custom data to be assigned to the connection by modules
-						 // the list elements have to point to struct custom_conn_data
+	gpointer *module_state; // per-connection state of the modules, indexed by module ID
+							// allocated when a module first sets its slot, see module_conn_state()
+
+	struct rule_wakeup wakeup; // when the rule of the current state is worth evaluating again
+	struct module_job *pending; // work a module submitted to decide on this conn
+	GQueue parked; // packets held while the job runs, replayed in order when it's done
+
+	GList *age_link; // position in conn_age_queue, NULL if the conn is not tracked
+	GList *target_link; // position in target->conns
+	GList *back_handler_link; // position in hih.back_handler->conns
+	GList *intra_handler_link; // position in intra_handler->conns
+	GList *evictable_link[__MAX_EVICTION_REASON]; // position in the evictable queue of each limit
+	evictable_t evictable; // the evictable queues it's in, see queue_evictable()
+	struct source_conns *source; // the tracked connections of its external source, NULL if it has none
+	eviction_reason_t eviction; // set when the conn was evicted to make room for a new one
 
 #ifdef HAVE_XMPP
 uint8_t dionaeaDownload;
@@ -415,6 +510,7 @@ struct raw_pcap {
 	struct pcap_pkthdr *header;
 	u_char *packet;
 	gboolean last; // last packet to be pushed in the queue
+	struct module_job *resume; // set instead of a packet when a module finished its work
 };
 void free_raw_pcap(struct raw_pcap *raw);
 
@@ -426,6 +522,30 @@ struct headers {
 	struct udphdr *udp;
 };
 
+/*! pkt_features
+ \brief what the modules derived from a packet, filled on first use
+ *
+ * Only the thread that runs the rules of the packet touches the cache, the
+ * accessors of feature_cache.h fill each field at most once.
+ *
+ \param filled, the feature_t of the fields already computed
+ \param source_ip, dotted saddr
+ \param dest_port, TCP or UDP destination port in host order
+ \param hints, hint_t of the payload
+ \param normalized, payload with the IP addresses replaced
+ \param normalized_len, length of normalized
+ \param digest, of normalized, by digest_t
+ */
+struct pkt_features {
+	uint32_t filled;
+	char source_ip[INET_ADDRSTRLEN];
+	uint16_t dest_port;
+	uint32_t hints;
+	char *normalized;
+	uint32_t normalized_len;
+	uint8_t digest[__MAX_DIGEST][DIGEST_SIZE];
+};
+
 /*! pkt_struct
  \brief The meta information of a packet stored in the conn_struct connection structure
 
@@ -433,6 +553,7 @@ struct headers {
  \param origin, to define from where the packet is coming (EXT, LIH or HIH)
  \param data, to provide the number of bytes in the packet
  \param DE, (0) if the packet was received before the decision to redirect, (1) otherwise
+ \param features, what the modules derived from the packet, NULL until asked
  */
 struct pkt_struct {
 	struct packet packet;
@@ -453,6 +574,10 @@ struct pkt_struct {
 	struct interface *in;
 	struct interface *out;
 
+	struct pkt_features *features;
+
+	gboolean answered; // a module replied in place of the destination, the packet goes no further
+
 }__attribute__ ((packed));
 
 /*! \brief Structure to pass arguments to the Decision Engine
@@ -474,25 +599,149 @@ struct mod_args {
 	struct pkt_struct *pkt;
 	const uint64_t backend_test;
 	uint64_t backend_use;
+
+	/* set by modules with TRIGGER_COUNT or TRIGGER_TIME, when their answer may change */
+	uint32_t wake_data_packets; // data packets from the intruder, 0 if unset
+	gint64 wake_time; // monotonic time, 0 if unset
 };
 
+/*!
+ \def mod_def
+ *
+ \brief definition of a decision module, everything but name and function is optional
+ *
+ \param function, decides on a packet
+ \param parse_config, parses the parameters of a rule node into node->param
+ \param init, called once before the first packet if a rule uses the module
+ \param shutdown, called on exit if init was called
+ \param conn_state_free, frees the slot of the module in conn->module_state
+ \param conn_state_print, renders that slot in the connection log
+ \param thread_init, creates the context of the module for a decision thread
+ \param thread_free, frees it when the thread exits
+ \param cacheable, results that only depend on the attacker, the service it
+ * hits and the module configuration, so they can be reused from the
+ * decision cache for the 'cache' seconds of the module (see CACHE_RESULT)
+ \param triggers, the events after which the answer of the module may change
+ * (trigger_t), every packet if none is given
+ */
 struct mod_def {
 	const char *name;
 	const module_function function;
+	const module_parse_config parse_config;
+	const module_init init;
+	const module_shutdown shutdown;
+	const GDestroyNotify conn_state_free;
+	const module_state_print conn_state_print;
+	const module_thread_init thread_init;
+	const GDestroyNotify thread_free;
+	const uint8_t cacheable;
+	const uint8_t triggers;
+};
+
+#define CACHE_RESULT(result) (1 << (result))
+
+#define DE_TRAIL_MAX	16
+
+struct rule_step;
+
+struct decision_trail {
+	const struct rule_step *step;
+	mod_result_t result;
+	uint64_t backend_use;
+};
+
+typedef enum {
+	JOB_RUNNING, // queued or running on a module worker
+	JOB_DONE, // finished or timed out, the owning decision thread was told to resume
+	JOB_RESUMED // the packets of the conn are replayed, the result waits for its module
+} job_state_t;
+
+/*!
+ \def module_job
+ *
+ \brief work a module runs on the worker pool while the packets of a conn are parked
+ *
+ * Shared by the connection, the worker pool, the timeout watchdog and the
+ * resume request, each of them holding a reference.
+ *
+ \param conn, the conn to resume, NULL once it's gone (protected by connlock)
+ \param node, the module instance that submitted the job
+ \param queue, the queue of the decision thread the conn belongs to
+ \param deadline, monotonic time after which the job times out
+ */
+struct module_job {
+	gint refs;
+	gint state;
+	struct conn_struct *conn;
+	const struct node *node;
+	GAsyncQueue *queue;
+
+	module_work work;
+	gpointer data;
+	GDestroyNotify data_free;
+
+	mod_result_t result;
+	uint64_t backend_use;
+
+	struct decision_trail *trail; // results of the modules called before this one
+	uint32_t trail_len;
+
+	gint64 deadline;
+	gboolean watched;
+	GList watch_link;
 };
 
 /*!
  \def node
  *
- \brief node of an execution tree, composed of a module and a argument, called by processing the tree
+ \brief instance of a module in a rule, with its parameters
  */
 struct node {
 	module_function module;
+	const struct mod_def *def;
 	GHashTable *config;
 	GString *module_name;
 	GString *function;
-	struct node *true_branch;
-	struct node *false_branch;
+	gpointer param; /* typed parameters filled by the module parse_config, freed with the node */
+	mod_result_t constant; /* ACCEPT or REJECT if the result doesn't depend on the packet, DEFER otherwise */
+	uint32_t cache_ttl; /* seconds a cacheable result of the module stays valid, 0 if it's never cached */
+	struct profile *profile; /* counters of the runs of the module, per decision thread, see profile.c */
+};
+
+#define RULE_ACCEPT	(-1)
+#define RULE_REJECT	(-2)
+
+/*!
+ \def rule_step
+ *
+ \brief instruction of a compiled rule: run the module of node, then continue
+ * with the step at on_accept or on_reject (or stop at RULE_ACCEPT/RULE_REJECT)
+ */
+struct rule_step {
+	struct node *node;
+	int32_t on_accept;
+	int32_t on_reject;
+};
+
+/*!
+ \def rule
+ *
+ \brief boolean equation of modules compiled into a flat program
+ *
+ * Steps only jump forward, so a decision is a single pass over the array.
+ * Modules with a constant result are folded away at compile time, a rule
+ * made only of those has no steps and entry is its result.
+ *
+ * The ID is unique for the lifetime of the process and keys the decision
+ * cache, cacheable is set if any of the modules may have its result cached.
+ */
+struct rule {
+	uint32_t id;
+	gboolean cacheable;
+	int32_t entry;
+	uint32_t length;
+	struct rule_step *steps;
+	gchar *equation;
 };
 
 /*!
@@ -502,10 +751,23 @@ struct node {
  */
 struct decision_holder {
 	struct pkt_struct *pkt;
-	struct node *node;
+	const struct rule *rule;
 	uint64_t backend_test;
 	uint64_t backend_use;
 	decision_t result;
+
+	/* results of the modules called for the packet, in order. When a module
+	 * parks the conn the trail is kept with the job, so the modules called
+	 * before it aren't called twice when the packet is evaluated again. */
+	struct decision_trail trail[DE_TRAIL_MAX];
+	uint32_t trail_len;
+	uint32_t replayed;
+	gboolean trail_overflow;
+
+	/* when the modules called may answer differently, see struct rule_wakeup */
+	uint8_t triggers;
+	uint32_t wake_data_packets;
+	gint64 wake_time;
 };
 
 struct log_event {
@@ -0,0 +1,322 @@
+/*
+ * This file is part of the honeybrid project.
+ *
+ * 2007-2009 University of Maryland (http://www.umd.edu)
+ * Robin Berthier <robinb@umd.edu>, Thomas Coquelin <coquelin@umd.edu>
+ * and Julien Vehent <julien@linuxwall.info>
+ *
+ * 2012-2014 University of Connecticut (http://www.uconn.edu)
+ * Tamas K Lengyel <tamas.k.lengyel@gmail.com>
+ *
+ * Honeybrid is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "timers.h"
+
+#include "log.h"
+#include "globals.h"
+#include "convenience.h"
+
+/*!	\file timers.c
+ \brief
+
+ One place for everything that has to happen later or regularly: the
+ connection cleaning, the module backups, the log rotation and the timers
+ of the modules. Timers are kept in a binary heap ordered by deadline, a
+ single dispatcher thread sleeps until the earliest one is due and hands
+ it to a small pool of threads, so callbacks that take a while don't hold
+ up the other timers. Adding and cancelling a timer costs O(log n), there
+ is no thread per timer.
+
+ A periodic timer is armed again once its callback returned, so a callback
+ never runs twice at the same time. Delays are in milliseconds.
+
+ */
+
+#define TIMER_THREADS	2
+#define NOT_QUEUED		G_MAXUINT
+
+struct timer {
+	guint id;
+	guint slot; /* position in the heap, NOT_QUEUED while it runs */
+	gint64 deadline;
+	gint64 interval; /* 0 for a one-shot timer */
+	timer_func func;
+	gpointer data;
+	GDestroyNotify destroy;
+	gboolean cancelled;
+};
+
+static GMutex timer_lock;
+static GCond timer_cond; /* the earliest deadline changed */
+static GCond timer_done; /* a callback returned */
+static GPtrArray *heap;
+static GHashTable *timers; /* key: id, value: struct timer */
+static guint last_id;
+
+/*! The timer whose callback the current thread runs */
+static GPrivate current_timer;
+
+static GThreadPool *timer_threads;
+static GThread *dispatcher;
+static gboolean dispatching;
+
+#define heap_at(i) ((struct timer *) g_ptr_array_index(heap, (i)))
+
+static void heap_set(guint slot, struct timer *timer) {
+	g_ptr_array_index(heap, slot) = timer;
+	timer->slot = slot;
+}
+
+static void sift_up(guint slot) {
+	struct timer *timer = heap_at(slot);
+
+	while (slot > 0) {
+		guint parent = (slot - 1) / 2;
+		if (heap_at(parent)->deadline <= timer->deadline)
+			break;
+		heap_set(slot, heap_at(parent));
+		slot = parent;
+	}
+	heap_set(slot, timer);
+}
+
+static void sift_down(guint slot) {
+	struct timer *timer = heap_at(slot);
+
+	for (;;) {
+		guint child = 2 * slot + 1;
+		if (child >= heap->len)
+			break;
+		if (child + 1 < heap->len
+				&& heap_at(child + 1)->deadline < heap_at(child)->deadline)
+			child++;
+		if (timer->deadline <= heap_at(child)->deadline)
+			break;
+		heap_set(slot, heap_at(child));
+		slot = child;
+	}
+	heap_set(slot, timer);
+}
+
+/*! heap_push
+ \brief queue a timer, wakes up the dispatcher if it's now the earliest
+ */
+static void heap_push(struct timer *timer) {
+	g_ptr_array_add(heap, timer);
+	timer->slot = heap->len - 1;
+	sift_up(timer->slot);
+
+	if (timer->slot == 0)
+		g_cond_signal(&timer_cond);
+}
+
+static void heap_remove(struct timer *timer) {
+	guint slot = timer->slot;
+	struct timer *last = g_ptr_array_remove_index(heap, heap->len - 1);
+
+	timer->slot = NOT_QUEUED;
+	if (last == timer)
+		return;
+
+	heap_set(slot, last);
+	if (slot > 0 && heap_at((slot - 1) / 2)->deadline > last->deadline)
+		sift_up(slot);
+	else
+		sift_down(slot);
+}
+
+static void free_timer(struct timer *timer) {
+	if (timer->destroy)
+		timer->destroy(timer->data);
+	g_free(timer);
+}
+
+static void run_timer(struct timer *timer, gpointer unused) {
+
+	g_private_set(&current_timer, timer);
+	timer->func(timer->data);
+	g_private_set(&current_timer, NULL);
+
+	g_mutex_lock(&timer_lock);
+	if (timer->interval && !timer->cancelled && dispatching) {
+		/* skip the runs that were missed rather than catching up */
+		gint64 now = g_get_monotonic_time();
+		timer->deadline += timer->interval;
+		if (timer->deadline <= now)
+			timer->deadline = now + timer->interval;
+		heap_push(timer);
+		timer = NULL;
+	} else {
+		g_hash_table_remove(timers, GUINT_TO_POINTER(timer->id));
+	}
+	g_cond_broadcast(&timer_done);
+	g_mutex_unlock(&timer_lock);
+
+	if (timer)
+		free_timer(timer);
+}
+
+/*! dispatch
+ \brief wait for the earliest timer and hand it over to the timer threads
+ */
+static void dispatch(void) {
+
+	g_mutex_lock(&timer_lock);
+	while (dispatching) {
+		if (!heap->len) {
+			g_cond_wait(&timer_cond, &timer_lock);
+			continue;
+		}
+
+		struct timer *timer = heap_at(0);
+		if (timer->deadline > g_get_monotonic_time()) {
+			g_cond_wait_until(&timer_cond, &timer_lock, timer->deadline);
+			continue;
+		}
+
+		heap_remove(timer);
+		g_thread_pool_push(timer_threads, timer, NULL);
+	}
+	g_mutex_unlock(&timer_lock);
+}
+
+/*! init_timers
+ \brief start the dispatcher and the timer threads
+ */
+void init_timers(void) {
+	heap = g_ptr_array_new();
+	timers = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	timer_threads = g_thread_pool_new((GFunc) run_timer, NULL,
+			ICONFIG("timer_threads") > 0 ?
+					ICONFIG("timer_threads") : TIMER_THREADS, TRUE, NULL);
+
+	dispatching = TRUE;
+	if ((dispatcher = g_thread_new("timer_dispatcher", (void *) dispatch,
+			NULL)) == NULL) {
+		errx(1, "%s Cannot create the timer dispatcher thread", H(0));
+	}
+}
+
+/*! timer_add_full
+ \brief call func(data) in delay ms, then every interval ms if it's not 0
+ *
+ \return the id to cancel the timer with, 0 if the timers are stopped
+ * destroy, if set, is called on data once the timer is done or cancelled
+ */
+guint timer_add_full(guint delay, guint interval, timer_func func,
+		gpointer data, GDestroyNotify destroy) {
+
+	struct timer *timer = g_malloc0(sizeof(struct timer));
+	timer->deadline = g_get_monotonic_time()
+			+ (gint64) delay * G_TIME_SPAN_MILLISECOND;
+	timer->interval = (gint64) interval * G_TIME_SPAN_MILLISECOND;
+	timer->func = func;
+	timer->data = data;
+	timer->destroy = destroy;
+
+	g_mutex_lock(&timer_lock);
+	if (!dispatching) {
+		g_mutex_unlock(&timer_lock);
+		free_timer(timer);
+		return 0;
+	}
+
+	do {
+		if (!++last_id)
+			last_id = 1;
+	} while (g_hash_table_contains(timers, GUINT_TO_POINTER(last_id)));
+	timer->id = last_id;
+
+	g_hash_table_insert(timers, GUINT_TO_POINTER(timer->id), timer);
+	heap_push(timer);
+	g_mutex_unlock(&timer_lock);
+
+	return timer->id;
+}
+
+guint timer_add(guint delay, timer_func func, gpointer data) {
+	return timer_add_full(delay, 0, func, data, NULL);
+}
+
+guint timer_add_periodic(guint interval, timer_func func, gpointer data) {
+	return timer_add_full(interval, interval, func, data, NULL);
+}
+
+/*! timer_cancel
+ \brief stop a timer, waiting for its callback if it's running
+ *
+ * A callback may cancel its own timer, it's then not armed again.
+ \return TRUE if the timer was still pending or running
+ */
+gboolean timer_cancel(guint id) {
+	gpointer key = GUINT_TO_POINTER(id);
+
+	g_mutex_lock(&timer_lock);
+	struct timer *timer = timers ? g_hash_table_lookup(timers, key) : NULL;
+	if (!timer) {
+		g_mutex_unlock(&timer_lock);
+		return FALSE;
+	}
+
+	timer->cancelled = TRUE;
+	if (timer->slot != NOT_QUEUED) {
+		heap_remove(timer);
+		g_hash_table_remove(timers, key);
+		g_mutex_unlock(&timer_lock);
+		free_timer(timer);
+		return TRUE;
+	}
+
+	/* it's running, run_timer frees it unless it's cancelling itself */
+	if (g_private_get(&current_timer) != timer)
+		while (g_hash_table_lookup(timers, key) == timer)
+			g_cond_wait(&timer_done, &timer_lock);
+	g_mutex_unlock(&timer_lock);
+
+	return TRUE;
+}
+
+guint timer_count(void) {
+	g_mutex_lock(&timer_lock);
+	guint count = timers ? g_hash_table_size(timers) : 0;
+	g_mutex_unlock(&timer_lock);
+	return count;
+}
+
+/*! close_timers
+ \brief stop the timers, callbacks already due still run
+ */
+void close_timers(void) {
+
+	g_mutex_lock(&timer_lock);
+	dispatching = FALSE;
+	g_cond_signal(&timer_cond);
+	g_mutex_unlock(&timer_lock);
+
+	g_thread_join(dispatcher);
+	g_thread_pool_free(timer_threads, FALSE, TRUE);
+
+	while (heap->len) {
+		struct timer *timer = heap_at(heap->len - 1);
+		g_ptr_array_remove_index(heap, heap->len - 1);
+		free_timer(timer);
+	}
+
+	g_ptr_array_free(heap, TRUE);
+	g_hash_table_destroy(timers);
+	heap = NULL;
+	timers = NULL;
+}
@@ -0,0 +1,50 @@
+/*
+ * This file is part of the honeybrid project.
+ *
+ * 2007-2009 University of Maryland (http://www.umd.edu)
+ * Robin Berthier <robinb@umd.edu>, Thomas Coquelin <coquelin@umd.edu>
+ * and Julien Vehent <julien@linuxwall.info>
+ *
+ * 2012-2014 University of Connecticut (http://www.uconn.edu)
+ * Tamas K Lengyel <tamas.k.lengyel@gmail.com>
+ *
+ * Honeybrid is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TIMERS_H_
+#define __TIMERS_H_
+
+#include "types.h"
+
+/*! timer_func
+ \brief what a timer runs when it expires, on one of the timer threads
+ */
+typedef void (*timer_func)(gpointer data);
+
+void init_timers(void);
+
+guint timer_add_full(guint delay, guint interval, timer_func func,
+		gpointer data, GDestroyNotify destroy);
+
+guint timer_add(guint delay, timer_func func, gpointer data);
+
+guint timer_add_periodic(guint interval, timer_func func, gpointer data);
+
+gboolean timer_cancel(guint id);
+
+guint timer_count(void);
+
+void close_timers(void);
+
+#endif /* __TIMERS_H_ */
@@ -67,6 +67,8 @@
 
 #define MIN_TCP_SIZE 54 // Ethernet(14) + IPv4(20) + TCP(20)
 
+#define MAX_PARKED_PACKETS 64 // packets held per conn while a module works on its decision
+
 /*! \brief constants to define the origin of a packet
  */
 typedef enum {
@@ -94,6 +96,78 @@ typedef enum {
     __MAX_CONN_STATUS
 } conn_status_t;
 
+/*! \brief policies to apply when a connection table limit is reached
+ */
+typedef enum {
+    EVICT_REFUSE,
+    EVICT_OLDEST_UNDECIDED,
+    EVICT_DROP_FIRST,
+
+    __MAX_EVICTION_POLICY
+} eviction_policy_t;
+
+/*! \brief how the balancer of a target picks among the backends with room left
+ */
+typedef enum {
+    BALANCE_LEAST_CONN, // fewest live connections per unit of weight
+    BALANCE_WEIGHTED, // round robin in proportion to the weights
+    BALANCE_RANDOM, // uniformly at random
+
+    __MAX_BALANCE_POLICY
+} balance_policy_t;
+
+/*! \brief what a configuration reload does with the connections of the targets it replaces
+ */
+typedef enum {
+    RELOAD_KEEP, // they finish with the rules they started with
+    RELOAD_RETIRE, // they are removed, the next packets start over with the new targets
+
+    __MAX_RELOAD_POLICY
+} reload_policy_t;
+
+/*! \brief how mod_hash fingerprints a payload
+ */
+typedef enum {
+    DIGEST_SHA1, // what the backups of previous versions hold
+    DIGEST_XXH64, // non cryptographic, several times faster
+
+    __MAX_DIGEST
+} digest_t;
+
+/*! \brief room for the largest digest_t, the shorter ones are zero padded
+ */
+#define DIGEST_SIZE 20
+
+/*! \brief what the rate limits of mod_control are kept for
+ */
+typedef enum {
+    CONTROL_SOURCE, // each host that sends
+    CONTROL_DESTINATION, // each host that is sent to
+    CONTROL_SERVICE, // each host that sends, per destination port
+
+    __MAX_CONTROL_SCOPE
+} control_scope_t;
+
+/*! \brief the limit that caused a connection to be evicted
+ */
+typedef enum {
+    EVICTION_NONE,
+    EVICTION_TOTAL_LIMIT,
+    EVICTION_TARGET_LIMIT,
+    EVICTION_SOURCE_LIMIT,
+
+    __MAX_EVICTION_REASON
+} eviction_reason_t;
+
+/*! \brief the connections an eviction policy picks from, by state
+ */
+typedef enum {
+    EVICTABLE_UNDECIDED, // INIT and DECISION
+    EVICTABLE_DROP,
+
+    __MAX_EVICTABLE // the connections in other states are never evicted
+} evictable_t;
+
 /*! \brief output modes
  */
 typedef enum {
@@ -127,15 +201,54 @@ typedef enum {
 	DE_DEFER,
 	DE_REJECT,
 	DE_ACCEPT,
-	DE_DROP
+	DE_DROP,
+	DE_PENDING
 } decision_t;
 
 typedef enum {
 	DEFER = DE_DEFER,
 	REJECT = DE_REJECT,
-	ACCEPT = DE_ACCEPT
+	ACCEPT = DE_ACCEPT,
+	PENDING = DE_PENDING // the module submitted its work, see module_submit()
 } mod_result_t;
 
+/*!
+ \def trigger_t
+ \brief events after which the answer of a module may change
+ *
+ * A rule that left a connection in its state is only evaluated again when
+ * one of the triggers of the modules it called fires.
+ */
+typedef enum {
+	TRIGGER_PACKET = 1 << 0, // any packet, for modules that declare nothing
+	TRIGGER_DATA = 1 << 1, // a packet with payload
+	TRIGGER_COUNT = 1 << 2, // the intruder sent the number of data packets the module asked for
+	TRIGGER_TIME = 1 << 3, // the time the module asked for is reached
+	TRIGGER_DIRECTION = 1 << 4 // a packet comes from the other side than the last one
+} trigger_t;
+
+/*!
+ \def feature_t
+ \brief what the feature cache of a packet already holds, see feature_cache.h
+ */
+typedef enum {
+	FEATURE_SOURCE_IP = 1 << 0,
+	FEATURE_PORT = 1 << 1,
+	FEATURE_HINTS = 1 << 2,
+	FEATURE_NORMALIZED = 1 << 3,
+	FEATURE_DIGEST = 1 << 4 // and the next bits, one per digest_t
+} feature_t;
+
+#define feature_digest(type) (FEATURE_DIGEST << (type))
+
+/*!
+ \def hint_t
+ \brief what the payload of a packet looks like
+ */
+typedef enum {
+	HINT_DNS_QUERY = 1 << 0
+} hint_t;
+
 /*!
  \def verbosity channel
  1 errors only
@@ -181,6 +294,14 @@ typedef enum {
 struct mod_args;
 typedef mod_result_t (*module_function)(struct mod_args *);
 
+struct node;
+typedef status_t (*module_parse_config)(struct node *);
+typedef status_t (*module_init)(void);
+typedef void (*module_shutdown)(void);
+typedef const char *(*module_state_print)(gpointer);
+typedef gpointer (*module_thread_init)(void);
+typedef mod_result_t (*module_work)(gpointer data, uint64_t *backend_use);
+
 typedef unsigned __int128 uint128_t;
 
 #endif